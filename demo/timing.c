@@ -52,10 +52,27 @@ static void callback(BuxtonResponse response, void *userdata)
 	}
 }
 
+static void unchanged_callback(BuxtonResponse response, void *userdata)
+{
+	bool *r = (bool *)userdata;
+
+	if (buxton_response_status(response) == BUXTON_STATUS_UNCHANGED) {
+		*r = true;
+	}
+}
+
+static void version_callback(BuxtonResponse response, void *userdata)
+{
+	uint64_t *version = (uint64_t *)userdata;
+
+	*version = buxton_response_version(response);
+}
+
 enum test_type {
 	TEST_GET,
 	TEST_SET,
 	TEST_SET_UNSET,
+	TEST_GET_UNCHANGED,
 	TEST_TYPE_MAX
 };
 
@@ -80,38 +97,48 @@ struct testcase {
 
 #define TEST_COUNT (TEST_TYPE_MAX * TEST_DATA_TYPE_MAX)
 static struct testcase testcases[TEST_COUNT] = {
-	{ "set_int32",          TEST_SET,       TEST_INT32    },
-	{ "get_int32",          TEST_GET,       TEST_INT32    },
-	{ "set_unset_int32",    TEST_SET_UNSET, TEST_INT32    },
-	{ "set_uint32",         TEST_SET,       TEST_UINT32   },
-	{ "get_uint32",         TEST_GET,       TEST_UINT32   },
-	{ "set_unset_uint32",   TEST_SET_UNSET, TEST_UINT32   },
-	{ "set_int64",          TEST_SET,       TEST_INT64    },
-	{ "get_int64",          TEST_GET,       TEST_INT64    },
-	{ "set_unset_int64",    TEST_SET_UNSET, TEST_INT64    },
-	{ "set_uint64",         TEST_SET,       TEST_UINT64   },
-	{ "get_uint64",         TEST_GET,       TEST_UINT64   },
-	{ "set_unset_uint64",   TEST_SET_UNSET, TEST_UINT64   },
-	{ "set_boolean",        TEST_SET,       TEST_BOOLEAN  },
-	{ "get_boolean",        TEST_GET,       TEST_BOOLEAN  },
-	{ "set_unset_boolean",  TEST_SET_UNSET, TEST_BOOLEAN  },
-	{ "set_string",         TEST_SET,       TEST_STRING   },
-	{ "get_string",         TEST_GET,       TEST_STRING   },
-	{ "set_unset_string",   TEST_SET_UNSET, TEST_STRING   },
-	{ "set_string4k",       TEST_SET,       TEST_STRING4K },
-	{ "get_string4k",       TEST_GET,       TEST_STRING4K },
-	{ "set_unset_string4k", TEST_SET_UNSET, TEST_STRING4K },
-	{ "set_float",          TEST_SET,       TEST_FLOAT    },
-	{ "get_float",          TEST_GET,       TEST_FLOAT    },
-	{ "set_unset_float",    TEST_SET_UNSET, TEST_FLOAT    },
-	{ "set_double",         TEST_SET,       TEST_DOUBLE   },
-	{ "get_double",         TEST_GET,       TEST_DOUBLE   },
-	{ "set_unset_double",   TEST_SET_UNSET, TEST_DOUBLE   }
+	{ "set_int32",              TEST_SET,           TEST_INT32    },
+	{ "get_int32",              TEST_GET,           TEST_INT32    },
+	{ "get_unchanged_int32",    TEST_GET_UNCHANGED, TEST_INT32    },
+	{ "set_unset_int32",        TEST_SET_UNSET,     TEST_INT32    },
+	{ "set_uint32",             TEST_SET,           TEST_UINT32   },
+	{ "get_uint32",             TEST_GET,           TEST_UINT32   },
+	{ "get_unchanged_uint32",   TEST_GET_UNCHANGED, TEST_UINT32   },
+	{ "set_unset_uint32",       TEST_SET_UNSET,     TEST_UINT32   },
+	{ "set_int64",              TEST_SET,           TEST_INT64    },
+	{ "get_int64",              TEST_GET,           TEST_INT64    },
+	{ "get_unchanged_int64",    TEST_GET_UNCHANGED, TEST_INT64    },
+	{ "set_unset_int64",        TEST_SET_UNSET,     TEST_INT64    },
+	{ "set_uint64",             TEST_SET,           TEST_UINT64   },
+	{ "get_uint64",             TEST_GET,           TEST_UINT64   },
+	{ "get_unchanged_uint64",   TEST_GET_UNCHANGED, TEST_UINT64   },
+	{ "set_unset_uint64",       TEST_SET_UNSET,     TEST_UINT64   },
+	{ "set_boolean",            TEST_SET,           TEST_BOOLEAN  },
+	{ "get_boolean",            TEST_GET,           TEST_BOOLEAN  },
+	{ "get_unchanged_boolean",  TEST_GET_UNCHANGED, TEST_BOOLEAN  },
+	{ "set_unset_boolean",      TEST_SET_UNSET,     TEST_BOOLEAN  },
+	{ "set_string",             TEST_SET,           TEST_STRING   },
+	{ "get_string",             TEST_GET,           TEST_STRING   },
+	{ "get_unchanged_string",   TEST_GET_UNCHANGED, TEST_STRING   },
+	{ "set_unset_string",       TEST_SET_UNSET,     TEST_STRING   },
+	{ "set_string4k",           TEST_SET,           TEST_STRING4K },
+	{ "get_string4k",           TEST_GET,           TEST_STRING4K },
+	{ "get_unchanged_string4k", TEST_GET_UNCHANGED, TEST_STRING4K },
+	{ "set_unset_string4k",     TEST_SET_UNSET,     TEST_STRING4K },
+	{ "set_float",              TEST_SET,           TEST_FLOAT    },
+	{ "get_float",              TEST_GET,           TEST_FLOAT    },
+	{ "get_unchanged_float",    TEST_GET_UNCHANGED, TEST_FLOAT    },
+	{ "set_unset_float",        TEST_SET_UNSET,     TEST_FLOAT    },
+	{ "set_double",             TEST_SET,           TEST_DOUBLE   },
+	{ "get_double",             TEST_GET,           TEST_DOUBLE   },
+	{ "get_unchanged_double",   TEST_GET_UNCHANGED, TEST_DOUBLE   },
+	{ "set_unset_double",       TEST_SET_UNSET,     TEST_DOUBLE   }
 };
 
 static BuxtonClient __client;
 static BuxtonData __data;
 static BuxtonKey __key;
+static uint64_t __version;
 
 static bool init_group(void)
 {
@@ -199,7 +226,20 @@ static bool testcase_init(struct testcase *tc)
 			return false;
 	}
 
-	return !buxton_set_value(__client, __key, value, callback, NULL, true);
+	if (buxton_set_value(__client, __key, value, callback, NULL, true)) {
+		return false;
+	}
+
+	/* Conditional gets ask for the value the key already has */
+	if (tc->t == TEST_GET_UNCHANGED) {
+		__version = 0;
+		if (buxton_get_value(__client, __key, version_callback,
+				     &__version, true) || !__version) {
+			return false;
+		}
+	}
+
+	return true;
 }
 
 static bool testcase_cleanup(struct testcase *tc)
@@ -225,6 +265,10 @@ static bool testcase_run(struct testcase *tc)
 			r = buxton_set_value(__client, __key, &__data, callback, &d, true);
 			s = buxton_unset_value(__client, __key, callback, &d, true);
 			return (!s && !r && d);
+		case TEST_GET_UNCHANGED:
+			r = buxton_get_value_if_changed(__client, __key, __version,
+							unchanged_callback, &d, true);
+			return (!r && d);
 		default:
 			return false;
 	}
@@ -56,6 +56,31 @@ bool cli_create_db(BuxtonControl *control,
 	return ret;
 }
 
+bool cli_sweep_orphans(BuxtonControl *control,
+		       __attribute__((unused)) BuxtonDataType type,
+		       char *one,
+		       __attribute__((unused)) char *two,
+		       __attribute__((unused)) char *three,
+		       __attribute__((unused)) char *four)
+{
+	BuxtonString layer_name;
+	uint32_t removed = 0;
+
+	if (!control->client.direct) {
+		printf("Unable to sweep orphaned keys in non direct mode\n");
+		return false;
+	}
+
+	layer_name = buxton_string_pack(one);
+
+	if (!buxton_direct_sweep_orphans(control, &layer_name, &removed)) {
+		return false;
+	}
+	printf("removed %u orphaned keys from %s\n", removed, one);
+
+	return true;
+}
+
 bool cli_set_label(BuxtonControl *control, BuxtonDataType type,
 		   char *one, char *two, char *three, char *four)
 {
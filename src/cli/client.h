@@ -67,6 +67,24 @@ bool cli_create_db(BuxtonControl *control,
 		   char *four)
 	__attribute__((warn_unused_result));
 
+/**
+ * Remove keys left behind by groups that no longer exist
+ * @param control An initialized control structure
+ * @param type Unused
+ * @param one Layer to sweep
+ * @param two Unused
+ * @param three Unused
+ * @param four Unused
+ * @returns bool indicating success or failure
+ */
+bool cli_sweep_orphans(BuxtonControl *control,
+		       BuxtonDataType type,
+		       char *one,
+		       char *two,
+		       char *three,
+		       char *four)
+	__attribute__((warn_unused_result));
+
 /**
  * Set a label in Buxton
  * @param control An initialized control structure
@@ -94,6 +94,7 @@ int main(int argc, char **argv)
 	Command c_create_group, c_remove_group;
 	Command c_unset_value;
 	Command c_create_db;
+	Command c_sweep_orphans;
 	Command *command;
 	int i = 0;
 	int c;
@@ -211,6 +212,11 @@ int main(int argc, char **argv)
 				    1, 1, "layer", &cli_create_db, STRING };
 	hashmap_put(commands, c_create_db.name, &c_create_db);
 
+	/* Remove keys whose group has been removed */
+	c_sweep_orphans = (Command) { "sweep-orphans", "Remove keys without a group from a layer",
+				      1, 1, "layer", &cli_sweep_orphans, STRING };
+	hashmap_put(commands, c_sweep_orphans.name, &c_sweep_orphans);
+
 	static struct option opts[] = {
 		{ "config-file", 1, NULL, 'c' },
 		{ "direct",	 0, NULL, 'd' },
@@ -15,16 +15,21 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <attr/xattr.h>
 
+#include "configurator.h"
 #include "daemon.h"
 #include "direct.h"
 #include "log.h"
+#include "smack.h"
+#include "uring.h"
 #include "util.h"
-#include "buxtonlist.h"
 
 bool parse_list(BuxtonControlMessage msg, size_t count, BuxtonData *list,
 		_BuxtonKey *key, BuxtonData **value)
@@ -91,6 +96,14 @@ bool parse_list(BuxtonControlMessage msg, size_t count, BuxtonData *list,
 		key->layer = list[0].store.d_string;
 		key->group = list[1].store.d_string;
 		break;
+	case BUXTON_CONTROL_GET_IF_CHANGED:
+		/* A get followed by the version the client already has */
+		if (count < 1 || list[count - 1].type != UINT64) {
+			return false;
+		}
+		count--;
+		*value = &list[count];
+		/* fall through */
 	case BUXTON_CONTROL_GET:
 		if (count == 4) {
 			if (list[0].type != STRING || list[1].type != STRING ||
@@ -113,6 +126,48 @@ bool parse_list(BuxtonControlMessage msg, size_t count, BuxtonData *list,
 			return false;
 		}
 		break;
+	case BUXTON_CONTROL_COMPARE_AND_SET:
+		/* A set followed by what to compare, and the expected value */
+		if (count != 6) {
+			return false;
+		}
+		if (list[0].type != STRING || list[1].type != STRING ||
+		    list[2].type != STRING || list[3].type == BUXTON_TYPE_MIN ||
+		    list[3].type == BUXTON_TYPE_MAX || list[4].type != UINT32) {
+			return false;
+		}
+		if (list[4].store.d_uint32 == BUXTON_COMPARE_VALUE) {
+			if (list[5].type != list[3].type) {
+				return false;
+			}
+		} else if (list[4].store.d_uint32 == BUXTON_COMPARE_VERSION) {
+			if (list[5].type != UINT64) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+		key->layer = list[0].store.d_string;
+		key->group = list[1].store.d_string;
+		key->name = list[2].store.d_string;
+		key->type = list[3].type;
+		*value = &(list[3]);
+		break;
+	case BUXTON_CONTROL_ADD:
+		if (count != 5) {
+			return false;
+		}
+		if (list[0].type != STRING || list[1].type != STRING ||
+		    list[2].type != STRING || list[3].type != UINT32 ||
+		    list[4].type != INT64) {
+			return false;
+		}
+		key->layer = list[0].store.d_string;
+		key->group = list[1].store.d_string;
+		key->name = list[2].store.d_string;
+		key->type = list[3].store.d_uint32;
+		*value = &(list[4]);
+		break;
 	case BUXTON_CONTROL_LIST:
 		return false;
 		if (count != 1) {
@@ -137,13 +192,20 @@ bool parse_list(BuxtonControlMessage msg, size_t count, BuxtonData *list,
 		key->type = list[3].store.d_uint32;
 		break;
 	case BUXTON_CONTROL_NOTIFY:
-		if (count != 3) {
+		if (count != 3 && count != 4) {
 			return false;
 		}
 		if (list[0].type != STRING || list[1].type != STRING ||
 		    list[2].type != UINT32) {
 			return false;
 		}
+		/* Newer clients add flags */
+		if (count == 4) {
+			if (list[3].type != UINT32) {
+				return false;
+			}
+			*value = &(list[3]);
+		}
 		key->group = list[0].store.d_string;
 		key->name = list[1].store.d_string;
 		key->type = list[2].store.d_uint32;
@@ -160,13 +222,197 @@ bool parse_list(BuxtonControlMessage msg, size_t count, BuxtonData *list,
 		key->name = list[1].store.d_string;
 		key->type = list[2].store.d_uint32;
 		break;
+	case BUXTON_CONTROL_SUBSCRIBE:
+		if (count != 1 && count != 2) {
+			return false;
+		}
+		if (list[0].type != UINT64) {
+			return false;
+		}
+		/* Newer clients add the epoch of the sequence number */
+		if (count == 2 && list[1].type != UINT64) {
+			return false;
+		}
+		*value = &(list[0]);
+		break;
+	case BUXTON_CONTROL_UNSUBSCRIBE:
+	case BUXTON_CONTROL_COMMIT:
+	case BUXTON_CONTROL_ROLLBACK:
+		if (count != 0) {
+			return false;
+		}
+		break;
+	case BUXTON_CONTROL_BEGIN:
+		if (count != 1) {
+			return false;
+		}
+		if (list[0].type != STRING) {
+			return false;
+		}
+		*value = &(list[0]);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Find which of the client's buckets a request takes from, or
+ * BUXTON_RATE_MAX for requests that aren't limited
+ */
+static BuxtonRateClass message_rate(BuxtonControlMessage msg)
+{
+	switch (msg) {
+	case BUXTON_CONTROL_GET:
+	case BUXTON_CONTROL_GET_IF_CHANGED:
+	case BUXTON_CONTROL_LIST:
+		return BUXTON_RATE_READ;
+	case BUXTON_CONTROL_SET:
+	case BUXTON_CONTROL_SET_LABEL:
+	case BUXTON_CONTROL_CREATE_GROUP:
+	case BUXTON_CONTROL_REMOVE_GROUP:
+	case BUXTON_CONTROL_UNSET:
+	case BUXTON_CONTROL_COMPARE_AND_SET:
+	case BUXTON_CONTROL_ADD:
+	case BUXTON_CONTROL_COMMIT:
+		return BUXTON_RATE_WRITE;
+	case BUXTON_CONTROL_NOTIFY:
+	case BUXTON_CONTROL_SUBSCRIBE:
+		return BUXTON_RATE_NOTIFY;
 	default:
+		return BUXTON_RATE_MAX;
+	}
+}
+
+/* A random ID for a new run of journal sequence numbers, never 0 */
+static uint64_t journal_epoch(void)
+{
+	uint64_t epoch = 0;
+	FILE *f;
+
+	f = fopen("/dev/urandom", "re");
+	if (f) {
+		if (fread(&epoch, sizeof(uint64_t), 1, f) != 1) {
+			epoch = 0;
+		}
+		fclose(f);
+	}
+	/* The time and pid still tell one run from the next */
+	if (!epoch) {
+		epoch = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid();
+	}
+	return epoch ? epoch : 1;
+}
+
+/*
+ * Size the journal from the config the first time it's needed, and tell
+ * whether it's enabled
+ */
+static bool journal_setup(BuxtonDaemon *self)
+{
+	BuxtonJournal *journal = &self->journal;
+	unsigned long size;
+
+	if (journal->entries) {
+		return true;
+	}
+
+	size = strtoul(buxton_journal_size(), NULL, 10);
+	if (size == 0) {
 		return false;
 	}
+	size = size > BUXTON_JOURNAL_MAX_SIZE ? BUXTON_JOURNAL_MAX_SIZE : size;
 
+	journal->entries = calloc(size, sizeof(BuxtonJournalEntry));
+	if (!journal->entries) {
+		abort();
+	}
+	journal->size = size;
+	/* After a handoff, sequence numbers go on from the last daemon's */
+	if (!journal->next_seq) {
+		journal->next_seq = 1;
+	}
+	if (!journal->epoch) {
+		journal->epoch = journal_epoch();
+	}
+	journal->first_seq = journal->next_seq;
 	return true;
 }
 
+/*
+ * Find the labels a get of key is checked against, so the journal only
+ * sends a change to the clients that may read it. Labels that aren't
+ * found are left NULL.
+ */
+static void journal_labels(BuxtonDaemon *self, _BuxtonKey *key,
+			   BuxtonString *group_label, BuxtonString *label)
+{
+	BuxtonData data;
+	_BuxtonKey group;
+
+	if (key->name.value) {
+		group = *key;
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+		if (buxton_direct_get_value_for_layer(&self->buxton, &group,
+						      &data, group_label,
+						      NULL) == 0) {
+			free(data.store.d_string.value);
+		}
+	}
+	if (buxton_direct_get_value_for_layer(&self->buxton, key, &data, label,
+					      NULL) == 0 &&
+	    data.type == STRING) {
+		free(data.store.d_string.value);
+	}
+}
+
+/*
+ * Find the labels of the keys a transaction unsets before its commit
+ * removes them, as a group and key label for each change
+ */
+static BuxtonString *journal_removed_labels(BuxtonDaemon *self,
+					    BuxtonTransaction *transaction)
+{
+	BuxtonString *labels;
+
+	if (!transaction->count) {
+		return NULL;
+	}
+	labels = new0(BuxtonString, 2 * transaction->count);
+	if (!labels) {
+		abort();
+	}
+	for (size_t c = 0; c < transaction->count; c++) {
+		if (!transaction->changes[c].data) {
+			journal_labels(self, transaction->changes[c].key,
+				       &labels[2 * c], &labels[2 * c + 1]);
+		}
+	}
+
+	return labels;
+}
+
+/* Journal a change that leaves key in place, under its labels now */
+static void journal_set(BuxtonDaemon *self, client_list_item *client,
+			BuxtonControlMessage op, _BuxtonKey *key,
+			BuxtonData *value)
+{
+	BuxtonString group_label = { NULL, 0 };
+	BuxtonString label = { NULL, 0 };
+
+	if (!journal_setup(self)) {
+		return;
+	}
+	journal_labels(self, key, &group_label, &label);
+	buxtond_journal_change(self, client, op, key, value, &group_label,
+			       &label);
+	free(group_label.value);
+	free(label.value);
+}
+
 bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t size)
 {
 	BuxtonControlMessage msg;
@@ -176,7 +422,7 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 	uint16_t i;
 	ssize_t p_count;
 	size_t response_len;
-	BuxtonData response_data, mdata;
+	BuxtonData response_data, mdata, edata;
 	BuxtonData *value = NULL;
 	_BuxtonKey key = {{0}, {0}, {0}, 0};
 	BuxtonArray *out_list = NULL, *key_list = NULL;
@@ -185,6 +431,16 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 	bool ret = false;
 	uint32_t msgid = 0;
 	uint32_t n_msgid = 0;
+	uint64_t seq = 0;
+	uint64_t version = 0;
+	BuxtonRateClass rate;
+	BuxtonUpdate update = { 0 };
+	BuxtonTransaction *committed = NULL;
+	BuxtonString group_label = { NULL, 0 };
+	BuxtonString label = { NULL, 0 };
+	_cleanup_free_ BuxtonString *removed = NULL;
+	size_t removed_count = 0;
+	bool staged = false;
 
 	assert(self);
 	assert(client);
@@ -210,6 +466,36 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 		goto end;
 	}
 
+	self->stats.messages++;
+	rate = message_rate(msg);
+	if (rate != BUXTON_RATE_MAX && !take_rate_token(self, client, rate)) {
+		buxton_debug("Throttled message from client %d\n", client->fd);
+		response = BUXTON_STATUS_THROTTLED;
+		goto respond;
+	}
+
+	/* Changes made during a transaction wait for its commit */
+	if (client->transaction && (msg == BUXTON_CONTROL_SET ||
+				    msg == BUXTON_CONTROL_UNSET)) {
+		stage_change(self, client, &key,
+			     msg == BUXTON_CONTROL_SET ? value : NULL,
+			     &response);
+		staged = true;
+		goto respond;
+	}
+
+	/* Keys that are removed take their labels with them */
+	if (journal_setup(self)) {
+		self->buxton.client.uid = client->cred.uid;
+		if (msg == BUXTON_CONTROL_UNSET ||
+		    msg == BUXTON_CONTROL_REMOVE_GROUP) {
+			journal_labels(self, &key, &group_label, &label);
+		} else if (msg == BUXTON_CONTROL_COMMIT && client->transaction) {
+			removed_count = client->transaction->count;
+			removed = journal_removed_labels(self, client->transaction);
+		}
+	}
+
 	/* use internal function from buxtond */
 	switch (msg) {
 	case BUXTON_CONTROL_SET:
@@ -225,7 +511,32 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 		remove_group(self, client, &key, &response);
 		break;
 	case BUXTON_CONTROL_GET:
-		data = get_value(self, client, &key, &response);
+		data = get_value(self, client, &key, &version, &response);
+		break;
+	case BUXTON_CONTROL_GET_IF_CHANGED:
+		data = get_value(self, client, &key, &version, &response);
+		/* Version 0 is unknown, so it never matches */
+		if (response == 0 && version &&
+		    version == value->store.d_uint64) {
+			response = BUXTON_STATUS_UNCHANGED;
+		}
+		break;
+	case BUXTON_CONTROL_COMPARE_AND_SET:
+		if (list[4].store.d_uint32 == BUXTON_COMPARE_VALUE) {
+			update.type = BUXTON_UPDATE_IF_VALUE;
+			update.expected = &list[5];
+		} else {
+			update.type = BUXTON_UPDATE_IF_VERSION;
+			update.version = list[5].store.d_uint64;
+		}
+		data = update_value(self, client, &key, &update, value,
+				    &version, &response);
+		break;
+	case BUXTON_CONTROL_ADD:
+		update.type = BUXTON_UPDATE_ADD;
+		update.delta = value->store.d_int64;
+		data = update_value(self, client, &key, &update, NULL,
+				    &version, &response);
 		break;
 	case BUXTON_CONTROL_UNSET:
 		unset_value(self, client, &key, &response);
@@ -235,14 +546,36 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 				     &response);
 		break;
 	case BUXTON_CONTROL_NOTIFY:
-		register_notification(self, client, &key, msgid, &response);
+		register_notification(self, client, &key, msgid,
+				      value ? value->store.d_uint32 : 0,
+				      &response);
 		break;
 	case BUXTON_CONTROL_UNNOTIFY:
 		n_msgid = unregister_notification(self, client, &key, &response);
 		break;
+	case BUXTON_CONTROL_SUBSCRIBE:
+		seq = subscribe_journal(self, client,
+					p_count == 2 ? value[1].store.d_uint64 : 0,
+					value->store.d_uint64, msgid, &response);
+		break;
+	case BUXTON_CONTROL_UNSUBSCRIBE:
+		n_msgid = unsubscribe_journal(self, client, &response);
+		break;
+	case BUXTON_CONTROL_BEGIN:
+		begin_transaction(self, client, &value->store.d_string,
+				  &response);
+		break;
+	case BUXTON_CONTROL_COMMIT:
+		committed = commit_transaction(self, client, &response);
+		break;
+	case BUXTON_CONTROL_ROLLBACK:
+		rollback_transaction(self, client, &response);
+		break;
 	default:
 		goto end;
 	}
+
+respond:
 	/* Set a response code */
 	response_data.type = INT32;
 	response_data.store.d_int32 = response;
@@ -306,8 +639,15 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 		}
 		break;
 	case BUXTON_CONTROL_GET:
-		if (data && !buxton_array_add(out_list, data)) {
-			abort();
+	case BUXTON_CONTROL_GET_IF_CHANGED:
+		/* The value's version follows it */
+		if (data && response == 0) {
+			mdata.type = UINT64;
+			mdata.store.d_uint64 = version;
+			if (!buxton_array_add(out_list, data) ||
+			    !buxton_array_add(out_list, &mdata)) {
+				abort();
+			}
 		}
 		response_len = buxton_serialize_message(&response_store,
 							BUXTON_CONTROL_STATUS,
@@ -320,6 +660,28 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 			abort();
 		}
 		break;
+	case BUXTON_CONTROL_COMPARE_AND_SET:
+	case BUXTON_CONTROL_ADD:
+		/* The stored value and its version, or the current ones on a mismatch */
+		if (data) {
+			mdata.type = UINT64;
+			mdata.store.d_uint64 = version;
+			if (!buxton_array_add(out_list, data) ||
+			    !buxton_array_add(out_list, &mdata)) {
+				abort();
+			}
+		}
+		response_len = buxton_serialize_message(&response_store,
+							BUXTON_CONTROL_STATUS,
+							msgid, out_list);
+		if (response_len == 0) {
+			if (errno == ENOMEM) {
+				abort();
+			}
+			buxton_log("Failed to serialize update response message\n");
+			abort();
+		}
+		break;
 	case BUXTON_CONTROL_UNSET:
 		response_len = buxton_serialize_message(&response_store,
 							BUXTON_CONTROL_STATUS,
@@ -381,23 +743,134 @@ bool buxtond_handle_message(BuxtonDaemon *self, client_list_item *client, size_t
 			abort();
 		}
 		break;
+	case BUXTON_CONTROL_SUBSCRIBE:
+		mdata.type = UINT64;
+		mdata.store.d_uint64 = seq;
+		if (!buxton_array_add(out_list, &mdata)) {
+			abort();
+		}
+		/* The client keeps the epoch to resume from seq later */
+		edata.type = UINT64;
+		edata.store.d_uint64 = self->journal.epoch;
+		if (!buxton_array_add(out_list, &edata)) {
+			abort();
+		}
+		response_len = buxton_serialize_message(&response_store,
+							BUXTON_CONTROL_STATUS,
+							msgid, out_list);
+		if (response_len == 0) {
+			if (errno == ENOMEM) {
+				abort();
+			}
+			buxton_log("Failed to serialize subscribe response message\n");
+			abort();
+		}
+		break;
+	case BUXTON_CONTROL_UNSUBSCRIBE:
+		mdata.type = UINT32;
+		mdata.store.d_uint32 = n_msgid;
+		if (!buxton_array_add(out_list, &mdata)) {
+			abort();
+		}
+		response_len = buxton_serialize_message(&response_store,
+							BUXTON_CONTROL_STATUS,
+							msgid, out_list);
+		if (response_len == 0) {
+			if (errno == ENOMEM) {
+				abort();
+			}
+			buxton_log("Failed to serialize unsubscribe response message\n");
+			abort();
+		}
+		break;
+	case BUXTON_CONTROL_BEGIN:
+	case BUXTON_CONTROL_COMMIT:
+	case BUXTON_CONTROL_ROLLBACK:
+		response_len = buxton_serialize_message(&response_store,
+							BUXTON_CONTROL_STATUS,
+							msgid, out_list);
+		if (response_len == 0) {
+			if (errno == ENOMEM) {
+				abort();
+			}
+			buxton_log("Failed to serialize transaction response message\n");
+			abort();
+		}
+		break;
 	default:
 		goto end;
 	}
 
-	/* Now write the response */
-	ret = _write(client->fd, response_store, response_len);
-	if (ret) {
-		if (msg == BUXTON_CONTROL_SET && response == 0) {
-			buxtond_notify_clients(self, client, &key, value);
-		} else if (msg == BUXTON_CONTROL_UNSET && response == 0) {
-			buxtond_notify_clients(self, client, &key, NULL);
+	/* Now queue the response, it's written at the end of the cycle */
+	ret = queue_output(self, client, response_store, response_len);
+	if (staged) {
+		/* Nothing changed until the transaction is committed */
+		goto end;
+	}
+	if (committed) {
+		/* Each committed change is told of as if it was made alone */
+		for (size_t c = 0; c < committed->count; c++) {
+			BuxtonChange *change = &committed->changes[c];
+
+			buxtond_notify_clients(self, client, change->key,
+					       change->data);
+			if (change->data) {
+				journal_set(self, client, BUXTON_CONTROL_SET,
+					    change->key, change->data);
+			} else if (removed) {
+				buxtond_journal_change(self, client,
+						       BUXTON_CONTROL_UNSET,
+						       change->key, NULL,
+						       &removed[2 * c],
+						       &removed[2 * c + 1]);
+			}
+		}
+		free_transaction(committed);
+		goto end;
+	}
+	/* Watchers hear of a change whether or not its response was queued */
+	if (msg == BUXTON_CONTROL_SET && response == 0) {
+		buxtond_notify_clients(self, client, &key, value);
+	} else if ((msg == BUXTON_CONTROL_COMPARE_AND_SET ||
+		    msg == BUXTON_CONTROL_ADD) && response == 0) {
+		buxtond_notify_clients(self, client, &key, data);
+	} else if (msg == BUXTON_CONTROL_UNSET && response == 0) {
+		buxtond_notify_clients(self, client, &key, NULL);
+	}
+	/* Changes are journaled whether or not the response was queued */
+	if (response == 0) {
+		switch (msg) {
+		case BUXTON_CONTROL_SET:
+		case BUXTON_CONTROL_SET_LABEL:
+			journal_set(self, client, msg, &key, value);
+			break;
+		case BUXTON_CONTROL_COMPARE_AND_SET:
+		case BUXTON_CONTROL_ADD:
+			/* Followers only need the value that was stored */
+			journal_set(self, client, BUXTON_CONTROL_SET, &key,
+				    data);
+			break;
+		case BUXTON_CONTROL_CREATE_GROUP:
+			journal_set(self, client, msg, &key, NULL);
+			break;
+		case BUXTON_CONTROL_UNSET:
+		case BUXTON_CONTROL_REMOVE_GROUP:
+			buxtond_journal_change(self, client, msg, &key, NULL,
+					       &group_label, &label);
+			break;
+		default:
+			break;
 		}
 	}
 
 end:
 	/* Restore our own UID */
 	self->buxton.client.uid = uid;
+	free(group_label.value);
+	free(label.value);
+	for (size_t r = 0; removed && r < 2 * removed_count; r++) {
+		free(removed[r].value);
+	}
 	if (out_list) {
 		buxton_array_free(&out_list, NULL);
 	}
@@ -412,119 +885,212 @@ end:
 	return ret;
 }
 
-void buxtond_notify_clients(BuxtonDaemon *self, client_list_item *client,
-			      _BuxtonKey *key, BuxtonData *value)
+/*
+ * Check for a comma separated list in the config naming an item
+ */
+static bool config_list_has(const char *list, const char *item, size_t length)
 {
-	BuxtonList *list = NULL;
-	BuxtonList *elem = NULL;
-	BuxtonNotification *nitem;
-	_cleanup_free_ uint8_t* response = NULL;
-	size_t response_len;
-	BuxtonArray *out_list = NULL;
-	_cleanup_free_ char *key_name;
-	int r;
+	const char *end;
+	size_t len;
+
+	while (list && *list) {
+		list += strspn(list, " \t");
+		end = strchr(list, ',');
+		len = end ? (size_t)(end - list) : strlen(list);
+		while (len && (list[len - 1] == ' ' || list[len - 1] == '\t')) {
+			len--;
+		}
+		if (len && len == length && memcmp(list, item, len) == 0) {
+			return true;
+		}
+		list = end ? end + 1 : NULL;
+	}
+	return false;
+}
 
-	assert(self);
-	assert(client);
-	assert(key);
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
 
-	r = asprintf(&key_name, "%s%s", key->group.value, key->name.value);
-	if (r == -1) {
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
 		abort();
 	}
-	list = hashmap_get(self->notify_mapping, key_name);
-	if (!list) {
-		return;
-	}
-
-	BUXTON_LIST_FOREACH(list, elem) {
-		nitem = elem->data;
-		int c = 1;
-		__attribute__((unused)) bool unused;
-		free(response);
-		response = NULL;
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
 
-		if (nitem->old_data && value) {
-			switch (value->type) {
-			case STRING:
-				c = memcmp((const void *)
-					   (nitem->old_data->store.d_string.value),
-					   (const void *)(value->store.d_string.value),
-					   value->store.d_string.length);
-				break;
-			case INT32:
-				c = memcmp((const void *)&(nitem->old_data->store.d_int32),
-					   (const void *)&(value->store.d_int32),
-					   sizeof(int32_t));
-				break;
-			case UINT32:
-				c = memcmp((const void *)&(nitem->old_data->store.d_uint32),
-					   (const void *)&(value->store.d_uint32),
-					   sizeof(uint32_t));
-				break;
-			case INT64:
-				c = memcmp((const void *)&(nitem->old_data->store.d_int64),
-					   (const void *)&(value->store.d_int64),
-					   sizeof(int64_t));
-				break;
-			case UINT64:
-				c = memcmp((const void *)&(nitem->old_data->store.d_uint64),
-					   (const void *)&(value->store.d_uint64),
-					   sizeof(uint64_t));
-				break;
-			case FLOAT:
-				c = memcmp((const void *)&(nitem->old_data->store.d_float),
-					   (const void *)&(value->store.d_float),
-					   sizeof(float));
-				break;
-			case DOUBLE:
-				c = memcmp((const void *)&(nitem->old_data->store.d_double),
-					   (const void *)&(value->store.d_double),
-					   sizeof(double));
-				break;
-			case BOOLEAN:
-				c = memcmp((const void *)&(nitem->old_data->store.d_boolean),
-					   (const void *)&(value->store.d_boolean),
-					   sizeof(bool));
-				break;
-			default:
-				buxton_log("Internal state corruption: Notification data type invalid\n");
-				abort();
-			}
-		}
+static uint64_t monotonic_msec(void)
+{
+	return monotonic_usec() / 1000;
+}
 
-		if (!c) {
-			continue;
-		}
-		if (nitem->old_data && (nitem->old_data->type == STRING)) {
-			free(nitem->old_data->store.d_string.value);
-		}
-		free(nitem->old_data);
+/*
+ * Free a change taken from a client's grouped changes
+ */
+static void free_change(void *p)
+{
+	free_buxton_data(&p);
+}
 
-		nitem->old_data = malloc0(sizeof(BuxtonData));
-		if (!nitem->old_data) {
+/*
+ * Queue a client's grouped changes as one message, which is a plain
+ * BUXTON_CONTROL_CHANGED when only one key changed
+ */
+static void queue_changes(BuxtonDaemon *self, client_list_item *cl)
+{
+	_cleanup_free_ uint8_t *response = NULL;
+	size_t response_len;
+	BuxtonArray *single = NULL;
+	BuxtonData *msgid;
+
+	if (!cl->changes) {
+		return;
+	}
+
+	if (cl->changes->len == 2) {
+		msgid = buxton_array_get(cl->changes, 0);
+		single = buxton_array_new();
+		if (!single) {
 			abort();
 		}
-		if (value) {
-			if (!buxton_data_copy(value, nitem->old_data)) {
-				abort();
-			}
+		if (!buxton_array_add(single, buxton_array_get(cl->changes, 1))) {
+			abort();
+		}
+		response_len = buxton_serialize_message(&response,
+							BUXTON_CONTROL_CHANGED,
+							msgid->store.d_uint32,
+							single);
+		buxton_array_free(&single, NULL);
+	} else {
+		response_len = buxton_serialize_message(&response,
+							BUXTON_CONTROL_CHANGED_MANY,
+							0, cl->changes);
+	}
+	if (response_len == 0) {
+		if (errno == ENOMEM) {
+			abort();
 		}
+		buxton_log("Failed to serialize notification\n");
+		abort();
+	}
+	buxton_debug("Notification to %d of %u key changes\n", cl->fd,
+		     cl->changes->len / 2);
+
+	if (!queue_output(self, cl, response, response_len)) {
+		buxton_log("Dropped notification to client %d\n", cl->fd);
+	}
+	buxton_array_free(&cl->changes, free_change);
+	cl->changes_size = 0;
+}
+
+/*
+ * Add a change to a client's grouped changes, queueing them first when
+ * the change wouldn't fit in the same message
+ */
+static void add_change(BuxtonDaemon *self, client_list_item *cl,
+		       uint32_t msgid, BuxtonData *value)
+{
+	BuxtonData *d;
+	size_t size;
+
+	/* Type and length of both parameters, then their values */
+	size = 2 * (sizeof(uint16_t) + sizeof(uint32_t)) + sizeof(uint32_t);
+	switch (value->type) {
+	case STRING:
+		size += value->store.d_string.length;
+		break;
+	case INT32:
+	case UINT32:
+		size += sizeof(uint32_t);
+		break;
+	case FLOAT:
+		size += sizeof(float);
+		break;
+	case BOOLEAN:
+		size += sizeof(bool);
+		break;
+	default:
+		size += sizeof(uint64_t);
+		break;
+	}
 
-		out_list = buxton_array_new();
-		if (!out_list) {
+	if (cl->changes &&
+	    (cl->changes->len + 2 > BUXTON_MESSAGE_MAX_PARAMS ||
+	     BUXTON_MESSAGE_HEADER_LENGTH + cl->changes_size + size >
+	     BUXTON_MESSAGE_MAX_LENGTH)) {
+		queue_changes(self, cl);
+	}
+	if (!cl->changes) {
+		cl->changes = buxton_array_new();
+		if (!cl->changes) {
 			abort();
 		}
-		if (value) {
-			if (!buxton_array_add(out_list, value)) {
-				abort();
-			}
+	}
+
+	d = malloc0(sizeof(BuxtonData));
+	if (!d) {
+		abort();
+	}
+	d->type = UINT32;
+	d->store.d_uint32 = msgid;
+	if (!buxton_array_add(cl->changes, d)) {
+		abort();
+	}
+
+	d = malloc0(sizeof(BuxtonData));
+	if (!d) {
+		abort();
+	}
+	if (!buxton_data_copy(value, d)) {
+		abort();
+	}
+	if (!buxton_array_add(cl->changes, d)) {
+		abort();
+	}
+	cl->changes_size += size;
+
+	if (!cl->flush_pending) {
+		LIST_PREPEND(client_list_item, pending, self->pending, cl);
+		cl->flush_pending = true;
+	}
+}
+
+/*
+ * Tell every watcher of a key of its last value
+ */
+static void send_notifications(BuxtonDaemon *self, BuxtonWatchedKey *watched)
+{
+	BuxtonNotification *nitem;
+	_cleanup_free_ uint8_t* response = NULL;
+	size_t response_len;
+	BuxtonArray *out_list = NULL;
+
+	out_list = buxton_array_new();
+	if (!out_list) {
+		abort();
+	}
+	/* An unset key is sent without a value */
+	if (watched->last && watched->last->type != BUXTON_TYPE_MIN) {
+		if (!buxton_array_add(out_list, watched->last)) {
+			abort();
+		}
+	}
+
+	LIST_FOREACH(watcher, nitem, watched->notifications) {
+		/* Values are grouped, unsets go on their own */
+		if (nitem->grouped && out_list->len) {
+			add_change(self, nitem->client, nitem->msgid,
+				   watched->last);
+			continue;
 		}
+		/* Behind the client's grouped changes, to keep their order */
+		queue_changes(self, nitem->client);
+
+		free(response);
+		response = NULL;
 
 		response_len = buxton_serialize_message(&response,
 							BUXTON_CONTROL_CHANGED,
 							nitem->msgid, out_list);
-		buxton_array_free(&out_list, NULL);
 		if (response_len == 0) {
 			if (errno == ENOMEM) {
 				abort();
@@ -533,701 +1099,2614 @@ void buxtond_notify_clients(BuxtonDaemon *self, client_list_item *client,
 			abort();
 		}
 		buxton_debug("Notification to %d of key change (%s)\n", nitem->client->fd,
-			     key_name);
+			     watched->name);
 
-		unused = _write(nitem->client->fd, response, response_len);
+		if (!queue_output(self, nitem->client, response, response_len)) {
+			buxton_log("Dropped notification to client %d\n",
+				   nitem->client->fd);
+		}
 	}
+	buxton_array_free(&out_list, NULL);
 }
 
-void set_value(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
-	       BuxtonData *value, int32_t *status)
+/*
+ * Put a key on the timer wheel, in the slot of the tick its interval
+ * ends in
+ */
+static void schedule_notification(BuxtonDaemon *self, BuxtonWatchedKey *watched)
 {
+	uint64_t tick;
 
-	assert(self);
-	assert(client);
-	assert(key);
-	assert(value);
-	assert(status);
-
-	*status = -1;
+	tick = (watched->quiet_until + BUXTON_TIMER_TICK - 1) / BUXTON_TIMER_TICK;
+	LIST_PREPEND(BuxtonWatchedKey, timer,
+		     self->timers[tick % BUXTON_TIMER_SLOTS], watched);
+	watched->deferred = true;
+	self->timers_pending++;
+}
 
-	buxton_debug("Daemon setting [%s][%s][%s]\n",
-		     key->layer.value,
-		     key->group.value,
-		     key->name.value);
+static void unschedule_notification(BuxtonDaemon *self, BuxtonWatchedKey *watched)
+{
+	uint64_t tick;
 
-	self->buxton.client.uid = client->cred.uid;
+	tick = (watched->quiet_until + BUXTON_TIMER_TICK - 1) / BUXTON_TIMER_TICK;
+	LIST_REMOVE(BuxtonWatchedKey, timer,
+		    self->timers[tick % BUXTON_TIMER_SLOTS], watched);
+	watched->deferred = false;
+	self->timers_pending--;
+}
 
-	if (!buxton_direct_set_value(&self->buxton, key, value, client->smack_label)) {
-		return;
+/*
+ * Whether two values kept for a watched key are the same, unsets
+ * included
+ */
+static bool same_value(BuxtonData *a, BuxtonData *b)
+{
+	if (!a || !b) {
+		return false;
 	}
-
-	*status = 0;
-	buxton_debug("Daemon set value completed\n");
+	if (a->type == BUXTON_TYPE_MIN || b->type == BUXTON_TYPE_MIN) {
+		return a->type == b->type;
+	}
+	return buxton_data_equal(a, b);
 }
 
-void set_label(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
-	       BuxtonData *value, int32_t *status)
+void buxtond_notify_clients(BuxtonDaemon *self, client_list_item *client,
+			      _BuxtonKey *key, BuxtonData *value)
 {
+	BuxtonWatchedKey *watched = NULL;
+	BuxtonData *latest;
+	_cleanup_free_ char *key_name;
+	uint64_t now;
+	int r;
 
 	assert(self);
 	assert(client);
 	assert(key);
-	assert(value);
-	assert(status);
 
-	*status = -1;
+	r = asprintf(&key_name, "%s%s", key->group.value, key->name.value);
+	if (r == -1) {
+		abort();
+	}
+	watched = hashmap_get(self->notify_mapping, key_name);
+	if (!watched) {
+		return;
+	}
 
-	buxton_debug("Daemon setting label on [%s][%s][%s]\n",
-		     key->layer.value,
-		     key->group.value,
-		     key->name.value);
+	/* All the watchers were told of the same value, so compare once */
+	latest = watched->deferred ? watched->pending : watched->last;
+	if (latest && value && buxton_data_equal(latest, value)) {
+		return;
+	}
 
-	self->buxton.client.uid = client->cred.uid;
+	latest = malloc0(sizeof(BuxtonData));
+	if (!latest) {
+		abort();
+	}
+	if (value) {
+		if (!buxton_data_copy(value, latest)) {
+			abort();
+		}
+	}
 
-	/* Use internal library to set label */
-	if (!buxton_direct_set_label(&self->buxton, key, &value->store.d_string)) {
-		return;
+	/* Within the interval, the latest value goes out when it ends */
+	if (watched->interval) {
+		now = monotonic_msec();
+		if (watched->deferred || now < watched->quiet_until) {
+			free_buxton_data(&(watched->pending));
+			watched->pending = latest;
+			if (!watched->deferred) {
+				schedule_notification(self, watched);
+			}
+			return;
+		}
+		watched->quiet_until = now + watched->interval;
 	}
 
-	*status = 0;
-	buxton_debug("Daemon set label completed\n");
+	free_buxton_data(&(watched->last));
+	watched->last = latest;
+	send_notifications(self, watched);
 }
 
-void create_group(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
-		  int32_t *status)
+/*
+ * Send a key's deferred notification, starting its next interval. A
+ * key back at the value last sent has nothing to tell its watchers.
+ */
+static void send_deferred_notification(BuxtonDaemon *self,
+				       BuxtonWatchedKey *watched, uint64_t now)
 {
-	assert(self);
-	assert(client);
-	assert(key);
-	assert(status);
-
-	*status = -1;
-
-	buxton_debug("Daemon creating group [%s][%s]\n",
-		     key->layer.value,
-		     key->group.value);
-
-	self->buxton.client.uid = client->cred.uid;
-
-	/* Use internal library to create group */
-	if (!buxton_direct_create_group(&self->buxton, key, client->smack_label)) {
+	unschedule_notification(self, watched);
+	if (same_value(watched->pending, watched->last)) {
+		free_buxton_data(&(watched->pending));
+		watched->pending = NULL;
 		return;
 	}
+	free_buxton_data(&(watched->last));
+	watched->last = watched->pending;
+	watched->pending = NULL;
+	send_notifications(self, watched);
+	watched->quiet_until = now + watched->interval;
+}
 
-	*status = 0;
-	buxton_debug("Daemon create group completed\n");
+int notification_timeout(BuxtonDaemon *self)
+{
+	assert(self);
+
+	if (!self->timers_pending) {
+		return -1;
+	}
+	return BUXTON_TIMER_TICK - (int)(monotonic_msec() % BUXTON_TIMER_TICK);
 }
 
-void remove_group(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
-		  int32_t *status)
+int sync_timeout(BuxtonDaemon *self)
 {
+	uint64_t now;
+
 	assert(self);
-	assert(client);
-	assert(key);
-	assert(status);
 
-	*status = -1;
+	now = monotonic_msec();
+	if (!self->synced) {
+		self->synced = now;
+	}
+	if (now - self->synced >= BUXTON_SYNC_INTERVAL) {
+		return 0;
+	}
+	return (int)(self->synced + BUXTON_SYNC_INTERVAL - now);
+}
 
-	buxton_debug("Daemon removing group [%s][%s]\n",
-		     key->layer.value,
-		     key->group.value);
+void sync_backends(BuxtonDaemon *self)
+{
+	uint64_t now;
 
-	self->buxton.client.uid = client->cred.uid;
+	assert(self);
 
-	/* Use internal library to create group */
-	if (!buxton_direct_remove_group(&self->buxton, key, client->smack_label)) {
+	now = monotonic_msec();
+	if (now - self->synced < BUXTON_SYNC_INTERVAL) {
 		return;
 	}
-
-	*status = 0;
-	buxton_debug("Daemon remove group completed\n");
+	buxton_direct_sync(&self->buxton);
+	self->synced = now;
 }
 
-void unset_value(BuxtonDaemon *self, client_list_item *client,
-		 _BuxtonKey *key, int32_t *status)
+void send_deferred_notifications(BuxtonDaemon *self, bool all)
 {
-	assert(self);
-	assert(client);
-	assert(key);
-	assert(status);
+	BuxtonWatchedKey *watched, *next;
+	uint64_t now;
+	uint64_t tick;
+	uint64_t t;
 
-	*status = -1;
+	assert(self);
 
-	buxton_debug("Daemon unsetting [%s][%s][%s]\n",
-		     key->layer.value,
-		     key->group.value,
-		     key->name.value);
+	now = monotonic_msec();
+	tick = now / BUXTON_TIMER_TICK;
 
-	/* Use internal library to unset value */
-	self->buxton.client.uid = client->cred.uid;
-	if (!buxton_direct_unset_value(&self->buxton, key, client->smack_label)) {
-		return;
+	if (all) {
+		for (t = 0; t < BUXTON_TIMER_SLOTS; t++) {
+			while ((watched = self->timers[t])) {
+				send_deferred_notification(self, watched, now);
+			}
+		}
+	} else if (self->timers_pending) {
+		/* Run each tick since the last run, but every slot only once */
+		t = self->timer_tick + 1;
+		if (tick - self->timer_tick >= BUXTON_TIMER_SLOTS) {
+			t = tick - BUXTON_TIMER_SLOTS + 1;
+		}
+		for (; t <= tick; t++) {
+			LIST_FOREACH_SAFE(timer, watched, next,
+					  self->timers[t % BUXTON_TIMER_SLOTS]) {
+				/* Left in the slot for a later turn of the wheel */
+				if (watched->quiet_until > now) {
+					continue;
+				}
+				send_deferred_notification(self, watched, now);
+			}
+		}
 	}
+	self->timer_tick = tick;
+}
 
-	buxton_debug("unset value returned successfully from db\n");
-
-	*status = 0;
-	buxton_debug("Daemon unset value completed\n");
+static void clear_journal_entry(BuxtonJournalEntry *entry)
+{
+	free(entry->key.layer.value);
+	free(entry->key.group.value);
+	free(entry->key.name.value);
+	if (entry->value.type == STRING) {
+		free(entry->value.store.d_string.value);
+	}
+	free(entry->group_label.value);
+	free(entry->label.value);
+	memset(entry, 0, sizeof(BuxtonJournalEntry));
 }
 
-BuxtonData *get_value(BuxtonDaemon *self, client_list_item *client,
-		      _BuxtonKey *key, int32_t *status)
+void buxtond_journal_change(BuxtonDaemon *self, client_list_item *client,
+			    BuxtonControlMessage op, _BuxtonKey *key,
+			    BuxtonData *value, BuxtonString *group_label,
+			    BuxtonString *label)
 {
-	BuxtonData *data = NULL;
-	BuxtonString label;
-	int32_t ret;
+	BuxtonJournal *journal = &self->journal;
+	BuxtonJournalEntry *entry;
+	client_list_item *cl;
 
 	assert(self);
 	assert(client);
 	assert(key);
-	assert(status);
 
-	*status = -1;
+	if (!journal_setup(self)) {
+		return;
+	}
 
-	data = malloc0(sizeof(BuxtonData));
-	if (!data) {
-		abort();
+	/* The oldest entry makes room once the ring is full */
+	if (journal->next_seq - journal->first_seq == journal->size) {
+		journal->first_seq++;
 	}
+	entry = &journal->entries[journal->next_seq % journal->size];
+	clear_journal_entry(entry);
 
-	if (key->layer.value) {
-		buxton_debug("Daemon getting [%s][%s][%s]\n", key->layer.value,
-			     key->group.value, key->name.value);
+	entry->seq = journal->next_seq++;
+	entry->op = op;
+	entry->uid = client->cred.uid;
+	if (!buxton_key_copy(key, &entry->key)) {
+		abort();
+	}
+	if (value) {
+		if (!buxton_data_copy(value, &entry->value)) {
+			abort();
+		}
 	} else {
-		buxton_debug("Daemon getting [%s][%s]\n", key->group.value,
-			     key->name.value);
+		entry->value.type = BUXTON_TYPE_MIN;
 	}
-	self->buxton.client.uid = client->cred.uid;
-	ret = buxton_direct_get_value(&self->buxton, key, data, &label,
-				      client->smack_label);
-	if (ret) {
-		goto fail;
+	if (group_label && group_label->value &&
+	    !buxton_string_copy(group_label, &entry->group_label)) {
+		abort();
+	}
+	if (label && label->value &&
+	    !buxton_string_copy(label, &entry->label)) {
+		abort();
 	}
 
-	free(label.value);
-	buxton_debug("get value returned successfully from db\n");
+	/* Subscribers catch up when they're flushed */
+	LIST_FOREACH(subscriber, cl, self->subscribers) {
+		if (!cl->flush_pending) {
+			LIST_PREPEND(client_list_item, pending, self->pending, cl);
+			cl->flush_pending = true;
+		}
+	}
+}
 
-	*status = 0;
-	goto end;
-fail:
-	buxton_debug("get value failed\n");
-	free(data);
-	data = NULL;
-end:
+/*
+ * Serialize a journal entry, or the signal that entries were lost when
+ * entry is NULL
+ */
+static size_t serialize_journal_entry(BuxtonJournal *journal,
+				      BuxtonJournalEntry *entry,
+				      uint32_t msgid, bool with_value,
+				      uint8_t **dest)
+{
+	BuxtonArray *out_list = NULL;
+	BuxtonData d[6];
+	size_t len;
 
-	return data;
+	out_list = buxton_array_new();
+	if (!out_list) {
+		abort();
+	}
+
+	d[0].type = UINT64;
+	d[0].store.d_uint64 = entry ? entry->seq : journal->next_seq;
+	d[1].type = UINT32;
+	d[1].store.d_uint32 = entry ? entry->op : BUXTON_CONTROL_MIN;
+	if (entry) {
+		d[2].type = STRING;
+		d[2].store.d_string = entry->key.layer;
+		d[3].type = STRING;
+		d[3].store.d_string = entry->key.group;
+		d[4].type = STRING;
+		d[4].store.d_string = entry->key.name;
+		/* Group changes have no key name */
+		if (!d[4].store.d_string.value) {
+			d[4].store.d_string = buxton_string_pack("");
+		}
+		d[5].type = UINT32;
+		d[5].store.d_uint32 = entry->uid;
+	}
+	for (int i = 0; i < (entry ? 6 : 2); i++) {
+		if (!buxton_array_add(out_list, &d[i])) {
+			abort();
+		}
+	}
+	if (entry && with_value && entry->value.type != BUXTON_TYPE_MIN) {
+		if (!buxton_array_add(out_list, &entry->value)) {
+			abort();
+		}
+	}
+
+	len = buxton_serialize_message(dest, BUXTON_CONTROL_JOURNAL, msgid,
+				       out_list);
+	if (len == 0 && errno == ENOMEM) {
+		abort();
+	}
+	buxton_array_free(&out_list, NULL);
+	return len;
 }
 
-BuxtonArray *list_keys(BuxtonDaemon *self, client_list_item *client,
-		       BuxtonString *layer, int32_t *status)
+/*
+ * Queue a journal entry for a subscriber if its output has room, leaving
+ * the rest for when it's read what it has
+ */
+static bool queue_journal_entry(BuxtonDaemon *self, client_list_item *cl,
+				BuxtonJournalEntry *entry)
 {
-	BuxtonArray *ret_list = NULL;
+	_cleanup_free_ uint8_t *response = NULL;
+	size_t response_len;
+
+	response_len = serialize_journal_entry(&self->journal, entry,
+					       cl->journal_msgid, true,
+					       &response);
+	/* A value that only just fit its request may not fit the entry */
+	if (response_len == 0) {
+		buxton_log("Journal entry %" PRIu64 " sent without its value\n",
+			   entry->seq);
+		response_len = serialize_journal_entry(&self->journal, entry,
+						       cl->journal_msgid,
+						       false, &response);
+		if (response_len == 0) {
+			buxton_log("Failed to serialize journal entry\n");
+			abort();
+		}
+	}
+
+	if (cl->out_offset - cl->out_start + response_len >
+	    BUXTON_CLIENT_OUTPUT_LIMIT) {
+		return false;
+	}
+	return queue_output(self, cl, response, response_len);
+}
+
+/*
+ * Whether a subscriber may read the key an entry changed, checked as a
+ * get of it would be. Entries whose labels weren't found are only sent
+ * to clients without a label.
+ */
+static bool journal_entry_readable(client_list_item *cl,
+				   BuxtonJournalEntry *entry)
+{
+	if (!cl->smack_label || !cl->smack_label->value) {
+		return true;
+	}
+	if (entry->key.name.value &&
+	    (!entry->group_label.value ||
+	     !buxton_check_smack_access(cl->smack_label, &entry->group_label,
+					ACCESS_READ))) {
+		return false;
+	}
+	return entry->label.value &&
+		buxton_check_smack_access(cl->smack_label, &entry->label,
+					  ACCESS_READ);
+}
+
+void buxtond_journal_catch_up(BuxtonDaemon *self, client_list_item *client)
+{
+	BuxtonJournal *journal = &self->journal;
+	BuxtonJournalEntry *entry;
+
 	assert(self);
 	assert(client);
-	assert(layer);
+
+	if (!client->journal_subscribed || !journal_setup(self)) {
+		return;
+	}
+
+	/* Entries the client wasn't sent are gone, so it has to resync */
+	if (client->journal_next < journal->first_seq) {
+		_cleanup_free_ uint8_t *response = NULL;
+		size_t response_len;
+
+		response_len = serialize_journal_entry(journal, NULL,
+						       client->journal_msgid,
+						       false, &response);
+		if (response_len == 0) {
+			buxton_log("Failed to serialize journal resync\n");
+			abort();
+		}
+		if (client->out_offset - client->out_start + response_len >
+		    BUXTON_CLIENT_OUTPUT_LIMIT) {
+			return;
+		}
+		if (!queue_output(self, client, response, response_len)) {
+			return;
+		}
+		buxton_debug("Client %d missed journal entries, resyncing\n",
+			     client->fd);
+		client->journal_next = journal->next_seq;
+	}
+
+	while (client->journal_next < journal->next_seq) {
+		entry = &journal->entries[client->journal_next % journal->size];
+		if (journal_entry_readable(client, entry) &&
+		    !queue_journal_entry(self, client, entry)) {
+			break;
+		}
+		client->journal_next++;
+	}
+}
+
+void buxtond_journal_free(BuxtonDaemon *self)
+{
+	BuxtonJournal *journal = &self->journal;
+
+	assert(self);
+
+	if (!journal->entries) {
+		return;
+	}
+	for (size_t i = 0; i < journal->size; i++) {
+		clear_journal_entry(&journal->entries[i]);
+	}
+	free(journal->entries);
+	journal->entries = NULL;
+	journal->size = 0;
+}
+
+void set_value(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
+	       BuxtonData *value, int32_t *status)
+{
+
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(value);
 	assert(status);
 
 	*status = -1;
-	if (buxton_direct_list_keys(&self->buxton, layer, &ret_list)) {
-		*status = 0;
+
+	buxton_debug("Daemon setting [%s][%s][%s]\n",
+		     key->layer.value,
+		     key->group.value,
+		     key->name.value);
+
+	self->buxton.client.uid = client->cred.uid;
+
+	if (!buxton_direct_set_value(&self->buxton, key, value, client->smack_label)) {
+		return;
 	}
-	return ret_list;
+
+	*status = 0;
+	buxton_debug("Daemon set value completed\n");
 }
 
-void register_notification(BuxtonDaemon *self, client_list_item *client,
-			   _BuxtonKey *key, uint32_t msgid,
-			   int32_t *status)
+BuxtonData *update_value(BuxtonDaemon *self, client_list_item *client,
+			 _BuxtonKey *key, BuxtonUpdate *update,
+			 BuxtonData *value, uint64_t *version, int32_t *status)
 {
-	BuxtonList *n_list = NULL;
-	BuxtonList *key_list = NULL;
-	BuxtonNotification *nitem;
-	BuxtonData *old_data = NULL;
-	int32_t key_status;
-	char *key_name;
-	int r;
-	uint64_t *fd = NULL;
-	char *key_name_copy = NULL;
+	BuxtonData *data = NULL;
 
 	assert(self);
 	assert(client);
 	assert(key);
+	assert(update);
+	assert(version);
 	assert(status);
 
-	*status = -1;
+	buxton_debug("Daemon updating [%s][%s][%s]\n",
+		     key->layer.value,
+		     key->group.value,
+		     key->name.value);
 
-	nitem = malloc0(sizeof(BuxtonNotification));
-	if (!nitem) {
+	data = malloc0(sizeof(BuxtonData));
+	if (!data) {
 		abort();
 	}
-	nitem->client = client;
 
-	/* Store data now, cheap */
-	old_data = get_value(self, client, key, &key_status);
-	if (key_status != 0) {
-		free(nitem);
+	self->buxton.client.uid = client->cred.uid;
+	*status = buxton_direct_update_value(&self->buxton, key, update, value,
+					     client->smack_label, data, version);
+
+	/* A mismatch sends no value if the key has none the client can read */
+	if (*status == -1 || data->type == BUXTON_TYPE_MIN) {
+		free(data);
+		data = NULL;
+	}
+
+	buxton_debug("Daemon update value completed\n");
+	return data;
+}
+
+void set_label(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
+	       BuxtonData *value, int32_t *status)
+{
+
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(value);
+	assert(status);
+
+	*status = -1;
+
+	buxton_debug("Daemon setting label on [%s][%s][%s]\n",
+		     key->layer.value,
+		     key->group.value,
+		     key->name.value);
+
+	self->buxton.client.uid = client->cred.uid;
+
+	/* Use internal library to set label */
+	if (!buxton_direct_set_label(&self->buxton, key, &value->store.d_string)) {
 		return;
 	}
-	nitem->old_data = old_data;
-	nitem->msgid = msgid;
 
-	/* May be null, but will append regardless */
-	r = asprintf(&key_name, "%s%s", key->group.value, key->name.value);
-	if (r == -1) {
-		abort();
+	*status = 0;
+	buxton_debug("Daemon set label completed\n");
+}
+
+void create_group(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
+		  int32_t *status)
+{
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+
+	buxton_debug("Daemon creating group [%s][%s]\n",
+		     key->layer.value,
+		     key->group.value);
+
+	self->buxton.client.uid = client->cred.uid;
+
+	/* Use internal library to create group */
+	if (!buxton_direct_create_group(&self->buxton, key, client->smack_label)) {
+		return;
 	}
 
-	key_name_copy = strdup(key_name);
-	if (!key_name_copy) {
+	*status = 0;
+	buxton_debug("Daemon create group completed\n");
+}
+
+/*
+ * Names of the watched keys that a group holds in a layer, which go
+ * with the group when it is removed
+ */
+static BuxtonArray *watched_members(BuxtonDaemon *self, _BuxtonKey *key)
+{
+	BuxtonWatchedKey *watched;
+	BuxtonArray *names = NULL;
+	const char *key_name;
+	size_t group_len;
+	Iterator iter;
+
+	names = buxton_array_new();
+	if (!names) {
 		abort();
 	}
+	if (!self->notify_mapping) {
+		return names;
+	}
 
-	n_list = hashmap_get(self->notify_mapping, key_name);
-	if (!n_list) {
-		if (!buxton_list_append(&n_list, nitem)) {
-			abort();
+	group_len = strlen(key->group.value);
+	HASHMAP_FOREACH_KEY(watched, key_name, self->notify_mapping, iter) {
+		_BuxtonKey member = *key;
+		BuxtonString label = { NULL, 0 };
+		BuxtonData data;
+		char *name;
+		int ret;
+
+		if (!strneq(key_name, key->group.value, group_len) ||
+		    key_name[group_len] == '\0') {
+			continue;
+		}
+
+		/* Only keys the layer holds are told of, whatever their type */
+		memzero(&data, sizeof(BuxtonData));
+		member.name = buxton_string_pack((char *)key_name + group_len);
+		ret = buxton_direct_get_value_for_layer(&self->buxton, &member,
+							&data, &label, NULL);
+		if (ret == 0) {
+			if (data.type == STRING) {
+				free(data.store.d_string.value);
+			}
+			free(label.value);
+		} else if (ret != EINVAL) {
+			continue;
 		}
 
-		if (hashmap_put(self->notify_mapping, key_name, n_list) < 0) {
+		name = strdup(member.name.value);
+		if (!name) {
 			abort();
 		}
-	} else {
-		free(key_name);
-		if (!buxton_list_append(&n_list, nitem)) {
+		if (!buxton_array_add(names, name)) {
 			abort();
 		}
 	}
 
-	fd = malloc0(sizeof(uint64_t));
-	if (!fd) {
-		abort();
+	return names;
+}
+
+void remove_group(BuxtonDaemon *self, client_list_item *client, _BuxtonKey *key,
+		  int32_t *status)
+{
+	BuxtonArray *members = NULL;
+
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+
+	buxton_debug("Daemon removing group [%s][%s]\n",
+		     key->layer.value,
+		     key->group.value);
+
+	self->buxton.client.uid = client->cred.uid;
+
+	/* Find the watched keys before they are removed with the group */
+	members = watched_members(self, key);
+
+	/* Use internal library to create group */
+	if (!buxton_direct_remove_group(&self->buxton, key, client->smack_label)) {
+		buxton_array_free(&members, free);
+		return;
+	}
+
+	for (uint16_t i = 0; i < members->len; i++) {
+		_BuxtonKey member = *key;
+
+		member.name = buxton_string_pack(buxton_array_get(members, i));
+		buxtond_notify_clients(self, client, &member, NULL);
+	}
+	buxton_array_free(&members, free);
+
+	*status = 0;
+	buxton_debug("Daemon remove group completed\n");
+}
+
+void unset_value(BuxtonDaemon *self, client_list_item *client,
+		 _BuxtonKey *key, int32_t *status)
+{
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+
+	buxton_debug("Daemon unsetting [%s][%s][%s]\n",
+		     key->layer.value,
+		     key->group.value,
+		     key->name.value);
+
+	/* Use internal library to unset value */
+	self->buxton.client.uid = client->cred.uid;
+	if (!buxton_direct_unset_value(&self->buxton, key, client->smack_label)) {
+		return;
+	}
+
+	buxton_debug("unset value returned successfully from db\n");
+
+	*status = 0;
+	buxton_debug("Daemon unset value completed\n");
+}
+
+BuxtonData *get_value(BuxtonDaemon *self, client_list_item *client,
+		      _BuxtonKey *key, uint64_t *version, int32_t *status)
+{
+	BuxtonData *data = NULL;
+	BuxtonString label;
+	int32_t ret;
+
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+
+	data = malloc0(sizeof(BuxtonData));
+	if (!data) {
+		abort();
+	}
+
+	if (key->layer.value) {
+		buxton_debug("Daemon getting [%s][%s][%s]\n", key->layer.value,
+			     key->group.value, key->name.value);
+	} else {
+		buxton_debug("Daemon getting [%s][%s]\n", key->group.value,
+			     key->name.value);
+	}
+	self->buxton.client.uid = client->cred.uid;
+	ret = buxton_direct_get_versioned_value(&self->buxton, key, data,
+						&label, client->smack_label,
+						version);
+	if (ret) {
+		goto fail;
+	}
+
+	free(label.value);
+	buxton_debug("get value returned successfully from db\n");
+
+	*status = 0;
+	goto end;
+fail:
+	buxton_debug("get value failed\n");
+	free(data);
+	data = NULL;
+end:
+
+	return data;
+}
+
+BuxtonArray *list_keys(BuxtonDaemon *self, client_list_item *client,
+		       BuxtonString *layer, int32_t *status)
+{
+	BuxtonArray *ret_list = NULL;
+	assert(self);
+	assert(client);
+	assert(layer);
+	assert(status);
+
+	*status = -1;
+	if (buxton_direct_list_keys(&self->buxton, layer, &ret_list)) {
+		*status = 0;
+	}
+	return ret_list;
+}
+
+/*
+ * Link a notification into the lists of its key and its client, taking
+ * key_name. A key that is watched already keeps its last value and
+ * interval, otherwise it starts from value, which is taken too.
+ */
+static void add_notification(BuxtonDaemon *self, BuxtonNotification *nitem,
+			     char *key_name, BuxtonData *value,
+			     uint32_t interval)
+{
+	BuxtonWatchedKey *watched = NULL;
+
+	watched = hashmap_get(self->notify_mapping, key_name);
+	if (!watched) {
+		watched = malloc0(sizeof(BuxtonWatchedKey));
+		if (!watched) {
+			abort();
+		}
+		watched->name = key_name;
+		watched->last = value;
+		watched->interval = interval;
+
+		if (hashmap_put(self->notify_mapping, watched->name, watched) < 0) {
+			abort();
+		}
+	} else {
+		free(key_name);
+		free_buxton_data(&value);
+	}
+
+	nitem->watched = watched;
+	LIST_PREPEND(BuxtonNotification, watcher, watched->notifications, nitem);
+	LIST_PREPEND(BuxtonNotification, subscription,
+		     nitem->client->subscriptions, nitem);
+}
+
+/*
+ * Unlink a notification from both its lists, and drop its key once
+ * nobody watches it
+ */
+static void remove_notification(BuxtonDaemon *self, BuxtonNotification *nitem)
+{
+	BuxtonWatchedKey *watched = nitem->watched;
+
+	LIST_REMOVE(BuxtonNotification, watcher, watched->notifications, nitem);
+	LIST_REMOVE(BuxtonNotification, subscription,
+		    nitem->client->subscriptions, nitem);
+	free(nitem);
+
+	if (watched->notifications) {
+		return;
+	}
+
+	if (watched->deferred) {
+		unschedule_notification(self, watched);
+	}
+	(void)hashmap_remove(self->notify_mapping, watched->name);
+	free(watched->name);
+	free_buxton_data(&(watched->last));
+	free_buxton_data(&(watched->pending));
+	free(watched);
+}
+
+/*
+ * Least time between notifications of a key, for the groups and keys
+ * the config names in CoalesceKeys
+ */
+static uint32_t coalesce_interval(_BuxtonKey *key)
+{
+	_cleanup_free_ char *item = NULL;
+	unsigned long interval;
+	const char *keys;
+	int r;
+
+	interval = strtoul(buxton_coalesce_interval(), NULL, 10);
+	if (interval == 0) {
+		return 0;
+	}
+	interval = interval > UINT32_MAX ? UINT32_MAX : interval;
+
+	keys = buxton_coalesce_keys();
+	if (config_list_has(keys, key->group.value, strlen(key->group.value))) {
+		return (uint32_t)interval;
+	}
+	if (!key->name.value) {
+		return 0;
+	}
+
+	r = asprintf(&item, "%s:%s", key->group.value, key->name.value);
+	if (r == -1) {
+		abort();
+	}
+	if (config_list_has(keys, item, (size_t)r)) {
+		return (uint32_t)interval;
+	}
+	return 0;
+}
+
+void register_notification(BuxtonDaemon *self, client_list_item *client,
+			   _BuxtonKey *key, uint32_t msgid, uint32_t flags,
+			   int32_t *status)
+{
+	BuxtonNotification *nitem;
+	BuxtonData *value = NULL;
+	int32_t key_status;
+	char *key_name;
+	int r;
+
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+
+	nitem = malloc0(sizeof(BuxtonNotification));
+	if (!nitem) {
+		abort();
+	}
+	nitem->client = client;
+
+	/* Only watch keys the client may read */
+	value = get_value(self, client, key, NULL, &key_status);
+	if (key_status != 0) {
+		free(nitem);
+		return;
+	}
+	nitem->msgid = msgid;
+	nitem->grouped = (flags & BUXTON_NOTIFY_GROUPED) != 0;
+
+	/* May be null, but will append regardless */
+	r = asprintf(&key_name, "%s%s", key->group.value, key->name.value);
+	if (r == -1) {
+		abort();
+	}
+
+	add_notification(self, nitem, key_name, value,
+			 coalesce_interval(key));
+
+	*status = 0;
+}
+
+uint32_t unregister_notification(BuxtonDaemon *self, client_list_item *client,
+				 _BuxtonKey *key, int32_t *status)
+{
+	BuxtonWatchedKey *watched = NULL;
+	BuxtonNotification *nitem;
+	uint32_t msgid = 0;
+	_cleanup_free_ char *key_name = NULL;
+	int r;
+
+	assert(self);
+	assert(client);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+	r = asprintf(&key_name, "%s%s", key->group.value, key->name.value);
+	if (r == -1) {
+		abort();
+	}
+	watched = hashmap_get(self->notify_mapping, key_name);
+	/* This key isn't actually registered for notifications */
+	if (!watched) {
+		return 0;
+	}
+
+	/* Find the client's registration among its own */
+	LIST_FOREACH(subscription, nitem, client->subscriptions) {
+		if (nitem->watched == watched) {
+			break;
+		}
+	}
+
+	/* Client hasn't registered for notifications on this key */
+	if (!nitem) {
+		return 0;
+	}
+
+	msgid = nitem->msgid;
+	/* Remove client from notifications */
+	remove_notification(self, nitem);
+
+	*status = 0;
+
+	return msgid;
+}
+
+uint64_t subscribe_journal(BuxtonDaemon *self, client_list_item *client,
+			   uint64_t epoch, uint64_t from, uint32_t msgid,
+			   int32_t *status)
+{
+	BuxtonJournal *journal = &self->journal;
+
+	assert(self);
+	assert(client);
+	assert(status);
+
+	*status = -1;
+
+	/* Entries are checked against the client's label as they're sent */
+	if (client->journal_subscribed) {
+		return 0;
+	}
+	if (!journal_setup(self)) {
+		return 0;
+	}
+
+	if (from == 0) {
+		client->journal_next = journal->next_seq;
+		*status = 0;
+	} else if (epoch != journal->epoch || from < journal->first_seq ||
+		   from > journal->next_seq) {
+		/* From a journal before a restart, or too old to replay */
+		client->journal_next = journal->next_seq;
+		*status = BUXTON_STATUS_RESYNC;
+	} else {
+		client->journal_next = from;
+		*status = 0;
+	}
+
+	client->journal_subscribed = true;
+	client->journal_msgid = msgid;
+	LIST_PREPEND(client_list_item, subscriber, self->subscribers, client);
+	/* The replay starts when the client is next flushed */
+	if (!client->flush_pending) {
+		LIST_PREPEND(client_list_item, pending, self->pending, client);
+		client->flush_pending = true;
+	}
+
+	return client->journal_next;
+}
+
+uint32_t unsubscribe_journal(BuxtonDaemon *self, client_list_item *client,
+			     int32_t *status)
+{
+	assert(self);
+	assert(client);
+	assert(status);
+
+	*status = -1;
+
+	if (!client->journal_subscribed) {
+		return 0;
+	}
+	LIST_REMOVE(client_list_item, subscriber, self->subscribers, client);
+	client->journal_subscribed = false;
+
+	*status = 0;
+
+	return client->journal_msgid;
+}
+
+void free_transaction(BuxtonTransaction *transaction)
+{
+	if (!transaction) {
+		return;
+	}
+
+	for (size_t i = 0; i < transaction->count; i++) {
+		key_free(transaction->changes[i].key);
+		data_free(transaction->changes[i].data);
+	}
+	free(transaction->changes);
+	free(transaction->layer.value);
+	free(transaction);
+}
+
+void begin_transaction(BuxtonDaemon *self, client_list_item *client,
+		       BuxtonString *layer, int32_t *status)
+{
+	BuxtonTransaction *transaction;
+
+	assert(self);
+	assert(client);
+	assert(layer);
+	assert(status);
+
+	*status = -1;
+
+	/* Transactions don't nest */
+	if (client->transaction || !layer->value) {
+		return;
+	}
+	if (!hashmap_get(self->buxton.config.layers, layer->value)) {
+		return;
+	}
+
+	transaction = malloc0(sizeof(BuxtonTransaction));
+	if (!transaction) {
+		abort();
+	}
+	if (!buxton_string_copy(layer, &transaction->layer)) {
+		abort();
+	}
+	client->transaction = transaction;
+
+	*status = 0;
+}
+
+void stage_change(BuxtonDaemon *self, client_list_item *client,
+		  _BuxtonKey *key, BuxtonData *value, int32_t *status)
+{
+	BuxtonTransaction *transaction;
+	BuxtonChange *change;
+
+	assert(self);
+	assert(client);
+	assert(client->transaction);
+	assert(key);
+	assert(status);
+
+	*status = -1;
+	transaction = client->transaction;
+
+	/* A transaction only changes its own layer */
+	if (!key->layer.value ||
+	    strcmp(key->layer.value, transaction->layer.value) != 0) {
+		return;
+	}
+	if (transaction->count == BUXTON_TRANSACTION_MAX_CHANGES) {
+		return;
+	}
+
+	if (transaction->count == transaction->size) {
+		size_t size = transaction->size ? transaction->size * 2 : 8;
+		BuxtonChange *changes;
+
+		changes = realloc(transaction->changes,
+				  sizeof(BuxtonChange) * size);
+		if (!changes) {
+			abort();
+		}
+		transaction->changes = changes;
+		transaction->size = size;
+	}
+
+	change = &transaction->changes[transaction->count];
+	memzero(change, sizeof(BuxtonChange));
+	change->key = malloc0(sizeof(_BuxtonKey));
+	if (!change->key) {
+		abort();
+	}
+	if (!buxton_key_copy(key, change->key)) {
+		abort();
+	}
+	if (value) {
+		change->data = malloc0(sizeof(BuxtonData));
+		if (!change->data) {
+			abort();
+		}
+		if (!buxton_data_copy(value, change->data)) {
+			abort();
+		}
+	}
+	transaction->count++;
+
+	*status = 0;
+}
+
+BuxtonTransaction *commit_transaction(BuxtonDaemon *self,
+				      client_list_item *client,
+				      int32_t *status)
+{
+	BuxtonTransaction *transaction;
+
+	assert(self);
+	assert(client);
+	assert(status);
+
+	*status = -1;
+
+	transaction = client->transaction;
+	if (!transaction) {
+		return NULL;
+	}
+	client->transaction = NULL;
+
+	buxton_debug("Daemon committing %zu changes to [%s]\n",
+		     transaction->count, transaction->layer.value);
+
+	self->buxton.client.uid = client->cred.uid;
+	if (!buxton_direct_commit(&self->buxton, &transaction->layer,
+				  transaction->changes, transaction->count,
+				  client->smack_label)) {
+		free_transaction(transaction);
+		return NULL;
+	}
+
+	*status = 0;
+	return transaction;
+}
+
+void rollback_transaction(BuxtonDaemon *self, client_list_item *client,
+			  int32_t *status)
+{
+	assert(self);
+	assert(client);
+	assert(status);
+
+	*status = -1;
+
+	if (!client->transaction) {
+		return;
+	}
+	free_transaction(client->transaction);
+	client->transaction = NULL;
+
+	*status = 0;
+}
+
+bool identify_client(client_list_item *cl)
+{
+	socklen_t len = sizeof(struct ucred);
+
+	assert(cl);
+
+	/*
+	 * The kernel records the peer's credentials when it connects, so
+	 * they are there before the client sends anything
+	 */
+	if (getsockopt(cl->fd, SOL_SOCKET, SO_PEERCRED, &cl->cred, &len) == -1) {
+		buxton_log("getsockopt(SO_PEERCRED): %m\n");
+		return false;
+	}
+
+	return true;
+}
+
+void add_pollfd(BuxtonDaemon *self, int fd, short events, bool a,
+		client_list_item *cl)
+{
+	BuxtonPollFd *polled;
+
+	assert(self);
+	assert(fd >= 0);
+
+	if (!greedy_realloc((void **) &(self->pollfds), &(self->nfds_alloc),
+			    (size_t)((self->nfds + 1) * (sizeof(struct pollfd))))) {
+		abort();
+	}
+	if (!greedy_realloc((void **) &(self->accepting), &(self->accepting_alloc),
+			    (size_t)((self->nfds + 1) * (sizeof(self->accepting))))) {
+		abort();
+	}
+	if (!greedy_realloc((void **) &(self->polled), &(self->polled_alloc),
+			    (size_t)((self->nfds + 1) * (sizeof(BuxtonPollFd *))))) {
+		abort();
+	}
+	polled = malloc0(sizeof(BuxtonPollFd));
+	if (!polled) {
+		abort();
+	}
+	polled->fd = fd;
+	polled->index = self->nfds;
+	polled->client = cl;
+	if (cl) {
+		cl->polled = polled;
+	}
+
+	self->pollfds[self->nfds].fd = fd;
+	self->pollfds[self->nfds].events = events;
+	self->pollfds[self->nfds].revents = 0;
+	self->accepting[self->nfds] = a;
+	self->polled[self->nfds] = polled;
+	self->nfds++;
+
+	/* poll and epoll share their event bits on Linux */
+	if (self->epollfd >= 0) {
+		struct epoll_event ev = { .events = (uint32_t)events, .data.ptr = polled };
+
+		if (epoll_ctl(self->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			buxton_log("epoll_ctl(): %m\n");
+			abort();
+		}
+	}
+	if (self->uring) {
+		buxtond_uring_add(self, polled, events, a);
+	}
+
+	buxton_debug("Added fd %d to our poll list (accepting=%d)\n", fd, a);
+}
+
+void del_pollfd(BuxtonDaemon *self, nfds_t i)
+{
+	BuxtonPollFd *polled;
+	nfds_t last;
+
+	assert(self);
+	assert(i < self->nfds);
+
+	buxton_debug("Removing fd %d from our list\n", self->pollfds[i].fd);
+
+	/* Closing the fd would remove it too, but it may be shared */
+	if (self->epollfd >= 0) {
+		(void)epoll_ctl(self->epollfd, EPOLL_CTL_DEL, self->pollfds[i].fd, NULL);
+	}
+	if (self->uring) {
+		buxtond_uring_del(self, self->pollfds[i].fd);
+	}
+
+	/*
+	 * Events already waited for may still point to the entry, so it
+	 * only goes once they are handled
+	 */
+	polled = self->polled[i];
+	polled->fd = -1;
+	if (polled->client) {
+		polled->client->polled = NULL;
+		polled->client = NULL;
+	}
+	polled->next_retired = self->retired;
+	self->retired = polled;
+
+	/* Nothing depends on the order of the fds, so the last one moves */
+	last = self->nfds - 1;
+	if (i != last) {
+		self->pollfds[i] = self->pollfds[last];
+		self->accepting[i] = self->accepting[last];
+		self->polled[i] = self->polled[last];
+		self->polled[i]->index = i;
+	}
+	self->nfds--;
+}
+
+void release_pollfds(BuxtonDaemon *self)
+{
+	BuxtonPollFd *polled;
+
+	assert(self);
+
+	while (self->retired) {
+		polled = self->retired;
+		self->retired = polled->next_retired;
+		free(polled);
+	}
+}
+
+void update_pollfd(BuxtonDaemon *self, nfds_t i, short events)
+{
+	struct epoll_event ev;
+
+	assert(self);
+	assert(i < self->nfds);
+
+	if (self->pollfds[i].events == events) {
+		return;
+	}
+	self->pollfds[i].events = events;
+
+	if (self->epollfd >= 0) {
+		ev.events = (uint32_t)(unsigned short)events;
+		ev.data.ptr = self->polled[i];
+		if (epoll_ctl(self->epollfd, EPOLL_CTL_MOD, self->pollfds[i].fd,
+			      &ev) < 0) {
+			buxton_log("epoll_ctl(): %m\n");
+			abort();
+		}
+	}
+}
+
+bool find_pollfd(BuxtonDaemon *self, int fd, nfds_t *i)
+{
+	assert(self);
+	assert(i);
+
+	for (*i = 0; *i < self->nfds; (*i)++) {
+		if (self->pollfds[*i].fd == fd) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void handle_smack_label(BuxtonDaemon *self, client_list_item *cl)
+{
+	char buf[SMACK_LABEL_LEN + 1];
+	char *value = buf;
+	socklen_t slabel_len = SMACK_LABEL_LEN;
+	BuxtonClientLabel *label;
+	int ret;
+
+	assert(self);
+	assert(cl);
+
+	ret = getsockopt(cl->fd, SOL_SOCKET, SO_PEERSEC, buf, &slabel_len);
+	if (ret < 0 && errno == ERANGE) {
+		/* Longer than a Smack label, slabel_len has the size needed */
+		value = malloc0((size_t)slabel_len + 1);
+		if (!value) {
+			abort();
+		}
+		ret = getsockopt(cl->fd, SOL_SOCKET, SO_PEERSEC, value, &slabel_len);
+	}
+	if (ret < 0) {
+		switch (errno) {
+		case ENOPROTOOPT:
+			/* If Smack is not enabled, do not set the client label */
+			cl->smack_label = NULL;
+			if (value != buf) {
+				free(value);
+			}
+			return;
+		default:
+			buxton_log("getsockopt(): %m\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	value[slabel_len] = '\0';
+
+	buxton_debug("getsockopt(): label=\"%s\"\n", value);
+
+	/* Clients mostly share a few labels, so keep one copy of each */
+	label = hashmap_get(self->labels, value);
+	if (!label) {
+		label = malloc0(sizeof(BuxtonClientLabel));
+		if (!label) {
+			abort();
+		}
+		label->label.value = strdup(value);
+		if (!label->label.value) {
+			abort();
+		}
+		label->label.length = (uint32_t)slabel_len;
+		if (hashmap_put(self->labels, label->label.value, label) < 0) {
+			abort();
+		}
+	}
+	label->clients++;
+
+	if (value != buf) {
+		free(value);
+	}
+
+	cl->smack_label = &label->label;
+}
+
+void release_smack_label(BuxtonDaemon *self, client_list_item *cl)
+{
+	BuxtonClientLabel *label = NULL;
+
+	assert(self);
+	assert(cl);
+
+	if (!cl->smack_label) {
+		return;
+	}
+
+	if (self->labels && cl->smack_label->value) {
+		label = hashmap_get(self->labels, cl->smack_label->value);
+	}
+
+	if (!label || &label->label != cl->smack_label) {
+		/* Not from handle_smack_label, so the client owns it */
+		free(cl->smack_label->value);
+		free(cl->smack_label);
+	} else if (--label->clients == 0) {
+		(void)hashmap_remove(self->labels, label->label.value);
+		free(label->label.value);
+		free(label);
+	}
+	cl->smack_label = NULL;
+}
+
+bool setup_client(BuxtonDaemon *self, client_list_item *cl)
+{
+	assert(self);
+	assert(cl);
+
+	if (!identify_client(cl)) {
+		return false;
+	}
+
+	handle_smack_label(self, cl);
+	cl->class = client_class(cl);
+	attach_rate_limit(self, cl);
+
+	return true;
+}
+
+bool client_has_message(client_list_item *cl)
+{
+	size_t size;
+
+	assert(cl);
+
+	if (!cl->buffer || cl->offset - cl->start < BUXTON_MESSAGE_HEADER_LENGTH) {
+		return false;
+	}
+	size = buxton_get_message_size(cl->buffer + cl->start,
+				       cl->offset - cl->start);
+
+	/* Invalid sizes count too, so the client gets terminated */
+	return size == 0 || size > BUXTON_MESSAGE_MAX_LENGTH ||
+		size <= cl->offset - cl->start;
+}
+
+BuxtonClientClass client_class(client_list_item *cl)
+{
+	char uid[21];
+	int len;
+
+	assert(cl);
+
+	len = snprintf(uid, sizeof(uid), "%lu", (unsigned long)cl->cred.uid);
+	if (config_list_has(buxton_priority_uids(), uid, (size_t)len)) {
+		return BUXTON_CLIENT_SYSTEM;
+	}
+
+	if (cl->smack_label && cl->smack_label->value &&
+	    config_list_has(buxton_priority_labels(), cl->smack_label->value,
+			    strlen(cl->smack_label->value))) {
+		return BUXTON_CLIENT_SYSTEM;
+	}
+
+	return BUXTON_CLIENT_DEFAULT;
+}
+
+static uint32_t config_rate(BuxtonRateClass rate)
+{
+	const char *value = NULL;
+	unsigned long r;
+
+	switch (rate) {
+	case BUXTON_RATE_READ:
+		value = buxton_read_rate();
+		break;
+	case BUXTON_RATE_WRITE:
+		value = buxton_write_rate();
+		break;
+	case BUXTON_RATE_NOTIFY:
+		value = buxton_notify_rate();
+		break;
+	default:
+		break;
+	}
+	if (!value) {
+		return 0;
+	}
+
+	r = strtoul(value, NULL, 10);
+	return r > UINT32_MAX ? UINT32_MAX : (uint32_t)r;
+}
+
+void attach_rate_limit(BuxtonDaemon *self, client_list_item *cl)
+{
+	_cleanup_free_ char *identity = NULL;
+	BuxtonRateLimit *limit;
+
+	assert(self);
+	assert(cl);
+
+	if (cl->rate || cl->class == BUXTON_CLIENT_SYSTEM) {
+		return;
+	}
+	assert(self->rate_limits);
+
+	/* Every connection of an app shares its buckets */
+	if (asprintf(&identity, "%lu:%s", (unsigned long)cl->cred.uid,
+		     cl->smack_label && cl->smack_label->value ?
+		     cl->smack_label->value : "") == -1) {
+		abort();
+	}
+
+	limit = hashmap_get(self->rate_limits, identity);
+	if (!limit) {
+		limit = malloc0(sizeof(BuxtonRateLimit));
+		if (!limit) {
+			abort();
+		}
+		limit->identity = identity;
+		identity = NULL;
+		for (int r = 0; r < BUXTON_RATE_MAX; r++) {
+			limit->rate[r] = config_rate(r);
+			limit->tokens[r] = limit->rate[r];
+		}
+		limit->refilled = monotonic_usec();
+		if (hashmap_put(self->rate_limits, limit->identity, limit) < 0) {
+			abort();
+		}
+	}
+	limit->clients++;
+	cl->rate = limit;
+}
+
+void detach_rate_limit(BuxtonDaemon *self, client_list_item *cl)
+{
+	BuxtonRateLimit *limit;
+
+	assert(self);
+	assert(cl);
+
+	limit = cl->rate;
+	if (!limit) {
+		return;
+	}
+	cl->rate = NULL;
+
+	if (--limit->clients == 0) {
+		(void)hashmap_remove(self->rate_limits, limit->identity);
+		free(limit->identity);
+		free(limit);
+	}
+}
+
+bool take_rate_token(BuxtonDaemon *self, client_list_item *cl,
+		     BuxtonRateClass rate)
+{
+	BuxtonRateLimit *limit;
+	uint64_t now;
+	double tokens;
+
+	assert(self);
+	assert(cl);
+	assert(rate < BUXTON_RATE_MAX);
+
+	limit = cl->rate;
+	if (!limit || limit->rate[rate] == 0) {
+		return true;
+	}
+
+	/* Buckets hold up to one second of requests */
+	now = monotonic_usec();
+	for (int r = 0; r < BUXTON_RATE_MAX; r++) {
+		tokens = limit->tokens[r] +
+			(double)(now - limit->refilled) * limit->rate[r] / 1000000;
+		limit->tokens[r] = tokens < limit->rate[r] ? tokens : limit->rate[r];
+	}
+	limit->refilled = now;
+
+	if (limit->tokens[rate] < 1) {
+		self->stats.throttled[rate]++;
+		return false;
+	}
+	limit->tokens[rate] -= 1;
+	return true;
+}
+
+void buxtond_log_stats(BuxtonDaemon *self)
+{
+	assert(self);
+
+	buxton_log("Received %" PRIu64 " requests, throttled %" PRIu64
+		   " reads, %" PRIu64 " writes and %" PRIu64
+		   " notification registrations\n", self->stats.messages,
+		   self->stats.throttled[BUXTON_RATE_READ],
+		   self->stats.throttled[BUXTON_RATE_WRITE],
+		   self->stats.throttled[BUXTON_RATE_NOTIFY]);
+}
+
+void queue_client(BuxtonDaemon *self, client_list_item *cl)
+{
+	assert(self);
+	assert(cl);
+	assert(cl->class < BUXTON_CLIENT_CLASS_MAX);
+
+	if (cl->queued) {
+		return;
+	}
+	LIST_INSERT_AFTER(client_list_item, ready, self->ready[cl->class],
+			  self->ready_tail[cl->class], cl);
+	self->ready_tail[cl->class] = cl;
+	cl->queued = true;
+}
+
+void dequeue_client(BuxtonDaemon *self, client_list_item *cl)
+{
+	assert(self);
+	assert(cl);
+
+	if (!cl->queued) {
+		return;
+	}
+	if (self->ready_tail[cl->class] == cl) {
+		self->ready_tail[cl->class] = cl->ready_prev;
+	}
+	LIST_REMOVE(client_list_item, ready, self->ready[cl->class], cl);
+	cl->queued = false;
+}
+
+bool clients_ready(BuxtonDaemon *self)
+{
+	assert(self);
+
+	for (int c = 0; c < BUXTON_CLIENT_CLASS_MAX; c++) {
+		if (self->ready[c]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Handle the complete messages in the client's buffer that fit in budget,
+ * in place. Returns false if the client must be terminated.
+ */
+static bool handle_buffered(BuxtonDaemon *self, client_list_item *cl,
+			    size_t *budget)
+{
+	size_t available, size;
+
+	for (;;) {
+		available = cl->offset - cl->start;
+		if (available < BUXTON_MESSAGE_HEADER_LENGTH) {
+			break;
+		}
+		size = buxton_get_message_size(cl->buffer + cl->start, available);
+		if (size == 0 || size > BUXTON_MESSAGE_MAX_LENGTH) {
+			return false;
+		}
+		if (size > available || size > *budget) {
+			break;
+		}
+
+		cl->data = cl->buffer + cl->start;
+		if (!buxtond_handle_message(self, cl, size)) {
+			buxton_log("Communication failed with client %d\n", cl->fd);
+			cl->data = NULL;
+			return false;
+		}
+		cl->data = NULL;
+		cl->start += size;
+		*budget -= size;
+	}
+
+	if (cl->start == cl->offset) {
+		cl->start = 0;
+		cl->offset = 0;
+	}
+	return true;
+}
+
+/*
+ * Make room at the end of the buffer for the rest of the partial message
+ * at its start, which handle_client has already checked
+ */
+static void reserve_buffer(client_list_item *cl)
+{
+	size_t need = BUXTON_MESSAGE_HEADER_LENGTH;
+	size_t available = cl->offset - cl->start;
+
+	if (available >= BUXTON_MESSAGE_HEADER_LENGTH) {
+		need = buxton_get_message_size(cl->buffer + cl->start, available);
+	}
+
+	/* Only move data once the handled head is worth reclaiming */
+	if (cl->start && (cl->size - cl->offset < need - available ||
+			  cl->start >= cl->size / 2)) {
+		memmove(cl->buffer, cl->buffer + cl->start, available);
+		cl->start = 0;
+		cl->offset = available;
+	}
+	if (need > cl->size) {
+		cl->buffer = realloc(cl->buffer, need);
+		if (!cl->buffer) {
+			abort();
+		}
+		cl->size = need;
+	}
+}
+
+/*
+ * Check the size of the message at the start of the buffer, so a full
+ * buffer always holds at least one complete message
+ */
+static bool valid_buffered(client_list_item *cl)
+{
+	size_t available = cl->offset - cl->start;
+	size_t size;
+
+	if (available < BUXTON_MESSAGE_HEADER_LENGTH) {
+		return true;
+	}
+	size = buxton_get_message_size(cl->buffer + cl->start, available);
+	return size != 0 && size <= BUXTON_MESSAGE_MAX_LENGTH;
+}
+
+bool handle_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
+{
+	ssize_t l;
+	size_t space;
+	size_t budget;
+	bool have_data;
+
+	assert(self);
+	assert(cl);
+
+	if (!cl->buffer) {
+		cl->buffer = malloc(BUXTON_CLIENT_BUFFER_SIZE);
+		if (!cl->buffer) {
+			abort();
+		}
+		cl->size = BUXTON_CLIENT_BUFFER_SIZE;
+		cl->start = 0;
+		cl->offset = 0;
+	}
+
+	buxton_debug("New packet from UID %ld, PID %ld\n", cl->cred.uid, cl->cred.pid);
+
+	/*
+	 * Fill as much of the buffer as the socket has. Messages are left
+	 * for serve_clients, and whatever doesn't fit stays in the socket
+	 * until they are handled.
+	 */
+	have_data = cl->offset > cl->start;
+	for (;;) {
+		if (!valid_buffered(cl)) {
+			goto terminate;
+		}
+		reserve_buffer(cl);
+		space = cl->size - cl->offset;
+		if (space == 0) {
+			break;
+		}
+		l = read(self->pollfds[i].fd, cl->buffer + cl->offset, space);
+
+		/*
+		 * Close clients with read errors, or that hung up. A partial
+		 * message stays buffered until the rest arrives.
+		 */
+		if (l < 0) {
+			if (errno != EAGAIN || !have_data) {
+				goto terminate;
+			}
+			break;
+		} else if (l == 0) {
+			/* Finish what the client sent before hanging up */
+			budget = SIZE_MAX;
+			(void)handle_buffered(self, cl, &budget);
+			goto terminate;
+		}
+		have_data = true;
+		cl->offset += (size_t)l;
+
+		/* A short read means the socket is drained */
+		if ((size_t)l < space) {
+			if (!valid_buffered(cl)) {
+				goto terminate;
+			}
+			break;
+		}
+	}
+
+	if (client_has_message(cl)) {
+		queue_client(self, cl);
+	}
+	return cl->queued;
+
+terminate:
+	terminate_client(self, cl, i);
+	return false;
+}
+
+bool receive_client(BuxtonDaemon *self, client_list_item *cl,
+		    uint8_t *data, size_t size)
+{
+	size_t space;
+	size_t budget;
+
+	assert(self);
+	assert(cl);
+
+	if (!cl->buffer) {
+		cl->buffer = malloc(BUXTON_CLIENT_BUFFER_SIZE);
+		if (!cl->buffer) {
+			abort();
+		}
+		cl->size = BUXTON_CLIENT_BUFFER_SIZE;
+		cl->start = 0;
+		cl->offset = 0;
+	}
+
+	if (size == 0) {
+		/* Finish what the client sent before hanging up */
+		budget = SIZE_MAX;
+		(void)handle_buffered(self, cl, &budget);
+		goto terminate;
+	}
+
+	/* The data is out of the socket already, so all of it is kept */
+	while (size) {
+		if (!valid_buffered(cl)) {
+			goto terminate;
+		}
+		reserve_buffer(cl);
+		space = cl->size - cl->offset;
+		if (space == 0) {
+			cl->buffer = realloc(cl->buffer, cl->size * 2);
+			if (!cl->buffer) {
+				abort();
+			}
+			cl->size *= 2;
+			continue;
+		}
+		if (space > size) {
+			space = size;
+		}
+		memcpy(cl->buffer + cl->offset, data, space);
+		cl->offset += space;
+		data += space;
+		size -= space;
+	}
+	if (!valid_buffered(cl)) {
+		goto terminate;
+	}
+
+	if (client_has_message(cl)) {
+		queue_client(self, cl);
+	}
+	return true;
+
+terminate:
+	assert(cl->polled);
+	terminate_client(self, cl, cl->polled->index);
+	return false;
+}
+
+void add_client(BuxtonDaemon *self, int fd)
+{
+	client_list_item *cl;
+	int on = 1;
+
+	assert(self);
+	assert(fd >= 0);
+
+	cl = malloc0(sizeof(client_list_item));
+	if (!cl) {
+		abort();
+	}
+
+	LIST_INIT(client_list_item, item, cl);
+
+	cl->fd = fd;
+	/* Credentials and label don't change, so look them up once */
+	if (!setup_client(self, cl)) {
+		close(fd);
+		free(cl);
+		return;
+	}
+	LIST_PREPEND(client_list_item, item, self->client_list, cl);
+
+	/* poll for data on this new client as well */
+	add_pollfd(self, cl->fd, POLLIN | POLLPRI, false, cl);
+
+	/* Mark our packets as high prio */
+	if (setsockopt(cl->fd, SOL_SOCKET, SO_PRIORITY, &on, sizeof(on)) == -1) {
+		buxton_log("setsockopt(SO_PRIORITY): %m\n");
+	}
+}
+
+/*
+ * Give the client its quantum and handle the messages it covers. Clients
+ * left with messages go to the back of the queue with what they didn't
+ * spend, the others start from nothing once they have messages again.
+ */
+static void serve_client(BuxtonDaemon *self, client_list_item *cl)
+{
+	size_t quantum = BUXTON_CLIENT_QUANTUM;
+
+	if (cl->class == BUXTON_CLIENT_SYSTEM) {
+		quantum *= BUXTON_CLIENT_SYSTEM_WEIGHT;
+	}
+	cl->deficit += quantum;
+
+	if (!handle_buffered(self, cl, &cl->deficit)) {
+		assert(cl->polled);
+		terminate_client(self, cl, cl->polled->index);
+		return;
+	}
+
+	if (client_has_message(cl)) {
+		queue_client(self, cl);
+	} else {
+		cl->deficit = 0;
+	}
+	if (self->uring) {
+		buxtond_uring_resume(self, cl);
+	}
+}
+
+void serve_clients(BuxtonDaemon *self)
+{
+	client_list_item *cl, *last;
+	bool done;
+
+	assert(self);
+
+	for (int c = 0; c < BUXTON_CLIENT_CLASS_MAX; c++) {
+		/* Clients queued again in this round wait for the next one */
+		last = self->ready_tail[c];
+		done = last == NULL;
+		while (!done) {
+			cl = self->ready[c];
+			done = cl == last;
+			dequeue_client(self, cl);
+			serve_client(self, cl);
+		}
+	}
+}
+
+bool queue_output(BuxtonDaemon *self, client_list_item *cl, uint8_t *data,
+		  size_t size)
+{
+	size_t used;
+	size_t need;
+
+	assert(self);
+	assert(cl);
+	assert(data);
+
+	used = cl->out_offset - cl->out_start;
+	if (used + size > BUXTON_CLIENT_OUTPUT_LIMIT) {
+		buxton_log("Client %d isn't reading its responses\n", cl->fd);
+		return false;
+	}
+
+	if (cl->out_size - cl->out_offset < size) {
+		/* Drop what's been written before growing */
+		if (cl->out_start) {
+			memmove(cl->out, cl->out + cl->out_start, used);
+			cl->out_start = 0;
+			cl->out_offset = used;
+		}
+		need = cl->out_size ? cl->out_size : BUXTON_CLIENT_BUFFER_SIZE;
+		while (need < used + size) {
+			need *= 2;
+		}
+		if (need > cl->out_size) {
+			cl->out = realloc(cl->out, need);
+			if (!cl->out) {
+				abort();
+			}
+			cl->out_size = need;
+		}
+	}
+
+	memcpy(cl->out + cl->out_offset, data, size);
+	cl->out_offset += size;
+
+	if (!cl->flush_pending) {
+		LIST_PREPEND(client_list_item, pending, self->pending, cl);
+		cl->flush_pending = true;
+	}
+	return true;
+}
+
+bool flush_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
+{
+	ssize_t l;
+
+	assert(self);
+	assert(cl);
+
+	queue_changes(self, cl);
+	buxtond_journal_catch_up(self, cl);
+	if (cl->flush_pending) {
+		LIST_REMOVE(client_list_item, pending, self->pending, cl);
+		cl->flush_pending = false;
+	}
+	if (self->uring) {
+		return buxtond_uring_send(self, cl);
 	}
-	*fd = (uint64_t)client->fd;
 
-	key_list = hashmap_get(self->client_key_mapping, fd);
-	if (!key_list) {
-		if (!buxton_list_append(&key_list, key_name_copy)) {
-			abort();
-		}
-		if(hashmap_put(self->client_key_mapping, fd, key_list) < 0) {
-			abort();
+	/* Everything queued this cycle goes out in one write if it fits */
+	while (cl->out_start < cl->out_offset) {
+		l = send(cl->fd, cl->out + cl->out_start,
+			 cl->out_offset - cl->out_start,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (l < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN && i < self->nfds) {
+				update_pollfd(self, i, self->pollfds[i].events | POLLOUT);
+				return true;
+			}
+			buxton_debug("write error\n");
+			if (i < self->nfds) {
+				terminate_client(self, cl, i);
+			}
+			return false;
 		}
-	} else {
-		if (!buxton_list_append(&key_list, key_name_copy)) {
-			abort();
+		cl->out_start += (size_t)l;
+
+		/* A subscriber far behind the journal is sent it in turns */
+		if (cl->out_start == cl->out_offset && cl->journal_subscribed &&
+		    cl->journal_next < self->journal.next_seq) {
+			cl->out_start = 0;
+			cl->out_offset = 0;
+			buxtond_journal_catch_up(self, cl);
 		}
-		free(fd);
 	}
 
-	*status = 0;
+	cl->out_start = 0;
+	cl->out_offset = 0;
+	if (i < self->nfds) {
+		update_pollfd(self, i, (short)(self->pollfds[i].events & ~POLLOUT));
+	}
+	return true;
 }
 
-uint32_t unregister_notification(BuxtonDaemon *self, client_list_item *client,
-				 _BuxtonKey *key, int32_t *status)
+void flush_clients(BuxtonDaemon *self)
 {
-	BuxtonList *n_list = NULL;
-	BuxtonList *key_list = NULL;
-	BuxtonList *elem = NULL;
-	BuxtonNotification *nitem, *citem = NULL;
-	uint32_t msgid = 0;
-	_cleanup_free_ char *key_name = NULL;
-	void *old_key_name;
-	int r;
-	char *client_keyname = NULL;
-	uint64_t fd = 0;
-	void *old_fd = NULL;
+	client_list_item *cl, *next;
 
 	assert(self);
-	assert(client);
-	assert(key);
-	assert(status);
 
-	*status = -1;
-	r = asprintf(&key_name, "%s%s", key->group.value, key->name.value);
-	if (r == -1) {
-		abort();
+	LIST_FOREACH_SAFE(pending, cl, next, self->pending) {
+		(void)flush_client(self, cl, cl->polled ? cl->polled->index :
+				   self->nfds);
 	}
-	n_list = hashmap_get2(self->notify_mapping, key_name, &old_key_name);
-	/* This key isn't actually registered for notifications */
-	if (!n_list) {
-		return 0;
+}
+
+void terminate_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
+{
+	if (cl->subscriptions) {
+		buxton_debug("Removing notifications for client before terminating\n");
+	}
+	while (cl->subscriptions) {
+		remove_notification(self, cl->subscriptions);
 	}
+	if (cl->journal_subscribed) {
+		LIST_REMOVE(client_list_item, subscriber, self->subscribers, cl);
+	}
+	free_transaction(cl->transaction);
 
-	BUXTON_LIST_FOREACH(n_list, elem) {
-		nitem = elem->data;
-		/* Find the list item for this client */
-		if (nitem->client == client) {
-			citem = nitem;
-			break;
-		}
-	};
+	dequeue_client(self, cl);
+	detach_rate_limit(self, cl);
+	if (cl->flush_pending) {
+		LIST_REMOVE(client_list_item, pending, self->pending, cl);
+	}
+	if (self->uring) {
+		buxtond_uring_detach(self, cl);
+	}
+	del_pollfd(self, i);
+	close(cl->fd);
+	release_smack_label(self, cl);
+	free(cl->buffer);
+	free(cl->out);
+	buxton_array_free(&cl->changes, free_change);
+	buxton_debug("Closed connection from fd %d\n", cl->fd);
+	LIST_REMOVE(client_list_item, item, self->client_list, cl);
+	free(cl);
+	cl = NULL;
+}
 
-	/* Client hasn't registered for notifications on this key */
-	if (!citem) {
-		return 0;
+static void save_value(FILE *f, const void *value, size_t size)
+{
+	/* Errors are picked up by ferror once everything is written */
+	(void)fwrite(value, 1, size, f);
+}
+
+static void save_bytes(FILE *f, const void *bytes, size_t size)
+{
+	uint32_t length = (uint32_t)size;
+
+	save_value(f, &length, sizeof(uint32_t));
+	if (size) {
+		save_value(f, bytes, size);
 	}
+}
 
-	fd = (uint64_t)client->fd;
-	/* Remove key name from client hashmap */
-	key_list = hashmap_get2(self->client_key_mapping, &fd, &old_fd);
+static void save_string(FILE *f, BuxtonString *string)
+{
+	save_bytes(f, string->value, string->value ? string->length : 0);
+}
 
-	if (!key_list || !old_fd) {
-		abort();
+/* The changes a client staged but hasn't committed yet */
+static void save_transaction(FILE *f, BuxtonTransaction *transaction)
+{
+	uint8_t open = transaction ? 1 : 0;
+	uint32_t count;
+	uint32_t type;
+	uint8_t kind;
+
+	save_value(f, &open, sizeof(uint8_t));
+	if (!transaction) {
+		return;
 	}
 
-	BUXTON_LIST_FOREACH(key_list, elem) {
-		if (!strcmp(elem->data, key_name)) {
-			client_keyname = elem->data;
-			break;
+	save_string(f, &transaction->layer);
+	count = (uint32_t)transaction->count;
+	save_value(f, &count, sizeof(uint32_t));
+	for (size_t i = 0; i < transaction->count; i++) {
+		BuxtonChange *change = &transaction->changes[i];
+		_cleanup_free_ uint8_t *data = NULL;
+		size_t size = 0;
+
+		save_string(f, &change->key->group);
+		save_string(f, &change->key->name);
+		save_string(f, &change->key->layer);
+		type = (uint32_t)change->key->type;
+		save_value(f, &type, sizeof(uint32_t));
+
+		if (!change->data) {
+			kind = BUXTON_HANDOFF_UNSET_DATA;
+		} else {
+			kind = BUXTON_HANDOFF_DATA;
+			size = buxton_serialize(change->data,
+						&(BuxtonString){ "", 0 }, &data);
+			if (size == 0) {
+				abort();
+			}
 		}
-	};
-
-	if (client_keyname) {
-		buxton_list_remove(&key_list, client_keyname, true);
-		if (!key_list) {
-			hashmap_remove(self->client_key_mapping, &fd);
-			free(old_fd);
+		save_value(f, &kind, sizeof(uint8_t));
+		if (kind == BUXTON_HANDOFF_DATA) {
+			save_bytes(f, data, size);
 		}
 	}
+}
 
-	msgid = citem->msgid;
-	/* Remove client from notifications */
-	free_buxton_data(&(citem->old_data));
-	buxton_list_remove(&n_list, citem, true);
+static bool is_client_fd(BuxtonDaemon *self, int fd)
+{
+	client_list_item *cl;
 
-	/* If we removed the last item, remove the mapping too */
-	if (!n_list) {
-		(void)hashmap_remove(self->notify_mapping, key_name);
-		free(old_key_name);
+	LIST_FOREACH(item, cl, self->client_list) {
+		if (cl->fd == fd) {
+			return true;
+		}
 	}
-
-	*status = 0;
-
-	return msgid;
+	return false;
 }
 
-bool identify_client(client_list_item *cl)
+bool buxtond_save_state(BuxtonDaemon *self, FILE *f, uint32_t flags)
 {
-	/* Identity handling */
-	ssize_t nr;
-	int data;
-	struct msghdr msgh;
-	struct iovec iov;
-	__attribute__((unused)) struct ucred *ucredp;
-	struct cmsghdr *cmhp;
-	socklen_t len = sizeof(struct ucred);
-	int on = 1;
+	client_list_item *cl;
+	BuxtonWatchedKey *watched;
+	BuxtonNotification *nitem;
+	Iterator iter;
+	char *key_name;
+	uint32_t magic = BUXTON_HANDOFF_MAGIC;
+	uint32_t version = BUXTON_HANDOFF_VERSION;
+	uint32_t count = 0;
+	int32_t fd;
+	uint8_t kind;
 
-	assert(cl);
+	assert(self);
+	assert(f);
 
-	union {
-		struct cmsghdr cmh;
-		char control[CMSG_SPACE(sizeof(struct ucred))];
-	} control_un;
+	save_value(f, &magic, sizeof(uint32_t));
+	save_value(f, &version, sizeof(uint32_t));
+	save_value(f, &flags, sizeof(uint32_t));
 
-	setsockopt(cl->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+	/* Listening sockets, and whatever else systemd passed in */
+	for (nfds_t i = 0; i < self->nfds; i++) {
+		if (!is_client_fd(self, self->pollfds[i].fd)) {
+			count++;
+		}
+	}
+	save_value(f, &count, sizeof(uint32_t));
+	for (nfds_t i = 0; i < self->nfds; i++) {
+		if (is_client_fd(self, self->pollfds[i].fd)) {
+			continue;
+		}
+		fd = self->pollfds[i].fd;
+		save_value(f, &fd, sizeof(int32_t));
+		save_value(f, &self->pollfds[i].events, sizeof(short));
+		save_value(f, &self->accepting[i], sizeof(bool));
+	}
 
-	control_un.cmh.cmsg_len = CMSG_LEN(sizeof(struct ucred));
-	control_un.cmh.cmsg_level = SOL_SOCKET;
-	control_un.cmh.cmsg_type = SCM_CREDENTIALS;
+	/* Clients, with what they sent and what they weren't sent yet */
+	count = 0;
+	LIST_FOREACH(item, cl, self->client_list) {
+		count++;
+	}
+	save_value(f, &count, sizeof(uint32_t));
+	LIST_FOREACH(item, cl, self->client_list) {
+		queue_changes(self, cl);
+		fd = cl->fd;
+		save_value(f, &fd, sizeof(int32_t));
+		save_bytes(f, cl->buffer ? cl->buffer + cl->start : NULL,
+			   cl->offset - cl->start);
+		save_bytes(f, cl->out ? cl->out + cl->out_start : NULL,
+			   cl->out_offset - cl->out_start);
+		save_transaction(f, cl->transaction);
+	}
 
-	msgh.msg_control = control_un.control;
-	msgh.msg_controllen = sizeof(control_un.control);
+	/* Watched keys, with their last value and who watches them */
+	count = hashmap_size(self->notify_mapping);
+	save_value(f, &count, sizeof(uint32_t));
+	HASHMAP_FOREACH_KEY(watched, key_name, self->notify_mapping, iter) {
+		_cleanup_free_ uint8_t *data = NULL;
+		size_t size = 0;
 
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	iov.iov_base = &data;
-	iov.iov_len = sizeof(int);
+		save_bytes(f, key_name, strlen(key_name) + 1);
 
-	msgh.msg_name = NULL;
-	msgh.msg_namelen = 0;
+		if (!watched->last) {
+			kind = BUXTON_HANDOFF_NO_DATA;
+		} else if (watched->last->type == BUXTON_TYPE_MIN) {
+			/* The key was unset when it last changed */
+			kind = BUXTON_HANDOFF_UNSET_DATA;
+		} else {
+			kind = BUXTON_HANDOFF_DATA;
+			size = buxton_serialize(watched->last,
+						&(BuxtonString){ "", 0 }, &data);
+			if (size == 0) {
+				abort();
+			}
+		}
+		save_value(f, &kind, sizeof(uint8_t));
+		if (kind == BUXTON_HANDOFF_DATA) {
+			save_bytes(f, data, size);
+		}
+		save_value(f, &watched->interval, sizeof(uint32_t));
 
-	nr = recvmsg(cl->fd, &msgh, MSG_PEEK | MSG_DONTWAIT);
-	if (nr == -1) {
-		return false;
+		count = 0;
+		LIST_FOREACH(watcher, nitem, watched->notifications) {
+			count++;
+		}
+		save_value(f, &count, sizeof(uint32_t));
+		LIST_FOREACH(watcher, nitem, watched->notifications) {
+			fd = nitem->client->fd;
+			save_value(f, &fd, sizeof(int32_t));
+			save_value(f, &nitem->msgid, sizeof(uint32_t));
+			save_value(f, &nitem->grouped, sizeof(bool));
+		}
 	}
 
-	cmhp = CMSG_FIRSTHDR(&msgh);
-
-	if (cmhp == NULL || cmhp->cmsg_len != CMSG_LEN(sizeof(struct ucred))) {
-		buxton_log("Invalid cmessage header from kernel\n");
-		abort();
+	/*
+	 * Where the journal is up to, and who follows it. The entries
+	 * aren't kept, so subscribers that were behind have to resync.
+	 */
+	save_value(f, &self->journal.next_seq, sizeof(uint64_t));
+	save_value(f, &self->journal.epoch, sizeof(uint64_t));
+	count = 0;
+	LIST_FOREACH(subscriber, cl, self->subscribers) {
+		count++;
 	}
-
-	if (cmhp->cmsg_level != SOL_SOCKET || cmhp->cmsg_type != SCM_CREDENTIALS) {
-		buxton_log("Missing credentials on socket\n");
-		abort();
+	save_value(f, &count, sizeof(uint32_t));
+	LIST_FOREACH(subscriber, cl, self->subscribers) {
+		fd = cl->fd;
+		save_value(f, &fd, sizeof(int32_t));
+		save_value(f, &cl->journal_msgid, sizeof(uint32_t));
+		save_value(f, &cl->journal_next, sizeof(uint64_t));
 	}
 
-	ucredp = (struct ucred *) CMSG_DATA(cmhp);
-
-	if (getsockopt(cl->fd, SOL_SOCKET, SO_PEERCRED, &cl->cred, &len) == -1) {
-		buxton_log("Missing label on socket\n");
-		abort();
+	if (fflush(f) || ferror(f)) {
+		buxton_log("Failed to save state: %m\n");
+		return false;
 	}
-
 	return true;
 }
 
-void add_pollfd(BuxtonDaemon *self, int fd, short events, bool a)
+static bool load_value(FILE *f, void *value, size_t size)
 {
-	assert(self);
-	assert(fd >= 0);
+	return fread(value, 1, size, f) == size;
+}
 
-	if (!greedy_realloc((void **) &(self->pollfds), &(self->nfds_alloc),
-			    (size_t)((self->nfds + 1) * (sizeof(struct pollfd))))) {
-		abort();
+static bool load_bytes(FILE *f, uint8_t **bytes, size_t *size, size_t max)
+{
+	uint32_t length;
+
+	if (!load_value(f, &length, sizeof(uint32_t)) || length > max) {
+		return false;
 	}
-	if (!greedy_realloc((void **) &(self->accepting), &(self->accepting_alloc),
-			    (size_t)((self->nfds + 1) * (sizeof(self->accepting))))) {
+
+	*bytes = malloc(length ? length : 1);
+	if (!*bytes) {
 		abort();
 	}
-	self->pollfds[self->nfds].fd = fd;
-	self->pollfds[self->nfds].events = events;
-	self->pollfds[self->nfds].revents = 0;
-	self->accepting[self->nfds] = a;
-	self->nfds++;
-
-	buxton_debug("Added fd %d to our poll list (accepting=%d)\n", fd, a);
+	*size = length;
+	return load_value(f, *bytes, length);
 }
 
-void del_pollfd(BuxtonDaemon *self, nfds_t i)
+static bool load_string(FILE *f, BuxtonString *string)
 {
-	assert(self);
-	assert(i < self->nfds);
+	uint8_t *bytes = NULL;
+	size_t size;
 
-	buxton_debug("Removing fd %d from our list\n", self->pollfds[i].fd);
-
-	if (i != (self->nfds - 1)) {
-		memmove(&(self->pollfds[i]),
-			&(self->pollfds[i + 1]),
-			/*
-			 * nfds < max int because of kernel limit of
-			 * fds. i + 1 < nfds because of if and assert
-			 * so the casts below are always >= 0 and less
-			 * than long unsigned max int so no loss of
-			 * precision.
-			 */
-			(size_t)(self->nfds - i - 1) * sizeof(struct pollfd));
-		memmove(&(self->accepting[i]),
-			&(self->accepting[i + 1]),
-			(size_t)(self->nfds - i - 1) * sizeof(bool));
+	if (!load_bytes(f, &bytes, &size, BUXTON_MESSAGE_MAX_LENGTH) ||
+	    (size && bytes[size - 1] != '\0')) {
+		free(bytes);
+		return false;
 	}
-	self->nfds--;
+	if (!size) {
+		free(bytes);
+		bytes = NULL;
+	}
+	string->value = (char *)bytes;
+	string->length = (uint32_t)size;
+	return true;
 }
 
-void handle_smack_label(client_list_item *cl)
+static bool load_transaction(FILE *f, BuxtonTransaction **transaction)
 {
-	socklen_t slabel_len = 1;
-	char *buf = NULL;
-	BuxtonString *slabel = NULL;
-	int ret;
-
-	ret = getsockopt(cl->fd, SOL_SOCKET, SO_PEERSEC, NULL, &slabel_len);
-	/* libsmack ignores ERANGE here, so we ignore it too */
-	if (ret < 0 && errno != ERANGE) {
-		switch (errno) {
-		case ENOPROTOOPT:
-			/* If Smack is not enabled, do not set the client label */
-			cl->smack_label = NULL;
-			return;
-		default:
-			buxton_log("getsockopt(): %m\n");
-			exit(EXIT_FAILURE);
-		}
+	BuxtonTransaction *t;
+	uint32_t count;
+	uint32_t type;
+	uint8_t open;
+	uint8_t kind;
+
+	*transaction = NULL;
+	if (!load_value(f, &open, sizeof(uint8_t))) {
+		return false;
 	}
-
-	slabel = malloc0(sizeof(BuxtonString));
-	if (!slabel) {
-		abort();
+	if (!open) {
+		return true;
 	}
 
-	/* already checked slabel_len positive above */
-	buf = malloc0((size_t)slabel_len + 1);
-	if (!buf) {
+	t = malloc0(sizeof(BuxtonTransaction));
+	if (!t) {
 		abort();
 	}
-
-	ret = getsockopt(cl->fd, SOL_SOCKET, SO_PEERSEC, buf, &slabel_len);
-	if (ret < 0) {
-		buxton_log("getsockopt(): %m\n");
-		exit(EXIT_FAILURE);
+	if (!load_string(f, &t->layer) || !t->layer.value ||
+	    !load_value(f, &count, sizeof(uint32_t)) ||
+	    count > BUXTON_TRANSACTION_MAX_CHANGES) {
+		free_transaction(t);
+		return false;
 	}
+	if (count) {
+		t->changes = calloc(count, sizeof(BuxtonChange));
+		if (!t->changes) {
+			abort();
+		}
+		t->size = count;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		BuxtonChange *change = &t->changes[i];
+		_cleanup_free_ uint8_t *data = NULL;
+		BuxtonString label;
+		size_t size;
 
-	slabel->value = buf;
-	slabel->length = (uint32_t)slabel_len;
+		change->key = malloc0(sizeof(_BuxtonKey));
+		if (!change->key) {
+			abort();
+		}
+		/* Freed with the transaction from here on */
+		t->count++;
+
+		if (!load_string(f, &change->key->group) ||
+		    !load_string(f, &change->key->name) ||
+		    !load_string(f, &change->key->layer) ||
+		    !load_value(f, &type, sizeof(uint32_t)) ||
+		    !load_value(f, &kind, sizeof(uint8_t)) ||
+		    (kind == BUXTON_HANDOFF_DATA &&
+		     !load_bytes(f, &data, &size, BUXTON_MESSAGE_MAX_LENGTH))) {
+			free_transaction(t);
+			return false;
+		}
+		change->key->type = (BuxtonDataType)type;
 
-	buxton_debug("getsockopt(): label=\"%s\"\n", slabel->value);
+		if (kind == BUXTON_HANDOFF_DATA) {
+			change->data = malloc0(sizeof(BuxtonData));
+			if (!change->data) {
+				abort();
+			}
+			buxton_deserialize(data, change->data, &label);
+			free(label.value);
+		}
+	}
 
-	cl->smack_label = slabel;
+	*transaction = t;
+	return true;
 }
 
-bool handle_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
+bool buxtond_restore_state(BuxtonDaemon *self, FILE *f, uint32_t *flags)
 {
-	ssize_t l;
-	uint16_t peek;
-	bool more_data = false;
-	int message_limit = 32;
+	client_list_item *cl;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	int32_t fd;
+	short events;
+	bool accepting;
 
 	assert(self);
-	assert(cl);
+	assert(f);
+	assert(flags);
 
-	if (!cl->data) {
-		cl->data = malloc0(BUXTON_MESSAGE_HEADER_LENGTH);
-		cl->offset = 0;
-		cl->size = BUXTON_MESSAGE_HEADER_LENGTH;
-	}
-	if (!cl->data) {
-		abort();
+	if (!load_value(f, &magic, sizeof(uint32_t)) ||
+	    !load_value(f, &version, sizeof(uint32_t)) ||
+	    !load_value(f, flags, sizeof(uint32_t))) {
+		return false;
 	}
-	/* client closed the connection, or some error occurred? */
-	if (recv(cl->fd, cl->data, cl->size, MSG_PEEK | MSG_DONTWAIT) <= 0) {
-		goto terminate;
+	if (magic != BUXTON_HANDOFF_MAGIC || version != BUXTON_HANDOFF_VERSION) {
+		buxton_log("Handoff state version %u isn't supported\n", version);
+		return false;
 	}
 
-	/* need to authenticate the client? */
-	if ((cl->cred.uid == 0) || (cl->cred.pid == 0)) {
-		if (!identify_client(cl)) {
-			goto terminate;
+	if (!load_value(f, &count, sizeof(uint32_t))) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (!load_value(f, &fd, sizeof(int32_t)) ||
+		    !load_value(f, &events, sizeof(short)) ||
+		    !load_value(f, &accepting, sizeof(bool))) {
+			return false;
 		}
-
-		handle_smack_label(cl);
+		add_pollfd(self, fd, events, accepting, NULL);
 	}
 
-	buxton_debug("New packet from UID %ld, PID %ld\n", cl->cred.uid, cl->cred.pid);
-
-	/* Hand off any read data */
-	do {
-		l = read(self->pollfds[i].fd, (cl->data) + cl->offset, cl->size - cl->offset);
-
-		/*
-		 * Close clients with read errors. If there isn't more
-		 * data and we don't have a complete message just
-		 * cleanup and let the client resend their request.
-		 */
-		if (l < 0) {
-			if (errno != EAGAIN) {
-				goto terminate;
-			} else {
-				goto cleanup;
-			}
-		} else if (l == 0) {
-			goto cleanup;
+	if (!load_value(f, &count, sizeof(uint32_t))) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		_cleanup_free_ uint8_t *in = NULL;
+		_cleanup_free_ uint8_t *out = NULL;
+		BuxtonTransaction *transaction;
+		size_t in_size, out_size;
+
+		if (!load_value(f, &fd, sizeof(int32_t)) ||
+		    !load_bytes(f, &in, &in_size, BUXTON_CLIENT_BUFFER_SIZE +
+				BUXTON_MESSAGE_MAX_LENGTH) ||
+		    !load_bytes(f, &out, &out_size, BUXTON_CLIENT_OUTPUT_LIMIT) ||
+		    !load_transaction(f, &transaction)) {
+			return false;
 		}
 
-		cl->offset += (size_t)l;
-		if (cl->offset < BUXTON_MESSAGE_HEADER_LENGTH) {
-			continue;
+		cl = malloc0(sizeof(client_list_item));
+		if (!cl) {
+			abort();
 		}
-		if (cl->size == BUXTON_MESSAGE_HEADER_LENGTH) {
-			cl->size = buxton_get_message_size(cl->data, cl->offset);
-			if (cl->size == 0 || cl->size > BUXTON_MESSAGE_MAX_LENGTH) {
-				goto terminate;
-			}
+		LIST_INIT(client_list_item, item, cl);
+		cl->fd = fd;
+
+		/* The socket still knows who connected */
+		if (!setup_client(self, cl)) {
+			close(fd);
+			free_transaction(transaction);
+			free(cl);
+			continue;
 		}
-		if (cl->size != BUXTON_MESSAGE_HEADER_LENGTH) {
-			cl->data = realloc(cl->data, cl->size);
-			if (!cl->data) {
+		LIST_PREPEND(client_list_item, item, self->client_list, cl);
+		add_pollfd(self, cl->fd, POLLIN | POLLPRI, false, cl);
+		cl->transaction = transaction;
+
+		if (in_size) {
+			cl->size = in_size > BUXTON_CLIENT_BUFFER_SIZE ?
+				in_size : BUXTON_CLIENT_BUFFER_SIZE;
+			cl->buffer = malloc(cl->size);
+			if (!cl->buffer) {
 				abort();
 			}
+			memcpy(cl->buffer, in, in_size);
+			cl->offset = in_size;
+			if (client_has_message(cl)) {
+				queue_client(self, cl);
+			}
 		}
-		if (cl->size > cl->offset) {
-			continue;
-		} else if (cl->size < cl->offset) {
-			buxton_log("Somehow read more bytes than from client requested\n");
-			abort();
-		}
-		if (!buxtond_handle_message(self, cl, cl->size)) {
-			buxton_log("Communication failed with client %d\n", cl->fd);
-			goto terminate;
+		if (out_size) {
+			if (!queue_output(self, cl, out, out_size)) {
+				buxton_log("Dropped output for client %d\n", cl->fd);
+			}
 		}
+	}
 
-		message_limit--;
-		if (message_limit) {
-			cl->size = BUXTON_MESSAGE_HEADER_LENGTH;
-			cl->offset = 0;
-			continue;
-		}
-		if (recv(cl->fd, &peek, sizeof(uint16_t), MSG_PEEK | MSG_DONTWAIT) > 0) {
-			more_data = true;
+	if (!load_value(f, &count, sizeof(uint32_t))) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		_cleanup_free_ uint8_t *data = NULL;
+		_cleanup_free_ uint8_t *key_name = NULL;
+		_cleanup_buxton_data_ BuxtonData *last = NULL;
+		BuxtonNotification *nitem;
+		BuxtonString label;
+		size_t size;
+		uint32_t watchers;
+		uint32_t interval;
+		uint32_t msgid;
+		bool grouped;
+		uint8_t kind;
+		char *name;
+
+		if (!load_bytes(f, &key_name, &size, BUXTON_MESSAGE_MAX_LENGTH) ||
+		    size == 0 || key_name[size - 1] != '\0' ||
+		    !load_value(f, &kind, sizeof(uint8_t)) ||
+		    (kind == BUXTON_HANDOFF_DATA &&
+		     !load_bytes(f, &data, &size, BUXTON_MESSAGE_MAX_LENGTH)) ||
+		    !load_value(f, &interval, sizeof(uint32_t)) ||
+		    !load_value(f, &watchers, sizeof(uint32_t))) {
+			return false;
 		}
-		goto cleanup;
-	} while (l > 0);
-
-cleanup:
-	free(cl->data);
-	cl->data = NULL;
-	cl->size = BUXTON_MESSAGE_HEADER_LENGTH;
-	cl->offset = 0;
-	return more_data;
-
-terminate:
-	terminate_client(self, cl, i);
-	return more_data;
-}
-
-void terminate_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
-{
-	BuxtonList *key_list = NULL;
-	BuxtonList *elem, *notify_elem;
-	char *key_name;
-	void *old_key_name = NULL;
-	void *old_fd = NULL;
-	uint64_t fd = (uint64_t)cl->fd;
-
-	key_list = hashmap_get2(self->client_key_mapping, &fd, &old_fd);
 
-	if (key_list) {
-		buxton_debug("Removing notifications for client before terminating\n");
-		BUXTON_LIST_FOREACH(key_list, elem) {
-			key_name = elem->data;
-			BuxtonList *n_list = NULL;
-
-			n_list = hashmap_get2(self->notify_mapping, key_name, &old_key_name);
-			if (!n_list || !old_key_name) {
+		if (kind != BUXTON_HANDOFF_NO_DATA) {
+			last = malloc0(sizeof(BuxtonData));
+			if (!last) {
 				abort();
 			}
+		}
+		if (kind == BUXTON_HANDOFF_DATA) {
+			buxton_deserialize(data, last, &label);
+			free(label.value);
+		}
 
-			BuxtonNotification *nitem, *citem = NULL;
+		for (uint32_t j = 0; j < watchers; j++) {
+			if (!load_value(f, &fd, sizeof(int32_t)) ||
+			    !load_value(f, &msgid, sizeof(uint32_t)) ||
+			    !load_value(f, &grouped, sizeof(bool))) {
+				return false;
+			}
 
-			BUXTON_LIST_FOREACH(n_list, notify_elem) {
-				nitem = notify_elem->data;
-				if (nitem->client == cl) {
-					citem = nitem;
+			LIST_FOREACH(item, cl, self->client_list) {
+				if (cl->fd == fd) {
 					break;
 				}
-			};
+			}
+			/* The client went away before it could be set up */
+			if (!cl) {
+				continue;
+			}
 
-			if (!citem) {
+			nitem = malloc0(sizeof(BuxtonNotification));
+			if (!nitem) {
 				abort();
 			}
+			nitem->client = cl;
+			nitem->msgid = msgid;
+			nitem->grouped = grouped;
 
-			/* Remove client from notifications */
-			free_buxton_data(&(citem->old_data));
-			buxton_list_remove(&n_list, citem, true);
-
-			/* If we removed the last item, remove the mapping too */
-			if (!n_list) {
-				(void)hashmap_remove(self->notify_mapping, key_name);
-				free(old_key_name);
+			name = strdup((char *)key_name);
+			if (!name) {
+				abort();
 			}
-		};
-		/* Remove key from client hashmap */
-		hashmap_remove(self->client_key_mapping, &fd);
-		free(old_fd);
-		buxton_list_free_all(&key_list);
+			/* The first registration takes the value */
+			add_notification(self, nitem, name, last, interval);
+			last = NULL;
+		}
 	}
 
-	del_pollfd(self, i);
-	close(cl->fd);
-	if (cl->smack_label) {
-		free(cl->smack_label->value);
+	if (!load_value(f, &self->journal.next_seq, sizeof(uint64_t)) ||
+	    !load_value(f, &self->journal.epoch, sizeof(uint64_t)) ||
+	    !load_value(f, &count, sizeof(uint32_t))) {
+		return false;
 	}
-	free(cl->smack_label);
-	free(cl->data);
-	buxton_debug("Closed connection from fd %d\n", cl->fd);
-	LIST_REMOVE(client_list_item, item, self->client_list, cl);
-	free(cl);
-	cl = NULL;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t msgid;
+		uint64_t next;
+
+		if (!load_value(f, &fd, sizeof(int32_t)) ||
+		    !load_value(f, &msgid, sizeof(uint32_t)) ||
+		    !load_value(f, &next, sizeof(uint64_t))) {
+			return false;
+		}
+
+		LIST_FOREACH(item, cl, self->client_list) {
+			if (cl->fd == fd) {
+				break;
+			}
+		}
+		if (!cl) {
+			continue;
+		}
+		cl->journal_subscribed = true;
+		cl->journal_msgid = msgid;
+		cl->journal_next = next;
+		LIST_PREPEND(client_list_item, subscriber, self->subscribers, cl);
+		/* A subscriber that was behind is told to resync */
+		if (!cl->flush_pending) {
+			LIST_PREPEND(client_list_item, pending, self->pending, cl);
+			cl->flush_pending = true;
+		}
+	}
+
+	return true;
 }
 
 /*
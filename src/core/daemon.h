@@ -13,6 +13,15 @@
  * \file daemon.h Internal header
  * This file is used internally by buxton to provide functionality
  * used for the buxtond
+ *
+ * buxtond serves every client from one event loop. Each request ends in
+ * a call into a backend module, and neither the modules (gdbm included),
+ * the Smack rule cache nor the notification maps are safe to share
+ * between threads. Splitting connections across loops would only
+ * parallelize framing, which costs little next to the backend call.
+ * Throughput comes from batching in the loop instead: requests are read
+ * and handled in rounds, and the responses to each round are written
+ * together.
  */
 #pragma once
 
@@ -20,50 +29,287 @@
 	#include "config.h"
 #endif
 
+#include <sys/epoll.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <stdio.h>
 
 #include "buxton.h"
 #include "backend.h"
+#include "direct.h"
 #include "hashmap.h"
 #include "list.h"
 #include "protocol.h"
 #include "serialize.h"
 
+/**
+ * Initial size of a client's receive buffer, which grows to fit the
+ * largest message the client sends
+ */
+#define BUXTON_CLIENT_BUFFER_SIZE 4096
+
+/**
+ * Most events buxtond takes from epoll at once
+ */
+#define BUXTON_EPOLL_EVENTS 64
+
+/**
+ * Most responses and notifications buffered for a client that isn't
+ * reading them
+ */
+#define BUXTON_CLIENT_OUTPUT_LIMIT (1024 * 1024)
+
+/**
+ * Bytes of messages handled for a client in each round of scheduling
+ */
+#define BUXTON_CLIENT_QUANTUM 4096
+
+/**
+ * Multiple of the quantum given to clients in the system class
+ */
+#define BUXTON_CLIENT_SYSTEM_WEIGHT 4
+
+/**
+ * Milliseconds per slot of the timer wheel of coalesced notifications
+ */
+#define BUXTON_TIMER_TICK 10
+
+/**
+ * Slots of the timer wheel, which covers this many ticks before timers
+ * share a slot with later ones
+ */
+#define BUXTON_TIMER_SLOTS 256
+
+/**
+ * Most changes the journal keeps, whatever JournalSize asks for
+ */
+#define BUXTON_JOURNAL_MAX_SIZE (1024 * 1024)
+
+/**
+ * Milliseconds between syncs of the backends, which write out what they
+ * hold in memory and compact their files
+ */
+#define BUXTON_SYNC_INTERVAL (60 * 1000)
+
+/**
+ * Most changes a client may stage in one transaction
+ */
+#define BUXTON_TRANSACTION_MAX_CHANGES 1024
+
+/**
+ * Scheduling classes of clients, served in order each round
+ */
+typedef enum BuxtonClientClass {
+	BUXTON_CLIENT_SYSTEM = 0, /**<Clients named by PriorityUids or PriorityLabels */
+	BUXTON_CLIENT_DEFAULT, /**<All other clients */
+	BUXTON_CLIENT_CLASS_MAX
+} BuxtonClientClass;
+
+/**
+ * Kinds of requests limited separately for each client
+ */
+typedef enum BuxtonRateClass {
+	BUXTON_RATE_READ = 0, /**<Getting values and listing keys */
+	BUXTON_RATE_WRITE, /**<Anything that changes the database */
+	BUXTON_RATE_NOTIFY, /**<Registering for notifications */
+	BUXTON_RATE_MAX
+} BuxtonRateClass;
+
+/**
+ * Token buckets shared by the connections of one uid and label
+ */
+typedef struct BuxtonRateLimit {
+	char *identity; /**<Key of the buckets in the daemon's map */
+	unsigned int clients; /**<Connections using the buckets */
+	uint32_t rate[BUXTON_RATE_MAX]; /**<Requests allowed per second, 0 for no limit */
+	double tokens[BUXTON_RATE_MAX]; /**<Requests each bucket allows now */
+	uint64_t refilled; /**<Monotonic time of the last refill, in usec */
+} BuxtonRateLimit;
+
+/**
+ * Counters logged by buxtond on SIGUSR1 and at exit
+ */
+typedef struct BuxtonDaemonStats {
+	uint64_t messages; /**<Requests received */
+	uint64_t throttled[BUXTON_RATE_MAX]; /**<Requests refused by rate limits */
+} BuxtonDaemonStats;
+
+/**
+ * Marks the state a buxtond hands to the one it execs
+ */
+#define BUXTON_HANDOFF_MAGIC 0x42584844
+
+/**
+ * Version of the handoff state, bumped when its layout changes
+ */
+#define BUXTON_HANDOFF_VERSION 6
+
+/**
+ * Environment variable holding the fd of the handoff state
+ */
+#define BUXTON_HANDOFF_ENV "BUXTON_HANDOFF_FD"
+
+/**
+ * Handoff flag set when buxtond created its socket rather than systemd
+ */
+#define BUXTON_HANDOFF_MANUAL_START (1 << 0)
+
+/**
+ * How the last value of a watched key is kept in the handoff state
+ */
+typedef enum BuxtonHandoffData {
+	BUXTON_HANDOFF_NO_DATA = 0, /**<No value yet */
+	BUXTON_HANDOFF_UNSET_DATA, /**<The key was unset */
+	BUXTON_HANDOFF_DATA /**<Serialized value follows */
+} BuxtonHandoffData;
+
+/**
+ * Smack label shared by the clients connected with it
+ */
+typedef struct BuxtonClientLabel {
+	BuxtonString label; /**<The label, what clients point to */
+	size_t clients; /**<Connected clients with the label */
+} BuxtonClientLabel;
+
+/**
+ * A change kept in the journal
+ */
+typedef struct BuxtonJournalEntry {
+	uint64_t seq; /**<Sequence number of the change, 0 for an unused entry */
+	BuxtonControlMessage op; /**<Request that made the change */
+	uid_t uid; /**<User of the client that made the change */
+	_BuxtonKey key; /**<Layer, group and name changed */
+	BuxtonData value; /**<Value or label set, of type BUXTON_TYPE_MIN for none */
+	BuxtonString group_label; /**<Label of the key's group, NULL if unknown */
+	BuxtonString label; /**<Label of the key or group, NULL if unknown */
+} BuxtonJournalEntry;
+
+/**
+ * Bounded journal of the changes made through buxtond
+ */
+typedef struct BuxtonJournal {
+	BuxtonJournalEntry *entries; /**<Ring of entries, by sequence number modulo size */
+	size_t size; /**<Number of entries kept, 0 when disabled */
+	uint64_t first_seq; /**<Sequence number of the oldest entry kept */
+	uint64_t next_seq; /**<Sequence number of the next change, 0 before setup */
+	uint64_t epoch; /**<Random ID of this run of sequence numbers, 0 before setup */
+} BuxtonJournal;
+
+/**
+ * Changes a client staged for one layer, applied together on commit
+ */
+typedef struct BuxtonTransaction {
+	BuxtonString layer; /**<Layer every change is made in */
+	BuxtonChange *changes; /**<Changes in order, owning their key and data */
+	size_t count; /**<Number of changes */
+	size_t size; /**<Number of changes allocated */
+} BuxtonTransaction;
+
 /**
  * List for daemon's clients
  */
 typedef struct client_list_item {
 	LIST_FIELDS(struct client_list_item, item); /**<List type */
+	LIST_FIELDS(struct client_list_item, ready); /**<Ready queue of the client's class */
+	LIST_FIELDS(struct client_list_item, pending); /**<Clients with output to flush */
 	int fd; /**<File descriptor of connected client */
 	struct ucred cred; /**<Credentials of connected client */
 	BuxtonString *smack_label; /**<Smack label of connected client */
-	uint8_t *data; /**<Data buffer for the client */
-	size_t offset; /**<Current position to write to data buffer */
-	size_t size; /**<Size of the data buffer */
+	uint8_t *data; /**<Message being handled, within buffer */
+	uint8_t *buffer; /**<Receive buffer, kept for the connection */
+	size_t start; /**<Start of data in buffer not yet handled */
+	size_t offset; /**<Current position to write to buffer */
+	size_t size; /**<Size of buffer */
+	BuxtonClientClass class; /**<Scheduling class of the client */
+	bool queued; /**<Client is on its class's ready queue */
+	size_t deficit; /**<Bytes of messages the client may still have handled */
+	BuxtonRateLimit *rate; /**<Rate limits, NULL for the system class */
+	uint8_t *out; /**<Responses and notifications not yet written */
+	size_t out_start; /**<Start of data in out not yet written */
+	size_t out_offset; /**<Current position to write to out */
+	size_t out_size; /**<Size of out */
+	bool flush_pending; /**<Client is on the list to flush */
+	struct BuxtonNotification *subscriptions; /**<Notifications the client registered */
+	BuxtonArray *changes; /**<Grouped changes not yet queued, as msgid and value pairs */
+	size_t changes_size; /**<Serialized size of changes */
+	LIST_FIELDS(struct client_list_item, subscriber); /**<Clients following the journal */
+	bool journal_subscribed; /**<Client follows the journal */
+	uint32_t journal_msgid; /**<Message id of the subscription */
+	uint64_t journal_next; /**<Next journal entry to send the client */
+	BuxtonTransaction *transaction; /**<Open transaction, or NULL */
+	struct BuxtonUringOp *uring_recv; /**<io_uring receive, or NULL */
+	struct BuxtonUringOp *uring_send; /**<io_uring send in flight, or NULL */
+	struct BuxtonPollFd *polled; /**<Entry of the client's fd in the poll list */
 } client_list_item;
 
 /**
- * Notification registration
+ * Entry of a fd in the poll list, which epoll hands back with its events
+ * so they lead straight to the fd and its client
+ */
+typedef struct BuxtonPollFd {
+	int fd; /**<File descriptor, or -1 once removed */
+	nfds_t index; /**<Index of the fd in pollfds */
+	client_list_item *client; /**<Client on the fd, or NULL */
+	struct BuxtonPollFd *next_retired; /**<Next entry removed but not freed */
+} BuxtonPollFd;
+
+/**
+ * Notification registration, linked into the lists of both its key and
+ * its client
  */
 typedef struct BuxtonNotification {
+	LIST_FIELDS(struct BuxtonNotification, watcher); /**<Registrations for the key */
+	LIST_FIELDS(struct BuxtonNotification, subscription); /**<Registrations of the client */
 	client_list_item *client; /**<Client */
-	BuxtonData *old_data; /**<Old value of a particular key*/
+	struct BuxtonWatchedKey *watched; /**<Key the client is told of changes to */
 	uint32_t msgid; /**<Message id from the client */
+	bool grouped; /**<Client takes the change grouped with others */
 } BuxtonNotification;
 
+/**
+ * A key clients are notified of changes to. Its last value is kept once
+ * for all of them, and goes with the last registration.
+ */
+typedef struct BuxtonWatchedKey {
+	char *name; /**<Group and name of the key, its notify_mapping key */
+	BuxtonNotification *notifications; /**<Registrations for the key */
+	BuxtonData *last; /**<Value the clients were last told of */
+	BuxtonData *pending; /**<Latest value while a change is deferred */
+	uint32_t interval; /**<Least time between notifications in ms, 0 to send each change */
+	uint64_t quiet_until; /**<Monotonic time, in ms, before which changes are deferred */
+	bool deferred; /**<A change waits on the timer wheel to be sent */
+	LIST_FIELDS(struct BuxtonWatchedKey, timer); /**<Slot of the timer wheel */
+} BuxtonWatchedKey;
+
 /**
  * Global store of buxtond state
  */
 typedef struct BuxtonDaemon {
 	size_t nfds_alloc;
 	size_t accepting_alloc;
+	size_t polled_alloc;
 	nfds_t nfds;
 	bool *accepting;
 	struct pollfd *pollfds;
+	BuxtonPollFd **polled; /**<Entry of each fd in pollfds */
+	BuxtonPollFd *retired; /**<Entries removed from the poll list, which
+				 events already waited for may still point to */
+	int epollfd; /**<epoll set watching pollfds, or -1 */
+	struct BuxtonUring *uring; /**<io_uring engine used instead of epoll, or NULL */
 	client_list_item *client_list;
-	Hashmap *notify_mapping;
-	Hashmap *client_key_mapping;
+	Hashmap *notify_mapping; /**<BuxtonWatchedKey by group and name */
+	client_list_item *ready[BUXTON_CLIENT_CLASS_MAX];
+	client_list_item *ready_tail[BUXTON_CLIENT_CLASS_MAX];
+	Hashmap *rate_limits;
+	Hashmap *labels; /**<BuxtonClientLabel of connected clients by value */
+	client_list_item *pending;
+	BuxtonWatchedKey *timers[BUXTON_TIMER_SLOTS]; /**<Timer wheel of deferred notifications */
+	uint64_t timer_tick; /**<Last tick of the timer wheel that was run */
+	size_t timers_pending; /**<Keys on the timer wheel */
+	uint64_t synced; /**<When the backends were last synced */
+	BuxtonJournal journal; /**<Recent changes, for clients to catch up from */
+	client_list_item *subscribers; /**<Clients following the journal */
+	BuxtonDaemonStats stats;
 	BuxtonControl buxton;
 } BuxtonDaemon;
 
@@ -103,6 +349,67 @@ bool buxtond_handle_message(BuxtonDaemon *self,
 void buxtond_notify_clients(BuxtonDaemon *self, client_list_item *client,
 			      _BuxtonKey* key, BuxtonData *value);
 
+/**
+ * Add a change to the journal, and send it to the clients following it
+ * that may read the key
+ * @param self Reference to BuxtonDaemon
+ * @param client Client that made the change
+ * @param op Request that made the change
+ * @param key Key, or group, that changed
+ * @param value Value or label set, or NULL
+ * @param group_label Label of the key's group, or NULL if unknown
+ * @param label Label of the key, or of the group changed, or NULL if
+ * unknown. Clients with a label aren't sent changes whose labels are
+ * unknown.
+ */
+void buxtond_journal_change(BuxtonDaemon *self, client_list_item *client,
+			    BuxtonControlMessage op, _BuxtonKey *key,
+			    BuxtonData *value, BuxtonString *group_label,
+			    BuxtonString *label);
+
+/**
+ * Queue the journal entries a client hasn't been sent yet, as far as its
+ * output allows
+ * @param self Reference to BuxtonDaemon
+ * @param client Client following the journal
+ */
+void buxtond_journal_catch_up(BuxtonDaemon *self, client_list_item *client);
+
+/**
+ * Free the entries of the journal
+ * @param self Reference to BuxtonDaemon
+ */
+void buxtond_journal_free(BuxtonDaemon *self);
+
+/**
+ * Time until the timer wheel of coalesced notifications next needs to run
+ * @param self Reference to BuxtonDaemon
+ * @returns int Milliseconds to wait, or -1 when no notification is deferred
+ */
+int notification_timeout(BuxtonDaemon *self)
+	__attribute__((warn_unused_result));
+
+/**
+ * Time until the backends are next due to be synced
+ * @param self Reference to BuxtonDaemon
+ * @returns int Milliseconds to wait
+ */
+int sync_timeout(BuxtonDaemon *self)
+	__attribute__((warn_unused_result));
+
+/**
+ * Sync the backends if BUXTON_SYNC_INTERVAL has passed since they last were
+ * @param self Reference to BuxtonDaemon
+ */
+void sync_backends(BuxtonDaemon *self);
+
+/**
+ * Send the coalesced notifications whose interval has ended
+ * @param self Reference to BuxtonDaemon
+ * @param all Send every deferred notification, ended or not
+ */
+void send_deferred_notifications(BuxtonDaemon *self, bool all);
+
 /**
  * Buxton daemon function for setting a value
  * @param self buxtond instance being run
@@ -114,6 +421,24 @@ void buxtond_notify_clients(BuxtonDaemon *self, client_list_item *client,
 void set_value(BuxtonDaemon *self, client_list_item *client,
 	       _BuxtonKey *key, BuxtonData *value, int32_t *status);
 
+/**
+ * Buxton daemon function for setting a value depending on the value it
+ * already holds
+ * @param self buxtond instance being run
+ * @param client Used to validate smack access
+ * @param key Key for the value being set
+ * @param update How the value is checked or changed
+ * @param value Value being set, unused when adding
+ * @param version Will be set with the version of the returned value
+ * @param status Will be set with 0, BUXTON_STATUS_MISMATCH or -1
+ * @return The value the key holds afterwards, the current value on a
+ * mismatch, or NULL
+ */
+BuxtonData *update_value(BuxtonDaemon *self, client_list_item *client,
+			 _BuxtonKey *key, BuxtonUpdate *update,
+			 BuxtonData *value, uint64_t *version, int32_t *status)
+	__attribute__((warn_unused_result));
+
 /**
  * Buxton daemon function for setting a label
  * @param self buxtond instance being run
@@ -150,11 +475,12 @@ void remove_group(BuxtonDaemon *self, client_list_item *client,
  * @param self buxtond instance being run
  * @param client Used to validate smack access
  * @param key Key for the value being sought
+ * @param version Pointer to store the value's version in, or NULL
  * @param status Will be set with the int32_t result of the operation
  * @returns BuxtonData Value stored for key if successful otherwise NULL
  */
 BuxtonData *get_value(BuxtonDaemon *self, client_list_item *client,
-		      _BuxtonKey *key, int32_t *status)
+		      _BuxtonKey *key, uint64_t *version, int32_t *status)
 	__attribute__((warn_unused_result));
 
 /**
@@ -184,12 +510,91 @@ BuxtonArray *list_keys(BuxtonDaemon *self, client_list_item *client,
  * @param client Used to validate smack access
  * @param key Key to notify for changes on
  * @param msgid Message ID from the client
+ * @param flags BUXTON_NOTIFY_GROUPED or 0
  * @param status Will be set with the int32_t result of the operation
  */
 void register_notification(BuxtonDaemon *self, client_list_item *client,
-			   _BuxtonKey *key, uint32_t msgid,
+			   _BuxtonKey *key, uint32_t msgid, uint32_t flags,
 			   int32_t *status);
 
+/**
+ * Buxton daemon function for following the journal of changes
+ * @param self buxtond instance being run
+ * @param client Client to send the journal to
+ * @param epoch Epoch from's sequence number belongs to
+ * @param from First sequence number wanted, 0 for changes from now on
+ * @param msgid Message ID from the client
+ * @param status Will be set with the int32_t result of the operation,
+ * BUXTON_STATUS_RESYNC if changes since from are no longer kept, or
+ * were numbered in another epoch
+ * @returns uint64_t Sequence number of the first entry the client gets
+ */
+uint64_t subscribe_journal(BuxtonDaemon *self, client_list_item *client,
+			   uint64_t epoch, uint64_t from, uint32_t msgid,
+			   int32_t *status)
+	__attribute__((warn_unused_result));
+
+/**
+ * Buxton daemon function for no longer following the journal
+ * @param self buxtond instance being run
+ * @param client Client following the journal
+ * @param status Will be set with the int32_t result of the operation
+ * @returns uint32_t Message ID of the subscription
+ */
+uint32_t unsubscribe_journal(BuxtonDaemon *self, client_list_item *client,
+			     int32_t *status)
+	__attribute__((warn_unused_result));
+
+/**
+ * Buxton daemon function for starting a transaction
+ * @param self buxtond instance being run
+ * @param client Client starting the transaction
+ * @param layer Layer the transaction changes
+ * @param status Will be set with the int32_t result of the operation
+ */
+void begin_transaction(BuxtonDaemon *self, client_list_item *client,
+		       BuxtonString *layer, int32_t *status);
+
+/**
+ * Buxton daemon function for adding a set or unset to the open
+ * transaction
+ * @param self buxtond instance being run
+ * @param client Client with the open transaction
+ * @param key Key to change
+ * @param value Value to set, or NULL to unset the key
+ * @param status Will be set with the int32_t result of the operation
+ */
+void stage_change(BuxtonDaemon *self, client_list_item *client,
+		  _BuxtonKey *key, BuxtonData *value, int32_t *status);
+
+/**
+ * Buxton daemon function for applying the open transaction
+ * @param self buxtond instance being run
+ * @param client Client with the open transaction
+ * @param status Will be set with the int32_t result of the operation
+ * @returns BuxtonTransaction The transaction, which the caller notifies
+ * clients of and frees, or NULL
+ */
+BuxtonTransaction *commit_transaction(BuxtonDaemon *self,
+				      client_list_item *client,
+				      int32_t *status)
+	__attribute__((warn_unused_result));
+
+/**
+ * Buxton daemon function for dropping the open transaction
+ * @param self buxtond instance being run
+ * @param client Client with the open transaction
+ * @param status Will be set with the int32_t result of the operation
+ */
+void rollback_transaction(BuxtonDaemon *self, client_list_item *client,
+			  int32_t *status);
+
+/**
+ * Free a transaction and the changes it holds
+ * @param transaction Transaction to free, or NULL
+ */
+void free_transaction(BuxtonTransaction *transaction);
+
 /**
  * Buxton daemon function for unregistering notifications from the given key
  * @param self buxtond instance being run
@@ -203,7 +608,7 @@ uint32_t unregister_notification(BuxtonDaemon *self, client_list_item *client,
 	__attribute__((warn_unused_result));
 
 /**
- * Verify credentials for the client socket
+ * Read the credentials of the client socket, valid straight after accept
  * @param cl Client to check the credentials of
  * @return bool indicating credentials where found or not
  */
@@ -211,38 +616,207 @@ bool identify_client(client_list_item *cl)
 	__attribute__((warn_unused_result));
 
 /**
- * Add a fd to daemon's poll list
+ * Add a fd to daemon's poll list, and to its epoll set when it has one
  * @param self buxtond instance being run
  * @param fd File descriptor to add to the poll list
  * @param events Priority mask for events
  * @param a Accepting status of the fd
+ * @param cl Client on the fd, or NULL
  * @return None
  */
-void add_pollfd(BuxtonDaemon *self, int fd, short events, bool a);
+void add_pollfd(BuxtonDaemon *self, int fd, short events, bool a,
+		client_list_item *cl);
 
 /**
- * Add a fd to daemon's poll list
+ * Remove a fd from daemon's poll list and epoll set, moving the last fd
+ * into its place. Its entry is kept until release_pollfds.
  * @param self buxtond instance being run
- * @param i File descriptor to remove from poll list
+ * @param i Index of the fd to remove from poll list
  * @return None
  */
 void del_pollfd(BuxtonDaemon *self, nfds_t i);
 
 /**
- * Setup a client's smack label
+ * Free the entries of fds removed from the poll list, once no event
+ * points to them
+ * @param self buxtond instance being run
+ */
+void release_pollfds(BuxtonDaemon *self);
+
+/**
+ * Change the events polled for on a fd
+ * @param self buxtond instance being run
+ * @param i Index of the fd in the poll list
+ * @param events Events to poll for
+ */
+void update_pollfd(BuxtonDaemon *self, nfds_t i, short events);
+
+/**
+ * Find a fd in daemon's poll list
+ * @param self buxtond instance being run
+ * @param fd File descriptor to find
+ * @param i Set to the index of the fd
+ * @return bool indicating the fd is in the poll list
+ */
+bool find_pollfd(BuxtonDaemon *self, int fd, nfds_t *i)
+	__attribute__((warn_unused_result));
+
+/**
+ * Setup a client's smack label, shared with clients that have the same one
+ * @param self buxtond instance being run
  * @param cl Client to set smack label on
  * @return None
  */
-void handle_smack_label(client_list_item *cl);
+void handle_smack_label(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Drop a client's use of its smack label
+ * @param self buxtond instance being run
+ * @param cl Client being terminated
+ */
+void release_smack_label(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Identify a newly accepted client and set up its label, class and limits
+ * @param self buxtond instance being run
+ * @param cl Client just accepted
+ * @return bool indicating the client could be identified
+ */
+bool setup_client(BuxtonDaemon *self, client_list_item *cl)
+	__attribute__((warn_unused_result));
+
+/**
+ * Find the scheduling class of a client from its credentials
+ * @param cl Client to classify
+ * @return The client's class
+ */
+BuxtonClientClass client_class(client_list_item *cl)
+	__attribute__((warn_unused_result));
+
+/**
+ * Share the rate limits of clients with the same uid and label
+ * @param self buxtond instance being run
+ * @param cl Identified client, which isn't limited in the system class
+ */
+void attach_rate_limit(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Drop a client's use of its rate limits
+ * @param self buxtond instance being run
+ * @param cl Client being terminated
+ */
+void detach_rate_limit(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Take a token for a request from the client's bucket
+ * @param self buxtond instance being run
+ * @param cl Client making the request
+ * @param rate Kind of request
+ * @return bool indicating the request is within the client's limit
+ */
+bool take_rate_token(BuxtonDaemon *self, client_list_item *cl,
+		     BuxtonRateClass rate)
+	__attribute__((warn_unused_result));
+
+/**
+ * Log the daemon's counters
+ * @param self buxtond instance being run
+ */
+void buxtond_log_stats(BuxtonDaemon *self);
+
+/**
+ * Put a client at the back of its class's ready queue
+ * @param self buxtond instance being run
+ * @param cl Client with messages to handle
+ */
+void queue_client(BuxtonDaemon *self, client_list_item *cl);
 
 /**
- * Handle a client connection
+ * Take a client off its class's ready queue
+ * @param self buxtond instance being run
+ * @param cl Client to remove
+ */
+void dequeue_client(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Read from a client connection, queueing it once a message is complete
  * @param self buxtond instance being run
  * @param cl The currently activate client
  * @param i The currently active file descriptor
- * @return bool indicating more data to process
+ * @return bool indicating the client has messages queued
+ */
+bool handle_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i);
+
+/**
+ * Take data the io_uring engine received for a client, queueing the
+ * client once a message is complete
+ * @param self buxtond instance being run
+ * @param cl Client the data is from
+ * @param data Data received
+ * @param size Size of data, 0 when the client hung up
+ * @return bool indicating the client is still connected
  */
-bool handle_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
+bool receive_client(BuxtonDaemon *self, client_list_item *cl,
+		    uint8_t *data, size_t size)
+	__attribute__((warn_unused_result));
+
+/**
+ * Take on a newly accepted connection
+ * @param self buxtond instance being run
+ * @param fd The connection, which is non-blocking
+ */
+void add_client(BuxtonDaemon *self, int fd);
+
+/**
+ * Handle queued messages for one round, using deficit round robin
+ * within each class and serving the classes in order
+ * @param self buxtond instance being run
+ */
+void serve_clients(BuxtonDaemon *self);
+
+/**
+ * Add a response or notification to the client's output, which is
+ * written when the clients are flushed
+ * @param self buxtond instance being run
+ * @param cl Client to send data to
+ * @param data Serialized message
+ * @param size Size of the message
+ * @return bool indicating the client's output had room for the message
+ */
+bool queue_output(BuxtonDaemon *self, client_list_item *cl, uint8_t *data,
+		  size_t size)
+	__attribute__((warn_unused_result));
+
+/**
+ * Write as much of a client's output as its socket takes, polling for
+ * room to write the rest
+ * @param self buxtond instance being run
+ * @param cl Client to write to
+ * @param i The client's file descriptor in the poll list
+ * @return bool indicating the client wasn't terminated
+ */
+bool flush_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i);
+
+/**
+ * Write the output queued for clients since the last flush
+ * @param self buxtond instance being run
+ */
+void flush_clients(BuxtonDaemon *self);
+
+/**
+ * Check for clients waiting to be served
+ * @param self buxtond instance being run
+ * @return bool indicating a ready queue is not empty
+ */
+bool clients_ready(BuxtonDaemon *self)
+	__attribute__((warn_unused_result));
+
+/**
+ * Check for a complete message already read from a client
+ * @param cl The client to check
+ * @return bool indicating a message is waiting in the client's buffer
+ */
+bool client_has_message(client_list_item *cl)
 	__attribute__((warn_unused_result));
 
 /**
@@ -253,6 +827,26 @@ bool handle_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i)
  */
 void terminate_client(BuxtonDaemon *self, client_list_item *cl, nfds_t i);
 
+/**
+ * Save what a new buxtond needs to take over the connections
+ * @param self buxtond instance being run
+ * @param f File to write the state to
+ * @param flags BUXTON_HANDOFF_ flags for the new buxtond
+ * @return bool indicating the state was written
+ */
+bool buxtond_save_state(BuxtonDaemon *self, FILE *f, uint32_t flags)
+	__attribute__((warn_unused_result));
+
+/**
+ * Take over the connections of the buxtond that exec'd this one
+ * @param self buxtond instance being run, with its maps set up
+ * @param f File with the state saved by buxtond_save_state
+ * @param flags Set to the flags the state was saved with
+ * @return bool indicating the state could be read
+ */
+bool buxtond_restore_state(BuxtonDaemon *self, FILE *f, uint32_t *flags)
+	__attribute__((warn_unused_result));
+
 /*
  * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
  *
@@ -20,9 +20,11 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -42,11 +44,9 @@
 #include "list.h"
 #include "log.h"
 #include "smack.h"
+#include "uring.h"
 #include "util.h"
 #include "configurator.h"
-#include "buxtonlist.h"
-
-#define SOCKET_TIMEOUT 5
 
 static BuxtonDaemon self;
 
@@ -58,6 +58,176 @@ static void print_usage(char *name)
 	printf("  -h, --help		   Display this help message\n");
 }
 
+/**
+ * Accept the clients waiting on a listening socket
+ * @param listenfd The listening socket, which is non-blocking
+ */
+static void accept_client(int listenfd)
+{
+	struct sockaddr_un remote;
+	socklen_t addr_len;
+	int fd;
+
+	for (;;) {
+		addr_len = sizeof(remote);
+		fd = accept4(listenfd, (struct sockaddr *)&remote, &addr_len,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				buxton_log("accept4(): %m\n");
+			}
+			return;
+		}
+
+		buxton_debug("New client fd %d connected through fd %d\n", fd, listenfd);
+		add_client(&self, fd);
+	}
+}
+
+static void set_cloexec(int fd, bool on)
+{
+	int flags = fcntl(fd, F_GETFD);
+
+	if (flags < 0) {
+		return;
+	}
+	flags = on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC;
+	if (fcntl(fd, F_SETFD, flags) < 0) {
+		buxton_log("fcntl(): %m\n");
+	}
+}
+
+/**
+ * Exec a new buxtond and hand it the listening and client sockets, so
+ * it can take over without clients seeing a disconnect. Only returns if
+ * the new buxtond couldn't be started, leaving this one running.
+ * @param argv Arguments buxtond was started with
+ * @param manual_start buxtond created its socket rather than systemd
+ * @param sigfd The signal fd, which the new buxtond makes itself
+ * @param smackfd The Smack rule watch fd, also made by the new buxtond
+ */
+static void hand_off(char *argv[], bool manual_start, int sigfd, int smackfd)
+{
+	FILE *state;
+	char fdstr[16];
+	nfds_t i;
+	int fd;
+
+	buxton_log("%s: Handing connections to a new buxtond\n", argv[0]);
+
+	/* Write out what the sockets will take, the rest goes in the state */
+	send_deferred_notifications(&self, true);
+	flush_clients(&self);
+
+	state = tmpfile();
+	if (!state) {
+		buxton_log("tmpfile(): %m\n");
+		return;
+	}
+	fd = fileno(state);
+
+	if (find_pollfd(&self, sigfd, &i)) {
+		del_pollfd(&self, i);
+	}
+	if (smackfd >= 0 && find_pollfd(&self, smackfd, &i)) {
+		del_pollfd(&self, i);
+		set_cloexec(smackfd, true);
+	}
+
+	/* Nothing may be left in flight, or it would be lost */
+	buxtond_uring_quiesce(&self);
+	if (!buxtond_save_state(&self, state, manual_start ?
+				BUXTON_HANDOFF_MANUAL_START : 0) ||
+	    lseek(fd, 0, SEEK_SET) < 0) {
+		goto fail;
+	}
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	if (setenv(BUXTON_HANDOFF_ENV, fdstr, 1) < 0) {
+		goto fail;
+	}
+	for (i = 0; i < self.nfds; i++) {
+		set_cloexec(self.pollfds[i].fd, false);
+	}
+	set_cloexec(fd, false);
+
+	/*
+	 * The backends stay open in case exec fails; their files close on
+	 * exec, so the new buxtond can open them again. It only needs what
+	 * they hold in memory written out.
+	 */
+	buxton_direct_sync(&self.buxton);
+
+	/* Prefer the installed binary, which an upgrade replaced */
+	execv(argv[0], argv);
+	execv("/proc/self/exe", argv);
+	buxton_log("execv(): %m\n");
+
+	for (i = 0; i < self.nfds; i++) {
+		set_cloexec(self.pollfds[i].fd, true);
+	}
+	unsetenv(BUXTON_HANDOFF_ENV);
+
+fail:
+	buxton_log("%s: Handoff failed, carrying on\n", argv[0]);
+	buxtond_uring_restart(&self);
+	fclose(state);
+	add_pollfd(&self, sigfd, POLLIN, false, NULL);
+	if (smackfd >= 0) {
+		add_pollfd(&self, smackfd, POLLIN | POLLPRI, false, NULL);
+	}
+}
+
+/**
+ * Take over the connections of the buxtond that exec'd this one
+ * @return Whether the socket was created by buxtond rather than systemd
+ */
+static bool take_over(void)
+{
+	client_list_item *cl;
+	FILE *state;
+	char *end;
+	long fd;
+	uint32_t flags;
+	unsigned clients = 0;
+
+	errno = 0;
+	fd = strtol(getenv(BUXTON_HANDOFF_ENV), &end, 10);
+	if (errno || *end || fd < 0 || fd > INT_MAX) {
+		buxton_log("Invalid %s\n", BUXTON_HANDOFF_ENV);
+		exit(EXIT_FAILURE);
+	}
+	unsetenv(BUXTON_HANDOFF_ENV);
+
+	state = fdopen((int)fd, "r");
+	if (!state) {
+		buxton_log("fdopen(): %m\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!buxtond_restore_state(&self, state, &flags)) {
+		buxton_log("Failed to take over from the previous buxtond\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(state);
+
+	for (nfds_t i = 0; i < self.nfds; i++) {
+		set_cloexec(self.pollfds[i].fd, true);
+	}
+
+	/* Start on output the previous buxtond couldn't write */
+	flush_clients(&self);
+
+	LIST_FOREACH(item, cl, self.client_list) {
+		clients++;
+	}
+	buxton_log("Took over %u client connections\n", clients);
+
+	return flags & BUXTON_HANDOFF_MANUAL_START;
+}
+
 /**
  * Entry point into buxtond
  * @param argc Number of arguments passed
@@ -68,21 +238,17 @@ int main(int argc, char *argv[])
 {
 	int fd;
 	int smackfd = -1;
-	socklen_t addr_len;
-	struct sockaddr_un remote;
 	int descriptors;
 	int ret;
 	bool manual_start = false;
 	sigset_t mask;
 	int sigfd;
-	bool leftover_messages = false;
 	struct stat st;
 	bool help = false;
-	BuxtonList *map_list = NULL;
+	BuxtonWatchedKey *watched = NULL;
 	Iterator iter;
-	char *notify_key;
-	BuxtonList *key_list = NULL;
-	uint64_t *client_fd;
+	BuxtonRateLimit *limit;
+	struct epoll_event events[BUXTON_EPOLL_EVENTS];
 
 	static struct option opts[] = {
 		{ "config-file", 1, NULL, 'c' },
@@ -135,7 +301,16 @@ int main(int argc, char *argv[])
 
 	self.nfds_alloc = 0;
 	self.accepting_alloc = 0;
+	self.polled_alloc = 0;
 	self.nfds = 0;
+	self.epollfd = -1;
+	if (!buxtond_uring_setup(&self)) {
+		self.epollfd = epoll_create1(EPOLL_CLOEXEC);
+		if (self.epollfd < 0) {
+			buxton_log("epoll_create1(): %m\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	self.buxton.client.direct = true;
 	self.buxton.client.uid = geteuid();
 	if (!buxton_direct_open(&self.buxton)) {
@@ -155,28 +330,40 @@ int main(int argc, char *argv[])
 	if (ret != 0) {
 		exit(EXIT_FAILURE);
 	}
+	ret = sigaddset(&mask, SIGUSR1);
+	if (ret != 0) {
+		exit(EXIT_FAILURE);
+	}
+	ret = sigaddset(&mask, SIGUSR2);
+	if (ret != 0) {
+		exit(EXIT_FAILURE);
+	}
 
 	ret = sigprocmask(SIG_BLOCK, &mask, NULL);
 	if (ret == -1) {
 		exit(EXIT_FAILURE);
 	}
 
-	sigfd = signalfd(-1, &mask, 0);
+	sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
 	if (sigfd == -1) {
 		exit(EXIT_FAILURE);
 	}
 
-	add_pollfd(&self, sigfd, POLLIN, false);
+	add_pollfd(&self, sigfd, POLLIN, false, NULL);
 
 	/* For client notifications */
 	self.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
-	/* For keeping track of keys a client is registered to*/
-	self.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
+	/* Rate limits shared by the clients of each uid and label */
+	self.rate_limits = hashmap_new(string_hash_func, string_compare_func);
+	/* Smack labels of connected clients */
+	self.labels = hashmap_new(string_hash_func, string_compare_func);
 	/* Store a list of connected clients */
 	LIST_HEAD_INIT(client_list_item, self.client_list);
 
-	descriptors = sd_listen_fds(0);
-	if (descriptors < 0) {
+	if (getenv(BUXTON_HANDOFF_ENV)) {
+		/* Exec'd by a buxtond handing its connections over */
+		manual_start = take_over();
+	} else if ((descriptors = sd_listen_fds(0)) < 0) {
 		buxton_log("sd_listen_fds: %m\n");
 		exit(EXIT_FAILURE);
 	} else if (descriptors == 0) {
@@ -187,7 +374,7 @@ int main(int argc, char *argv[])
 			struct sockaddr_un un;
 		} sa;
 
-		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 		if (fd < 0) {
 			buxton_log("socket(): %m\n");
 			exit(EXIT_FAILURE);
@@ -214,18 +401,23 @@ int main(int argc, char *argv[])
 			buxton_log("listen(): %m\n");
 			exit(EXIT_FAILURE);
 		}
-		add_pollfd(&self, fd, POLLIN | POLLPRI, true);
+		add_pollfd(&self, fd, POLLIN | POLLPRI, true, NULL);
 	} else {
 		/* systemd socket activation */
 		for (fd = SD_LISTEN_FDS_START + 0; fd < SD_LISTEN_FDS_START + descriptors; fd++) {
+			/* Accepting drains each socket until it would block */
+			if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+				buxton_log("fcntl(): %m\n");
+				exit(EXIT_FAILURE);
+			}
 			if (sd_is_fifo(fd, NULL)) {
-				add_pollfd(&self, fd, POLLIN, false);
+				add_pollfd(&self, fd, POLLIN, false, NULL);
 				buxton_debug("Added fd %d type FIFO\n", fd);
 			} else if (sd_is_socket_unix(fd, SOCK_STREAM, -1, buxton_socket(), 0)) {
-				add_pollfd(&self, fd, POLLIN | POLLPRI, true);
+				add_pollfd(&self, fd, POLLIN | POLLPRI, true, NULL);
 				buxton_debug("Added fd %d type UNIX\n", fd);
 			} else if (sd_is_socket(fd, AF_UNSPEC, 0, -1)) {
-				add_pollfd(&self, fd, POLLIN | POLLPRI, true);
+				add_pollfd(&self, fd, POLLIN | POLLPRI, true, NULL);
 				buxton_debug("Added fd %d type SOCKET\n", fd);
 			}
 		}
@@ -233,59 +425,87 @@ int main(int argc, char *argv[])
 
 	if (smackfd >= 0) {
 		/* add Smack rule fd to pollfds */
-		add_pollfd(&self, smackfd, POLLIN | POLLPRI, false);
+		add_pollfd(&self, smackfd, POLLIN | POLLPRI, false, NULL);
 	}
 
 	buxton_log("%s: Started\n", argv[0]);
 
 	/* Enter loop to accept clients */
 	for (;;) {
-		ret = poll(self.pollfds, self.nfds, leftover_messages ? 0 : -1);
-
-		if (ret < 0) {
-			buxton_log("poll(): %m\n");
-			break;
+		int nevents;
+		int timeout;
+		int sync;
+
+		/* Only check for new data while clients wait to be served,
+		 * or until a coalesced notification or a sync is due */
+		timeout = clients_ready(&self) ? 0 : notification_timeout(&self);
+		sync = sync_timeout(&self);
+		if (timeout < 0 || sync < timeout) {
+			timeout = sync;
+		}
+		if (self.uring) {
+			/* Clients are accepted and read from in there */
+			nevents = buxtond_uring_wait(&self, events,
+						     BUXTON_EPOLL_EVENTS, timeout);
+		} else {
+			nevents = epoll_wait(self.epollfd, events,
+					     BUXTON_EPOLL_EVENTS, timeout);
 		}
-		if (ret == 0) {
-			if (!leftover_messages) {
+
+		if (nevents < 0) {
+			if (errno == EINTR) {
 				continue;
 			}
+			buxton_log("Waiting for events: %m\n");
+			break;
 		}
 
-		leftover_messages = false;
-
 		/* check sigfd if the daemon was signaled */
-		if (self.pollfds[0].revents != 0) {
+		for (int e = 0; e < nevents; e++) {
+			BuxtonPollFd *polled = events[e].data.ptr;
 			ssize_t sinfo;
 			struct signalfd_siginfo si;
 
-			sinfo = read(self.pollfds[0].fd, &si, sizeof(struct signalfd_siginfo));
+			if (polled->fd != sigfd) {
+				continue;
+			}
+
+			sinfo = read(sigfd, &si, sizeof(struct signalfd_siginfo));
 			if (sinfo != sizeof(struct signalfd_siginfo)) {
 				exit(EXIT_FAILURE);
 			}
 
 			if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
-				break;
+				goto shutdown;
+			}
+			if (si.ssi_signo == SIGUSR1) {
+				buxtond_log_stats(&self);
+			}
+			if (si.ssi_signo == SIGUSR2) {
+				hand_off(argv, manual_start, sigfd, smackfd);
 			}
 		}
 
-		for (nfds_t i = 1; i < self.nfds; i++) {
-			client_list_item *cl = NULL;
+		for (int e = 0; e < nevents; e++) {
+			BuxtonPollFd *polled = events[e].data.ptr;
+			client_list_item *cl;
 			char discard[256];
+			nfds_t i;
 
-			if (self.pollfds[i].revents == 0) {
+			/* Clients terminated earlier in the batch are gone */
+			if (polled->fd < 0 || polled->fd == sigfd) {
 				continue;
 			}
+			i = polled->index;
+			self.pollfds[i].revents = (short)events[e].events;
 
-			if (self.pollfds[i].fd == -1) {
-				/* TODO: Remove client from list  */
-				buxton_debug("Removing / Closing client for fd %d\n", self.pollfds[i].fd);
-				del_pollfd(&self, i);
+			/* Accepted below */
+			if (self.accepting[i]) {
 				continue;
 			}
 
 			if (smackfd >= 0) {
-				if (self.pollfds[i].fd == smackfd) {
+				if (polled->fd == smackfd) {
 					if (!buxton_cache_smack_rules()) {
 						exit(EXIT_FAILURE);
 					}
@@ -296,111 +516,92 @@ int main(int argc, char *argv[])
 				}
 			}
 
-			if (self.accepting[i] == true) {
-				struct timeval tv;
-				int fd;
-				int on = 1;
-
-				addr_len = sizeof(remote);
-
-				if ((fd = accept(self.pollfds[i].fd,
-						 (struct sockaddr *)&remote, &addr_len)) == -1) {
-					buxton_log("accept(): %m\n");
-					break;
-				}
-
-				buxton_debug("New client fd %d connected through fd %d\n", fd, self.pollfds[i].fd);
-
-				if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
-					close(fd);
-					break;
-				}
-
-				cl = malloc0(sizeof(client_list_item));
-				if (!cl) {
-					exit(EXIT_FAILURE);
-				}
-
-				LIST_INIT(client_list_item, item, cl);
-
-				cl->fd = fd;
-				cl->cred = (struct ucred) {0, 0, 0};
-				LIST_PREPEND(client_list_item, item, self.client_list, cl);
-
-				/* poll for data on this new client as well */
-				add_pollfd(&self, cl->fd, POLLIN | POLLPRI, false);
-
-				/* Mark our packets as high prio */
-				if (setsockopt(cl->fd, SOL_SOCKET, SO_PRIORITY, &on, sizeof(on)) == -1) {
-					buxton_log("setsockopt(SO_PRIORITY): %m\n");
+			/* handle data on any connection */
+			cl = polled->client;
+			assert(cl);
+			/* Finish output the socket had no room for first */
+			if (self.pollfds[i].revents & POLLOUT) {
+				if (!flush_client(&self, cl, i)) {
+					continue;
 				}
-
-				/* Set socket recv timeout */
-				tv.tv_sec = SOCKET_TIMEOUT;
-				tv.tv_usec = 0;
-				if (setsockopt(cl->fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,
-					       sizeof(struct timeval)) == -1) {
-					buxton_log("setsockopt(SO_RCVTIMEO): %m\n");
+				if (!(self.pollfds[i].revents & ~POLLOUT)) {
+					continue;
 				}
-
-				/* check if this is optimal or not */
-				break;
-			}
-
-			assert(self.accepting[i] == 0);
-			if (smackfd >= 0) {
-				assert(self.pollfds[i].fd != smackfd);
 			}
+			handle_client(&self, cl, i);
+		}
 
-			/* handle data on any connection */
-			/* TODO: Replace with hash table lookup */
-			LIST_FOREACH(item, cl, self.client_list)
-				if (self.pollfds[i].fd == cl->fd) {
-					break;
-				}
+		/*
+		 * Accept new clients once the others are handled, so an event
+		 * for a client closed in this batch never reaches one that
+		 * reused its fd
+		 */
+		for (int e = 0; e < nevents; e++) {
+			BuxtonPollFd *polled = events[e].data.ptr;
 
-			assert(cl);
-			if (handle_client(&self, cl, i)) {
-				leftover_messages = true;
+			if (polled->fd >= 0 && self.accepting[polled->index]) {
+				accept_client(polled->fd);
 			}
 		}
+
+		serve_clients(&self);
+		send_deferred_notifications(&self, false);
+		flush_clients(&self);
+		sync_backends(&self);
+		release_pollfds(&self);
 	}
 
+shutdown:
 	buxton_log("%s: Closing all connections\n", argv[0]);
+	buxtond_log_stats(&self);
 
 	if (manual_start) {
 		unlink(buxton_socket());
 	}
 	for (int i = 0; i < self.nfds; i++) {
 		close(self.pollfds[i].fd);
+		free(self.polled[i]);
+	}
+	release_pollfds(&self);
+	if (self.epollfd >= 0) {
+		close(self.epollfd);
 	}
+	buxtond_uring_free(&self);
 	for (client_list_item *i = self.client_list; i;) {
 		client_list_item *j = i->item_next;
+		release_smack_label(&self, i);
+		free_transaction(i->transaction);
+		free(i->buffer);
+		free(i->out);
 		free(i);
 		i = j;
 	}
 	/* Clean up notification lists */
-	HASHMAP_FOREACH_KEY(map_list, notify_key, self.notify_mapping, iter) {
-		hashmap_remove(self.notify_mapping, notify_key);
-		BuxtonList *elem;
-		BUXTON_LIST_FOREACH(map_list, elem) {
-			BuxtonNotification *notif = (BuxtonNotification*)elem->data;
-			if (notif->old_data) {
-				free_buxton_data(&(notif->old_data));
-			}
+	HASHMAP_FOREACH(watched, self.notify_mapping, iter) {
+		hashmap_remove(self.notify_mapping, watched->name);
+		while (watched->notifications) {
+			BuxtonNotification *nitem = watched->notifications;
+
+			LIST_REMOVE(BuxtonNotification, watcher,
+				    watched->notifications, nitem);
+			free(nitem);
 		}
-		free(notify_key);
-		buxton_list_free_all(&map_list);
+		free_buxton_data(&(watched->last));
+		free_buxton_data(&(watched->pending));
+		free(watched->name);
+		free(watched);
 	}
+	buxtond_journal_free(&self);
 
-	/* Clean up key lists */
-	HASHMAP_FOREACH_KEY(key_list, client_fd, self.client_key_mapping, iter) {
-		hashmap_remove(self.client_key_mapping, client_fd);
-		buxton_list_free_all(&key_list);
-		free(client_fd);
+	/* Clean up rate limits */
+	HASHMAP_FOREACH(limit, self.rate_limits, iter) {
+		hashmap_remove(self.rate_limits, limit->identity);
+		free(limit->identity);
+		free(limit);
 	}
 	hashmap_free(self.notify_mapping);
-	hashmap_free(self.client_key_mapping);
+	hashmap_free(self.rate_limits);
+	hashmap_free(self.labels);
 	buxton_direct_close(&self.buxton);
 	return EXIT_SUCCESS;
 }
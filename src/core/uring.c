@@ -0,0 +1,923 @@
+/*
+ * This file is part of buxton.
+ *
+ * Copyright (C) 2013 Intel Corporation
+ *
+ * buxton is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "log.h"
+#include "uring.h"
+#include "util.h"
+
+/*
+ * Every request in flight is a BuxtonUringOp, which is its user_data.
+ * Accepts, receives and polls are multishot: they stay armed until a
+ * completion comes without IORING_CQE_F_MORE, and are armed again then
+ * unless their fd was removed. An op whose fd is removed while it is
+ * armed is cancelled, and freed once its last completion is in.
+ * Cancellations themselves have no op, and a user_data of 0.
+ */
+
+/* Buffer group clients are received into */
+#define BUXTON_URING_GROUP 0
+
+/* Completions the ring holds before the kernel has to keep them aside */
+#define BUXTON_URING_COMPLETIONS (BUXTON_URING_ENTRIES * 8)
+
+typedef enum BuxtonUringOpType {
+	BUXTON_URING_ACCEPT = 0, /**<Multishot accept on a listening socket */
+	BUXTON_URING_RECV, /**<Multishot receive from a client */
+	BUXTON_URING_POLL, /**<Multishot poll of any other fd */
+	BUXTON_URING_SEND /**<Send of a client's output */
+} BuxtonUringOpType;
+
+typedef struct BuxtonUringOp {
+	LIST_FIELDS(struct BuxtonUringOp, item); /**<List of every op */
+	BuxtonUringOpType type; /**<What the op does */
+	int fd; /**<File descriptor the op is on */
+	short events; /**<Events polled for */
+	client_list_item *client; /**<Client received from or sent to, or NULL */
+	BuxtonPollFd *polled; /**<Entry of a polled fd in the poll list, or NULL */
+	bool armed; /**<A completion without IORING_CQE_F_MORE is still due */
+	bool dead; /**<The fd was removed, so the op goes once it completes */
+	bool paused; /**<Not received from until the client's backlog is handled */
+	bool polling; /**<Send waits for the socket to have room */
+	uint8_t *data; /**<Output being sent, owned by the op */
+	size_t size; /**<Size of data */
+	size_t start; /**<Start of data not yet sent */
+	size_t end; /**<End of data to send */
+} BuxtonUringOp;
+
+typedef struct BuxtonUring {
+	int fd; /**<The ring */
+	void *rings; /**<Submission and completion rings, mapped together */
+	size_t rings_size; /**<Size of the mapping */
+	struct io_uring_sqe *sqes; /**<Submission entries */
+	size_t sqes_size; /**<Size of the entries' mapping */
+	unsigned *sq_head; /**<Next entry the kernel takes */
+	unsigned *sq_tail; /**<Next entry to fill, as the kernel sees it */
+	unsigned *sq_array; /**<Indices of the entries to submit */
+	unsigned sq_mask; /**<Mask of submission ring indices */
+	unsigned sq_entries; /**<Size of the submission ring */
+	unsigned tail; /**<Next entry to fill */
+	unsigned queued; /**<Entries filled but not yet submitted */
+	unsigned *cq_head; /**<Next completion to take */
+	unsigned *cq_tail; /**<End of the completions */
+	unsigned cq_mask; /**<Mask of completion ring indices */
+	struct io_uring_cqe *cqes; /**<Completions */
+	struct io_uring_buf_ring *buf_ring; /**<Buffers the kernel receives into */
+	size_t buf_ring_size; /**<Size of buf_ring */
+	uint8_t *buffers; /**<Memory of the buffers */
+	uint16_t buf_tail; /**<Next slot of buf_ring to give a buffer back in */
+	unsigned inflight; /**<Ops still due a last completion */
+	bool quiescing; /**<Nothing is armed or sent, for a handoff */
+	BuxtonUringOp *ops; /**<Every op, armed or not */
+} BuxtonUring;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*
+ * Submit what is queued, and wait for at least wait completions or for
+ * timeout ms, if it isn't -1. Returns what io_uring_enter does.
+ */
+static int uring_enter(BuxtonUring *ring, unsigned wait, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	int ret;
+
+	memzero(&arg, sizeof(arg));
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+			   flags, &arg, sizeof(arg));
+	if (ret > 0) {
+		ring->queued -= (unsigned)ret;
+	}
+	return ret;
+}
+
+static struct io_uring_sqe *get_sqe(BuxtonUring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	/* A full ring goes to the kernel early */
+	while (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+	       ring->sq_entries) {
+		if (uring_enter(ring, 0, -1) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY) {
+			buxton_log("io_uring_enter(): %m\n");
+			abort();
+		}
+	}
+
+	index = ring->tail & ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memzero(sqe, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	ring->tail++;
+	ring->queued++;
+
+	return sqe;
+}
+
+/* Take the next completion, if there is one */
+static bool next_cqe(BuxtonUring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	*cqe = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool cqe_ready(BuxtonUring *ring)
+{
+	return *ring->cq_head != __atomic_load_n(ring->cq_tail,
+						 __ATOMIC_ACQUIRE);
+}
+
+/* Hand a buffer back to the kernel to receive into */
+static void give_buffer(BuxtonUring *ring, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring->buf_ring->bufs[ring->buf_tail & (BUXTON_URING_BUFFERS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ring->buffers +
+					  (size_t)bid * BUXTON_CLIENT_BUFFER_SIZE);
+	buf->len = BUXTON_CLIENT_BUFFER_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static uint8_t *buffer_data(BuxtonUring *ring, uint16_t bid)
+{
+	return ring->buffers + (size_t)bid * BUXTON_CLIENT_BUFFER_SIZE;
+}
+
+static void arm(BuxtonUring *ring, BuxtonUringOp *op)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t events;
+
+	assert(!op->armed);
+
+	sqe = get_sqe(ring);
+	sqe->fd = op->fd;
+	sqe->user_data = (uint64_t)(uintptr_t)op;
+
+	switch (op->type) {
+	case BUXTON_URING_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		break;
+	case BUXTON_URING_RECV:
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUXTON_URING_GROUP;
+		break;
+	case BUXTON_URING_POLL:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		events = (uint32_t)(unsigned short)op->events;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		/* The kernel takes the mask word-reversed */
+		events = (events << 16) | (events >> 16);
+#endif
+		sqe->poll32_events = events;
+		break;
+	case BUXTON_URING_SEND:
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)(op->data + op->start);
+		sqe->len = (uint32_t)(op->end - op->start);
+		sqe->msg_flags = MSG_NOSIGNAL;
+		break;
+	}
+
+	op->armed = true;
+	ring->inflight++;
+}
+
+/* Wait for a socket to have room for the rest of a send */
+static void arm_send_poll(BuxtonUring *ring, BuxtonUringOp *op)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t events = POLLOUT;
+
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = op->fd;
+	sqe->user_data = (uint64_t)(uintptr_t)op;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+
+	op->polling = true;
+	op->armed = true;
+	ring->inflight++;
+}
+
+static void cancel(BuxtonUring *ring, BuxtonUringOp *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	if (op) {
+		sqe->addr = (uint64_t)(uintptr_t)op;
+	} else {
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY |
+			IORING_ASYNC_CANCEL_ALL;
+	}
+}
+
+static BuxtonUringOp *new_op(BuxtonUring *ring, BuxtonUringOpType type,
+			     int fd)
+{
+	BuxtonUringOp *op;
+
+	op = malloc0(sizeof(BuxtonUringOp));
+	if (!op) {
+		abort();
+	}
+	LIST_INIT(BuxtonUringOp, item, op);
+	op->type = type;
+	op->fd = fd;
+	LIST_PREPEND(BuxtonUringOp, item, ring->ops, op);
+
+	return op;
+}
+
+static void free_op(BuxtonUring *ring, BuxtonUringOp *op)
+{
+	LIST_REMOVE(BuxtonUringOp, item, ring->ops, op);
+	free(op->data);
+	free(op);
+}
+
+/* A client with a full buffer of messages isn't read from until served */
+static bool backlogged(client_list_item *cl)
+{
+	return cl->offset - cl->start >= BUXTON_CLIENT_BUFFER_SIZE &&
+		client_has_message(cl);
+}
+
+static void terminate(BuxtonDaemon *self, client_list_item *cl)
+{
+	assert(cl->polled);
+	terminate_client(self, cl, cl->polled->index);
+}
+
+/* Put the client on the list to flush if it has more to send */
+static void flush_later(BuxtonDaemon *self, client_list_item *cl)
+{
+	if (cl->flush_pending) {
+		return;
+	}
+	if (cl->out_offset == cl->out_start &&
+	    (!cl->journal_subscribed ||
+	     cl->journal_next >= self->journal.next_seq)) {
+		return;
+	}
+	LIST_PREPEND(client_list_item, pending, self->pending, cl);
+	cl->flush_pending = true;
+}
+
+/* Put what a send didn't get to back in front of the client's output */
+static void unsend(client_list_item *cl, BuxtonUringOp *op)
+{
+	size_t left = op->end - op->start;
+	size_t queued = cl->out_offset - cl->out_start;
+	size_t size = left + queued;
+	uint8_t *out;
+
+	if (size < BUXTON_CLIENT_BUFFER_SIZE) {
+		size = BUXTON_CLIENT_BUFFER_SIZE;
+	}
+	out = malloc(size);
+	if (!out) {
+		abort();
+	}
+	memcpy(out, op->data + op->start, left);
+	if (queued) {
+		memcpy(out + left, cl->out + cl->out_start, queued);
+	}
+	free(cl->out);
+	cl->out = out;
+	cl->out_size = size;
+	cl->out_start = 0;
+	cl->out_offset = left + queued;
+}
+
+/* Arm a multishot op again once its last completion is in */
+static void rearm(BuxtonUring *ring, BuxtonUringOp *op)
+{
+	if (op->armed) {
+		return;
+	}
+	if (op->dead) {
+		free_op(ring, op);
+		return;
+	}
+	if (!op->paused && !ring->quiescing) {
+		arm(ring, op);
+	}
+}
+
+static void complete_accept(BuxtonDaemon *self, BuxtonUringOp *op,
+			    struct io_uring_cqe *cqe)
+{
+	if (cqe->res >= 0) {
+		if (op->dead) {
+			close(cqe->res);
+		} else {
+			buxton_debug("New client fd %d connected through fd %d\n",
+				     cqe->res, op->fd);
+			add_client(self, cqe->res);
+		}
+	} else if (cqe->res != -ECANCELED) {
+		buxton_log("accept: %s\n", strerror(-cqe->res));
+	}
+	rearm(self->uring, op);
+}
+
+static void complete_recv(BuxtonDaemon *self, BuxtonUringOp *op,
+			  struct io_uring_cqe *cqe)
+{
+	BuxtonUring *ring = self->uring;
+	client_list_item *cl = op->client;
+	bool connected = true;
+	uint16_t bid;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (!op->dead && cqe->res > 0) {
+			connected = receive_client(self, cl, buffer_data(ring, bid),
+						   (size_t)cqe->res);
+		}
+		give_buffer(ring, bid);
+	}
+	/* Once terminated, the client took the op with it */
+	if (!connected) {
+		return;
+	}
+	if (op->dead) {
+		rearm(ring, op);
+		return;
+	}
+
+	/* A hangup always terminates the client */
+	if (cqe->res == 0 && !receive_client(self, cl, NULL, 0)) {
+		return;
+	}
+	/* Running out of buffers only stops the receive until it's rearmed */
+	if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		buxton_debug("Receive from client %d failed: %s\n", cl->fd,
+			     strerror(-cqe->res));
+		terminate(self, cl);
+		return;
+	}
+
+	if (!op->paused && backlogged(cl)) {
+		op->paused = true;
+		if (op->armed) {
+			cancel(ring, op);
+		}
+	}
+	rearm(ring, op);
+}
+
+static void complete_poll(BuxtonDaemon *self, BuxtonUringOp *op,
+			  struct io_uring_cqe *cqe, struct epoll_event *event)
+{
+	if (cqe->res > 0 && !op->dead && event) {
+		/* poll and epoll share their event bits on Linux */
+		event->events = (uint32_t)cqe->res;
+		event->data.ptr = op->polled;
+	}
+	rearm(self->uring, op);
+}
+
+static void complete_send(BuxtonDaemon *self, BuxtonUringOp *op,
+			  struct io_uring_cqe *cqe)
+{
+	BuxtonUring *ring = self->uring;
+	client_list_item *cl = op->client;
+	int res = cqe->res;
+
+	/* The client was terminated while this was in flight */
+	if (!cl) {
+		free_op(ring, op);
+		return;
+	}
+
+	if (op->polling) {
+		op->polling = false;
+		if (res > 0 || res == -ECANCELED) {
+			res = 0;
+		}
+	} else if (res == -EAGAIN && !ring->quiescing) {
+		arm_send_poll(ring, op);
+		return;
+	} else if (res == -EAGAIN || res == -EINTR || res == -ECANCELED) {
+		res = 0;
+	}
+	if (res < 0) {
+		buxton_debug("Send to client %d failed: %s\n", cl->fd,
+			     strerror(-res));
+		cl->uring_send = NULL;
+		free_op(ring, op);
+		terminate(self, cl);
+		return;
+	}
+
+	op->start += (size_t)res;
+	if (op->start < op->end) {
+		if (!ring->quiescing) {
+			arm(ring, op);
+			return;
+		}
+		unsend(cl, op);
+	} else if (!cl->out) {
+		/* Keep the buffer for what's sent next */
+		cl->out = op->data;
+		cl->out_size = op->size;
+		op->data = NULL;
+	}
+	cl->uring_send = NULL;
+	free_op(ring, op);
+	flush_later(self, cl);
+}
+
+/* Handle a completion, filling event if it's from a polled fd */
+static void complete(BuxtonDaemon *self, struct io_uring_cqe *cqe,
+		     struct epoll_event *event)
+{
+	BuxtonUring *ring = self->uring;
+	BuxtonUringOp *op = (BuxtonUringOp *)(uintptr_t)cqe->user_data;
+
+	/* Cancellations are done with */
+	if (!op) {
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		op->armed = false;
+		ring->inflight--;
+	}
+
+	switch (op->type) {
+	case BUXTON_URING_ACCEPT:
+		complete_accept(self, op, cqe);
+		break;
+	case BUXTON_URING_RECV:
+		complete_recv(self, op, cqe);
+		break;
+	case BUXTON_URING_POLL:
+		complete_poll(self, op, cqe, event);
+		break;
+	case BUXTON_URING_SEND:
+		complete_send(self, op, cqe);
+		break;
+	}
+}
+
+/*
+ * Check the kernel has multishot receives, which came after the buffer
+ * rings, by receiving from a socket that has one byte and then hangs up
+ */
+static bool probe_recv(BuxtonUring *ring)
+{
+	struct io_uring_cqe cqe;
+	BuxtonUringOp probe;
+	bool supported = true;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		return false;
+	}
+	if (write(sv[1], "", 1) != 1 || shutdown(sv[1], SHUT_WR) < 0) {
+		supported = false;
+		goto end;
+	}
+
+	memzero(&probe, sizeof(BuxtonUringOp));
+	probe.type = BUXTON_URING_RECV;
+	probe.fd = sv[0];
+	arm(ring, &probe);
+	while (probe.armed) {
+		if (uring_enter(ring, 1, -1) < 0 && errno != EINTR) {
+			buxton_log("io_uring_enter(): %m\n");
+			abort();
+		}
+		while (next_cqe(ring, &cqe)) {
+			if (cqe.res == -EINVAL) {
+				supported = false;
+			}
+			if (cqe.flags & IORING_CQE_F_BUFFER) {
+				give_buffer(ring, (uint16_t)(cqe.flags >>
+							     IORING_CQE_BUFFER_SHIFT));
+			}
+			if (!(cqe.flags & IORING_CQE_F_MORE)) {
+				probe.armed = false;
+				ring->inflight--;
+			}
+		}
+	}
+
+end:
+	close(sv[0]);
+	close(sv[1]);
+	return supported;
+}
+
+static void uring_free(BuxtonUring *ring)
+{
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	if (ring->rings) {
+		munmap(ring->rings, ring->rings_size);
+	}
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->buf_ring) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+	while (ring->ops) {
+		free_op(ring, ring->ops);
+	}
+	free(ring->buffers);
+	free(ring);
+}
+
+bool buxtond_uring_setup(BuxtonDaemon *self)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	BuxtonUring *ring;
+	uint8_t *rings;
+	size_t sq_size, cq_size;
+
+	assert(self);
+	assert(!self->uring);
+
+	ring = malloc0(sizeof(BuxtonUring));
+	if (!ring) {
+		abort();
+	}
+
+	memzero(&params, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = BUXTON_URING_COMPLETIONS;
+	ring->fd = uring_setup(BUXTON_URING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		buxton_log("io_uring_setup(): %m, using epoll\n");
+		goto fail;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(params.features & IORING_FEAT_NODROP) ||
+	    !(params.features & IORING_FEAT_EXT_ARG)) {
+		buxton_log("io_uring lacks features buxtond needs, using epoll\n");
+		goto fail;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		ring->rings = NULL;
+		buxton_log("mmap(): %m, using epoll\n");
+		goto fail;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		buxton_log("mmap(): %m, using epoll\n");
+		goto fail;
+	}
+
+	rings = ring->rings;
+	ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+	ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned *)(rings + params.sq_off.ring_entries);
+	ring->tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	/* Clients are received into buffers the kernel picks from a ring */
+	ring->buf_ring_size = BUXTON_URING_BUFFERS * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		buxton_log("mmap(): %m, using epoll\n");
+		goto fail;
+	}
+	ring->buffers = malloc(BUXTON_URING_BUFFERS * BUXTON_CLIENT_BUFFER_SIZE);
+	if (!ring->buffers) {
+		abort();
+	}
+	memzero(&reg, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	reg.ring_entries = BUXTON_URING_BUFFERS;
+	reg.bgid = BUXTON_URING_GROUP;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		buxton_log("io_uring has no buffer rings, using epoll\n");
+		goto fail;
+	}
+	for (uint16_t bid = 0; bid < BUXTON_URING_BUFFERS; bid++) {
+		give_buffer(ring, bid);
+	}
+
+	if (!probe_recv(ring)) {
+		buxton_log("io_uring has no multishot receive, using epoll\n");
+		goto fail;
+	}
+
+	buxton_debug("Using io_uring\n");
+	self->uring = ring;
+	return true;
+
+fail:
+	uring_free(ring);
+	return false;
+}
+
+void buxtond_uring_free(BuxtonDaemon *self)
+{
+	BuxtonUringOp *op;
+
+	assert(self);
+
+	if (!self->uring) {
+		return;
+	}
+
+	/* Closing the ring cancels what's in flight */
+	LIST_FOREACH(item, op, self->uring->ops) {
+		if (op->client && op->type == BUXTON_URING_RECV) {
+			op->client->uring_recv = NULL;
+		} else if (op->client) {
+			op->client->uring_send = NULL;
+		}
+	}
+	uring_free(self->uring);
+	self->uring = NULL;
+}
+
+void buxtond_uring_add(BuxtonDaemon *self, BuxtonPollFd *polled,
+		       short events, bool accepting)
+{
+	BuxtonUring *ring = self->uring;
+	client_list_item *cl = polled->client;
+	BuxtonUringOp *op;
+
+	assert(ring);
+
+	if (accepting) {
+		op = new_op(ring, BUXTON_URING_ACCEPT, polled->fd);
+	} else if (cl) {
+		op = new_op(ring, BUXTON_URING_RECV, polled->fd);
+		op->client = cl;
+		cl->uring_recv = op;
+	} else {
+		op = new_op(ring, BUXTON_URING_POLL, polled->fd);
+		op->polled = polled;
+	}
+	op->events = events;
+
+	if (!ring->quiescing) {
+		arm(ring, op);
+	}
+}
+
+void buxtond_uring_del(BuxtonDaemon *self, int fd)
+{
+	BuxtonUring *ring = self->uring;
+	BuxtonUringOp *op;
+
+	assert(ring);
+
+	LIST_FOREACH(item, op, ring->ops) {
+		if (op->fd == fd && !op->dead && op->type != BUXTON_URING_SEND) {
+			break;
+		}
+	}
+	if (!op) {
+		return;
+	}
+
+	op->dead = true;
+	if (op->client) {
+		op->client->uring_recv = NULL;
+		op->client = NULL;
+	}
+	if (op->armed) {
+		cancel(ring, op);
+	} else {
+		free_op(ring, op);
+	}
+}
+
+int buxtond_uring_wait(BuxtonDaemon *self, struct epoll_event *events,
+		       int max, int timeout)
+{
+	BuxtonUring *ring = self->uring;
+	struct io_uring_cqe cqe;
+	int nevents = 0;
+	int ret;
+
+	assert(ring);
+	assert(events);
+
+	/* Completions already in are handled without waiting */
+	ret = uring_enter(ring, timeout != 0 && !cqe_ready(ring) ? 1 : 0,
+			  timeout);
+	if (ret < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+		return -1;
+	}
+
+	while (nevents < max && next_cqe(ring, &cqe)) {
+		events[nevents].events = 0;
+		complete(self, &cqe, &events[nevents]);
+		if (events[nevents].events) {
+			nevents++;
+		}
+	}
+
+	return nevents;
+}
+
+bool buxtond_uring_send(BuxtonDaemon *self, client_list_item *cl)
+{
+	BuxtonUring *ring = self->uring;
+	BuxtonUringOp *op;
+
+	assert(ring);
+	assert(cl);
+
+	/* What's queued meanwhile goes once the send in flight is done */
+	if (cl->uring_send || ring->quiescing) {
+		return true;
+	}
+	if (cl->out_start == cl->out_offset) {
+		cl->out_start = 0;
+		cl->out_offset = 0;
+		return true;
+	}
+
+	op = new_op(ring, BUXTON_URING_SEND, cl->fd);
+	op->client = cl;
+	op->data = cl->out;
+	op->size = cl->out_size;
+	op->start = cl->out_start;
+	op->end = cl->out_offset;
+	cl->out = NULL;
+	cl->out_size = 0;
+	cl->out_start = 0;
+	cl->out_offset = 0;
+	cl->uring_send = op;
+	arm(ring, op);
+
+	return true;
+}
+
+void buxtond_uring_detach(BuxtonDaemon *self, client_list_item *cl)
+{
+	assert(self->uring);
+	assert(cl);
+
+	if (cl->uring_send) {
+		cl->uring_send->client = NULL;
+		cl->uring_send = NULL;
+	}
+}
+
+void buxtond_uring_resume(BuxtonDaemon *self, client_list_item *cl)
+{
+	BuxtonUringOp *op = cl->uring_recv;
+
+	assert(self->uring);
+
+	if (!op || !op->paused || backlogged(cl)) {
+		return;
+	}
+	op->paused = false;
+	rearm(self->uring, op);
+}
+
+void buxtond_uring_quiesce(BuxtonDaemon *self)
+{
+	BuxtonUring *ring = self->uring;
+	struct io_uring_cqe cqe;
+
+	if (!ring) {
+		return;
+	}
+
+	ring->quiescing = true;
+	cancel(ring, NULL);
+	while (ring->inflight) {
+		if (uring_enter(ring, 1, -1) < 0 && errno != EINTR &&
+		    errno != EBUSY && errno != EAGAIN) {
+			buxton_log("io_uring_enter(): %m\n");
+			abort();
+		}
+		/* Polled fds are polled again once the ring restarts */
+		while (next_cqe(ring, &cqe)) {
+			complete(self, &cqe, NULL);
+		}
+	}
+}
+
+void buxtond_uring_restart(BuxtonDaemon *self)
+{
+	BuxtonUring *ring = self->uring;
+	client_list_item *cl;
+	BuxtonUringOp *op;
+
+	if (!ring || !ring->quiescing) {
+		return;
+	}
+
+	ring->quiescing = false;
+	LIST_FOREACH(item, op, ring->ops) {
+		if (op->type != BUXTON_URING_SEND) {
+			rearm(ring, op);
+		}
+	}
+	LIST_FOREACH(item, cl, self->client_list) {
+		flush_later(self, cl);
+	}
+}
+
+/*
+ * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: t
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 noexpandtab:
+ * :indentSize=8:tabSize=8:noTabs=false:
+ */
@@ -0,0 +1,167 @@
+/*
+ * This file is part of buxton.
+ *
+ * Copyright (C) 2013 Intel Corporation
+ *
+ * buxton is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/**
+ * \file uring.h Internal header
+ * io_uring engine for buxtond, built with --enable-io-uring
+ *
+ * Listening sockets take multishot accepts and clients multishot
+ * receives, which read into a ring of buffers shared with the kernel.
+ * Responses are queued as sends, and the whole batch goes to the kernel
+ * with the next wait, so a pass of the loop costs one io_uring_enter.
+ * Other fds (signals, Smack rules) are polled through the ring and come
+ * back to the loop as epoll events. Without the engine, or on a kernel
+ * that lacks what it needs, buxtond uses epoll.
+ */
+#pragma once
+
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+#include "daemon.h"
+
+/**
+ * Number of buffers clients are received into
+ */
+#define BUXTON_URING_BUFFERS 128
+
+/**
+ * Most submissions queued before they must go to the kernel
+ */
+#define BUXTON_URING_ENTRIES 256
+
+#ifdef HAVE_IO_URING
+
+/**
+ * Set up the io_uring engine for buxtond
+ * @param self buxtond instance being run, without fds yet
+ * @return bool indicating the engine is used, false to use epoll
+ */
+bool buxtond_uring_setup(BuxtonDaemon *self)
+	__attribute__((warn_unused_result));
+
+/**
+ * Tear down the io_uring engine, dropping whatever is in flight
+ * @param self buxtond instance being run
+ */
+void buxtond_uring_free(BuxtonDaemon *self);
+
+/**
+ * Start the accept, receive or poll for a fd added to the poll list
+ * @param self buxtond instance being run
+ * @param polled Entry of the fd that was added
+ * @param events Events polled for, when the fd isn't a socket
+ * @param accepting The fd is a listening socket
+ */
+void buxtond_uring_add(BuxtonDaemon *self, BuxtonPollFd *polled,
+		       short events, bool accepting);
+
+/**
+ * Cancel whatever is in flight for a fd removed from the poll list
+ * @param self buxtond instance being run
+ * @param fd File descriptor that was removed
+ */
+void buxtond_uring_del(BuxtonDaemon *self, int fd);
+
+/**
+ * Submit what is queued and wait for completions. Accepted clients and
+ * the data they send are handled here, and polled fds are returned.
+ * @param self buxtond instance being run
+ * @param events Set to the polled fds that are ready
+ * @param max Most events to return
+ * @param timeout Most time to wait in ms, -1 to wait for a completion
+ * @return Number of events, or -1 with errno set
+ */
+int buxtond_uring_wait(BuxtonDaemon *self, struct epoll_event *events,
+		       int max, int timeout);
+
+/**
+ * Queue a send of a client's output, unless one is in flight already
+ * @param self buxtond instance being run
+ * @param cl Client with output
+ * @return bool indicating the client is still connected
+ */
+bool buxtond_uring_send(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Let go of a terminated client's send, which finishes on its own
+ * @param self buxtond instance being run
+ * @param cl Client being terminated
+ */
+void buxtond_uring_detach(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Receive for a client again once its backlog is handled
+ * @param self buxtond instance being run
+ * @param cl Client that was served
+ */
+void buxtond_uring_resume(BuxtonDaemon *self, client_list_item *cl);
+
+/**
+ * Cancel everything in flight and wait for it, leaving what wasn't
+ * sent in the clients' output, before buxtond hands off its state
+ * @param self buxtond instance being run
+ */
+void buxtond_uring_quiesce(BuxtonDaemon *self);
+
+/**
+ * Start accepting, receiving and sending again after a handoff failed
+ * @param self buxtond instance being run
+ */
+void buxtond_uring_restart(BuxtonDaemon *self);
+
+#else
+
+static inline bool buxtond_uring_setup(BuxtonDaemon *self)
+{
+	return false;
+}
+static inline void buxtond_uring_free(BuxtonDaemon *self) {}
+static inline void buxtond_uring_add(BuxtonDaemon *self,
+				     BuxtonPollFd *polled, short events,
+				     bool accepting) {}
+static inline void buxtond_uring_del(BuxtonDaemon *self, int fd) {}
+static inline int buxtond_uring_wait(BuxtonDaemon *self,
+				     struct epoll_event *events, int max,
+				     int timeout)
+{
+	return -1;
+}
+static inline bool buxtond_uring_send(BuxtonDaemon *self,
+				      client_list_item *cl)
+{
+	return true;
+}
+static inline void buxtond_uring_detach(BuxtonDaemon *self,
+					client_list_item *cl) {}
+static inline void buxtond_uring_resume(BuxtonDaemon *self,
+					client_list_item *cl) {}
+static inline void buxtond_uring_quiesce(BuxtonDaemon *self) {}
+static inline void buxtond_uring_restart(BuxtonDaemon *self) {}
+
+#endif
+
+/*
+ * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: t
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 noexpandtab:
+ * :indentSize=8:tabSize=8:noTabs=false:
+ */
@@ -15,21 +15,93 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <gdbm.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "buxtonlist.h"
+#include "configurator.h"
 #include "log.h"
 #include "hashmap.h"
+#include "list.h"
 #include "serialize.h"
 #include "util.h"
 
 /**
  * GDBM Database Module
+ *
+ * Records refer to their label by an ID into the layer's label table,
+ * which is stored in the database under BUXTON_LABEL_TABLE_KEY.
+ *
+ * GDBM has no transactions of its own. A commit first writes every
+ * record it stores or deletes to a log next to the database, and only
+ * removes the log once the database is synced. A log found on open is
+ * from a commit that didn't finish, and is applied again. Logs end by
+ * storing their commit's number under GDBM_COMMIT_KEY, so a log the
+ * database already holds is dropped rather than applied over newer
+ * values. A database whose log fails to apply is closed, and only
+ * opened again once the log applies.
+ *
+ * Each user of a user layer has a database of their own, so at most
+ * MaxOpenDatabases are kept open, closing the least recently used. A
+ * layer caches the database it last used, which spares the lookup by
+ * name while the same user keeps using it.
+ */
+
+#define GDBM_LOG_SUFFIX ".commit"
+
+/* Key of the number of the last commit applied, without a nil like the
+ * label table's */
+#define GDBM_COMMIT_KEY "buxton-commit"
+#define GDBM_COMMIT_KEY_LENGTH (sizeof(GDBM_COMMIT_KEY) - 1)
+
+/* Commit log operations */
+#define GDBM_LOG_STORE 1
+#define GDBM_LOG_DELETE 2
+
+/*
+ * Databases stay open while buxtond execs its successor, so they must
+ * not leak into it. gdbm before 1.10 can't be asked to do that itself.
  */
+#ifndef GDBM_CLOEXEC
+#define GDBM_CLOEXEC 0
+#define GDBM_SET_CLOEXEC
+#endif
 
+typedef struct GdbmDb {
+	GDBM_FILE file; /**<Open database */
+	BuxtonLabelTable labels; /**<Labels used by the records */
+	char *log_path; /**<Commit log path */
+	uint64_t commits; /**<Number of the last commit applied */
+	bool failed; /**<A commit was left half applied */
+	char *name; /**<Name of the database in _resources */
+	uid_t uid; /**<Owner of a user layer's database */
+	BuxtonLayer *layer; /**<Layer that last used the database */
+	unsigned int cursors; /**<Open cursors, which keep it open */
+	LIST_FIELDS(struct GdbmDb, lru); /**<Most recently used first */
+} GdbmDb;
 
 static Hashmap *_resources = NULL;
+static LIST_HEAD(GdbmDb, _lru);
+static unsigned int _open_count = 0;
+static unsigned int _max_open = 0;
+static size_t _cache_size = 0;
+
+static bool is_commit_key(const char *key, size_t length)
+{
+	return length == GDBM_COMMIT_KEY_LENGTH &&
+		memcmp(key, GDBM_COMMIT_KEY, length) == 0;
+}
+
+/* Records that aren't groups or keys */
+static bool is_internal_key(const char *key, size_t length)
+{
+	return buxton_is_label_table_key(key, length) ||
+		is_commit_key(key, length);
+}
 
 static char *key_get_name(BuxtonString *key)
 {
@@ -49,11 +121,13 @@ static char *key_get_name(BuxtonString *key)
 
 static GDBM_FILE try_open_database(char *path, const int oflag)
 {
-	GDBM_FILE db = gdbm_open(path, 0, oflag, S_IRUSR | S_IWUSR, NULL);
+	GDBM_FILE db = gdbm_open(path, 0, oflag | GDBM_CLOEXEC,
+				 S_IRUSR | S_IWUSR, NULL);
 	/* handle open under write mode failing by falling back to
 	   reader mode */
 	if (!db && (gdbm_errno == GDBM_FILE_OPEN_ERROR)) {
-		db = gdbm_open(path, 0, GDBM_READER, S_IRUSR | S_IWUSR, NULL);
+		db = gdbm_open(path, 0, GDBM_READER | GDBM_CLOEXEC,
+			       S_IRUSR | S_IWUSR, NULL);
 		buxton_debug("Attempting to fallback to opening db as read-only\n");
 		errno = EROFS;
 	} else {
@@ -63,13 +137,392 @@ static GDBM_FILE try_open_database(char *path, const int oflag)
 		/* Must do this as gdbm_open messes with errno */
 		errno = 0;
 	}
+#ifdef GDBM_SET_CLOEXEC
+	if (db) {
+		int saved = errno;
+
+		(void)fcntl(gdbm_fdesc(db), F_SETFD, FD_CLOEXEC);
+		errno = saved;
+	}
+#endif
+	return db;
+}
+
+/*
+ * Load the label table. Records only hold label IDs, so a table that
+ * doesn't load can't be rebuilt, and new labels mustn't reuse its IDs.
+ */
+static bool load_labels(GdbmDb *db, const char *path)
+{
+	datum key, value;
+	bool ret;
+
+	key.dptr = BUXTON_LABEL_TABLE_KEY;
+	key.dsize = (int)BUXTON_LABEL_TABLE_KEY_LENGTH;
+	value = gdbm_fetch(db->file, key);
+	if (!value.dptr) {
+		/* Databases from before label tables have none */
+		return true;
+	}
+	ret = buxton_label_table_load(&db->labels, (uint8_t *)value.dptr,
+				      (size_t)value.dsize);
+	if (!ret) {
+		buxton_log("Invalid label table in %s\n", path);
+	}
+	free(value.dptr);
+
+	return ret;
+}
+
+/* Write the label table, before any record that uses a new label */
+static int store_labels(GdbmDb *db)
+{
+	_cleanup_free_ uint8_t *data = NULL;
+	datum key, value;
+	size_t size;
+
+	size = buxton_label_table_serialize(&db->labels, &data);
+	key.dptr = BUXTON_LABEL_TABLE_KEY;
+	key.dsize = (int)BUXTON_LABEL_TABLE_KEY_LENGTH;
+	value.dptr = (char *)data;
+	value.dsize = (int)size;
+	if (gdbm_store(db->file, key, value, GDBM_REPLACE)) {
+		return gdbm_errno == GDBM_READER_CANT_STORE ? EROFS : EIO;
+	}
+
+	return 0;
+}
+
+/* Build the group\0 or group\0name\0 record key for key into buf */
+static datum fill_key_datum(_BuxtonKey *key, char **buf, size_t *size)
+{
+	datum key_data;
+	size_t len = key->group.length;
+
+	if (key->name.value) {
+		len += key->name.length;
+	}
+
+	/* Batches reuse one buffer for all their keys */
+	if (len > *size) {
+		char *k = realloc(*buf, len);
+		if (!k) {
+			abort();
+		}
+		*buf = k;
+		*size = len;
+	}
+	memcpy(*buf, key->group.value, key->group.length);
+	if (key->name.value) {
+		memcpy(*buf + key->group.length, key->name.value,
+		       key->name.length);
+	}
+	key_data.dptr = *buf;
+	key_data.dsize = (int)len;
+
+	return key_data;
+}
+
+/* Build the group\0 or group\0name\0 record key for key */
+static datum key_datum(_BuxtonKey *key)
+{
+	char *buf = NULL;
+	size_t size = 0;
+
+	return fill_key_datum(key, &buf, &size);
+}
+
+/* Encode a commit log entry into buf when not NULL, returning its size */
+static size_t encode_log_entry(uint8_t *buf, uint8_t op, datum key,
+			       datum value)
+{
+	uint32_t key_len = (uint32_t)key.dsize;
+	uint32_t value_len = (uint32_t)value.dsize;
+	size_t offset = 0;
+
+	if (buf) {
+		buf[offset] = op;
+		memcpy(buf + offset + 1, &key_len, sizeof(uint32_t));
+		memcpy(buf + offset + 1 + sizeof(uint32_t), &value_len,
+		       sizeof(uint32_t));
+		offset += 1 + 2 * sizeof(uint32_t);
+		memcpy(buf + offset, key.dptr, key_len);
+		offset += key_len;
+		if (value_len) {
+			memcpy(buf + offset, value.dptr, value_len);
+		}
+	}
+
+	return 1 + 2 * sizeof(uint32_t) + key_len + value_len;
+}
+
+/* The record a commit log ends with, giving the commit's number */
+static void commit_record(uint64_t *number, datum *key, datum *value)
+{
+	key->dptr = GDBM_COMMIT_KEY;
+	key->dsize = (int)GDBM_COMMIT_KEY_LENGTH;
+	value->dptr = (char *)number;
+	value->dsize = (int)sizeof(uint64_t);
+}
+
+/* Read the commit log entry at *offset, returning false once it's torn */
+static bool next_log_entry(uint8_t *buf, size_t size, size_t *offset,
+			   uint8_t *op, datum *key, datum *value)
+{
+	uint32_t key_len, value_len;
+
+	if (size - *offset < 1 + 2 * sizeof(uint32_t)) {
+		return false;
+	}
+	*op = buf[*offset];
+	memcpy(&key_len, buf + *offset + 1, sizeof(uint32_t));
+	memcpy(&value_len, buf + *offset + 1 + sizeof(uint32_t),
+	       sizeof(uint32_t));
+	*offset += 1 + 2 * sizeof(uint32_t);
+	if (size - *offset < (size_t)key_len + value_len) {
+		return false;
+	}
+	key->dptr = (char *)buf + *offset;
+	key->dsize = (int)key_len;
+	*offset += key_len;
+	value->dptr = (char *)buf + *offset;
+	value->dsize = (int)value_len;
+	*offset += value_len;
+
+	return true;
+}
+
+/* Number of the commit a log holds, or 0 if it holds none */
+static uint64_t log_number(uint8_t *buf, size_t size)
+{
+	size_t offset = 0;
+	datum key = {0}, value = {0};
+	uint64_t number = 0;
+	uint8_t op = 0;
+
+	while (offset < size) {
+		if (!next_log_entry(buf, size, &offset, &op, &key, &value)) {
+			return 0;
+		}
+	}
+	/* The number is stored last, once the rest of the commit is */
+	if (op == GDBM_LOG_STORE && is_commit_key(key.dptr, (size_t)key.dsize) &&
+	    value.dsize == (int)sizeof(uint64_t)) {
+		memcpy(&number, value.dptr, sizeof(uint64_t));
+	}
+
+	return number;
+}
+
+/*
+ * Store and delete the records of a commit log, then sync. The log
+ * holds whole records, so applying it again gives the same result.
+ */
+static bool apply_log(GdbmDb *db, uint8_t *buf, size_t size)
+{
+	size_t offset = 0;
+	datum key, value;
+	uint8_t op;
+
+	while (offset < size) {
+		if (!next_log_entry(buf, size, &offset, &op, &key, &value)) {
+			return false;
+		}
+
+		if (op == GDBM_LOG_STORE) {
+			if (gdbm_store(db->file, key, value, GDBM_REPLACE)) {
+				return false;
+			}
+		} else if (gdbm_delete(db->file, key) &&
+			   gdbm_errno != GDBM_ITEM_NOT_FOUND) {
+			return false;
+		}
+	}
+	gdbm_sync(db->file);
+
+	return true;
+}
+
+/* Write a commit log in full before the database is touched */
+static bool write_log(GdbmDb *db, uint8_t *buf, size_t size)
+{
+	_cleanup_free_ char *tmp = NULL;
+	bool ret = false;
+	int fd;
+
+	if (asprintf(&tmp, "%s.tmp", db->log_path) == -1) {
+		abort();
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		buxton_log("Couldn't write commit log %s: %m\n", tmp);
+		return false;
+	}
+	if (_write(fd, buf, size) && fsync(fd) == 0) {
+		ret = true;
+	}
+	close(fd);
+
+	/* The rename makes the log appear whole, or not at all */
+	if (!ret || rename(tmp, db->log_path) == -1) {
+		buxton_log("Couldn't write commit log %s: %m\n", db->log_path);
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Finish a commit that was being applied when buxtond stopped, or that
+ * failed to apply. Returns false if the log can't be applied, when the
+ * database holds half a commit.
+ */
+static bool replay_log(GdbmDb *db)
+{
+	_cleanup_free_ uint8_t *buf = NULL;
+	struct stat st;
+	size_t offset = 0;
+	uint64_t number;
+	ssize_t r;
+	int fd;
+
+	fd = open(db->log_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return true;
+	}
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return false;
+	}
+	buf = malloc((size_t)st.st_size + 1);
+	if (!buf) {
+		abort();
+	}
+	while (offset < (size_t)st.st_size) {
+		r = read(fd, buf + offset, (size_t)st.st_size - offset);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		offset += (size_t)r;
+	}
+	close(fd);
+
+	number = log_number(buf, offset);
+	if (!number) {
+		buxton_log("Invalid commit log %s\n", db->log_path);
+		return false;
+	}
+	/* Values stored since then would be rolled back */
+	if (number <= db->commits) {
+		buxton_log("Dropping applied commit log %s\n", db->log_path);
+		unlink(db->log_path);
+		return true;
+	}
+
+	buxton_log("Applying unfinished commit %s\n", db->log_path);
+	if (!apply_log(db, buf, offset)) {
+		buxton_log("Couldn't apply commit log %s\n", db->log_path);
+		return false;
+	}
+	db->commits = number;
+	unlink(db->log_path);
+
+	return true;
+}
+
+/*
+ * Write a commit log and apply it. A log that fails to apply is kept,
+ * and the database is closed before its next use, so nothing is stored
+ * over half a commit until reopening it finishes the log.
+ */
+static int run_log(GdbmDb *db, uint8_t *buf, size_t size, uint64_t number)
+{
+	if (!write_log(db, buf, size)) {
+		return EIO;
+	}
+	if (!apply_log(db, buf, size)) {
+		buxton_log("Couldn't apply commit log %s\n", db->log_path);
+		db->failed = true;
+		return EIO;
+	}
+	db->commits = number;
+	unlink(db->log_path);
+
+	return 0;
+}
+
+static void load_commits(GdbmDb *db)
+{
+	datum key, value;
+
+	key.dptr = GDBM_COMMIT_KEY;
+	key.dsize = (int)GDBM_COMMIT_KEY_LENGTH;
+	value = gdbm_fetch(db->file, key);
+	if (value.dptr && value.dsize == (int)sizeof(uint64_t)) {
+		memcpy(&db->commits, value.dptr, sizeof(uint64_t));
+	}
+	free(value.dptr);
+}
+
+static void close_db(GdbmDb *db)
+{
+	hashmap_remove(_resources, db->name);
+	LIST_REMOVE(GdbmDb, lru, _lru, db);
+	_open_count--;
+	if (db->layer && db->layer->handle == db) {
+		db->layer->handle = NULL;
+	}
+	gdbm_close(db->file);
+	buxton_label_table_free(&db->labels);
+	free(db->log_path);
+	free(db->name);
+	free(db);
+}
+
+/* Close the least recently used databases over the limit, but not db */
+static void evict_databases(GdbmDb *db)
+{
+	GdbmDb *victim, *prev;
+
+	if (!_max_open || _open_count <= _max_open) {
+		return;
+	}
+
+	LIST_FIND_TAIL(GdbmDb, lru, _lru, victim);
+	while (victim && _open_count > _max_open) {
+		prev = victim->lru_prev;
+		/* Cursors walking a database keep it open */
+		if (victim != db && !victim->cursors) {
+			buxton_debug("Closing database %s\n", victim->name);
+			close_db(victim);
+		}
+		victim = prev;
+	}
+}
+
+/* Cache db as the database the layer uses, and mark it recently used */
+static GdbmDb *use_db(BuxtonLayer *layer, GdbmDb *db)
+{
+	if (_lru != db) {
+		LIST_REMOVE(GdbmDb, lru, _lru, db);
+		LIST_PREPEND(GdbmDb, lru, _lru, db);
+	}
+	db->layer = layer;
+	layer->handle = db;
+
 	return db;
 }
 
 /* Open or create databases on the fly */
-static GDBM_FILE db_for_resource(BuxtonLayer *layer)
+static GdbmDb *db_for_resource(BuxtonLayer *layer)
 {
-	GDBM_FILE db;
+	GdbmDb *db;
+	GDBM_FILE file;
 	_cleanup_free_ char *path = NULL;
 	char *name = NULL;
 	int r;
@@ -79,6 +532,14 @@ static GDBM_FILE db_for_resource(BuxtonLayer *layer)
 	assert(layer);
 	assert(_resources);
 
+	/* A user layer is shared by every user, so check whose it is */
+	db = layer->handle;
+	if (db && !db->failed &&
+	    (layer->type != LAYER_USER || db->uid == layer->uid)) {
+		errno = 0;
+		return use_db(layer, db);
+	}
+
 	if (layer->type == LAYER_USER) {
 		r = asprintf(&name, "%s-%d", layer->name.value, layer->uid);
 	} else {
@@ -89,99 +550,125 @@ static GDBM_FILE db_for_resource(BuxtonLayer *layer)
 	}
 
 	db = hashmap_get(_resources, name);
+	/* Reopening finishes a commit left half applied */
+	if (db && db->failed) {
+		if (db->cursors) {
+			free(name);
+			errno = EIO;
+			return NULL;
+		}
+		close_db(db);
+		db = NULL;
+	}
 	if (!db) {
 		path = get_layer_path(layer);
 		if (!path) {
 			abort();
 		}
 
-		db = try_open_database(path, oflag);
+		file = try_open_database(path, oflag);
 		save_errno = errno;
-		if (!db) {
+		if (!file) {
 			free(name);
 			buxton_log("Couldn't create db for path: %s\n", path);
 			return 0;
 		}
+		if (_cache_size &&
+		    gdbm_setopt(file, GDBM_CACHESIZE, &_cache_size,
+				sizeof(_cache_size))) {
+			buxton_debug("Couldn't set cache size for %s\n", path);
+		}
+		db = malloc0(sizeof(GdbmDb));
+		if (!db) {
+			abort();
+		}
+		db->file = file;
+		db->name = name;
+		db->uid = layer->uid;
+		if (asprintf(&db->log_path, "%s%s", path, GDBM_LOG_SUFFIX) == -1) {
+			abort();
+		}
+		/* The log may hold a new label table, so replay it first */
+		load_commits(db);
+		if ((!layer->readonly && !replay_log(db)) ||
+		    !load_labels(db, path)) {
+			gdbm_close(db->file);
+			free(db->log_path);
+			free(db->name);
+			free(db);
+			errno = EIO;
+			return NULL;
+		}
 		r = hashmap_put(_resources, name, db);
 		if (r != 1) {
 			abort();
 		}
+		LIST_PREPEND(GdbmDb, lru, _lru, db);
+		_open_count++;
+		evict_databases(db);
 	} else {
-		db = (GDBM_FILE) hashmap_get(_resources, name);
 		free(name);
 	}
 
 	errno = save_errno;
-	return db;
+	return use_db(layer, db);
 }
 
-static int set_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
-		      BuxtonString *label)
+/* Store data under key_data, or relabel the stored value if data is NULL */
+static int store_record(GdbmDb *db, datum key_data, BuxtonData *data,
+			BuxtonString *label)
 {
-	GDBM_FILE db;
-	int ret = -1;
-	datum key_data;
+	int ret;
 	datum cvalue = {0};
 	datum value;
 	_cleanup_free_ uint8_t *data_store = NULL;
 	size_t size;
-	uint32_t sz;
+	uint16_t label_id;
+	uint16_t label_count = db->labels.count;
+	bool added;
 	BuxtonData cdata = {0};
-	BuxtonString clabel;
-
-	assert(layer);
-	assert(key);
-	assert(label);
-
-	if (key->name.value) {
-		sz = key->group.length + key->name.length;
-		key_data.dptr = malloc(sz);
-		if (!key_data.dptr) {
-			abort();
-		}
-
-		/* size is string\0string\0 so just write, bonus for
-		   nil seperator being added without extra work */
-		key_data.dsize = (int)sz;
-		memcpy(key_data.dptr, key->group.value, key->group.length);
-		memcpy(key_data.dptr + key->group.length, key->name.value,
-		       key->name.length);
-	} else {
-		key_data.dptr = malloc(key->group.length);
-		if (!key_data.dptr) {
-			abort();
-		}
-
-		memcpy(key_data.dptr, key->group.value, key->group.length);
-		key_data.dsize = (int)key->group.length;
-	}
-
-	db = db_for_resource(layer);
-	if (!db || errno) {
-		ret = errno;
-		goto end;
-	}
+	uint64_t version;
 
 	/* set_label will pass a NULL for data */
 	if (!data) {
-		cvalue = gdbm_fetch(db, key_data);
+		cvalue = gdbm_fetch(db->file, key_data);
 		if (cvalue.dsize < 0 || cvalue.dptr == NULL) {
 			ret = ENOENT;
 			goto end;
 		}
 
-		data_store = (uint8_t*)cvalue.dptr;
-		buxton_deserialize(data_store, &cdata, &clabel);
-		free(clabel.value);
+		/* Only the label changes, so the value keeps its version */
+		if (!buxton_deserialize_record((uint8_t *)cvalue.dptr,
+					       (size_t)cvalue.dsize,
+					       &db->labels, &cdata, NULL,
+					       &version)) {
+			ret = EINVAL;
+			goto end;
+		}
 		data = &cdata;
-		data_store = NULL;
+	} else {
+		version = buxton_record_next_version();
 	}
 
-	size = buxton_serialize(data, label, &data_store);
+	/* Labels that can't be given an ID are stored in full */
+	if (buxton_label_table_intern(&db->labels, label, &label_id, &added)) {
+		if (added) {
+			ret = store_labels(db);
+			if (ret) {
+				buxton_label_table_truncate(&db->labels,
+							    label_count);
+				goto end;
+			}
+		}
+		size = buxton_serialize_record(data, label_id, version,
+					       &data_store);
+	} else {
+		size = buxton_serialize(data, label, &data_store);
+	}
 
 	value.dptr = (char *)data_store;
 	value.dsize = (int)size;
-	ret = gdbm_store(db, key_data, value, GDBM_REPLACE);
+	ret = gdbm_store(db->file, key_data, value, GDBM_REPLACE);
 	if (ret && gdbm_errno == GDBM_READER_CANT_STORE) {
 		ret = EROFS;
 	}
@@ -191,71 +678,59 @@ end:
 	if (cdata.type == STRING) {
 		free(cdata.store.d_string.value);
 	}
-	free(key_data.dptr);
 	free(cvalue.dptr);
 
 	return ret;
 }
 
-static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
+static int set_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
 		      BuxtonString *label)
 {
-	GDBM_FILE db;
+	GdbmDb *db;
 	datum key_data;
-	datum value;
-	uint8_t *data_store = NULL;
 	int ret;
-	uint32_t sz;
 
 	assert(layer);
+	assert(key);
+	assert(label);
 
-	if (key->name.value) {
-		sz = key->group.length + key->name.length;
-		key_data.dptr = malloc(sz);
-		if (!key_data.dptr) {
-			abort();
-		}
-
-		/* size is string\0string\0 so just write, bonus for
-		   nil seperator being added without extra work */
-		key_data.dsize = (int)sz;
-		memcpy(key_data.dptr, key->group.value, key->group.length);
-		memcpy(key_data.dptr + key->group.length, key->name.value,
-		       key->name.length);
-	} else {
-		key_data.dptr = malloc(key->group.length);
-		if (!key_data.dptr) {
-			abort();
-		}
-
-		memcpy(key_data.dptr, key->group.value, key->group.length);
-		key_data.dsize = (int)key->group.length;
-	}
+	key_data = key_datum(key);
 
-	memzero(&value, sizeof(datum));
 	db = db_for_resource(layer);
-	if (!db) {
-		/*
-		 * Set negative here to indicate layer not found
-		 * rather than key not found, optimization for
-		 * set value
-		 */
-		ret = -ENOENT;
+	if (!db || errno) {
+		ret = errno;
 		goto end;
 	}
 
-	value = gdbm_fetch(db, key_data);
+	ret = store_record(db, key_data, data, label);
+
+end:
+	free(key_data.dptr);
+
+	return ret;
+}
+
+static int fetch_record(GdbmDb *db, datum key_data, _BuxtonKey *key,
+			BuxtonData *data, BuxtonString *label,
+			uint64_t *version)
+{
+	BuxtonString stored;
+	datum value;
+	int ret;
+
+	value = gdbm_fetch(db->file, key_data);
 	if (value.dsize < 0 || value.dptr == NULL) {
-		ret = ENOENT;
-		goto end;
+		return ENOENT;
 	}
 
-	data_store = (uint8_t*)value.dptr;
-	buxton_deserialize(data_store, data, label);
+	if (!buxton_deserialize_record((uint8_t *)value.dptr,
+				       (size_t)value.dsize, &db->labels,
+				       data, &stored, version)) {
+		ret = EINVAL;
+		goto end;
+	}
 
 	if (data->type != key->type) {
-		free(label->value);
-		label->value = NULL;
 		if (data->type == STRING) {
 			free(data->store.d_string.value);
 			data->store.d_string.value = NULL;
@@ -263,80 +738,355 @@ static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
 		ret = EINVAL;
 		goto end;
 	}
+
+	/* The caller owns its label, the table keeps the stored one */
+	if (!buxton_string_copy(&stored, label)) {
+		abort();
+	}
 	ret = 0;
 
 end:
-	free(key_data.dptr);
 	free(value.dptr);
-	data_store = NULL;
 
 	return ret;
 }
 
+static int get_versioned_value(BuxtonLayer *layer, _BuxtonKey *key,
+			       BuxtonData *data, BuxtonString *label,
+			       uint64_t *version)
+{
+	GdbmDb *db;
+	datum key_data;
+	int ret;
+
+	assert(layer);
+
+	key_data = key_datum(key);
+
+	db = db_for_resource(layer);
+	if (!db) {
+		/*
+		 * Set negative here to indicate layer not found
+		 * rather than key not found, optimization for
+		 * set value
+		 */
+		ret = -ENOENT;
+		goto end;
+	}
+
+	ret = fetch_record(db, key_data, key, data, label, version);
+
+end:
+	free(key_data.dptr);
+
+	return ret;
+}
+
+static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
+		      BuxtonString *label)
+{
+	return get_versioned_value(layer, key, data, label, NULL);
+}
+
+static int delete_record(GdbmDb *db, datum key_data)
+{
+	if (gdbm_delete(db->file, key_data)) {
+		if (gdbm_errno == GDBM_READER_CANT_DELETE) {
+			return EROFS;
+		} else if (gdbm_errno == GDBM_ITEM_NOT_FOUND) {
+			return ENOENT;
+		}
+		abort();
+	}
+
+	return 0;
+}
+
 static int unset_value(BuxtonLayer *layer,
 			_BuxtonKey *key,
 			__attribute__((unused)) BuxtonData *data,
 			__attribute__((unused)) BuxtonString *label)
 {
-	GDBM_FILE db;
+	GdbmDb *db;
 	datum key_data;
 	int ret;
-	uint32_t sz;
 
 	assert(layer);
 	assert(key);
 
-	if (key->name.value) {
-		sz = key->group.length + key->name.length;
-		key_data.dptr = malloc(sz);
-		if (!key_data.dptr) {
-			abort();
+	key_data = key_datum(key);
+
+	/* gdbm_errno may be stale from an earlier lookup, so use errno */
+	errno = 0;
+	db = db_for_resource(layer);
+	if (!db || errno) {
+		ret = EROFS;
+		goto end;
+	}
+
+	ret = delete_record(db, key_data);
+
+end:
+	free(key_data.dptr);
+
+	return ret;
+}
+
+/* Record an item's status, returning the first failure of the batch */
+static int item_status(BuxtonBatchItem *item, int status, int ret)
+{
+	item->status = status;
+
+	return ret ? ret : status;
+}
+
+static int get_many(BuxtonLayer *layer, BuxtonBatchItem *items, size_t count)
+{
+	GdbmDb *db;
+	_cleanup_free_ char *buf = NULL;
+	size_t size = 0;
+	datum key_data;
+	int ret = 0;
+
+	assert(layer);
+	assert(items);
+
+	db = db_for_resource(layer);
+	for (size_t i = 0; i < count; i++) {
+		if (!db) {
+			ret = item_status(&items[i], -ENOENT, ret);
+			continue;
 		}
+		key_data = fill_key_datum(items[i].key, &buf, &size);
+		items[i].version = 0;
+		ret = item_status(&items[i],
+				  fetch_record(db, key_data, items[i].key,
+					       items[i].data, items[i].label,
+					       &items[i].version), ret);
+	}
 
-		/* size is string\0string\0 so just write, bonus for
-		   nil seperator being added without extra work */
-		key_data.dsize = (int)sz;
-		memcpy(key_data.dptr, key->group.value, key->group.length);
-		memcpy(key_data.dptr + key->group.length, key->name.value,
-		       key->name.length);
-	} else {
-		key_data.dptr = malloc(key->group.length);
-		if (!key_data.dptr) {
-			abort();
+	return ret;
+}
+
+static int set_many(BuxtonLayer *layer, BuxtonBatchItem *items, size_t count)
+{
+	GdbmDb *db;
+	_cleanup_free_ char *buf = NULL;
+	size_t size = 0;
+	datum key_data;
+	int ret = 0;
+	int err;
+
+	assert(layer);
+	assert(items);
+
+	errno = 0;
+	db = db_for_resource(layer);
+	err = !db ? ENOENT : errno;
+	for (size_t i = 0; i < count; i++) {
+		if (err) {
+			ret = item_status(&items[i], err, ret);
+			continue;
 		}
+		assert(items[i].label);
+		key_data = fill_key_datum(items[i].key, &buf, &size);
+		ret = item_status(&items[i],
+				  store_record(db, key_data, items[i].data,
+					       items[i].label), ret);
+	}
 
-		memcpy(key_data.dptr, key->group.value, key->group.length);
-		key_data.dsize = (int)key->group.length;
+	return ret;
+}
+
+static int unset_many(BuxtonLayer *layer, BuxtonBatchItem *items, size_t count)
+{
+	GdbmDb *db;
+	_cleanup_free_ char *buf = NULL;
+	size_t size = 0;
+	datum key_data;
+	int ret = 0;
+	bool readonly;
+
+	assert(layer);
+	assert(items);
+
+	errno = 0;
+	db = db_for_resource(layer);
+	readonly = !db || errno;
+	for (size_t i = 0; i < count; i++) {
+		if (readonly) {
+			ret = item_status(&items[i], EROFS, ret);
+			continue;
+		}
+		key_data = fill_key_datum(items[i].key, &buf, &size);
+		ret = item_status(&items[i], delete_record(db, key_data), ret);
 	}
 
+	return ret;
+}
+
+/* Delete every group\0name\0 key in list, returning the number removed */
+static uint32_t delete_collected(GDBM_FILE db, BuxtonList *list)
+{
+	BuxtonList *elem;
+	datum key;
+	size_t group_len;
+	uint32_t count = 0;
+
+	BUXTON_LIST_FOREACH(list, elem) {
+		key.dptr = elem->data;
+		group_len = strlen(key.dptr) + 1;
+		key.dsize = (int)(group_len + strlen(key.dptr + group_len) + 1);
+		if (gdbm_delete(db, key) == 0) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Remove a group with its members through the commit log, so that a
+ * removal cut short is finished when the layer is next opened rather
+ * than leaving members without their group
+ */
+static int remove_group(BuxtonLayer *layer,
+			_BuxtonKey *key,
+			__attribute__((unused)) BuxtonData *data,
+			__attribute__((unused)) BuxtonString *label)
+{
+	GdbmDb *db;
+	datum key_data, nextkey;
+	datum group_data;
+	datum none = {0};
+	datum commit_key, commit_value;
+	_cleanup_list_all_ BuxtonList *members = NULL;
+	_cleanup_free_ uint8_t *buf = NULL;
+	BuxtonList *elem;
+	size_t size, offset = 0;
+	uint64_t number;
+
+	assert(layer);
+	assert(key);
+	assert(!key->name.value);
+
+	/* gdbm_errno may be stale from an earlier lookup, so use errno */
 	errno = 0;
 	db = db_for_resource(layer);
-	if (!db || gdbm_errno) {
-		ret = EROFS;
-		goto end;
+	if (!db || errno || layer->readonly) {
+		return EROFS;
 	}
 
-	ret = gdbm_delete(db, key_data);
-	if (ret) {
-		if (gdbm_errno == GDBM_READER_CANT_DELETE) {
-			ret = EROFS;
-		} else if (gdbm_errno == GDBM_ITEM_NOT_FOUND) {
-			ret = ENOENT;
+	group_data.dptr = key->group.value;
+	group_data.dsize = (int)key->group.length;
+	if (!gdbm_exists(db->file, group_data)) {
+		return ENOENT;
+	}
+
+	/*
+	 * Collect the member keys before deleting anything, as removing
+	 * records while walking with gdbm_nextkey may skip entries.
+	 * Member keys are stored as group\0name\0, so matching the group
+	 * including its nil terminator is an exact group match.
+	 */
+	number = db->commits + 1;
+	commit_record(&number, &commit_key, &commit_value);
+	size = encode_log_entry(NULL, 0, group_data, none) +
+		encode_log_entry(NULL, 0, commit_key, commit_value);
+	key_data = gdbm_firstkey(db->file);
+	while (key_data.dptr) {
+		nextkey = gdbm_nextkey(db->file, key_data);
+		if (key_data.dsize > (int)key->group.length &&
+		    memcmp(key_data.dptr, key->group.value,
+			   key->group.length) == 0) {
+			if (!buxton_list_prepend(&members, key_data.dptr)) {
+				abort();
+			}
+			size += encode_log_entry(NULL, 0, key_data, none);
 		} else {
-			abort();
+			free(key_data.dptr);
 		}
+		key_data = nextkey;
 	}
 
-end:
-	free(key_data.dptr);
+	buf = malloc(size);
+	if (!buf) {
+		abort();
+	}
+	/* Members go first, the group only once they are all gone */
+	BUXTON_LIST_FOREACH(members, elem) {
+		key_data.dptr = elem->data;
+		key_data.dsize = (int)(strlen(key_data.dptr) + 1);
+		key_data.dsize += (int)strlen(key_data.dptr + key_data.dsize) + 1;
+		offset += encode_log_entry(buf + offset, GDBM_LOG_DELETE,
+					   key_data, none);
+	}
+	offset += encode_log_entry(buf + offset, GDBM_LOG_DELETE, group_data,
+				   none);
+	offset += encode_log_entry(buf + offset, GDBM_LOG_STORE, commit_key,
+				   commit_value);
 
-	return ret;
+	return run_log(db, buf, offset, number);
+}
+
+static bool sweep_orphans(BuxtonLayer *layer, uint32_t *removed)
+{
+	GdbmDb *db;
+	datum key_data, nextkey;
+	datum group_data;
+	_cleanup_list_all_ BuxtonList *orphans = NULL;
+	BuxtonString in_key;
+	uint32_t count;
+
+	assert(layer);
+	assert(removed);
+
+	errno = 0;
+	db = db_for_resource(layer);
+	if (!db || errno) {
+		return false;
+	}
+
+	key_data = gdbm_firstkey(db->file);
+	while (key_data.dptr) {
+		nextkey = gdbm_nextkey(db->file, key_data);
+		in_key.value = key_data.dptr;
+		in_key.length = (uint32_t)key_data.dsize;
+
+		/* The label table and commit number have no nil, so skip
+		 * them before looking */
+		if (is_internal_key(key_data.dptr, (size_t)key_data.dsize)) {
+			free(key_data.dptr);
+			key_data = nextkey;
+			continue;
+		}
+
+		/* Only member keys can be orphans; their group is the prefix */
+		group_data.dptr = key_data.dptr;
+		group_data.dsize = (int)strlen(key_data.dptr) + 1;
+		if (key_get_name(&in_key) && !gdbm_exists(db->file, group_data)) {
+			if (!buxton_list_prepend(&orphans, key_data.dptr)) {
+				abort();
+			}
+		} else {
+			free(key_data.dptr);
+		}
+		key_data = nextkey;
+	}
+
+	count = delete_collected(db->file, orphans);
+	if (count) {
+		gdbm_sync(db->file);
+	}
+
+	*removed = count;
+	return true;
 }
 
 static bool list_keys(BuxtonLayer *layer,
 		      BuxtonArray **list)
 {
-	GDBM_FILE db;
+	GdbmDb *db;
 	datum key, nextkey;
 	BuxtonArray *k_list = NULL;
 	BuxtonData *current = NULL;
@@ -352,14 +1102,21 @@ static bool list_keys(BuxtonLayer *layer,
 	}
 
 	k_list = buxton_array_new();
-	key = gdbm_firstkey(db);
+	key = gdbm_firstkey(db->file);
 	/* Iterate through all of the keys */
 	while (key.dptr) {
 		/* Split the key name from the rest of the key */
 		in_key.value = (char*)key.dptr;
 		in_key.length = (uint32_t)key.dsize;
-		name = key_get_name(&in_key);
+		name = NULL;
+		if (!is_internal_key(key.dptr, (size_t)key.dsize)) {
+			name = key_get_name(&in_key);
+		}
 		if (!name) {
+			/* Group records and internal records have no name */
+			nextkey = gdbm_nextkey(db->file, key);
+			free(key.dptr);
+			key = nextkey;
 			continue;
 		}
 
@@ -378,7 +1135,7 @@ static bool list_keys(BuxtonLayer *layer,
 		}
 
 		/* Visit the next key */
-		nextkey = gdbm_nextkey(db, key);
+		nextkey = gdbm_nextkey(db->file, key);
 		free(key.dptr);
 		key = nextkey;
 	}
@@ -402,17 +1159,270 @@ end:
 	return ret;
 }
 
+struct BuxtonCursor {
+	GdbmDb *db; /**<Database being walked */
+	datum key; /**<Next key to visit, NULL once done */
+	char *group; /**<Only visit keys with this group\0 prefix, or NULL */
+	uint32_t group_len; /**<Length of group including its nil */
+	uint32_t flags; /**<BUXTON_CURSOR_* flags */
+	char **held; /**<Keys, values and records handed out last batch */
+	size_t held_count; /**<Number of pointers in held */
+	size_t held_size; /**<Allocated pointers in held */
+};
+
+static void cursor_release(BuxtonCursor *cursor)
+{
+	for (size_t i = 0; i < cursor->held_count; i++) {
+		free(cursor->held[i]);
+	}
+	cursor->held_count = 0;
+}
+
+/* Fill view from key, returning false for records the walk skips */
+static bool cursor_view(BuxtonCursor *cursor, datum key,
+			BuxtonRecordView *view)
+{
+	BuxtonString in_key;
+	datum value;
+	char *name;
+	bool valid;
+
+	if (is_internal_key(key.dptr, (size_t)key.dsize)) {
+		return false;
+	}
+	if (cursor->group &&
+	    (key.dsize < (int)cursor->group_len ||
+	     memcmp(key.dptr, cursor->group, cursor->group_len) != 0)) {
+		return false;
+	}
+
+	memzero(view, sizeof(BuxtonRecordView));
+	in_key.value = key.dptr;
+	in_key.length = (uint32_t)key.dsize;
+	name = key_get_name(&in_key);
+	view->group.value = key.dptr;
+	view->group.length = (uint32_t)strlen(key.dptr) + 1;
+	if (name) {
+		view->name.value = name;
+		view->name.length = (uint32_t)strlen(name) + 1;
+	}
+	if (!(cursor->flags & BUXTON_CURSOR_VALUES)) {
+		return true;
+	}
+
+	value = gdbm_fetch(cursor->db->file, key);
+	if (!value.dptr) {
+		/* Deleted since the walk passed it */
+		return false;
+	}
+	valid = buxton_deserialize_record((uint8_t *)value.dptr,
+					  (size_t)value.dsize,
+					  &cursor->db->labels, &view->data,
+					  &view->label, &view->version);
+	if (!valid) {
+		buxton_log("Skipping invalid record %s\n", key.dptr);
+		free(value.dptr);
+		return false;
+	}
+	if (view->data.type == STRING) {
+		cursor->held[cursor->held_count++] = view->data.store.d_string.value;
+	}
+	/* Old records' labels are borrowed from the value itself */
+	cursor->held[cursor->held_count++] = value.dptr;
+
+	return true;
+}
+
+static BuxtonCursor *cursor_open(BuxtonLayer *layer, BuxtonString *group,
+				 uint32_t flags)
+{
+	BuxtonCursor *cursor;
+	GdbmDb *db;
+
+	assert(layer);
+
+	db = db_for_resource(layer);
+	if (!db) {
+		return NULL;
+	}
+
+	cursor = malloc0(sizeof(BuxtonCursor));
+	if (!cursor) {
+		abort();
+	}
+	cursor->db = db;
+	cursor->db->cursors++;
+	cursor->flags = flags;
+	if (group) {
+		cursor->group = malloc(group->length);
+		if (!cursor->group) {
+			abort();
+		}
+		memcpy(cursor->group, group->value, group->length);
+		cursor->group_len = group->length;
+	}
+	cursor->key = gdbm_firstkey(db->file);
+
+	return cursor;
+}
+
+static bool cursor_next(BuxtonCursor *cursor, BuxtonRecordView *records,
+			size_t max, size_t *count)
+{
+	datum key;
+	size_t n = 0;
+
+	assert(cursor);
+	assert(records);
+	assert(count);
+
+	cursor_release(cursor);
+	/* Each record holds at most its key, a string value and itself */
+	if (max * 3 > cursor->held_size) {
+		char **h = realloc(cursor->held, max * 3 * sizeof(char *));
+		if (!h) {
+			abort();
+		}
+		cursor->held = h;
+		cursor->held_size = max * 3;
+	}
+
+	while (n < max && cursor->key.dptr) {
+		key = cursor->key;
+		cursor->key = gdbm_nextkey(cursor->db->file, key);
+		if (!cursor_view(cursor, key, &records[n])) {
+			free(key.dptr);
+			continue;
+		}
+		cursor->held[cursor->held_count++] = key.dptr;
+		n++;
+	}
+
+	*count = n;
+	return true;
+}
+
+static void cursor_close(BuxtonCursor *cursor)
+{
+	if (!cursor) {
+		return;
+	}
+	cursor_release(cursor);
+	cursor->db->cursors--;
+	free(cursor->held);
+	free(cursor->key.dptr);
+	free(cursor->group);
+	free(cursor);
+}
+
+static int commit(BuxtonLayer *layer, BuxtonChange *changes, size_t count)
+{
+	GdbmDb *db;
+	_cleanup_free_ datum *keys = NULL;
+	_cleanup_free_ datum *values = NULL;
+	_cleanup_free_ uint8_t *buf = NULL;
+	_cleanup_free_ uint8_t *table = NULL;
+	datum table_key, table_value = {0};
+	datum commit_key, commit_value;
+	uint16_t label_id, label_count;
+	bool added, labels_added = false;
+	size_t size = 0, offset = 0;
+	uint64_t number;
+	int ret = 0;
+
+	assert(layer);
+	assert(changes);
+	assert(count);
+
+	errno = 0;
+	db = db_for_resource(layer);
+	if (!db || errno) {
+		return EROFS;
+	}
+
+	keys = new0(datum, count);
+	values = new0(datum, count);
+	if (!keys || !values) {
+		abort();
+	}
+
+	label_count = db->labels.count;
+	for (size_t i = 0; i < count; i++) {
+		BuxtonChange *c = &changes[i];
+		uint8_t *data_store = NULL;
+
+		keys[i] = key_datum(c->key);
+		if (c->data) {
+			assert(c->label);
+			if (buxton_label_table_intern(&db->labels, c->label,
+						      &label_id, &added)) {
+				labels_added |= added;
+				values[i].dsize = (int)buxton_serialize_record(c->data,
+									       label_id,
+									       buxton_record_next_version(),
+									       &data_store);
+			} else {
+				values[i].dsize = (int)buxton_serialize(c->data,
+									c->label,
+									&data_store);
+			}
+			values[i].dptr = (char *)data_store;
+		}
+		size += encode_log_entry(NULL, 0, keys[i], values[i]);
+	}
+
+	/* Records with new labels need the table that holds them */
+	table_key.dptr = BUXTON_LABEL_TABLE_KEY;
+	table_key.dsize = (int)BUXTON_LABEL_TABLE_KEY_LENGTH;
+	if (labels_added) {
+		table_value.dsize = (int)buxton_label_table_serialize(&db->labels,
+								      &table);
+		table_value.dptr = (char *)table;
+		size += encode_log_entry(NULL, 0, table_key, table_value);
+	}
+	number = db->commits + 1;
+	commit_record(&number, &commit_key, &commit_value);
+	size += encode_log_entry(NULL, 0, commit_key, commit_value);
+
+	buf = malloc(size);
+	if (!buf) {
+		abort();
+	}
+	if (labels_added) {
+		offset += encode_log_entry(buf, GDBM_LOG_STORE, table_key,
+					   table_value);
+	}
+	for (size_t i = 0; i < count; i++) {
+		offset += encode_log_entry(buf + offset,
+					   values[i].dptr ? GDBM_LOG_STORE :
+					   GDBM_LOG_DELETE,
+					   keys[i], values[i]);
+	}
+	(void)encode_log_entry(buf + offset, GDBM_LOG_STORE, commit_key,
+			       commit_value);
+
+	ret = run_log(db, buf, size, number);
+	if (ret) {
+		/* The table is read again if the log is, so drop them now */
+		buxton_label_table_truncate(&db->labels, label_count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(keys[i].dptr);
+		free(values[i].dptr);
+	}
+
+	return ret;
+}
+
 _bx_export_ void buxton_module_destroy(void)
 {
-	const char *key;
 	Iterator iterator;
-	GDBM_FILE db;
+	GdbmDb *db;
 
 	/* close all gdbm handles */
-	HASHMAP_FOREACH_KEY(db, key, _resources, iterator) {
-		hashmap_remove(_resources, key);
-		gdbm_close(db);
-		free((void *)key);
+	HASHMAP_FOREACH(db, _resources, iterator) {
+		close_db(db);
 	}
 	hashmap_free(_resources);
 	_resources = NULL;
@@ -426,14 +1436,30 @@ _bx_export_ bool buxton_module_init(BuxtonBackend *backend)
 	/* Point the struct methods back to our own */
 	backend->set_value = &set_value;
 	backend->get_value = &get_value;
+	backend->get_versioned_value = &get_versioned_value;
 	backend->list_keys = &list_keys;
 	backend->unset_value = &unset_value;
+	backend->remove_group = &remove_group;
+	backend->sweep_orphans = &sweep_orphans;
+	backend->commit = &commit;
+	backend->version = BUXTON_BACKEND_VERSION;
+	backend->get_many = &get_many;
+	backend->set_many = &set_many;
+	backend->unset_many = &unset_many;
+	backend->cursor_open = &cursor_open;
+	backend->cursor_next = &cursor_next;
+	backend->cursor_close = &cursor_close;
+	backend->sync = NULL;
 	backend->create_db = (module_db_init_func) &db_for_resource;
 
 	_resources = hashmap_new(string_hash_func, string_compare_func);
 	if (!_resources) {
 		abort();
 	}
+	LIST_HEAD_INIT(GdbmDb, _lru);
+	_open_count = 0;
+	_max_open = (unsigned int)strtoul(buxton_max_open_databases(), NULL, 10);
+	_cache_size = (size_t)strtoul(buxton_database_cache_size(), NULL, 10);
 
 	return true;
 }
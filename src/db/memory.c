@@ -15,11 +15,19 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "hashmap.h"
 #include "log.h"
 #include "buxton.h"
 #include "backend.h"
+#include "serialize.h"
 #include "util.h"
 
 /**
@@ -27,16 +35,638 @@
  *
  * Used for quick testing and debugging of Buxton, to ensure protocol
  * and direct access are working as intended.
- * Note this is not persistent.
+ * Note this is not persistent, unless the layer sets Snapshot=true.
+ *
+ * Each layer is a single open-addressing table of fixed size entries.
+ * Keys, labels and string values that don't fit inline live in one
+ * byte arena per layer, referenced by offset. Labels are interned, as
+ * nearly all keys share a handful of them. Space freed in the arena is
+ * reclaimed by compacting once it outweighs the live data.
+ *
+ * A snapshot is the header below followed by the raw table, arena and
+ * label slots, so loading one needs no rehashing or re-interning.
  */
 
+#define MEMORY_SLOT_EMPTY 0
+#define MEMORY_SLOT_DELETED 1
+#define MEMORY_MIN_SLOTS 16
+#define MEMORY_INLINE_SIZE 8
+#define MEMORY_COMPACT_MIN 4096
+#define MEMORY_SNAPSHOT_MAGIC "BXMEMv2\n"
+#define MEMORY_SNAPSHOT_MAGIC_LENGTH 8
+
+typedef struct MemoryEntry {
+	uint32_t hash; /**<Key hash, or MEMORY_SLOT_EMPTY/DELETED */
+	uint32_t key; /**<Arena offset of group\0 or group\0name\0 */
+	uint32_t key_len; /**<Length of key including separators */
+	uint32_t label; /**<Arena offset of the interned label */
+	uint16_t label_len; /**<Length of label */
+	uint16_t type; /**<BuxtonDataType of the value */
+	uint32_t value_len; /**<Length of a string value */
+	union {
+		uint8_t inline_data[MEMORY_INLINE_SIZE]; /**<Small values */
+		uint32_t offset; /**<Arena offset of a large string */
+	} value;
+	uint64_t version; /**<Version of the value */
+} MemoryEntry;
+
+/* Snapshots hold the table as is, so the layout has no padding to leak */
+__extension__ _Static_assert(sizeof(MemoryEntry) == 40,
+			     "MemoryEntry isn't 40 bytes");
+
+typedef struct MemoryDb {
+	MemoryEntry *entries; /**<Open-addressing table */
+	uint32_t size; /**<Number of slots, always a power of two */
+	uint32_t count; /**<Live entries */
+	uint32_t deleted; /**<Deleted slots awaiting a rehash */
+	uint8_t *arena; /**<Backing store for variable length data */
+	uint32_t arena_used; /**<Bytes handed out from the arena */
+	size_t arena_allocated; /**<Allocated size of the arena */
+	uint32_t arena_dead; /**<Bytes no longer referenced */
+	uint32_t *labels; /**<Interned label offsets, 0 when empty */
+	uint32_t labels_size; /**<Number of label slots */
+	uint32_t labels_count; /**<Interned labels */
+	char *path; /**<Snapshot file, NULL when the layer is volatile */
+	bool dirty; /**<Changed since the last snapshot */
+} MemoryDb;
+
+typedef struct MemorySnapshotHeader {
+	char magic[MEMORY_SNAPSHOT_MAGIC_LENGTH]; /**<MEMORY_SNAPSHOT_MAGIC */
+	uint32_t size; /**<Number of table slots */
+	uint32_t count; /**<Live entries */
+	uint32_t arena_used; /**<Bytes of arena */
+	uint32_t labels_size; /**<Number of label slots */
+	uint32_t labels_count; /**<Interned labels */
+	uint32_t entry_size; /**<sizeof(MemoryEntry) when written */
+} MemorySnapshotHeader;
 
 static Hashmap *_resources;
 
-/* Return existing hashmap or create new hashmap on the fly */
-static Hashmap *_db_for_resource(BuxtonLayer *layer)
+static uint32_t hash_bytes(const uint8_t *p, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a */
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	/* Reserve the empty and deleted markers */
+	if (hash <= MEMORY_SLOT_DELETED) {
+		hash += 2;
+	}
+	return hash;
+}
+
+static uint32_t arena_add(MemoryDb *db, const void *data, uint32_t len)
+{
+	uint32_t offset = db->arena_used;
+
+	size_t need = (size_t)db->arena_used + len;
+	void *p;
+
+	if (UINT32_MAX - db->arena_used < len) {
+		abort();
+	}
+	/* Grow by half rather than doubling, the arena is the bulk of a layer */
+	if (need > db->arena_allocated) {
+		need = MAX(need + need / 2, (size_t)MEMORY_COMPACT_MIN);
+		p = realloc(db->arena, need);
+		if (!p) {
+			abort();
+		}
+		db->arena = p;
+		db->arena_allocated = need;
+	}
+	memcpy(db->arena + offset, data, len);
+	db->arena_used += len;
+
+	return offset;
+}
+
+static void labels_resize(MemoryDb *db, uint32_t size)
+{
+	uint32_t *old = db->labels;
+	uint32_t old_size = db->labels_size;
+	uint32_t i, slot, offset;
+	uint16_t len;
+
+	db->labels = calloc(size, sizeof(uint32_t));
+	if (!db->labels) {
+		abort();
+	}
+	db->labels_size = size;
+	db->labels_count = 0;
+
+	for (i = 0; i < old_size; i++) {
+		offset = old[i];
+		if (!offset) {
+			continue;
+		}
+		memcpy(&len, db->arena + offset, sizeof(uint16_t));
+		slot = hash_bytes(db->arena + offset + sizeof(uint16_t), len) &
+			(size - 1);
+		while (db->labels[slot]) {
+			slot = (slot + 1) & (size - 1);
+		}
+		db->labels[slot] = offset;
+		db->labels_count++;
+	}
+	free(old);
+}
+
+/*
+ * Labels are stored as a u16 length followed by the bytes. The returned
+ * offset points at the bytes, so that offset 0 never names a label.
+ */
+static uint32_t intern_label(MemoryDb *db, const char *label, uint16_t len)
+{
+	uint32_t slot, offset;
+	uint16_t stored;
+
+	if ((db->labels_count + 1) * 2 > db->labels_size) {
+		labels_resize(db, db->labels_size ? db->labels_size * 2 :
+			      MEMORY_MIN_SLOTS);
+	}
+
+	slot = hash_bytes((const uint8_t *)label, len) & (db->labels_size - 1);
+	while ((offset = db->labels[slot])) {
+		memcpy(&stored, db->arena + offset, sizeof(uint16_t));
+		if (stored == len &&
+		    memcmp(db->arena + offset + sizeof(uint16_t), label, len) == 0) {
+			return offset + (uint32_t)sizeof(uint16_t);
+		}
+		slot = (slot + 1) & (db->labels_size - 1);
+	}
+
+	/* Keep offset 0 out of use so it can mark empty label slots */
+	if (db->arena_used == 0) {
+		(void)arena_add(db, "", 1);
+	}
+	offset = arena_add(db, &len, sizeof(uint16_t));
+	(void)arena_add(db, label, len);
+	db->labels[slot] = offset;
+	db->labels_count++;
+
+	return offset + (uint32_t)sizeof(uint16_t);
+}
+
+/* Index of the slot holding key, or the free slot it would go in */
+static uint32_t find_slot(MemoryDb *db, const char *key, uint32_t key_len,
+			  uint32_t hash, bool *found)
+{
+	uint32_t slot = hash & (db->size - 1);
+	uint32_t free_slot = UINT32_MAX;
+	MemoryEntry *e;
+
+	*found = false;
+	while (true) {
+		e = &db->entries[slot];
+		if (e->hash == MEMORY_SLOT_EMPTY) {
+			break;
+		}
+		if (e->hash == MEMORY_SLOT_DELETED) {
+			if (free_slot == UINT32_MAX) {
+				free_slot = slot;
+			}
+		} else if (e->hash == hash && e->key_len == key_len &&
+			   memcmp(db->arena + e->key, key, key_len) == 0) {
+			*found = true;
+			return slot;
+		}
+		slot = (slot + 1) & (db->size - 1);
+	}
+
+	return free_slot != UINT32_MAX ? free_slot : slot;
+}
+
+static MemoryEntry *lookup(MemoryDb *db, const char *key, uint32_t key_len)
+{
+	uint32_t slot;
+	bool found;
+
+	if (!db->count) {
+		return NULL;
+	}
+
+	slot = find_slot(db, key, key_len,
+			 hash_bytes((const uint8_t *)key, key_len), &found);
+	return found ? &db->entries[slot] : NULL;
+}
+
+static void table_resize(MemoryDb *db, uint32_t size)
+{
+	MemoryEntry *old = db->entries;
+	uint32_t old_size = db->size;
+	uint32_t slot;
+
+	db->entries = calloc(size, sizeof(MemoryEntry));
+	if (!db->entries) {
+		abort();
+	}
+	db->size = size;
+	db->deleted = 0;
+
+	for (uint32_t i = 0; i < old_size; i++) {
+		if (old[i].hash <= MEMORY_SLOT_DELETED) {
+			continue;
+		}
+		slot = old[i].hash & (size - 1);
+		while (db->entries[slot].hash != MEMORY_SLOT_EMPTY) {
+			slot = (slot + 1) & (size - 1);
+		}
+		db->entries[slot] = old[i];
+	}
+	free(old);
+}
+
+static inline bool value_inline(MemoryEntry *e)
+{
+	return e->type != STRING || e->value_len <= MEMORY_INLINE_SIZE;
+}
+
+/* Copy every live byte into a fresh arena, dropping unused labels */
+static void arena_compact(MemoryDb *db)
+{
+	uint8_t *old = db->arena;
+	uint32_t *old_labels = db->labels;
+	MemoryEntry *e;
+
+	db->arena = NULL;
+	db->arena_used = 0;
+	db->arena_allocated = 0;
+	db->arena_dead = 0;
+	db->labels = NULL;
+	db->labels_size = 0;
+	db->labels_count = 0;
+
+	for (uint32_t i = 0; i < db->size; i++) {
+		e = &db->entries[i];
+		if (e->hash <= MEMORY_SLOT_DELETED) {
+			continue;
+		}
+		e->label = intern_label(db, (char *)old + e->label,
+					e->label_len);
+		e->key = arena_add(db, old + e->key, e->key_len);
+		if (!value_inline(e)) {
+			e->value.offset = arena_add(db, old + e->value.offset,
+						    e->value_len);
+		}
+	}
+
+	free(old);
+	free(old_labels);
+}
+
+static void release_value(MemoryDb *db, MemoryEntry *e)
+{
+	if (!value_inline(e)) {
+		db->arena_dead += e->value_len;
+	}
+}
+
+static void maybe_compact(MemoryDb *db)
+{
+	if (db->arena_dead > MEMORY_COMPACT_MIN &&
+	    db->arena_dead > db->arena_used / 2) {
+		arena_compact(db);
+	}
+}
+
+static void store_value(MemoryDb *db, MemoryEntry *e, BuxtonData *data)
 {
-	Hashmap *db;
+	e->type = (uint16_t)data->type;
+	e->value_len = 0;
+
+	switch (data->type) {
+	case STRING:
+		e->value_len = data->store.d_string.length;
+		if (e->value_len <= MEMORY_INLINE_SIZE) {
+			memcpy(e->value.inline_data, data->store.d_string.value,
+			       e->value_len);
+		} else {
+			e->value.offset = arena_add(db,
+						    data->store.d_string.value,
+						    e->value_len);
+		}
+		break;
+	case INT32:
+		memcpy(e->value.inline_data, &data->store.d_int32, sizeof(int32_t));
+		break;
+	case UINT32:
+		memcpy(e->value.inline_data, &data->store.d_uint32, sizeof(uint32_t));
+		break;
+	case INT64:
+		memcpy(e->value.inline_data, &data->store.d_int64, sizeof(int64_t));
+		break;
+	case UINT64:
+		memcpy(e->value.inline_data, &data->store.d_uint64, sizeof(uint64_t));
+		break;
+	case FLOAT:
+		memcpy(e->value.inline_data, &data->store.d_float, sizeof(float));
+		break;
+	case DOUBLE:
+		memcpy(e->value.inline_data, &data->store.d_double, sizeof(double));
+		break;
+	case BOOLEAN:
+		memcpy(e->value.inline_data, &data->store.d_boolean, sizeof(bool));
+		break;
+	default:
+		abort();
+	}
+}
+
+static void load_value(MemoryDb *db, MemoryEntry *e, BuxtonData *data)
+{
+	data->type = (BuxtonDataType)e->type;
+
+	switch (data->type) {
+	case STRING:
+		data->store.d_string.value = malloc(e->value_len);
+		if (!data->store.d_string.value) {
+			abort();
+		}
+		memcpy(data->store.d_string.value, value_inline(e) ?
+		       e->value.inline_data : db->arena + e->value.offset,
+		       e->value_len);
+		data->store.d_string.length = e->value_len;
+		break;
+	case INT32:
+		memcpy(&data->store.d_int32, e->value.inline_data, sizeof(int32_t));
+		break;
+	case UINT32:
+		memcpy(&data->store.d_uint32, e->value.inline_data, sizeof(uint32_t));
+		break;
+	case INT64:
+		memcpy(&data->store.d_int64, e->value.inline_data, sizeof(int64_t));
+		break;
+	case UINT64:
+		memcpy(&data->store.d_uint64, e->value.inline_data, sizeof(uint64_t));
+		break;
+	case FLOAT:
+		memcpy(&data->store.d_float, e->value.inline_data, sizeof(float));
+		break;
+	case DOUBLE:
+		memcpy(&data->store.d_double, e->value.inline_data, sizeof(double));
+		break;
+	case BOOLEAN:
+		memcpy(&data->store.d_boolean, e->value.inline_data, sizeof(bool));
+		break;
+	default:
+		abort();
+	}
+}
+
+static void load_label(MemoryDb *db, MemoryEntry *e, BuxtonString *label)
+{
+	label->value = malloc((size_t)e->label_len + 1);
+	if (!label->value) {
+		abort();
+	}
+	memcpy(label->value, db->arena + e->label, e->label_len);
+	label->value[e->label_len] = '\0';
+	label->length = (uint32_t)e->label_len + 1;
+}
+
+static void remove_entry(MemoryDb *db, MemoryEntry *e)
+{
+	release_value(db, e);
+	db->arena_dead += e->key_len;
+	e->hash = MEMORY_SLOT_DELETED;
+	db->count--;
+	db->deleted++;
+}
+
+static void free_db(MemoryDb *db)
+{
+	free(db->entries);
+	free(db->arena);
+	free(db->labels);
+	free(db->path);
+	free(db);
+}
+
+static bool snapshot_valid(MemorySnapshotHeader *header, uint8_t *data,
+			   size_t size)
+{
+	uint8_t *arena, *labels;
+	uint32_t label;
+	uint16_t len;
+	MemoryEntry entry;
+	size_t expected;
+	uint32_t count = 0;
+	uint32_t label_count = 0;
+	uint32_t end = header->arena_used;
+
+	if (memcmp(header->magic, MEMORY_SNAPSHOT_MAGIC,
+		   MEMORY_SNAPSHOT_MAGIC_LENGTH) != 0 ||
+	    header->entry_size != sizeof(MemoryEntry)) {
+		return false;
+	}
+	if (header->size < MEMORY_MIN_SLOTS ||
+	    (header->size & (header->size - 1)) ||
+	    (header->labels_size & (header->labels_size - 1))) {
+		return false;
+	}
+	expected = (size_t)header->size * sizeof(MemoryEntry) +
+		header->arena_used +
+		(size_t)header->labels_size * sizeof(uint32_t);
+	if (size != expected) {
+		return false;
+	}
+
+	/* Every offset has to land inside the arena */
+	for (uint32_t i = 0; i < header->size; i++) {
+		MemoryEntry *e = &entry;
+
+		memcpy(e, data + (size_t)i * sizeof(MemoryEntry),
+		       sizeof(MemoryEntry));
+		if (e->hash <= MEMORY_SLOT_DELETED) {
+			continue;
+		}
+		count++;
+		if (e->type <= BUXTON_TYPE_MIN || e->type >= BUXTON_TYPE_MAX ||
+		    e->key > end || e->key_len > end - e->key ||
+		    e->label > end || e->label_len > end - e->label) {
+			return false;
+		}
+		if ((e->type != STRING || e->value_len > MEMORY_INLINE_SIZE) &&
+		    (e->value.offset > end ||
+		     e->value_len > end - e->value.offset)) {
+			return false;
+		}
+	}
+
+	/* Label slots aren't aligned in the file, and each length is read */
+	arena = data + (size_t)header->size * sizeof(MemoryEntry);
+	labels = arena + header->arena_used;
+	for (uint32_t i = 0; i < header->labels_size; i++) {
+		memcpy(&label, labels + (size_t)i * sizeof(uint32_t),
+		       sizeof(uint32_t));
+		if (!label) {
+			continue;
+		}
+		label_count++;
+		if (label >= end || end - label < sizeof(uint16_t)) {
+			return false;
+		}
+		memcpy(&len, arena + label, sizeof(uint16_t));
+		if (len > end - label - sizeof(uint16_t)) {
+			return false;
+		}
+	}
+
+	return count == header->count && label_count == header->labels_count;
+}
+
+/* Fill db from the snapshot at db->path, leaving it empty on failure */
+static void load_snapshot(MemoryDb *db)
+{
+	MemorySnapshotHeader header;
+	struct stat st;
+	uint8_t *map;
+	uint8_t *data;
+	size_t size;
+	int fd;
+
+	fd = open(db->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(MemorySnapshotHeader)) {
+		close(fd);
+		return;
+	}
+
+	size = (size_t)st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		buxton_log("mmap(): %m\n");
+		return;
+	}
+	(void)madvise(map, size, MADV_SEQUENTIAL);
+
+	memcpy(&header, map, sizeof(MemorySnapshotHeader));
+	data = map + sizeof(MemorySnapshotHeader);
+	size -= sizeof(MemorySnapshotHeader);
+	if (!snapshot_valid(&header, data, size)) {
+		buxton_log("Ignoring invalid snapshot %s\n", db->path);
+		goto end;
+	}
+
+	/*
+	 * The table and arena are copied out of the mapping rather than
+	 * used in place, as both are grown with realloc later on
+	 */
+	free(db->entries);
+	db->entries = malloc((size_t)header.size * sizeof(MemoryEntry));
+	db->arena_allocated = MAX((size_t)header.arena_used,
+				  (size_t)MEMORY_COMPACT_MIN);
+	db->arena = malloc(db->arena_allocated);
+	db->labels = NULL;
+	if (header.labels_size) {
+		db->labels = malloc((size_t)header.labels_size *
+				    sizeof(uint32_t));
+	}
+	if (!db->entries || !db->arena ||
+	    (header.labels_size && !db->labels)) {
+		abort();
+	}
+
+	memcpy(db->entries, data, (size_t)header.size * sizeof(MemoryEntry));
+	data += (size_t)header.size * sizeof(MemoryEntry);
+	memcpy(db->arena, data, header.arena_used);
+	data += header.arena_used;
+	if (header.labels_size) {
+		memcpy(db->labels, data, (size_t)header.labels_size *
+		       sizeof(uint32_t));
+	}
+
+	db->size = header.size;
+	db->count = header.count;
+	db->deleted = 0;
+	db->arena_used = header.arena_used;
+	db->arena_dead = 0;
+	db->labels_size = header.labels_size;
+	db->labels_count = header.labels_count;
+
+end:
+	munmap(map, (size_t)st.st_size);
+}
+
+static bool write_snapshot(MemoryDb *db)
+{
+	_cleanup_free_ char *tmp = NULL;
+	MemorySnapshotHeader header;
+	bool ret = false;
+	int fd;
+
+	assert(db->path);
+
+	/* Written snapshots carry no dead bytes or deleted slots */
+	if (db->arena_dead) {
+		arena_compact(db);
+	}
+	if (db->deleted) {
+		table_resize(db, db->size);
+	}
+
+	memset(&header, 0, sizeof(MemorySnapshotHeader));
+	memcpy(header.magic, MEMORY_SNAPSHOT_MAGIC,
+	       MEMORY_SNAPSHOT_MAGIC_LENGTH);
+	header.size = db->size;
+	header.count = db->count;
+	header.arena_used = db->arena_used;
+	header.labels_size = db->labels_size;
+	header.labels_count = db->labels_count;
+	header.entry_size = sizeof(MemoryEntry);
+
+	if (asprintf(&tmp, "%s.tmp", db->path) == -1) {
+		abort();
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		buxton_log("Couldn't write snapshot %s: %m\n", tmp);
+		return false;
+	}
+	if (_write(fd, (uint8_t *)&header, sizeof(MemorySnapshotHeader)) &&
+	    _write(fd, (uint8_t *)db->entries,
+		   (size_t)db->size * sizeof(MemoryEntry)) &&
+	    (!db->arena_used || _write(fd, db->arena, db->arena_used)) &&
+	    (!db->labels_size || _write(fd, (uint8_t *)db->labels,
+					(size_t)db->labels_size *
+					sizeof(uint32_t))) &&
+	    fsync(fd) == 0) {
+		ret = true;
+	}
+	close(fd);
+
+	if (!ret || rename(tmp, db->path) == -1) {
+		buxton_log("Couldn't replace snapshot %s: %m\n", db->path);
+		unlink(tmp);
+		return false;
+	}
+	db->dirty = false;
+
+	return true;
+}
+
+/* Note a change, for the next sync to write out */
+static void mark_dirty(MemoryDb *db)
+{
+	if (db->path) {
+		db->dirty = true;
+	}
+}
+
+/* Return existing table or create new table on the fly */
+static MemoryDb *_db_for_resource(BuxtonLayer *layer)
+{
+	MemoryDb *db;
 	char *name = NULL;
 	int r;
 
@@ -54,7 +684,18 @@ static Hashmap *_db_for_resource(BuxtonLayer *layer)
 
 	db = hashmap_get(_resources, name);
 	if (!db) {
-		db = hashmap_new(string_hash_func, string_compare_func);
+		db = malloc0(sizeof(MemoryDb));
+		if (!db) {
+			abort();
+		}
+		table_resize(db, MEMORY_MIN_SLOTS);
+		if (layer->snapshot) {
+			db->path = get_layer_path(layer);
+			if (!db->path) {
+				abort();
+			}
+			load_snapshot(db);
+		}
 		hashmap_put(_resources, name, db);
 	} else {
 		free(name);
@@ -63,118 +704,171 @@ static Hashmap *_db_for_resource(BuxtonLayer *layer)
 	return db;
 }
 
-static int set_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
-		      BuxtonString *label)
+/* Build the group\0 or group\0name\0 lookup key for key into buf */
+static uint32_t build_key(_BuxtonKey *key, char **buf, uint32_t *size)
 {
-	Hashmap *db;
-	BuxtonArray *array = NULL;
-	BuxtonArray *stored;
-	BuxtonData *data_copy = NULL;
-	BuxtonData *d;
-	BuxtonString *label_copy = NULL;
-	BuxtonString *l;
-	char *full_key = NULL;
-	char *k;
-	int ret;
+	uint32_t key_len;
 
-	assert(layer);
-	assert(key);
-	assert(label);
-
-	db = _db_for_resource(layer);
-	if (!db) {
-		ret = ENOENT;
-		goto end;
+	if (key->name.value) {
+		key_len = key->group.length + key->name.length;
+	} else {
+		key_len = key->group.length;
 	}
 
-	if (key->name.value) {
-		if (asprintf(&full_key, "%s%s", key->group.value, key->name.value) == -1) {
+	/* Batches reuse one buffer for all their keys */
+	if (key_len > *size) {
+		char *k = realloc(*buf, key_len);
+		if (!k) {
 			abort();
 		}
-	} else {
-		full_key = strdup(key->group.value);
-		if (!full_key) {
-			abort();
+		*buf = k;
+		*size = key_len;
+	}
+	memcpy(*buf, key->group.value, key->group.length);
+	if (key->name.value) {
+		memcpy(*buf + key->group.length, key->name.value,
+		       key->name.length);
+	}
+
+	return key_len;
+}
+
+/* Build the group\0 or group\0name\0 lookup key for key */
+static char *make_key(_BuxtonKey *key, uint32_t *key_len)
+{
+	char *k = NULL;
+	uint32_t size = 0;
+
+	*key_len = build_key(key, &k, &size);
+
+	return k;
+}
+
+/* Make room for count more entries, so probing finds a free slot */
+static void reserve_entries(MemoryDb *db, uint32_t count)
+{
+	if ((db->count + db->deleted + count) * 5 > db->size * 4) {
+		uint32_t size = db->size;
+
+		while ((db->count + count) * 2 >= size) {
+			size *= 2;
 		}
+		table_resize(db, size);
 	}
+}
+
+static int store_entry(MemoryDb *db, const char *full_key, uint32_t key_len,
+		       BuxtonData *data, BuxtonString *label)
+{
+	MemoryEntry *e;
+	BuxtonData cdata = {0};
+	uint32_t hash, slot, label_off;
+	uint16_t label_len;
+	bool found;
+
+	hash = hash_bytes((const uint8_t *)full_key, key_len);
+	slot = find_slot(db, full_key, key_len, hash, &found);
+	e = &db->entries[slot];
 
 	if (!data) {
-		stored = (BuxtonArray *)hashmap_get(db, full_key);
-		if (!stored) {
-			ret = ENOENT;
-			free(full_key);
-			goto end;
+		if (!found) {
+			return ENOENT;
 		}
-		data = buxton_array_get(stored, 0);
+		/* set_label keeps the stored value and its version */
+		load_value(db, e, &cdata);
+		data = &cdata;
+	} else {
+		e->version = buxton_record_next_version();
 	}
 
-	array = buxton_array_new();
-	if (!array) {
-		abort();
-	}
-	data_copy = malloc0(sizeof(BuxtonData));
-	if (!data_copy) {
-		abort();
+	label_len = (uint16_t)label->length;
+	if (label_len && label->value[label_len - 1] == '\0') {
+		label_len--;
 	}
-	label_copy = malloc0(sizeof(BuxtonString));
-	if (!label_copy) {
-		abort();
+	label_off = intern_label(db, label->value, label_len);
+
+	if (found) {
+		release_value(db, e);
+	} else {
+		if (e->hash == MEMORY_SLOT_DELETED) {
+			db->deleted--;
+		}
+		e->hash = hash;
+		e->key = arena_add(db, full_key, key_len);
+		e->key_len = key_len;
+		db->count++;
 	}
+	e->label = label_off;
+	e->label_len = label_len;
+	store_value(db, e, data);
 
-	if (!buxton_data_copy(data, data_copy)) {
-		abort();
+	if (cdata.type == STRING) {
+		free(cdata.store.d_string.value);
 	}
-	if (!buxton_string_copy(label, label_copy)) {
-		abort();
+	return 0;
+}
+
+static int set_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
+		      BuxtonString *label)
+{
+	MemoryDb *db;
+	_cleanup_free_ char *full_key = NULL;
+	uint32_t key_len;
+	int ret;
+
+	assert(layer);
+	assert(key);
+	assert(label);
+
+	db = _db_for_resource(layer);
+	if (!db) {
+		return ENOENT;
 	}
-	if (!buxton_array_add(array, data_copy)) {
-		abort();
+
+	full_key = make_key(key, &key_len);
+
+	/* Grow before probing so the slot found stays valid */
+	reserve_entries(db, 1);
+	ret = store_entry(db, full_key, key_len, data, label);
+	if (ret) {
+		return ret;
 	}
-	if (!buxton_array_add(array, label_copy)) {
-		abort();
+	maybe_compact(db);
+	mark_dirty(db);
+
+	return 0;
+}
+
+static int fetch_entry(MemoryDb *db, _BuxtonKey *key, const char *full_key,
+		       uint32_t key_len, BuxtonData *data,
+		       BuxtonString *label, uint64_t *version)
+{
+	MemoryEntry *e;
+
+	e = lookup(db, full_key, key_len);
+	if (!e) {
+		return ENOENT;
 	}
-	if (!buxton_array_add(array, full_key)) {
-		abort();
+	if (e->type != key->type) {
+		return EINVAL;
 	}
 
-	ret = hashmap_put(db, full_key, array);
-	if (ret != 1) {
-		if (ret == -ENOMEM) {
-			abort();
-		}
-		/* remove the old value */
-		stored = (BuxtonArray *)hashmap_remove(db, full_key);
-		assert(stored);
-
-		/* free the data */
-		d = buxton_array_get(stored, 0);
-		data_free(d);
-		l = buxton_array_get(stored, 1);
-		string_free(l);
-		k = buxton_array_get(stored, 2);
-		free(k);
-		buxton_array_free(&stored, NULL);
-		ret = hashmap_put(db, full_key, array);
-		if (ret != 1) {
-			abort();
-		}
+	load_value(db, e, data);
+	load_label(db, e, label);
+	if (version) {
+		*version = e->version;
 	}
 
-	ret = 0;
-
-end:
-	return ret;
+	return 0;
 }
 
-static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
-		      BuxtonString *label)
+static int get_versioned_value(BuxtonLayer *layer, _BuxtonKey *key,
+			       BuxtonData *data, BuxtonString *label,
+			       uint64_t *version)
 {
-	Hashmap *db;
-	BuxtonArray *stored;
-	BuxtonData *d;
-	BuxtonString *l;
-	char *full_key = NULL;
-	int ret;
+	MemoryDb *db;
+	_cleanup_free_ char *full_key = NULL;
+	uint32_t key_len;
 
 	assert(layer);
 	assert(key);
@@ -188,127 +882,439 @@ static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
 		 * rather than key not found, optimization for
 		 * set value
 		 */
-		ret = -ENOENT;
-		goto end;
+		return -ENOENT;
 	}
 
-	if (key->name.value) {
-		if (asprintf(&full_key, "%s%s", key->group.value, key->name.value) == -1) {
-			abort();
-		}
-	} else {
-		full_key = strdup(key->group.value);
-		if (!full_key) {
-			abort();
-		}
+	full_key = make_key(key, &key_len);
+
+	return fetch_entry(db, key, full_key, key_len, data, label, version);
+}
+
+static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
+		      BuxtonString *label)
+{
+	return get_versioned_value(layer, key, data, label, NULL);
+}
+
+static int delete_entry(MemoryDb *db, const char *full_key, uint32_t key_len)
+{
+	MemoryEntry *e;
+
+	e = lookup(db, full_key, key_len);
+	if (!e) {
+		return ENOENT;
 	}
+	remove_entry(db, e);
 
-	stored = (BuxtonArray *)hashmap_get(db, full_key);
-	if (!stored) {
-		ret = ENOENT;
-		goto end;
+	return 0;
+}
+
+static int unset_value(BuxtonLayer *layer,
+			_BuxtonKey *key,
+			__attribute__((unused)) BuxtonData *data,
+			__attribute__((unused)) BuxtonString *label)
+{
+	MemoryDb *db;
+	_cleanup_free_ char *full_key = NULL;
+	uint32_t key_len;
+	int ret;
+
+	assert(layer);
+	assert(key);
+
+	db = _db_for_resource(layer);
+	if (!db) {
+		return ENOENT;
 	}
-	d = buxton_array_get(stored, 0);
-	if (d->type != key->type) {
-		ret = EINVAL;
-		goto end;
+
+	full_key = make_key(key, &key_len);
+	ret = delete_entry(db, full_key, key_len);
+	if (ret) {
+		return ret;
 	}
+	maybe_compact(db);
+	mark_dirty(db);
 
-	if (!buxton_data_copy(d, data)) {
-		abort();
+	return 0;
+}
+
+/* Record an item's status, returning the first failure of the batch */
+static int item_status(BuxtonBatchItem *item, int status, int ret)
+{
+	item->status = status;
+
+	return ret ? ret : status;
+}
+
+static int get_many(BuxtonLayer *layer, BuxtonBatchItem *items, size_t count)
+{
+	MemoryDb *db;
+	_cleanup_free_ char *full_key = NULL;
+	uint32_t key_len, size = 0;
+	int ret = 0;
+
+	assert(layer);
+	assert(items);
+
+	db = _db_for_resource(layer);
+	for (size_t i = 0; i < count; i++) {
+		if (!db) {
+			ret = item_status(&items[i], -ENOENT, ret);
+			continue;
+		}
+		key_len = build_key(items[i].key, &full_key, &size);
+		items[i].version = 0;
+		ret = item_status(&items[i],
+				  fetch_entry(db, items[i].key, full_key,
+					      key_len, items[i].data,
+					      items[i].label,
+					      &items[i].version), ret);
 	}
 
-	l = buxton_array_get(stored, 1);
-	if (!buxton_string_copy(l, label)) {
-		abort();
+	return ret;
+}
+
+static int set_many(BuxtonLayer *layer, BuxtonBatchItem *items, size_t count)
+{
+	MemoryDb *db;
+	_cleanup_free_ char *full_key = NULL;
+	uint32_t key_len, size = 0;
+	int ret = 0;
+
+	assert(layer);
+	assert(items);
+
+	db = _db_for_resource(layer);
+	if (db) {
+		/* One resize for the whole batch, before any slot is found */
+		reserve_entries(db, (uint32_t)count);
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (!db) {
+			ret = item_status(&items[i], ENOENT, ret);
+			continue;
+		}
+		assert(items[i].label);
+		key_len = build_key(items[i].key, &full_key, &size);
+		ret = item_status(&items[i],
+				  store_entry(db, full_key, key_len,
+					      items[i].data, items[i].label),
+				  ret);
+	}
+	if (db) {
+		maybe_compact(db);
+		mark_dirty(db);
 	}
 
-	ret = 0;
+	return ret;
+}
+
+static int unset_many(BuxtonLayer *layer, BuxtonBatchItem *items, size_t count)
+{
+	MemoryDb *db;
+	_cleanup_free_ char *full_key = NULL;
+	uint32_t key_len, size = 0;
+	int ret = 0;
+
+	assert(layer);
+	assert(items);
+
+	db = _db_for_resource(layer);
+	for (size_t i = 0; i < count; i++) {
+		if (!db) {
+			ret = item_status(&items[i], ENOENT, ret);
+			continue;
+		}
+		key_len = build_key(items[i].key, &full_key, &size);
+		ret = item_status(&items[i],
+				  delete_entry(db, full_key, key_len), ret);
+	}
+	if (db) {
+		maybe_compact(db);
+		mark_dirty(db);
+	}
 
-end:
-	free(full_key);
 	return ret;
 }
 
-static int unset_value(BuxtonLayer *layer,
+static int remove_group(BuxtonLayer *layer,
 			_BuxtonKey *key,
 			__attribute__((unused)) BuxtonData *data,
 			__attribute__((unused)) BuxtonString *label)
 {
-	Hashmap *db;
-	BuxtonArray *stored;
-	BuxtonData *d;
-	BuxtonString *l;
-	char *full_key = NULL;
-	char *k;
-	int ret;
+	MemoryDb *db;
+	MemoryEntry *e;
 
 	assert(layer);
 	assert(key);
+	assert(!key->name.value);
 
 	db = _db_for_resource(layer);
 	if (!db) {
-		ret = ENOENT;
-		goto end;
+		return ENOENT;
 	}
 
-	if (key->name.value) {
-		if (asprintf(&full_key, "%s%s", key->group.value, key->name.value) == -1) {
+	if (!lookup(db, key->group.value, key->group.length)) {
+		return ENOENT;
+	}
+
+	/* Members share the group\0 prefix; the group record goes too */
+	for (uint32_t i = 0; i < db->size; i++) {
+		e = &db->entries[i];
+		if (e->hash > MEMORY_SLOT_DELETED &&
+		    e->key_len >= key->group.length &&
+		    memcmp(db->arena + e->key, key->group.value,
+			   key->group.length) == 0) {
+			remove_entry(db, e);
+		}
+	}
+	maybe_compact(db);
+	mark_dirty(db);
+
+	return 0;
+}
+
+static bool sweep_orphans(BuxtonLayer *layer, uint32_t *removed)
+{
+	MemoryDb *db;
+	MemoryEntry *e;
+	uint32_t group_len;
+	uint32_t count = 0;
+
+	assert(layer);
+	assert(removed);
+
+	db = _db_for_resource(layer);
+	if (!db) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < db->size; i++) {
+		e = &db->entries[i];
+		if (e->hash <= MEMORY_SLOT_DELETED) {
+			continue;
+		}
+		group_len = (uint32_t)strnlen((char *)db->arena + e->key,
+					      e->key_len) + 1;
+		if (group_len >= e->key_len) {
+			continue;
+		}
+		if (!lookup(db, (char *)db->arena + e->key, group_len)) {
+			remove_entry(db, e);
+			count++;
+		}
+	}
+	maybe_compact(db);
+	if (count) {
+		mark_dirty(db);
+	}
+
+	*removed = count;
+	return true;
+}
+
+struct BuxtonCursor {
+	MemoryDb *db; /**<Table being walked */
+	uint32_t slot; /**<Next slot to visit */
+	char *group; /**<Only visit keys with this group\0 prefix, or NULL */
+	uint32_t group_len; /**<Length of group including its nil */
+	uint32_t flags; /**<BUXTON_CURSOR_* flags */
+	char *copy; /**<Keys, string values and labels of the last batch */
+	size_t copy_size; /**<Allocated size of copy */
+};
+
+static BuxtonCursor *cursor_open(BuxtonLayer *layer, BuxtonString *group,
+				 uint32_t flags)
+{
+	BuxtonCursor *cursor;
+	MemoryDb *db;
+
+	assert(layer);
+
+	db = _db_for_resource(layer);
+	if (!db) {
+		return NULL;
+	}
+
+	cursor = malloc0(sizeof(BuxtonCursor));
+	if (!cursor) {
+		abort();
+	}
+	cursor->db = db;
+	cursor->flags = flags;
+	if (group) {
+		cursor->group = malloc(group->length);
+		if (!cursor->group) {
 			abort();
 		}
-	} else {
-		full_key = strdup(key->group.value);
-		if (!full_key) {
+		memcpy(cursor->group, group->value, group->length);
+		cursor->group_len = group->length;
+	}
+
+	return cursor;
+}
+
+/*
+ * The table and arena move as the layer changes, so each batch is copied
+ * out into one buffer that the views point into
+ */
+static bool cursor_next(BuxtonCursor *cursor, BuxtonRecordView *records,
+			size_t max, size_t *count)
+{
+	MemoryDb *db;
+	MemoryEntry *e;
+	MemoryEntry *found[BUXTON_CURSOR_BATCH];
+	BuxtonRecordView *view;
+	size_t n = 0;
+	size_t copy_len = 0;
+	uint32_t group_len;
+	char *p;
+
+	assert(cursor);
+	assert(records);
+	assert(count);
+
+	db = cursor->db;
+	max = MIN(max, (size_t)BUXTON_CURSOR_BATCH);
+	while (n < max && cursor->slot < db->size) {
+		e = &db->entries[cursor->slot++];
+		if (e->hash <= MEMORY_SLOT_DELETED) {
+			continue;
+		}
+		if (cursor->group &&
+		    (e->key_len < cursor->group_len ||
+		     memcmp(db->arena + e->key, cursor->group,
+			    cursor->group_len) != 0)) {
+			continue;
+		}
+		found[n++] = e;
+		copy_len += e->key_len;
+		if (cursor->flags & BUXTON_CURSOR_VALUES) {
+			copy_len += (size_t)e->label_len + 1;
+			if (e->type == STRING) {
+				copy_len += e->value_len;
+			}
+		}
+	}
+
+	if (copy_len > cursor->copy_size) {
+		char *c = realloc(cursor->copy, copy_len);
+		if (!c) {
 			abort();
 		}
+		cursor->copy = c;
+		cursor->copy_size = copy_len;
 	}
 
-	/* test if the value exists */
-	stored = (BuxtonArray *)hashmap_remove(db, full_key);
-	if (!stored) {
-		ret = ENOENT;
-		goto end;
+	p = cursor->copy;
+	for (size_t i = 0; i < n; i++) {
+		e = found[i];
+		view = &records[i];
+		memzero(view, sizeof(BuxtonRecordView));
+		memcpy(p, db->arena + e->key, e->key_len);
+		group_len = (uint32_t)strnlen(p, e->key_len) + 1;
+		view->group.value = p;
+		view->group.length = group_len;
+		if (group_len < e->key_len) {
+			view->name.value = p + group_len;
+			view->name.length = e->key_len - group_len;
+		}
+		p += e->key_len;
+		if (!(cursor->flags & BUXTON_CURSOR_VALUES)) {
+			continue;
+		}
+
+		if (e->type == STRING) {
+			view->data.type = STRING;
+			memcpy(p, value_inline(e) ? e->value.inline_data :
+			       db->arena + e->value.offset, e->value_len);
+			view->data.store.d_string.value = p;
+			view->data.store.d_string.length = e->value_len;
+			p += e->value_len;
+		} else {
+			load_value(db, e, &view->data);
+		}
+		view->label.value = p;
+		view->label.length = (uint32_t)e->label_len + 1;
+		memcpy(p, db->arena + e->label, e->label_len);
+		p[e->label_len] = '\0';
+		p += view->label.length;
+		view->version = e->version;
 	}
 
-	/* free the data */
-	d = buxton_array_get(stored, 0);
-	data_free(d);
-	l = buxton_array_get(stored, 1);
-	string_free(l);
-	k = buxton_array_get(stored, 2);
-	free(k);
-	buxton_array_free(&stored, NULL);
+	*count = n;
+	return true;
+}
 
-	ret = 0;
+static void cursor_close(BuxtonCursor *cursor)
+{
+	if (!cursor) {
+		return;
+	}
+	free(cursor->copy);
+	free(cursor->group);
+	free(cursor);
+}
+
+/*
+ * The table only lives in memory, where no change can fail half way,
+ * so applying the changes in turn makes them all or none
+ */
+static int commit(BuxtonLayer *layer, BuxtonChange *changes, size_t count)
+{
+	MemoryDb *db;
+	int ret = 0;
+
+	assert(layer);
+	assert(changes);
+
+	db = _db_for_resource(layer);
+	if (!db) {
+		return ENOENT;
+	}
+
+	for (size_t i = 0; i < count && !ret; i++) {
+		if (changes[i].data) {
+			ret = set_value(layer, changes[i].key, changes[i].data,
+					changes[i].label);
+		} else {
+			ret = unset_value(layer, changes[i].key, NULL, NULL);
+			/* The key was checked, so it only went missing earlier on */
+			if (ret == ENOENT) {
+				ret = 0;
+			}
+		}
+	}
+	mark_dirty(db);
 
-end:
-	free(full_key);
 	return ret;
 }
 
+/* Write out the tables changed since their last snapshot */
+static void sync_snapshots(void)
+{
+	Iterator iterator;
+	MemoryDb *db;
+
+	HASHMAP_FOREACH(db, _resources, iterator) {
+		if (db->path && db->dirty) {
+			(void)write_snapshot(db);
+		}
+	}
+}
+
 _bx_export_ void buxton_module_destroy(void)
 {
-	const char *key1, *key2;
-	Iterator iteratori, iteratoro;
-	Hashmap *map;
-	BuxtonArray *array;
-	BuxtonData *d;
-	BuxtonString *l;
-
-	/* free all hashmaps */
-	HASHMAP_FOREACH_KEY(map, key1, _resources, iteratoro) {
-		HASHMAP_FOREACH_KEY(array, key2, map, iteratori) {
-			hashmap_remove(map, key2);
-			d = buxton_array_get(array, 0);
-			data_free(d);
-			l = buxton_array_get(array, 1);
-			string_free(l);
-			buxton_array_free(&array, NULL);
-		}
-		hashmap_remove(_resources, key1);
-		hashmap_free(map);
-		free((void *)key1);
-		map = NULL;
+	const char *key;
+	Iterator iterator;
+	MemoryDb *db;
+
+	/* free all tables, saving the ones that persist */
+	sync_snapshots();
+	HASHMAP_FOREACH_KEY(db, key, _resources, iterator) {
+		hashmap_remove(_resources, key);
+		free_db(db);
+		free((void *)key);
 	}
 	hashmap_free(_resources);
 	_resources = NULL;
@@ -322,7 +1328,19 @@ _bx_export_ bool buxton_module_init(BuxtonBackend *backend)
 	/* Point the struct methods back to our own */
 	backend->set_value = &set_value;
 	backend->get_value = &get_value;
+	backend->get_versioned_value = &get_versioned_value;
 	backend->unset_value = &unset_value;
+	backend->remove_group = &remove_group;
+	backend->sweep_orphans = &sweep_orphans;
+	backend->commit = &commit;
+	backend->version = BUXTON_BACKEND_VERSION;
+	backend->get_many = &get_many;
+	backend->set_many = &set_many;
+	backend->unset_many = &unset_many;
+	backend->cursor_open = &cursor_open;
+	backend->cursor_next = &cursor_next;
+	backend->cursor_close = &cursor_close;
+	backend->sync = &sync_snapshots;
 	backend->list_keys = NULL;
 	backend->create_db = NULL;
 
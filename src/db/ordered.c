@@ -0,0 +1,1472 @@
+/*
+ * This file is part of buxton.
+ *
+ * Copyright (C) 2013 Intel Corporation
+ *
+ * buxton is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "hashmap.h"
+#include "log.h"
+#include "serialize.h"
+#include "util.h"
+
+/**
+ * Ordered Database Module
+ *
+ * Records are kept in a skip list sorted by their group\0name\0 key, so
+ * every key of a group sits directly after the group record itself.
+ * Group removal, orphan sweeping and listing are therefore contiguous
+ * range scans, and inserting or removing a key costs O(log n).
+ *
+ * On disk a layer is a sorted snapshot plus an append-only journal of
+ * changes made since the snapshot was written. The journal is replayed
+ * on open, and folded into a fresh snapshot when the backend is synced
+ * once it has grown too long, or when the module is destroyed. A
+ * transaction is journaled as a single batch entry, so a torn write
+ * drops all of its changes.
+ *
+ * Records refer to their label by an ID into the layer's label table,
+ * which is itself a record under BUXTON_LABEL_TABLE_KEY.
+ */
+
+#define ORDERED_MAGIC "BXORDv1\n"
+#define ORDERED_MAGIC_LENGTH 8
+#define ORDERED_COMPACT_THRESHOLD 1024
+#define ORDERED_MAX_LEVEL 24
+
+/* Journal operations */
+#define ORDERED_OP_PUT 1
+#define ORDERED_OP_DELETE 2
+#define ORDERED_OP_DELETE_RANGE 3
+#define ORDERED_OP_BATCH 4
+
+/* Batches hold their operations as the value of a record with this key */
+#define ORDERED_BATCH_KEY ""
+#define ORDERED_BATCH_KEY_LENGTH 1
+
+typedef struct OrderedRecord {
+	char *key; /**<group\0 or group\0name\0 */
+	uint32_t key_len; /**<Length of key including separators */
+	uint8_t *value; /**<Serialized data and label */
+	uint32_t value_len; /**<Length of value */
+	uint8_t level; /**<Number of links in next */
+	struct OrderedRecord *next[]; /**<Following record on each level */
+} OrderedRecord;
+
+typedef struct OrderedDb {
+	OrderedRecord *head; /**<Links to the first record on each level */
+	uint8_t level; /**<Levels in use */
+	uint32_t seed; /**<State of the level generator */
+	size_t count; /**<Number of records */
+	char *path; /**<Snapshot path */
+	char *journal_path; /**<Journal path */
+	int journal_fd; /**<Open journal, or -1 if readonly */
+	off_t journal_size; /**<Bytes of complete journal entries */
+	uint32_t journal_entries; /**<Operations since the last snapshot */
+	bool readonly; /**<Layer is readonly */
+	BuxtonLabelTable labels; /**<Labels used by the records */
+} OrderedDb;
+
+static Hashmap *_resources = NULL;
+
+static int compare_keys(const char *a, uint32_t a_len,
+			const char *b, uint32_t b_len)
+{
+	int r;
+
+	r = memcmp(a, b, MIN(a_len, b_len));
+	if (r) {
+		return r;
+	}
+	if (a_len == b_len) {
+		return 0;
+	}
+	return a_len < b_len ? -1 : 1;
+}
+
+static inline bool has_key(OrderedRecord *rec, const char *key,
+			   uint32_t key_len)
+{
+	return rec && rec->key_len == key_len &&
+		memcmp(rec->key, key, key_len) == 0;
+}
+
+static inline bool has_prefix(OrderedRecord *rec, const char *prefix,
+			      uint32_t prefix_len)
+{
+	return rec && rec->key_len >= prefix_len &&
+		memcmp(rec->key, prefix, prefix_len) == 0;
+}
+
+static OrderedRecord *new_record(uint8_t level)
+{
+	OrderedRecord *rec;
+
+	rec = malloc0(sizeof(OrderedRecord) + level * sizeof(OrderedRecord *));
+	if (!rec) {
+		abort();
+	}
+	rec->level = level;
+
+	return rec;
+}
+
+static void free_record(OrderedRecord *rec)
+{
+	free(rec->key);
+	free(rec->value);
+	free(rec);
+}
+
+/* Each level holds about a quarter of the records of the one below */
+static uint8_t random_level(OrderedDb *db)
+{
+	uint8_t level = 1;
+
+	while (level < ORDERED_MAX_LEVEL) {
+		/* xorshift32 */
+		db->seed ^= db->seed << 13;
+		db->seed ^= db->seed >> 17;
+		db->seed ^= db->seed << 5;
+		if (db->seed & 3) {
+			break;
+		}
+		level++;
+	}
+
+	return level;
+}
+
+/*
+ * Return the first record whose key is not less than key. If update is
+ * given, it gets the last record before that one on every level.
+ */
+static OrderedRecord *seek(OrderedDb *db, const char *key, uint32_t key_len,
+			   OrderedRecord **update)
+{
+	OrderedRecord *x = db->head;
+
+	for (int i = db->level - 1; i >= 0; i--) {
+		while (x->next[i] && compare_keys(x->next[i]->key,
+						  x->next[i]->key_len,
+						  key, key_len) < 0) {
+			x = x->next[i];
+		}
+		if (update) {
+			update[i] = x;
+		}
+	}
+
+	return x->next[0];
+}
+
+static OrderedRecord *find_record(OrderedDb *db, const char *key,
+				  uint32_t key_len)
+{
+	OrderedRecord *rec;
+
+	rec = seek(db, key, key_len, NULL);
+	return has_key(rec, key, key_len) ? rec : NULL;
+}
+
+/* Link rec in after the records in update, which precede it */
+static void link_record(OrderedDb *db, OrderedRecord **update,
+			OrderedRecord *rec)
+{
+	for (uint8_t i = db->level; i < rec->level; i++) {
+		update[i] = db->head;
+	}
+	db->level = MAX(db->level, rec->level);
+	for (uint8_t i = 0; i < rec->level; i++) {
+		rec->next[i] = update[i]->next[i];
+		update[i]->next[i] = rec;
+	}
+	db->count++;
+}
+
+/* Unlink and free rec, which directly follows the records in update */
+static void unlink_record(OrderedDb *db, OrderedRecord **update,
+			  OrderedRecord *rec)
+{
+	for (uint8_t i = 0; i < rec->level; i++) {
+		update[i]->next[i] = rec->next[i];
+	}
+	while (db->level > 1 && !db->head->next[db->level - 1]) {
+		db->level--;
+	}
+	free_record(rec);
+	db->count--;
+}
+
+static void free_records(OrderedDb *db)
+{
+	OrderedRecord *rec, *next;
+
+	for (rec = db->head->next[0]; rec; rec = next) {
+		next = rec->next[0];
+		free_record(rec);
+	}
+	memzero(db->head->next, ORDERED_MAX_LEVEL * sizeof(OrderedRecord *));
+	db->level = 1;
+	db->count = 0;
+}
+
+/* Insert or replace a record, taking ownership of key and value */
+static void put_record(OrderedDb *db, char *key, uint32_t key_len,
+		       uint8_t *value, uint32_t value_len)
+{
+	OrderedRecord *update[ORDERED_MAX_LEVEL];
+	OrderedRecord *rec;
+
+	rec = seek(db, key, key_len, update);
+	if (has_key(rec, key, key_len)) {
+		free(rec->key);
+		free(rec->value);
+	} else {
+		rec = new_record(random_level(db));
+		link_record(db, update, rec);
+	}
+
+	rec->key = key;
+	rec->key_len = key_len;
+	rec->value = value;
+	rec->value_len = value_len;
+}
+
+static bool delete_key(OrderedDb *db, const char *key, uint32_t key_len)
+{
+	OrderedRecord *update[ORDERED_MAX_LEVEL];
+	OrderedRecord *rec;
+
+	rec = seek(db, key, key_len, update);
+	if (!has_key(rec, key, key_len)) {
+		return false;
+	}
+	unlink_record(db, update, rec);
+
+	return true;
+}
+
+static void delete_prefix(OrderedDb *db, const char *prefix,
+			  uint32_t prefix_len)
+{
+	OrderedRecord *update[ORDERED_MAX_LEVEL];
+	OrderedRecord *rec, *next;
+
+	/* The records before the range stay the ones before what is left */
+	rec = seek(db, prefix, prefix_len, update);
+	while (has_prefix(rec, prefix, prefix_len)) {
+		next = rec->next[0];
+		unlink_record(db, update, rec);
+		rec = next;
+	}
+}
+
+/*
+ * Parse one length-prefixed record from buf, copying key and value.
+ * Returns the number of bytes consumed, or 0 if buf is truncated.
+ */
+static size_t parse_record(uint8_t *buf, size_t len, char **key,
+			   uint32_t *key_len, uint8_t **value,
+			   uint32_t *value_len)
+{
+	uint32_t klen, vlen;
+
+	if (len < 2 * sizeof(uint32_t)) {
+		return 0;
+	}
+	memcpy(&klen, buf, sizeof(uint32_t));
+	memcpy(&vlen, buf + sizeof(uint32_t), sizeof(uint32_t));
+	if (klen == 0 || len - 2 * sizeof(uint32_t) < (size_t)klen + vlen) {
+		return 0;
+	}
+	buf += 2 * sizeof(uint32_t);
+
+	*key = malloc(klen);
+	if (!*key) {
+		abort();
+	}
+	memcpy(*key, buf, klen);
+	*key_len = klen;
+
+	*value = NULL;
+	if (vlen) {
+		*value = malloc(vlen);
+		if (!*value) {
+			abort();
+		}
+		memcpy(*value, buf + klen, vlen);
+	}
+	*value_len = vlen;
+
+	return 2 * sizeof(uint32_t) + klen + vlen;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+	struct stat st;
+	uint8_t *buf = NULL;
+	size_t offset = 0;
+	ssize_t r;
+	int fd;
+
+	*size = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		goto end;
+	}
+
+	buf = malloc((size_t)st.st_size);
+	if (!buf) {
+		abort();
+	}
+	while (offset < (size_t)st.st_size) {
+		r = read(fd, buf + offset, (size_t)st.st_size - offset);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		offset += (size_t)r;
+	}
+	*size = offset;
+
+end:
+	close(fd);
+	return buf;
+}
+
+static bool load_snapshot(OrderedDb *db)
+{
+	_cleanup_free_ uint8_t *buf = NULL;
+	OrderedRecord *tail[ORDERED_MAX_LEVEL];
+	OrderedRecord *rec;
+	size_t size, offset, r;
+	uint32_t count;
+	char *key;
+	uint32_t key_len, value_len;
+	uint8_t *value;
+
+	buf = read_file(db->path, &size);
+	if (!buf) {
+		return true;
+	}
+
+	if (size < ORDERED_MAGIC_LENGTH + sizeof(uint32_t) ||
+	    memcmp(buf, ORDERED_MAGIC, ORDERED_MAGIC_LENGTH) != 0) {
+		buxton_log("Not an ordered database: %s\n", db->path);
+		return false;
+	}
+	memcpy(&count, buf + ORDERED_MAGIC_LENGTH, sizeof(uint32_t));
+	offset = ORDERED_MAGIC_LENGTH + sizeof(uint32_t);
+
+	/* Snapshots are written sorted, so records append in order */
+	for (uint8_t i = 0; i < ORDERED_MAX_LEVEL; i++) {
+		tail[i] = db->head;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		r = parse_record(buf + offset, size - offset, &key, &key_len,
+				 &value, &value_len);
+		if (!r) {
+			buxton_log("Truncated ordered database: %s\n", db->path);
+			return false;
+		}
+		offset += r;
+		if (tail[0] != db->head &&
+		    compare_keys(tail[0]->key, tail[0]->key_len, key,
+				 key_len) >= 0) {
+			buxton_log("Unsorted ordered database: %s\n", db->path);
+			free(key);
+			free(value);
+			return false;
+		}
+		rec = new_record(random_level(db));
+		rec->key = key;
+		rec->key_len = key_len;
+		rec->value = value;
+		rec->value_len = value_len;
+		link_record(db, tail, rec);
+		for (uint8_t l = 0; l < rec->level; l++) {
+			tail[l] = rec;
+		}
+	}
+
+	return true;
+}
+
+/* Apply one journaled operation, taking ownership of key and value */
+static void apply_entry(OrderedDb *db, uint8_t op, char *key,
+			uint32_t key_len, uint8_t *value, uint32_t value_len)
+{
+	size_t offset = 0, r;
+	char *k;
+	uint32_t k_len, v_len;
+	uint8_t *v;
+
+	switch (op) {
+	case ORDERED_OP_PUT:
+		put_record(db, key, key_len, value, value_len);
+		return;
+	case ORDERED_OP_DELETE:
+		(void)delete_key(db, key, key_len);
+		break;
+	case ORDERED_OP_DELETE_RANGE:
+		delete_prefix(db, key, key_len);
+		break;
+	case ORDERED_OP_BATCH:
+		while (offset < value_len) {
+			r = parse_record(value + offset + 1,
+					 value_len - offset - 1, &k, &k_len,
+					 &v, &v_len);
+			if (!r) {
+				buxton_debug("Ignoring malformed batch\n");
+				break;
+			}
+			apply_entry(db, value[offset], k, k_len, v, v_len);
+			offset += r + 1;
+		}
+		break;
+	default:
+		buxton_debug("Unknown journal operation %d\n", op);
+		break;
+	}
+	free(key);
+	free(value);
+}
+
+static void replay_journal(OrderedDb *db)
+{
+	_cleanup_free_ uint8_t *buf = NULL;
+	size_t size, offset = 0, r;
+	char *key;
+	uint32_t key_len, value_len;
+	uint8_t *value;
+	uint8_t op;
+
+	buf = read_file(db->journal_path, &size);
+	if (!buf) {
+		return;
+	}
+
+	while (offset < size) {
+		op = buf[offset];
+		r = parse_record(buf + offset + 1, size - offset - 1, &key,
+				 &key_len, &value, &value_len);
+		if (!r) {
+			/* A torn write from a crash; drop the partial tail */
+			buxton_debug("Ignoring truncated journal entry\n");
+			break;
+		}
+		offset += r + 1;
+		db->journal_entries++;
+		apply_entry(db, op, key, key_len, value, value_len);
+	}
+
+	/* Later entries are appended after the last complete one */
+	db->journal_size = (off_t)offset;
+	if (offset < size && db->journal_fd != -1) {
+		if (ftruncate(db->journal_fd, db->journal_size) == -1) {
+			buxton_log("ftruncate(): %m\n");
+			db->readonly = true;
+		}
+	}
+}
+
+/* Make a rename into the directory holding path durable */
+static bool sync_dir(const char *path)
+{
+	_cleanup_free_ char *dir = NULL;
+	char *slash;
+	bool ret;
+	int fd;
+
+	dir = strdup(path);
+	if (!dir) {
+		abort();
+	}
+	slash = strrchr(dir, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	ret = fsync(fd) == 0;
+	close(fd);
+
+	return ret;
+}
+
+static bool write_snapshot(OrderedDb *db)
+{
+	_cleanup_free_ char *tmp = NULL;
+	_cleanup_free_ uint8_t *buf = NULL;
+	OrderedRecord *rec;
+	size_t size = ORDERED_MAGIC_LENGTH + sizeof(uint32_t);
+	size_t offset;
+	uint32_t count = (uint32_t)db->count;
+	bool ret = false;
+	int fd;
+
+	for (rec = db->head->next[0]; rec; rec = rec->next[0]) {
+		size += 2 * sizeof(uint32_t) + rec->key_len + rec->value_len;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		abort();
+	}
+	memcpy(buf, ORDERED_MAGIC, ORDERED_MAGIC_LENGTH);
+	memcpy(buf + ORDERED_MAGIC_LENGTH, &count, sizeof(uint32_t));
+	offset = ORDERED_MAGIC_LENGTH + sizeof(uint32_t);
+	for (rec = db->head->next[0]; rec; rec = rec->next[0]) {
+		memcpy(buf + offset, &rec->key_len, sizeof(uint32_t));
+		offset += sizeof(uint32_t);
+		memcpy(buf + offset, &rec->value_len, sizeof(uint32_t));
+		offset += sizeof(uint32_t);
+		memcpy(buf + offset, rec->key, rec->key_len);
+		offset += rec->key_len;
+		if (rec->value_len) {
+			memcpy(buf + offset, rec->value, rec->value_len);
+			offset += rec->value_len;
+		}
+	}
+
+	if (asprintf(&tmp, "%s.tmp", db->path) == -1) {
+		abort();
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		buxton_log("Couldn't write snapshot %s: %m\n", tmp);
+		return false;
+	}
+	if (_write(fd, buf, size) && fsync(fd) == 0) {
+		ret = true;
+	}
+	close(fd);
+
+	if (!ret || rename(tmp, db->path) == -1) {
+		buxton_log("Couldn't replace snapshot %s: %m\n", db->path);
+		unlink(tmp);
+		return false;
+	}
+	/* Only drop the journal once the new snapshot is sure to be found */
+	if (!sync_dir(db->path)) {
+		buxton_log("Couldn't sync the directory of %s: %m\n", db->path);
+		return false;
+	}
+	if (db->journal_fd != -1) {
+		if (ftruncate(db->journal_fd, 0) == -1) {
+			buxton_log("ftruncate(): %m\n");
+			return false;
+		}
+		db->journal_size = 0;
+	}
+	db->journal_entries = 0;
+
+	return true;
+}
+
+/* Encode a journal entry into buf, returning the bytes written */
+static size_t encode_entry(uint8_t *buf, uint8_t op, const char *key,
+			   uint32_t key_len, uint8_t *value,
+			   uint32_t value_len)
+{
+	size_t offset = 0;
+
+	buf[offset++] = op;
+	memcpy(buf + offset, &key_len, sizeof(uint32_t));
+	offset += sizeof(uint32_t);
+	memcpy(buf + offset, &value_len, sizeof(uint32_t));
+	offset += sizeof(uint32_t);
+	memcpy(buf + offset, key, key_len);
+	offset += key_len;
+	if (value_len) {
+		memcpy(buf + offset, value, value_len);
+		offset += value_len;
+	}
+
+	return offset;
+}
+
+static inline size_t entry_size(uint32_t key_len, uint32_t value_len)
+{
+	return 1 + 2 * sizeof(uint32_t) + key_len + value_len;
+}
+
+static bool append_journal(OrderedDb *db, uint8_t op, const char *key,
+			   uint32_t key_len, uint8_t *value,
+			   uint32_t value_len)
+{
+	_cleanup_free_ uint8_t *buf = NULL;
+	size_t size;
+
+	assert(db->journal_fd != -1);
+
+	size = entry_size(key_len, value_len);
+	buf = malloc(size);
+	if (!buf) {
+		abort();
+	}
+	(void)encode_entry(buf, op, key, key_len, value, value_len);
+
+	if (!_write(db->journal_fd, buf, size) ||
+	    fsync(db->journal_fd) == -1) {
+		buxton_log("Couldn't append to %s: %m\n", db->journal_path);
+		/* Drop what was written, so no entry follows a torn one */
+		if (ftruncate(db->journal_fd, db->journal_size) == -1) {
+			buxton_log("ftruncate(): %m\n");
+			db->readonly = true;
+		}
+		return false;
+	}
+	db->journal_size += (off_t)size;
+	db->journal_entries++;
+
+	return true;
+}
+
+static void free_db(OrderedDb *db)
+{
+	if (!db) {
+		return;
+	}
+
+	free_records(db);
+	free(db->head);
+	if (db->journal_fd != -1) {
+		close(db->journal_fd);
+	}
+	free(db->path);
+	free(db->journal_path);
+	buxton_label_table_free(&db->labels);
+	free(db);
+}
+
+/*
+ * Load the label table. Records only hold label IDs, so a table that
+ * doesn't load can't be rebuilt, and new labels mustn't reuse its IDs.
+ */
+static bool load_labels(OrderedDb *db)
+{
+	OrderedRecord *rec;
+
+	rec = find_record(db, BUXTON_LABEL_TABLE_KEY,
+			  BUXTON_LABEL_TABLE_KEY_LENGTH);
+	if (!rec) {
+		/* Databases from before label tables have none */
+		return true;
+	}
+	if (!buxton_label_table_load(&db->labels, rec->value,
+				     rec->value_len)) {
+		buxton_log("Invalid label table in %s\n", db->path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Write the label table, before any record that uses a new label. If
+ * it can't be written, the table goes back to its count labels.
+ */
+static bool store_labels(OrderedDb *db, uint16_t count)
+{
+	uint8_t *data;
+	char *key;
+	size_t size;
+
+	size = buxton_label_table_serialize(&db->labels, &data);
+	if (!append_journal(db, ORDERED_OP_PUT, BUXTON_LABEL_TABLE_KEY,
+			    BUXTON_LABEL_TABLE_KEY_LENGTH, data,
+			    (uint32_t)size)) {
+		buxton_label_table_truncate(&db->labels, count);
+		free(data);
+		return false;
+	}
+
+	key = malloc(BUXTON_LABEL_TABLE_KEY_LENGTH);
+	if (!key) {
+		abort();
+	}
+	memcpy(key, BUXTON_LABEL_TABLE_KEY, BUXTON_LABEL_TABLE_KEY_LENGTH);
+	put_record(db, key, BUXTON_LABEL_TABLE_KEY_LENGTH, data,
+		   (uint32_t)size);
+
+	return true;
+}
+
+/* Open or create databases on the fly */
+static OrderedDb *db_for_resource(BuxtonLayer *layer)
+{
+	OrderedDb *db;
+	char *name = NULL;
+	int r;
+
+	assert(layer);
+	assert(_resources);
+
+	if (layer->type == LAYER_USER) {
+		r = asprintf(&name, "%s-%d", layer->name.value, layer->uid);
+	} else {
+		r = asprintf(&name, "%s", layer->name.value);
+	}
+	if (r == -1) {
+		abort();
+	}
+
+	db = hashmap_get(_resources, name);
+	if (db) {
+		free(name);
+		return db;
+	}
+
+	db = malloc0(sizeof(OrderedDb));
+	if (!db) {
+		abort();
+	}
+	db->head = new_record(ORDERED_MAX_LEVEL);
+	db->level = 1;
+	db->seed = 2463534242u;
+	db->journal_fd = -1;
+	db->readonly = layer->readonly;
+	db->path = get_layer_path(layer);
+	if (!db->path) {
+		abort();
+	}
+	if (asprintf(&db->journal_path, "%s-journal", db->path) == -1) {
+		abort();
+	}
+
+	if (!db->readonly) {
+		db->journal_fd = open(db->journal_path,
+				      O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+				      S_IRUSR | S_IWUSR);
+		if (db->journal_fd == -1) {
+			buxton_debug("Attempting to fallback to opening db as read-only\n");
+			db->readonly = true;
+		}
+	}
+
+	if (!load_snapshot(db)) {
+		buxton_log("Couldn't create db for path: %s\n", db->path);
+		free_db(db);
+		free(name);
+		return NULL;
+	}
+	replay_journal(db);
+	if (!load_labels(db)) {
+		free_db(db);
+		free(name);
+		return NULL;
+	}
+
+	/* Make sure the snapshot exists, as create_db callers expect */
+	if (!db->readonly && access(db->path, F_OK) == -1) {
+		(void)write_snapshot(db);
+	}
+
+	r = hashmap_put(_resources, name, db);
+	if (r != 1) {
+		abort();
+	}
+
+	return db;
+}
+
+/* Build the group\0 or group\0name\0 lookup key for key */
+static char *make_key(_BuxtonKey *key, uint32_t *key_len)
+{
+	char *k;
+
+	if (key->name.value) {
+		*key_len = key->group.length + key->name.length;
+	} else {
+		*key_len = key->group.length;
+	}
+
+	k = malloc(*key_len);
+	if (!k) {
+		abort();
+	}
+	memcpy(k, key->group.value, key->group.length);
+	if (key->name.value) {
+		memcpy(k + key->group.length, key->name.value,
+		       key->name.length);
+	}
+
+	return k;
+}
+
+static int set_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
+		      BuxtonString *label)
+{
+	OrderedDb *db;
+	OrderedRecord *rec;
+	char *key_data = NULL;
+	uint32_t key_len;
+	uint8_t *data_store = NULL;
+	size_t size;
+	uint16_t label_id;
+	uint16_t label_count;
+	bool added;
+	BuxtonData cdata = {0};
+	uint64_t version;
+	int ret;
+
+	assert(layer);
+	assert(key);
+	assert(label);
+
+	db = db_for_resource(layer);
+	if (!db) {
+		return ENOENT;
+	}
+	if (db->readonly) {
+		return EROFS;
+	}
+
+	key_data = make_key(key, &key_len);
+
+	/* set_label will pass a NULL for data */
+	if (!data) {
+		rec = find_record(db, key_data, key_len);
+		if (!rec) {
+			ret = ENOENT;
+			goto end;
+		}
+		/* Only the label changes, so the value keeps its version */
+		if (!buxton_deserialize_record(rec->value, rec->value_len,
+					       &db->labels, &cdata, NULL,
+					       &version)) {
+			ret = EINVAL;
+			goto end;
+		}
+		data = &cdata;
+	} else {
+		version = buxton_record_next_version();
+	}
+
+	/* Labels that can't be given an ID are stored in full */
+	label_count = db->labels.count;
+	if (buxton_label_table_intern(&db->labels, label, &label_id, &added)) {
+		if (added && !store_labels(db, label_count)) {
+			ret = EIO;
+			goto end;
+		}
+		size = buxton_serialize_record(data, label_id, version,
+					       &data_store);
+	} else {
+		size = buxton_serialize(data, label, &data_store);
+	}
+	if (!append_journal(db, ORDERED_OP_PUT, key_data, key_len,
+			    data_store, (uint32_t)size)) {
+		ret = EIO;
+		goto end;
+	}
+
+	put_record(db, key_data, key_len, data_store, (uint32_t)size);
+	key_data = NULL;
+	data_store = NULL;
+	ret = 0;
+
+end:
+	if (cdata.type == STRING) {
+		free(cdata.store.d_string.value);
+	}
+	free(key_data);
+	free(data_store);
+
+	return ret;
+}
+
+static int get_versioned_value(BuxtonLayer *layer, _BuxtonKey *key,
+			       BuxtonData *data, BuxtonString *label,
+			       uint64_t *version)
+{
+	OrderedDb *db;
+	OrderedRecord *rec;
+	BuxtonString stored;
+	_cleanup_free_ char *key_data = NULL;
+	uint32_t key_len;
+
+	assert(layer);
+
+	db = db_for_resource(layer);
+	if (!db) {
+		/*
+		 * Set negative here to indicate layer not found
+		 * rather than key not found, optimization for
+		 * set value
+		 */
+		return -ENOENT;
+	}
+
+	key_data = make_key(key, &key_len);
+	rec = find_record(db, key_data, key_len);
+	if (!rec) {
+		return ENOENT;
+	}
+
+	if (!buxton_deserialize_record(rec->value, rec->value_len,
+				       &db->labels, data, &stored, version)) {
+		return EINVAL;
+	}
+	if (data->type != key->type) {
+		if (data->type == STRING) {
+			free(data->store.d_string.value);
+			data->store.d_string.value = NULL;
+		}
+		return EINVAL;
+	}
+
+	/* The caller owns its label, the table keeps the stored one */
+	if (!buxton_string_copy(&stored, label)) {
+		abort();
+	}
+
+	return 0;
+}
+
+static int get_value(BuxtonLayer *layer, _BuxtonKey *key, BuxtonData *data,
+		      BuxtonString *label)
+{
+	return get_versioned_value(layer, key, data, label, NULL);
+}
+
+static int unset_value(BuxtonLayer *layer,
+			_BuxtonKey *key,
+			__attribute__((unused)) BuxtonData *data,
+			__attribute__((unused)) BuxtonString *label)
+{
+	OrderedDb *db;
+	_cleanup_free_ char *key_data = NULL;
+	uint32_t key_len;
+
+	assert(layer);
+	assert(key);
+
+	db = db_for_resource(layer);
+	if (!db || db->readonly) {
+		return EROFS;
+	}
+
+	key_data = make_key(key, &key_len);
+	if (!find_record(db, key_data, key_len)) {
+		return ENOENT;
+	}
+	if (!append_journal(db, ORDERED_OP_DELETE, key_data, key_len,
+			    NULL, 0)) {
+		return EIO;
+	}
+	(void)delete_key(db, key_data, key_len);
+
+	return 0;
+}
+
+static int remove_group(BuxtonLayer *layer,
+			_BuxtonKey *key,
+			__attribute__((unused)) BuxtonData *data,
+			__attribute__((unused)) BuxtonString *label)
+{
+	OrderedDb *db;
+
+	assert(layer);
+	assert(key);
+	assert(!key->name.value);
+
+	db = db_for_resource(layer);
+	if (!db || db->readonly) {
+		return EROFS;
+	}
+
+	if (!find_record(db, key->group.value, key->group.length)) {
+		return ENOENT;
+	}
+
+	/*
+	 * The group record and its members share the group\0 prefix and
+	 * are adjacent, so a single range entry removes all of them.
+	 */
+	if (!append_journal(db, ORDERED_OP_DELETE_RANGE, key->group.value,
+			    key->group.length, NULL, 0)) {
+		return EIO;
+	}
+	delete_prefix(db, key->group.value, key->group.length);
+
+	return 0;
+}
+
+static int commit(BuxtonLayer *layer, BuxtonChange *changes, size_t count)
+{
+	OrderedDb *db;
+	_cleanup_free_ char **keys = NULL;
+	_cleanup_free_ uint32_t *key_lens = NULL;
+	_cleanup_free_ uint8_t **values = NULL;
+	_cleanup_free_ uint32_t *value_lens = NULL;
+	_cleanup_free_ uint8_t *batch = NULL;
+	size_t size = 0, offset = 0, len;
+	uint16_t label_id, label_count;
+	bool added;
+	int ret = 0;
+
+	assert(layer);
+	assert(changes);
+	assert(count);
+
+	db = db_for_resource(layer);
+	if (!db || db->readonly) {
+		return EROFS;
+	}
+
+	keys = new0(char *, count);
+	key_lens = new0(uint32_t, count);
+	values = new0(uint8_t *, count);
+	value_lens = new0(uint32_t, count);
+	if (!keys || !key_lens || !values || !value_lens) {
+		abort();
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		BuxtonChange *c = &changes[i];
+
+		keys[i] = make_key(c->key, &key_lens[i]);
+		if (c->data) {
+			assert(c->label);
+			/* New labels are journaled ahead of the batch */
+			label_count = db->labels.count;
+			if (buxton_label_table_intern(&db->labels, c->label,
+						      &label_id, &added)) {
+				if (added && !store_labels(db, label_count)) {
+					ret = EIO;
+					goto end;
+				}
+				len = buxton_serialize_record(c->data, label_id,
+							      buxton_record_next_version(),
+							      &values[i]);
+			} else {
+				len = buxton_serialize(c->data, c->label,
+						       &values[i]);
+			}
+			value_lens[i] = (uint32_t)len;
+		}
+		size += entry_size(key_lens[i], value_lens[i]);
+	}
+
+	batch = malloc(size);
+	if (!batch) {
+		abort();
+	}
+	for (size_t i = 0; i < count; i++) {
+		offset += encode_entry(batch + offset,
+				       values[i] ? ORDERED_OP_PUT : ORDERED_OP_DELETE,
+				       keys[i], key_lens[i], values[i],
+				       value_lens[i]);
+	}
+
+	/* One write, so replay finds either the whole batch or none of it */
+	if (!append_journal(db, ORDERED_OP_BATCH, ORDERED_BATCH_KEY,
+			    ORDERED_BATCH_KEY_LENGTH, batch, (uint32_t)size)) {
+		ret = EIO;
+		goto end;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (values[i]) {
+			put_record(db, keys[i], key_lens[i], values[i],
+				   value_lens[i]);
+			keys[i] = NULL;
+			values[i] = NULL;
+		} else {
+			(void)delete_key(db, keys[i], key_lens[i]);
+		}
+	}
+
+end:
+	for (size_t i = 0; i < count; i++) {
+		free(keys[i]);
+		free(values[i]);
+	}
+
+	return ret;
+}
+
+static bool sweep_orphans(BuxtonLayer *layer, uint32_t *removed)
+{
+	OrderedDb *db;
+	OrderedRecord *update[ORDERED_MAX_LEVEL];
+	OrderedRecord *rec, *next;
+	const char *group = NULL;
+	uint32_t group_len = 0;
+	uint32_t len;
+	uint32_t count = 0;
+	bool orphan;
+
+	assert(layer);
+	assert(removed);
+
+	db = db_for_resource(layer);
+	if (!db || db->readonly) {
+		return false;
+	}
+
+	/*
+	 * A group record sorts directly before its members, so any member
+	 * not preceded by its own group record is an orphan. update keeps
+	 * the records before rec, so orphans unlink without a search.
+	 */
+	for (uint8_t l = 0; l < ORDERED_MAX_LEVEL; l++) {
+		update[l] = db->head;
+	}
+	for (rec = db->head->next[0]; rec; rec = next) {
+		next = rec->next[0];
+		if (buxton_is_label_table_key(rec->key, rec->key_len)) {
+			orphan = false;
+		} else {
+			len = (uint32_t)strnlen(rec->key, rec->key_len) + 1;
+			if (len >= rec->key_len) {
+				group = rec->key;
+				group_len = rec->key_len;
+			}
+			orphan = len < rec->key_len &&
+				!(group && group_len == len &&
+				  memcmp(group, rec->key, len) == 0);
+		}
+		if (!orphan) {
+			for (uint8_t l = 0; l < rec->level; l++) {
+				update[l] = rec;
+			}
+			continue;
+		}
+		if (!append_journal(db, ORDERED_OP_DELETE, rec->key,
+				    rec->key_len, NULL, 0)) {
+			return false;
+		}
+		unlink_record(db, update, rec);
+		count++;
+	}
+
+	*removed = count;
+	return true;
+}
+
+static bool list_keys(BuxtonLayer *layer,
+		      BuxtonArray **list)
+{
+	OrderedDb *db;
+	OrderedRecord *rec;
+	BuxtonArray *k_list = NULL;
+	BuxtonData *current = NULL;
+	size_t len;
+
+	assert(layer);
+
+	db = db_for_resource(layer);
+	if (!db) {
+		return false;
+	}
+
+	k_list = buxton_array_new();
+	if (!k_list) {
+		abort();
+	}
+	for (rec = db->head->next[0]; rec; rec = rec->next[0]) {
+		len = strnlen(rec->key, rec->key_len) + 1;
+		/* Skip group records and the label table, which have no name */
+		if (len >= rec->key_len) {
+			continue;
+		}
+
+		current = malloc0(sizeof(BuxtonData));
+		if (!current) {
+			abort();
+		}
+		current->type = STRING;
+		current->store.d_string.value = strdup(rec->key + len);
+		if (!current->store.d_string.value) {
+			abort();
+		}
+		current->store.d_string.length =
+			(uint32_t)strlen(current->store.d_string.value) + 1;
+		if (!buxton_array_add(k_list, current)) {
+			abort();
+		}
+	}
+
+	/* Pass ownership of the array to the caller */
+	*list = k_list;
+	return true;
+}
+
+struct BuxtonCursor {
+	OrderedDb *db; /**<Layer being walked */
+	char *last; /**<Key of the last record visited, or NULL */
+	uint32_t last_len; /**<Length of last */
+	size_t last_size; /**<Allocated size of last */
+	bool done; /**<Every record has been visited */
+	char *group; /**<Only visit keys with this group\0 prefix, or NULL */
+	uint32_t group_len; /**<Length of group including its nil */
+	uint32_t flags; /**<BUXTON_CURSOR_* flags */
+	char **held; /**<Keys and string values handed out last batch */
+	size_t held_count; /**<Number of pointers in held */
+	size_t held_size; /**<Allocated pointers in held */
+};
+
+static void cursor_release(BuxtonCursor *cursor)
+{
+	for (size_t i = 0; i < cursor->held_count; i++) {
+		free(cursor->held[i]);
+	}
+	cursor->held_count = 0;
+}
+
+static BuxtonCursor *cursor_open(BuxtonLayer *layer, BuxtonString *group,
+				 uint32_t flags)
+{
+	BuxtonCursor *cursor;
+	OrderedDb *db;
+
+	assert(layer);
+
+	db = db_for_resource(layer);
+	if (!db) {
+		return NULL;
+	}
+
+	cursor = malloc0(sizeof(BuxtonCursor));
+	if (!cursor) {
+		abort();
+	}
+	cursor->db = db;
+	cursor->flags = flags;
+	if (group) {
+		cursor->group = malloc(group->length);
+		if (!cursor->group) {
+			abort();
+		}
+		memcpy(cursor->group, group->value, group->length);
+		cursor->group_len = group->length;
+	}
+
+	return cursor;
+}
+
+static bool cursor_next(BuxtonCursor *cursor, BuxtonRecordView *records,
+			size_t max, size_t *count)
+{
+	OrderedDb *db;
+	OrderedRecord *rec;
+	OrderedRecord *visited = NULL;
+	BuxtonRecordView *view;
+	size_t n = 0;
+	uint32_t group_len;
+	char *key;
+
+	assert(cursor);
+	assert(records);
+	assert(count);
+
+	cursor_release(cursor);
+	/*
+	 * Records are freed as keys are set and unset, so each view holds a
+	 * copy of its key and string value. Labels are the table's.
+	 */
+	if (max * 2 > cursor->held_size) {
+		char **h = realloc(cursor->held, max * 2 * sizeof(char *));
+		if (!h) {
+			abort();
+		}
+		cursor->held = h;
+		cursor->held_size = max * 2;
+	}
+
+	/*
+	 * Records may come and go between batches, so each one carries on
+	 * from the key it stopped at rather than from a record
+	 */
+	db = cursor->db;
+	if (cursor->done) {
+		rec = NULL;
+	} else if (cursor->last) {
+		rec = seek(db, cursor->last, cursor->last_len, NULL);
+		if (has_key(rec, cursor->last, cursor->last_len)) {
+			rec = rec->next[0];
+		}
+	} else if (cursor->group) {
+		/* A group and its keys are one contiguous range */
+		rec = seek(db, cursor->group, cursor->group_len, NULL);
+	} else {
+		rec = db->head->next[0];
+	}
+	for (; n < max && rec; rec = rec->next[0]) {
+		if (cursor->group &&
+		    !has_prefix(rec, cursor->group, cursor->group_len)) {
+			/* Past the end of the group */
+			rec = NULL;
+			break;
+		}
+		visited = rec;
+		if (buxton_is_label_table_key(rec->key, rec->key_len)) {
+			continue;
+		}
+
+		view = &records[n];
+		memzero(view, sizeof(BuxtonRecordView));
+		if (cursor->flags & BUXTON_CURSOR_VALUES) {
+			if (!buxton_deserialize_record(rec->value, rec->value_len,
+						       &db->labels, &view->data,
+						       &view->label,
+						       &view->version)) {
+				buxton_log("Skipping invalid record %s\n", rec->key);
+				continue;
+			}
+			if (view->data.type == STRING) {
+				cursor->held[cursor->held_count++] =
+					view->data.store.d_string.value;
+			}
+		}
+		key = malloc(rec->key_len);
+		if (!key) {
+			abort();
+		}
+		memcpy(key, rec->key, rec->key_len);
+		cursor->held[cursor->held_count++] = key;
+		group_len = (uint32_t)strnlen(key, rec->key_len) + 1;
+		view->group.value = key;
+		view->group.length = group_len;
+		if (group_len < rec->key_len) {
+			view->name.value = key + group_len;
+			view->name.length = rec->key_len - group_len;
+		}
+		n++;
+	}
+	if (!rec) {
+		cursor->done = true;
+	} else if (visited) {
+		if (!greedy_realloc((void **)&cursor->last, &cursor->last_size,
+				    visited->key_len)) {
+			abort();
+		}
+		memcpy(cursor->last, visited->key, visited->key_len);
+		cursor->last_len = visited->key_len;
+	}
+
+	*count = n;
+	return true;
+}
+
+static void cursor_close(BuxtonCursor *cursor)
+{
+	if (!cursor) {
+		return;
+	}
+	cursor_release(cursor);
+	free(cursor->held);
+	free(cursor->last);
+	free(cursor->group);
+	free(cursor);
+}
+
+/* Fold long journals into their snapshots, away from the writes */
+static void sync_journals(void)
+{
+	Iterator iterator;
+	OrderedDb *db;
+
+	HASHMAP_FOREACH(db, _resources, iterator) {
+		if (!db->readonly &&
+		    db->journal_entries >= ORDERED_COMPACT_THRESHOLD) {
+			(void)write_snapshot(db);
+		}
+	}
+}
+
+_bx_export_ void buxton_module_destroy(void)
+{
+	const char *key;
+	Iterator iterator;
+	OrderedDb *db;
+
+	/* fold outstanding journals into their snapshots */
+	HASHMAP_FOREACH_KEY(db, key, _resources, iterator) {
+		hashmap_remove(_resources, key);
+		if (!db->readonly && db->journal_entries) {
+			(void)write_snapshot(db);
+		}
+		free_db(db);
+		free((void *)key);
+	}
+	hashmap_free(_resources);
+	_resources = NULL;
+}
+
+_bx_export_ bool buxton_module_init(BuxtonBackend *backend)
+{
+
+	assert(backend);
+
+	/* Point the struct methods back to our own */
+	backend->set_value = &set_value;
+	backend->get_value = &get_value;
+	backend->get_versioned_value = &get_versioned_value;
+	backend->list_keys = &list_keys;
+	backend->unset_value = &unset_value;
+	backend->remove_group = &remove_group;
+	backend->sweep_orphans = &sweep_orphans;
+	backend->commit = &commit;
+	backend->version = BUXTON_BACKEND_VERSION;
+	backend->cursor_open = &cursor_open;
+	backend->cursor_next = &cursor_next;
+	backend->cursor_close = &cursor_close;
+	backend->sync = &sync_journals;
+	backend->create_db = (module_db_init_func) &db_for_resource;
+
+	_resources = hashmap_new(string_hash_func, string_compare_func);
+	if (!_resources) {
+		abort();
+	}
+
+	return true;
+}
+
+/*
+ * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: t
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 noexpandtab:
+ * :indentSize=8:tabSize=8:noTabs=false:
+ */
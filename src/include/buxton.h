@@ -72,9 +72,45 @@ typedef enum BuxtonControlMessage {
 	BUXTON_CONTROL_NOTIFY, /**<Register for notification */
 	BUXTON_CONTROL_UNNOTIFY, /**<Opt out of notifications */
 	BUXTON_CONTROL_CHANGED, /**<A key changed in Buxton */
+	BUXTON_CONTROL_CHANGED_MANY, /**<Several keys changed in Buxton */
+	BUXTON_CONTROL_SUBSCRIBE, /**<Follow the journal of changes */
+	BUXTON_CONTROL_UNSUBSCRIBE, /**<Stop following the journal */
+	BUXTON_CONTROL_JOURNAL, /**<An entry of the journal of changes */
+	BUXTON_CONTROL_GET_IF_CHANGED, /**<Retrieve a value unless the client
+					 already has its version */
+	BUXTON_CONTROL_COMPARE_AND_SET, /**<Set a value if it still holds an
+					  expected value or version */
+	BUXTON_CONTROL_ADD, /**<Add to an integer value */
+	BUXTON_CONTROL_BEGIN, /**<Start a transaction within one layer */
+	BUXTON_CONTROL_COMMIT, /**<Apply the changes of a transaction */
+	BUXTON_CONTROL_ROLLBACK, /**<Drop the changes of a transaction */
 	BUXTON_CONTROL_MAX
 } BuxtonControlMessage;
 
+/**
+ * Response status for requests buxtond refused because the client
+ * exceeded its rate limit. Other failures have a status of -1.
+ */
+#define BUXTON_STATUS_THROTTLED -2
+
+/**
+ * Response status when the journal no longer holds the changes a client
+ * asked for, which has to read the keys it follows again
+ */
+#define BUXTON_STATUS_RESYNC -3
+
+/**
+ * Response status of a conditional get when the value still has the
+ * version the client already holds. No value is sent.
+ */
+#define BUXTON_STATUS_UNCHANGED -4
+
+/**
+ * Response status of a compare-and-set when the key no longer holds the
+ * expected value or version. The current value and version are sent.
+ */
+#define BUXTON_STATUS_MISMATCH -5
+
 /**
  * Used to communicate with Buxton
  */
@@ -139,6 +175,127 @@ _bx_export_ int buxton_set_value(BuxtonClient client,
 				 bool sync)
 	__attribute__((warn_unused_result));
 
+/**
+ * Set a value within Buxton if the key still holds an expected value
+ *
+ * The daemon compares and stores the value in one step. On success the
+ * response has the stored value and its version; when the key holds
+ * another value it has a status of BUXTON_STATUS_MISMATCH, with the
+ * current value and version if the client may read them.
+ * @param client An open client connection
+ * @param key The key to set
+ * @param expected A pointer to the value the key must hold
+ * @param value A pointer to a supported data type
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return A int value, indicating success of the operation
+ */
+_bx_export_ int buxton_compare_and_set_value(BuxtonClient client,
+					     BuxtonKey key,
+					     void *expected,
+					     void *value,
+					     BuxtonCallback callback,
+					     void *data,
+					     bool sync)
+	__attribute__((warn_unused_result));
+
+/**
+ * Set a value within Buxton if it still has a known version
+ *
+ * Responses are those of buxton_compare_and_set_value. Values stored
+ * without a version never match.
+ * @param client An open client connection
+ * @param key The key to set
+ * @param version Version the value must have, from buxton_response_version,
+ * or 0 if the key must not have a value yet
+ * @param value A pointer to a supported data type
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return A int value, indicating success of the operation
+ */
+_bx_export_ int buxton_set_value_if_version(BuxtonClient client,
+					    BuxtonKey key,
+					    uint64_t version,
+					    void *value,
+					    BuxtonCallback callback,
+					    void *data,
+					    bool sync)
+	__attribute__((warn_unused_result));
+
+/**
+ * Add to an INT32, UINT32, INT64 or UINT64 value within Buxton
+ *
+ * A key without a value counts as 0. Sums that don't fit the key's type
+ * fail. The response has the stored value and its version.
+ * @param client An open client connection
+ * @param key The key to change
+ * @param delta Amount to add, which may be negative
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return A int value, indicating success of the operation
+ */
+_bx_export_ int buxton_add_value(BuxtonClient client,
+				 BuxtonKey key,
+				 int64_t delta,
+				 BuxtonCallback callback,
+				 void *data,
+				 bool sync)
+	__attribute__((warn_unused_result));
+
+/**
+ * Start a transaction within one layer
+ *
+ * Until the transaction is committed or rolled back, values set and
+ * unset within the layer are only staged, and changes to other layers
+ * fail. A connection has at most one open transaction.
+ * @param client An open client connection
+ * @param layer The layer the transaction changes
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_begin_transaction(BuxtonClient client,
+					 char *layer,
+					 BuxtonCallback callback,
+					 void *data,
+					 bool sync)
+	__attribute__((warn_unused_result));
+
+/**
+ * Apply the changes staged by the open transaction
+ *
+ * Either every change is made or, if any of them fails, none is.
+ * Clients are notified of each change once it is committed.
+ * @param client An open client connection
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_commit_transaction(BuxtonClient client,
+					  BuxtonCallback callback,
+					  void *data,
+					  bool sync)
+	__attribute__((warn_unused_result));
+
+/**
+ * Drop the changes staged by the open transaction
+ * @param client An open client connection
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_rollback_transaction(BuxtonClient client,
+					    BuxtonCallback callback,
+					    void *data,
+					    bool sync)
+	__attribute__((warn_unused_result));
+
 /**
  * Set a label within Buxton
  *
@@ -211,6 +368,29 @@ _bx_export_ int buxton_get_value(BuxtonClient client,
 				 bool sync)
 	__attribute__((warn_unused_result));
 
+/**
+ * Retrieve a value from Buxton unless it is still at a known version
+ *
+ * When the value still has the given version, the response has a status
+ * of BUXTON_STATUS_UNCHANGED and no value. Otherwise it is the response
+ * to buxton_get_value, with the new version in buxton_response_version.
+ * @param client An open client connection
+ * @param key The key to retrieve
+ * @param version Version of the value the client already holds, 0 to
+ * always retrieve it
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_get_value_if_changed(BuxtonClient client,
+					    BuxtonKey key,
+					    uint64_t version,
+					    BuxtonCallback callback,
+					    void *data,
+					    bool sync)
+	__attribute__((warn_unused_result));
+
 /**
  * List all keys within a given layer in Buxon
  * @param client An open client connection
@@ -243,6 +423,24 @@ _bx_export_ int buxton_register_notification(BuxtonClient client,
 					     bool sync)
 	__attribute__((warn_unused_result));
 
+/**
+ * Register for notifications on the given key in all layers, taking
+ * changes of several keys in one message. The changes to keys registered
+ * with the same callback and data are passed to one call of the callback.
+ * @param client An open client connection
+ * @param key The key to register interest with
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_register_grouped_notification(BuxtonClient client,
+						     BuxtonKey key,
+						     BuxtonCallback callback,
+						     void *data,
+						     bool sync)
+	__attribute__((warn_unused_result));
+
 /**
  * Unregister from notifications on the given key in all layers
  * @param client An open client connection
@@ -260,6 +458,43 @@ _bx_export_ int buxton_unregister_notification(BuxtonClient client,
 	__attribute__((warn_unused_result));
 
 
+/**
+ * Follow the journal of changes buxtond keeps. The callback is called
+ * with the response to the subscription, then with a
+ * BUXTON_CONTROL_JOURNAL response for each change in order. Only changes
+ * to keys the client may read are sent.
+ * @param client An open client connection
+ * @param epoch Epoch from was numbered in, as given by
+ * buxton_response_epoch(), or 0 for changes from now on
+ * @param from Sequence number of the first change wanted, 0 for changes
+ * from now on
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_subscribe_journal(BuxtonClient client,
+					 uint64_t epoch,
+					 uint64_t from,
+					 BuxtonCallback callback,
+					 void *data,
+					 bool sync)
+	__attribute__((warn_unused_result));
+
+/**
+ * Stop following the journal of changes
+ * @param client An open client connection
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @param sync Indicator for running a synchronous request
+ * @return An int value, indicating success of the operation
+ */
+_bx_export_ int buxton_unsubscribe_journal(BuxtonClient client,
+					   BuxtonCallback callback,
+					   void *data,
+					   bool sync)
+	__attribute__((warn_unused_result));
+
 /**
  * Unset a value by key in the given BuxtonLayer
  * @param client An open client connection
@@ -366,6 +601,72 @@ _bx_export_ BuxtonKey buxton_response_key(BuxtonResponse response)
 _bx_export_ void *buxton_response_value(BuxtonResponse response)
 	__attribute__((warn_unused_result));
 
+/**
+ * Get the number of keys a change notification tells of
+ * @param response The BuxtonResponse
+ * @return The number of changed keys, 0 if the response isn't a change
+ */
+_bx_export_ size_t buxton_response_changes(BuxtonResponse response)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get one of the keys a change notification tells of
+ * @param response The BuxtonResponse
+ * @param index Index of the change, below buxton_response_changes()
+ * @return BuxtonKey of the change, to be freed with buxton_key_free
+ */
+_bx_export_ BuxtonKey buxton_response_changed_key(BuxtonResponse response,
+						  size_t index)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get the new value of one of the keys a change notification tells of
+ * @param response The BuxtonResponse
+ * @param index Index of the change, below buxton_response_changes()
+ * @return pointer to the new value, NULL if the key was unset
+ */
+_bx_export_ void *buxton_response_changed_value(BuxtonResponse response,
+						size_t index)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get the sequence number of a journal entry, or of the first entry a
+ * journal subscription gets
+ * @param response The BuxtonResponse
+ * @return The sequence number, 0 if the response has none
+ */
+_bx_export_ uint64_t buxton_response_sequence(BuxtonResponse response)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get the epoch of the journal a subscription follows. Sequence numbers
+ * only resume within the same epoch.
+ * @param response The BuxtonResponse
+ * @return The epoch, 0 if the response has none
+ */
+_bx_export_ uint64_t buxton_response_epoch(BuxtonResponse response)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get the request that made the change in a journal entry
+ * @param response The BuxtonResponse
+ * @return BUXTON_CONTROL_SET, BUXTON_CONTROL_UNSET, BUXTON_CONTROL_SET_LABEL,
+ * BUXTON_CONTROL_CREATE_GROUP or BUXTON_CONTROL_REMOVE_GROUP, and
+ * BUXTON_CONTROL_MIN when changes were lost or for other responses
+ */
+_bx_export_ BuxtonControlMessage buxton_response_journal_op(BuxtonResponse response)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get the version of the value in a response to a get, compare-and-set
+ * or add
+ * @param response The BuxtonResponse
+ * @return The version, 0 if the response has no value or the value was
+ * stored without one
+ */
+_bx_export_ uint64_t buxton_response_version(BuxtonResponse response)
+	__attribute__((warn_unused_result));
+
 /*
  * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
  *
@@ -137,6 +137,7 @@ void buxton_close(BuxtonClient client)
 	close(c->fd);
 	c->direct = 0;
 	c->fd = -1;
+	free(c->buffer);
 	free(c);
 }
 
@@ -172,11 +173,46 @@ int buxton_get_value(BuxtonClient client,
 	return ret;
 }
 
-int buxton_register_notification(BuxtonClient client,
-				 BuxtonKey key,
-				 BuxtonCallback callback,
-				 void *data,
-				 bool sync)
+int buxton_get_value_if_changed(BuxtonClient client,
+				BuxtonKey key,
+				uint64_t version,
+				BuxtonCallback callback,
+				void *data,
+				bool sync)
+{
+	bool r;
+	int ret = 0;
+	_BuxtonKey *k = (_BuxtonKey *)key;
+
+	if (!k || !(k->group.value) || !(k->name.value) ||
+	    k->type <= BUXTON_TYPE_MIN || k->type >= BUXTON_TYPE_MAX) {
+		return EINVAL;
+	}
+
+	r = buxton_wire_get_value_if_changed((_BuxtonClient *)client, k,
+					     version, callback, data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Register for notifications, grouped or not as flags say
+ */
+static int register_notification(BuxtonClient client, BuxtonKey key,
+				 BuxtonCallback callback, void *data,
+				 bool sync, uint32_t flags)
 {
 	bool r;
 	int ret = 0;
@@ -188,7 +224,7 @@ int buxton_register_notification(BuxtonClient client,
 	}
 
 	r = buxton_wire_register_notification((_BuxtonClient *)client, k,
-					      callback, data);
+					      callback, data, flags);
 	if (!r) {
 		return -1;
 	}
@@ -205,6 +241,25 @@ int buxton_register_notification(BuxtonClient client,
 	return ret;
 }
 
+int buxton_register_notification(BuxtonClient client,
+				 BuxtonKey key,
+				 BuxtonCallback callback,
+				 void *data,
+				 bool sync)
+{
+	return register_notification(client, key, callback, data, sync, 0);
+}
+
+int buxton_register_grouped_notification(BuxtonClient client,
+					 BuxtonKey key,
+					 BuxtonCallback callback,
+					 void *data,
+					 bool sync)
+{
+	return register_notification(client, key, callback, data, sync,
+				     BUXTON_NOTIFY_GROUPED);
+}
+
 int buxton_unregister_notification(BuxtonClient client,
 				   BuxtonKey key,
 				   BuxtonCallback callback,
@@ -238,6 +293,60 @@ int buxton_unregister_notification(BuxtonClient client,
 	return ret;
 }
 
+int buxton_subscribe_journal(BuxtonClient client,
+			     uint64_t epoch,
+			     uint64_t from,
+			     BuxtonCallback callback,
+			     void *data,
+			     bool sync)
+{
+	bool r;
+	int ret = 0;
+
+	r = buxton_wire_subscribe_journal((_BuxtonClient *)client, epoch,
+					  from, callback, data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+int buxton_unsubscribe_journal(BuxtonClient client,
+			       BuxtonCallback callback,
+			       void *data,
+			       bool sync)
+{
+	bool r;
+	int ret = 0;
+
+	r = buxton_wire_unsubscribe_journal((_BuxtonClient *)client,
+					    callback, data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
 int buxton_set_value(BuxtonClient client,
 		     BuxtonKey key,
 		     void *value,
@@ -272,6 +381,183 @@ int buxton_set_value(BuxtonClient client,
 	return ret;
 }
 
+/*
+ * Send a compare-and-set, checking the value or version as compare says
+ */
+static int compare_and_set(BuxtonClient client, BuxtonKey key, void *value,
+			   uint32_t compare, void *expected,
+			   BuxtonCallback callback, void *data, bool sync)
+{
+	bool r;
+	int ret = 0;
+	_BuxtonKey *k = (_BuxtonKey *)key;
+
+	if (!k || !k->group.value || !k->name.value || !k->layer.value ||
+	    k->type <= BUXTON_TYPE_MIN || k->type >= BUXTON_TYPE_MAX ||
+	    !value || !expected) {
+		return EINVAL;
+	}
+
+	r = buxton_wire_compare_and_set((_BuxtonClient *)client, k, value,
+					compare, expected, callback, data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+int buxton_compare_and_set_value(BuxtonClient client,
+				 BuxtonKey key,
+				 void *expected,
+				 void *value,
+				 BuxtonCallback callback,
+				 void *data,
+				 bool sync)
+{
+	return compare_and_set(client, key, value, BUXTON_COMPARE_VALUE,
+			       expected, callback, data, sync);
+}
+
+int buxton_set_value_if_version(BuxtonClient client,
+				BuxtonKey key,
+				uint64_t version,
+				void *value,
+				BuxtonCallback callback,
+				void *data,
+				bool sync)
+{
+	return compare_and_set(client, key, value, BUXTON_COMPARE_VERSION,
+			       &version, callback, data, sync);
+}
+
+int buxton_add_value(BuxtonClient client,
+		     BuxtonKey key,
+		     int64_t delta,
+		     BuxtonCallback callback,
+		     void *data,
+		     bool sync)
+{
+	bool r;
+	int ret = 0;
+	_BuxtonKey *k = (_BuxtonKey *)key;
+
+	if (!k || !k->group.value || !k->name.value || !k->layer.value) {
+		return EINVAL;
+	}
+	if (k->type != INT32 && k->type != UINT32 && k->type != INT64 &&
+	    k->type != UINT64) {
+		return EINVAL;
+	}
+
+	r = buxton_wire_add_value((_BuxtonClient *)client, k, delta, callback,
+				  data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+int buxton_begin_transaction(BuxtonClient client,
+			     char *layer,
+			     BuxtonCallback callback,
+			     void *data,
+			     bool sync)
+{
+	bool r;
+	int ret = 0;
+	BuxtonString l;
+
+	if (!layer) {
+		return EINVAL;
+	}
+
+	l = buxton_string_pack(layer);
+	r = buxton_wire_begin_transaction((_BuxtonClient *)client, &l,
+					  callback, data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Send a commit or rollback of the open transaction
+ */
+static int end_transaction(BuxtonClient client,
+			   BuxtonControlMessage msg,
+			   BuxtonCallback callback,
+			   void *data,
+			   bool sync)
+{
+	bool r;
+	int ret = 0;
+
+	r = buxton_wire_end_transaction((_BuxtonClient *)client, msg,
+					callback, data);
+	if (!r) {
+		return -1;
+	}
+
+	if (sync) {
+		ret = buxton_wire_get_response(client);
+		if (ret <= 0) {
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+int buxton_commit_transaction(BuxtonClient client,
+			      BuxtonCallback callback,
+			      void *data,
+			      bool sync)
+{
+	return end_transaction(client, BUXTON_CONTROL_COMMIT, callback, data,
+			       sync);
+}
+
+int buxton_rollback_transaction(BuxtonClient client,
+				BuxtonCallback callback,
+				void *data,
+				bool sync)
+{
+	return end_transaction(client, BUXTON_CONTROL_ROLLBACK, callback, data,
+			       sync);
+}
+
 int buxton_set_label(BuxtonClient client,
 		     BuxtonKey key,
 		     char *value,
@@ -607,6 +893,13 @@ int32_t buxton_response_status(BuxtonResponse response)
 		return 0;
 	}
 
+	if (buxton_response_type(response) == BUXTON_CONTROL_JOURNAL) {
+		if (buxton_response_journal_op(response) == BUXTON_CONTROL_MIN) {
+			return BUXTON_STATUS_RESYNC;
+		}
+		return 0;
+	}
+
 	d = buxton_array_get(r->data, 0);
 
 	if (d) {
@@ -642,27 +935,12 @@ BuxtonKey buxton_response_key(BuxtonResponse response)
 	return (BuxtonKey)key;
 }
 
-void *buxton_response_value(BuxtonResponse response)
+/*
+ * Copy a value from a response for the client
+ */
+static void *response_data_value(BuxtonData *d)
 {
 	void *p = NULL;
-	BuxtonData *d = NULL;
-	_BuxtonResponse *r = (_BuxtonResponse *)response;
-	BuxtonControlMessage type;
-
-	if (!response) {
-		return NULL;
-	}
-
-	type = buxton_response_type(response);
-	if (type == BUXTON_CONTROL_GET) {
-		d = buxton_array_get(r->data, 1);
-	} else if (type == BUXTON_CONTROL_CHANGED) {
-		if (r->data->len) {
-			d = buxton_array_get(r->data, 0);
-		}
-	} else {
-		goto out;
-	}
 
 	if (!d) {
 		goto out;
@@ -728,6 +1006,168 @@ out:
 	return p;
 }
 
+void *buxton_response_value(BuxtonResponse response)
+{
+	BuxtonData *d = NULL;
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+	BuxtonControlMessage type;
+
+	if (!response) {
+		return NULL;
+	}
+
+	type = buxton_response_type(response);
+	if (type == BUXTON_CONTROL_GET ||
+	    type == BUXTON_CONTROL_GET_IF_CHANGED ||
+	    type == BUXTON_CONTROL_COMPARE_AND_SET ||
+	    type == BUXTON_CONTROL_ADD) {
+		d = buxton_array_get(r->data, 1);
+	} else if (type == BUXTON_CONTROL_CHANGED) {
+		if (r->data->len) {
+			d = buxton_array_get(r->data, 0);
+		}
+	} else if (type == BUXTON_CONTROL_JOURNAL) {
+		/* After the sequence, op, layer, group, name and uid */
+		if (r->data->len > 6) {
+			d = buxton_array_get(r->data, 6);
+		}
+	}
+
+	return response_data_value(d);
+}
+
+size_t buxton_response_changes(BuxtonResponse response)
+{
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (!response || r->type != BUXTON_CONTROL_CHANGED) {
+		return 0;
+	}
+
+	/* A change of one key, possibly unset, comes on its own */
+	if (!r->keys) {
+		return 1;
+	}
+	return r->keys->len;
+}
+
+BuxtonKey buxton_response_changed_key(BuxtonResponse response, size_t index)
+{
+	_BuxtonKey *key = NULL;
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (index >= buxton_response_changes(response)) {
+		return NULL;
+	}
+
+	if (!r->keys) {
+		return buxton_response_key(response);
+	}
+
+	key = malloc0(sizeof(_BuxtonKey));
+	if (!key) {
+		return NULL;
+	}
+
+	if (!buxton_key_copy(buxton_array_get(r->keys, (uint16_t)index), key)) {
+		free(key);
+		return NULL;
+	}
+
+	return (BuxtonKey)key;
+}
+
+void *buxton_response_changed_value(BuxtonResponse response, size_t index)
+{
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (index >= buxton_response_changes(response)) {
+		return NULL;
+	}
+
+	if (!r->keys) {
+		return buxton_response_value(response);
+	}
+
+	return response_data_value(buxton_array_get(r->data, (uint16_t)index));
+}
+
+uint64_t buxton_response_sequence(BuxtonResponse response)
+{
+	BuxtonData *d = NULL;
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (!response) {
+		return 0;
+	}
+
+	if (r->type == BUXTON_CONTROL_JOURNAL) {
+		d = buxton_array_get(r->data, 0);
+	} else if (r->type == BUXTON_CONTROL_SUBSCRIBE) {
+		d = buxton_array_get(r->data, 1);
+	}
+
+	if (!d || d->type != UINT64) {
+		return 0;
+	}
+	return d->store.d_uint64;
+}
+
+uint64_t buxton_response_epoch(BuxtonResponse response)
+{
+	BuxtonData *d;
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (!response || r->type != BUXTON_CONTROL_SUBSCRIBE) {
+		return 0;
+	}
+
+	d = buxton_array_get(r->data, 2);
+	if (!d || d->type != UINT64) {
+		return 0;
+	}
+	return d->store.d_uint64;
+}
+
+BuxtonControlMessage buxton_response_journal_op(BuxtonResponse response)
+{
+	BuxtonData *d;
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (!response || r->type != BUXTON_CONTROL_JOURNAL) {
+		return BUXTON_CONTROL_MIN;
+	}
+
+	d = buxton_array_get(r->data, 1);
+	if (!d || d->type != UINT32) {
+		return BUXTON_CONTROL_MIN;
+	}
+	return (BuxtonControlMessage)d->store.d_uint32;
+}
+
+uint64_t buxton_response_version(BuxtonResponse response)
+{
+	BuxtonData *d;
+	_BuxtonResponse *r = (_BuxtonResponse *)response;
+
+	if (!response || (r->type != BUXTON_CONTROL_GET &&
+			  r->type != BUXTON_CONTROL_GET_IF_CHANGED &&
+			  r->type != BUXTON_CONTROL_COMPARE_AND_SET &&
+			  r->type != BUXTON_CONTROL_ADD)) {
+		return 0;
+	}
+
+	/* After the status and the value; older daemons send none */
+	if (r->data->len < 3) {
+		return 0;
+	}
+	d = buxton_array_get(r->data, 2);
+	if (!d || d->type != UINT64) {
+		return 0;
+	}
+	return d->store.d_uint64;
+}
+
 /*
  * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
  *
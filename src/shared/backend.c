@@ -104,6 +104,8 @@ static BuxtonLayer *buxton_layer_new(ConfigLayer *conf_layer)
 		out->backend = BACKEND_GDBM;
 	} else if (strcmp(conf_layer->backend, "memory") == 0) {
 		out->backend = BACKEND_MEMORY;
+	} else if (strcmp(conf_layer->backend, "ordered") == 0) {
+		out->backend = BACKEND_ORDERED;
 	} else {
 		buxton_log("Layer %s has unknown database: %s\n", conf_layer->name, conf_layer->backend);
 		goto fail;
@@ -118,6 +120,7 @@ static BuxtonLayer *buxton_layer_new(ConfigLayer *conf_layer)
 
 	out->readonly = is_read_only(conf_layer);
 	out->priority = conf_layer->priority;
+	out->snapshot = conf_layer->snapshot;
 	return out;
 fail:
 	free(out->name.value);
@@ -147,6 +150,8 @@ static void init_backend(BuxtonConfig *config,
 		name = "gdbm";
 	} else if (layer->backend == BACKEND_MEMORY) {
 		name = "memory";
+	} else if (layer->backend == BACKEND_ORDERED) {
+		name = "ordered";
 	} else {
 		buxton_log("Invalid backend type for layer: %s\n", layer->name);
 		abort();
@@ -198,6 +203,16 @@ static void init_backend(BuxtonConfig *config,
 		buxton_log("buxton_module_init failed\n");
 		abort();
 	}
+	if (backend_tmp->version < 1) {
+		buxton_debug("Module %s has no transactions or batch functions\n",
+			     name);
+	}
+	if (backend_tmp->version < 2) {
+		buxton_debug("Module %s has no cursors\n", name);
+	}
+	if (backend_tmp->version < 3) {
+		buxton_debug("Module %s has no sync\n", name);
+	}
 
 	if (!config->backends) {
 		config->backends = hashmap_new(trivial_hash_func, trivial_compare_func);
@@ -243,6 +258,121 @@ BuxtonBackend *backend_for_layer(BuxtonConfig *config,
 	return (BuxtonBackend*)hashmap_get(config->databases, layer->name.value);
 }
 
+bool backend_has_version(BuxtonBackend *backend, uint32_t version)
+{
+	assert(backend);
+
+	return backend->version >= version;
+}
+
+int backend_get_many(BuxtonBackend *backend, BuxtonLayer *layer,
+		     BuxtonBatchItem *items, size_t count)
+{
+	int ret = 0;
+
+	assert(backend);
+	assert(layer);
+	assert(items || count == 0);
+
+	if (backend_has_version(backend, 1) && backend->get_many) {
+		return backend->get_many(layer, items, count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		items[i].version = 0;
+		if (backend_has_version(backend, 1) &&
+		    backend->get_versioned_value) {
+			items[i].status = backend->get_versioned_value(layer,
+								       items[i].key,
+								       items[i].data,
+								       items[i].label,
+								       &items[i].version);
+		} else {
+			items[i].status = backend->get_value(layer, items[i].key,
+							     items[i].data,
+							     items[i].label);
+		}
+		if (items[i].status && !ret) {
+			ret = items[i].status;
+		}
+	}
+
+	return ret;
+}
+
+int backend_set_many(BuxtonBackend *backend, BuxtonLayer *layer,
+		     BuxtonBatchItem *items, size_t count)
+{
+	int ret = 0;
+
+	assert(backend);
+	assert(layer);
+	assert(items || count == 0);
+
+	if (backend_has_version(backend, 1) && backend->set_many) {
+		return backend->set_many(layer, items, count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		items[i].status = backend->set_value(layer, items[i].key,
+						     items[i].data,
+						     items[i].label);
+		if (items[i].status && !ret) {
+			ret = items[i].status;
+		}
+	}
+
+	return ret;
+}
+
+int backend_unset_many(BuxtonBackend *backend, BuxtonLayer *layer,
+		       BuxtonBatchItem *items, size_t count)
+{
+	int ret = 0;
+
+	assert(backend);
+	assert(layer);
+	assert(items || count == 0);
+
+	if (backend_has_version(backend, 1) && backend->unset_many) {
+		return backend->unset_many(layer, items, count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		items[i].status = backend->unset_value(layer, items[i].key,
+						       NULL, NULL);
+		if (items[i].status && !ret) {
+			ret = items[i].status;
+		}
+	}
+
+	return ret;
+}
+
+BuxtonCursor *backend_cursor_open(BuxtonBackend *backend, BuxtonLayer *layer,
+				  BuxtonString *group, uint32_t flags)
+{
+	assert(backend);
+	assert(layer);
+
+	if (!backend_has_version(backend, 2) || !backend->cursor_open) {
+		return NULL;
+	}
+
+	return backend->cursor_open(layer, group, flags);
+}
+
+void backend_sync(BuxtonBackend *backend)
+{
+	assert(backend);
+
+	if (!backend_has_version(backend, 3) || !backend->sync) {
+		return;
+	}
+
+	backend->sync();
+}
+
 void destroy_backend(BuxtonBackend *backend)
 {
 
@@ -252,6 +382,19 @@ void destroy_backend(BuxtonBackend *backend)
 	backend->get_value = NULL;
 	backend->list_keys = NULL;
 	backend->unset_value = NULL;
+	backend->remove_group = NULL;
+	backend->sweep_orphans = NULL;
+	backend->create_db = NULL;
+	backend->get_versioned_value = NULL;
+	backend->commit = NULL;
+	backend->version = 0;
+	backend->get_many = NULL;
+	backend->set_many = NULL;
+	backend->unset_many = NULL;
+	backend->cursor_open = NULL;
+	backend->cursor_next = NULL;
+	backend->cursor_close = NULL;
+	backend->sync = NULL;
 	backend->destroy();
 	dlclose(backend->module);
 	free(backend);
@@ -28,6 +28,26 @@
 #include "protocol.h"
 #include "hashmap.h"
 
+/**
+ * Version of the backend interface, which modules set in their
+ * BuxtonBackend. The fields up to create_db are laid out as they always
+ * were, and every field after version is only there for modules that
+ * set it. Modules from before it was added leave it 0. Version 1 added
+ * group removal, orphan sweeps, versioned gets, transactions and batch
+ * functions, version 2 cursors, and version 3 sync.
+ */
+#define BUXTON_BACKEND_VERSION 3
+
+/**
+ * Cursor flag to fetch the value and label of each record
+ */
+#define BUXTON_CURSOR_VALUES (1 << 0)
+
+/**
+ * Most records a cursor hands out in one batch
+ */
+#define BUXTON_CURSOR_BATCH 64
+
 /**
  * Possible backends for Buxton
  */
@@ -35,6 +55,7 @@ typedef enum BuxtonBackendType {
 	BACKEND_UNSET = 0, /**<No backend set */
 	BACKEND_GDBM, /**<GDBM backend */
 	BACKEND_MEMORY, /**<Memory backend */
+	BACKEND_ORDERED, /**<Ordered backend */
 	BACKEND_MAXTYPES
 } BuxtonBackendType;
 
@@ -62,6 +83,8 @@ typedef struct BuxtonLayer {
 	int priority; /**<Priority of this layer */
 	char *description; /**<Description of this layer */
 	bool readonly; /**<Layer is readonly or not */
+	bool snapshot; /**<Persist a volatile layer across restarts */
+	void *handle; /**<Database last used, cached by the layer's backend */
 } BuxtonLayer;
 
 /**
@@ -75,6 +98,123 @@ typedef struct BuxtonLayer {
 typedef int (*module_value_func) (BuxtonLayer *layer, _BuxtonKey *key,
 				  BuxtonData *data, BuxtonString *label);
 
+/**
+ * Backend versioned get function
+ * @param layer The layer to query
+ * @param key The key to query
+ * @param data Get data
+ * @param label The key's label
+ * @param version Pointer to store the value's version in, 0 if the value
+ * was stored without one
+ * @return a int value, indicating success of the operation or errno
+ */
+typedef int (*module_versioned_value_func) (BuxtonLayer *layer,
+					    _BuxtonKey *key,
+					    BuxtonData *data,
+					    BuxtonString *label,
+					    uint64_t *version);
+
+/**
+ * A change to one key of a layer, made along with the other changes of
+ * a transaction
+ */
+typedef struct BuxtonChange {
+	_BuxtonKey *key; /**<Key to change */
+	BuxtonData *data; /**<New value, or NULL to unset the key */
+	BuxtonString *label; /**<Label of the new value */
+} BuxtonChange;
+
+/**
+ * Backend transaction commit function
+ *
+ * Changes are applied in order, and either all of them are kept or
+ * none, including when buxtond stops half way through
+ * @param layer The layer to manipulate
+ * @param changes The changes to make
+ * @param count Number of changes
+ * @return a int value, indicating success of the operation or errno
+ */
+typedef int (*module_commit_func) (BuxtonLayer *layer, BuxtonChange *changes,
+				   size_t count);
+
+/**
+ * One key of a batch operation, with its own result
+ */
+typedef struct BuxtonBatchItem {
+	_BuxtonKey *key; /**<Key to get, set or unset */
+	BuxtonData *data; /**<Value to set, or where the value got is stored */
+	BuxtonString *label; /**<Label to set, or where the label got is stored */
+	uint64_t version; /**<Version of the value got, 0 if it has none */
+	int status; /**<0, or the errno the key failed with */
+} BuxtonBatchItem;
+
+/**
+ * Backend batch function, doing what the matching single key function
+ * does for each item while looking up the layer's database only once.
+ * Unlike a commit, items that fail don't stop the others.
+ * @param layer The layer to manipulate or query
+ * @param items The keys to manipulate or query, each given its status
+ * @param count Number of items
+ * @return 0 if every item succeeded, or the first item's errno that
+ * didn't
+ */
+typedef int (*module_batch_func) (BuxtonLayer *layer, BuxtonBatchItem *items,
+				  size_t count);
+
+/**
+ * A record seen through a cursor. It points into memory the cursor
+ * holds, or into the layer's label table for the label, so is only
+ * valid until the cursor's next batch or close. Changing the layer in
+ * between leaves it intact.
+ */
+typedef struct BuxtonRecordView {
+	BuxtonString group; /**<Group of the record, nil terminated */
+	BuxtonString name; /**<Name of the record, NULL for a group record */
+	BuxtonData data; /**<Value, only set with BUXTON_CURSOR_VALUES */
+	BuxtonString label; /**<Label, only set with BUXTON_CURSOR_VALUES */
+	uint64_t version; /**<Version of the value, 0 if it has none */
+} BuxtonRecordView;
+
+/**
+ * Position of a walk over the records of a layer, defined by each module
+ */
+typedef struct BuxtonCursor BuxtonCursor;
+
+/**
+ * Backend cursor open function
+ *
+ * Records come in no particular order, and a layer changed while a
+ * cursor is open may have records skipped or seen twice.
+ * @param layer The layer to walk
+ * @param group Only walk the group record and keys of this group, or
+ * NULL for the whole layer
+ * @param flags BUXTON_CURSOR_VALUES or 0
+ * @return A cursor to pass to the other cursor functions, or NULL
+ */
+typedef BuxtonCursor *(*module_cursor_open_func) (BuxtonLayer *layer,
+						  BuxtonString *group,
+						  uint32_t flags);
+
+/**
+ * Backend cursor batch function
+ * @param cursor An open cursor
+ * @param records Where to put the next records
+ * @param max Most records to put in records, which a backend may lower
+ * to BUXTON_CURSOR_BATCH
+ * @param count Pointer to store the number of records in, 0 once the
+ * walk is done
+ * @return a boolean value, indicating success of the operation
+ */
+typedef bool (*module_cursor_next_func) (BuxtonCursor *cursor,
+					 BuxtonRecordView *records,
+					 size_t max, size_t *count);
+
+/**
+ * Backend cursor close function
+ * @param cursor The cursor to free, along with the records it handed out
+ */
+typedef void (*module_cursor_close_func) (BuxtonCursor *cursor);
+
 /**
  * Backend key list function
  * @param layer The layer to query
@@ -83,6 +223,14 @@ typedef int (*module_value_func) (BuxtonLayer *layer, _BuxtonKey *key,
  */
 typedef bool (*module_list_func) (BuxtonLayer *layer, BuxtonArray **data);
 
+/**
+ * Backend orphan sweep function
+ * @param layer The layer to sweep
+ * @param removed Pointer to store the number of keys removed
+ * @return a boolean value, indicating success of the operation
+ */
+typedef bool (*module_sweep_func) (BuxtonLayer *layer, uint32_t *removed);
+
 /**
  * Backend database creation function
  * @param layer The layer matching the db to create
@@ -95,6 +243,13 @@ typedef void *(*module_db_init_func) (BuxtonLayer *layer);
  */
 typedef void (*module_destroy_func) (void);
 
+/**
+ * Write out whatever a backend module only holds in memory, and do any
+ * upkeep kept out of the write path, keeping its databases open.
+ * buxtond calls it periodically.
+ */
+typedef void (*module_sync_func) (void);
+
 /**
  * A data-backend for Buxton
  *
@@ -108,6 +263,22 @@ typedef struct BuxtonBackend {
 	module_list_func list_keys; /**<List keys function */
 	module_value_func unset_value; /**<Unset value function */
 	module_db_init_func create_db; /**<DB file creation function */
+	uint32_t version; /**<BUXTON_BACKEND_VERSION of the module */
+	module_value_func remove_group; /**<Remove group and its keys function,
+					  optional */
+	module_sweep_func sweep_orphans; /**<Remove keys without a group
+					   function, optional */
+	module_versioned_value_func get_versioned_value; /**<Get value and
+							   version function,
+							   optional */
+	module_commit_func commit; /**<Apply a transaction at once, optional */
+	module_batch_func get_many; /**<Get several values, optional */
+	module_batch_func set_many; /**<Set several values, optional */
+	module_batch_func unset_many; /**<Unset several values, optional */
+	module_cursor_open_func cursor_open; /**<Start walking a layer, optional */
+	module_cursor_next_func cursor_next; /**<Get the next records of a walk */
+	module_cursor_close_func cursor_close; /**<End a walk */
+	module_sync_func sync; /**<Write out what is held in memory, optional */
 } BuxtonBackend;
 
 /**
@@ -145,6 +316,76 @@ BuxtonBackend *backend_for_layer(BuxtonConfig *config,
 				 BuxtonLayer *layer)
 	__attribute__((warn_unused_result));
 
+/**
+ * Check a module was built with the fields of a backend interface
+ * version, which are only read once this holds
+ * @param backend The backend to check
+ * @param version The BUXTON_BACKEND_VERSION that added the fields
+ * @return a boolean value, indicating the module has the fields
+ */
+bool backend_has_version(BuxtonBackend *backend, uint32_t version)
+	__attribute__((warn_unused_result));
+
+/**
+ * Get several values of a layer, one at a time for modules without
+ * get_many
+ * @param backend The layer's backend
+ * @param layer The layer to query
+ * @param items The keys to get, with empty data and labels
+ * @param count Number of items
+ * @return 0 if every item was found, or the first item's errno that
+ * wasn't
+ */
+int backend_get_many(BuxtonBackend *backend, BuxtonLayer *layer,
+		     BuxtonBatchItem *items, size_t count);
+
+/**
+ * Set several values of a layer, one at a time for modules without
+ * set_many
+ * @param backend The layer's backend
+ * @param layer The layer to manipulate
+ * @param items The keys to set, with their data and labels
+ * @param count Number of items
+ * @return 0 if every item was set, or the first item's errno that
+ * wasn't
+ */
+int backend_set_many(BuxtonBackend *backend, BuxtonLayer *layer,
+		     BuxtonBatchItem *items, size_t count);
+
+/**
+ * Unset several values of a layer, one at a time for modules without
+ * unset_many
+ * @param backend The layer's backend
+ * @param layer The layer to manipulate
+ * @param items The keys to unset
+ * @param count Number of items
+ * @return 0 if every item was unset, or the first item's errno that
+ * wasn't
+ */
+int backend_unset_many(BuxtonBackend *backend, BuxtonLayer *layer,
+		       BuxtonBatchItem *items, size_t count);
+
+/**
+ * Open a cursor over a layer, for modules that have cursors
+ * @param backend The layer's backend
+ * @param layer The layer to walk
+ * @param group Only walk this group, or NULL for the whole layer
+ * @param flags BUXTON_CURSOR_VALUES or 0
+ * @return A cursor to use with the backend's cursor_next and
+ * cursor_close, or NULL if the module has no cursors or the layer
+ * couldn't be opened
+ */
+BuxtonCursor *backend_cursor_open(BuxtonBackend *backend, BuxtonLayer *layer,
+				  BuxtonString *group, uint32_t flags)
+	__attribute__((warn_unused_result));
+
+/**
+ * Write out what a backend only holds in memory, for modules that
+ * have sync
+ * @param backend The backend to sync
+ */
+void backend_sync(BuxtonBackend *backend);
+
 /**
  * Initialize layers using the configuration file
  * @param config A BuxtonControl's configuration
@@ -21,6 +21,9 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 /**
  * Used to communicate with Buxton
@@ -30,6 +33,10 @@ typedef struct BuxtonClient {
 	bool direct; /**<Only used for direction connections */
 	pid_t pid; /**<Process ID, used within libbuxton */
 	uid_t uid; /**<User ID of currently using user */
+	uint8_t *buffer; /**<Responses read but not yet handled */
+	size_t start; /**<Start of data in buffer not yet handled */
+	size_t offset; /**<Current position to write to buffer */
+	size_t size; /**<Size of buffer */
 } _BuxtonClient;
 
 /*
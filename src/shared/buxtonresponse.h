@@ -25,6 +25,7 @@ typedef struct BuxtonResponse {
 	BuxtonArray *data; /**<Array containing BuxtonData elements */
 	BuxtonControlMessage type; /**<Type of message in the response */
 	_BuxtonKey *key; /**<Key used by client to make the request */
+	BuxtonArray *keys; /**<Key of each value in a grouped change, else NULL */
 } _BuxtonResponse;
 
 /*
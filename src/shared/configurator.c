@@ -62,7 +62,17 @@ static const char *KS[CONFIG_MAX] = {
 	"BUXTON_MODULE_DIR",
 	"BUXTON_DB_PATH",
 	"BUXTON_SMACK_LOAD_FILE",
-	"BUXTON_BUXTON_SOCKET"
+	"BUXTON_BUXTON_SOCKET",
+	"BUXTON_PRIORITY_UIDS",
+	"BUXTON_PRIORITY_LABELS",
+	"BUXTON_READ_RATE",
+	"BUXTON_WRITE_RATE",
+	"BUXTON_NOTIFY_RATE",
+	"BUXTON_COALESCE_KEYS",
+	"BUXTON_COALESCE_INTERVAL",
+	"BUXTON_JOURNAL_SIZE",
+	"BUXTON_MAX_OPEN_DATABASES",
+	"BUXTON_DATABASE_CACHE_SIZE"
 };
 
 /**
@@ -75,7 +85,17 @@ static const char *config_keys[CONFIG_MAX] = {
 	"ModuleDirectory",
 	"DatabasePath",
 	"SmackLoadFile",
-	"SocketPath"
+	"SocketPath",
+	"PriorityUids",
+	"PriorityLabels",
+	"ReadRate",
+	"WriteRate",
+	"NotifyRate",
+	"CoalesceKeys",
+	"CoalesceInterval",
+	"JournalSize",
+	"MaxOpenDatabases",
+	"DatabaseCacheSize"
 };
 
 static const char *COMPILE_DEFAULT[CONFIG_MAX] = {
@@ -84,7 +104,17 @@ static const char *COMPILE_DEFAULT[CONFIG_MAX] = {
 	_MODULE_DIRECTORY,
 	_DB_PATH,
 	_SMACK_LOAD_FILE,
-	_BUXTON_SOCKET
+	_BUXTON_SOCKET,
+	"0",			/**< root is served first by default */
+	"",
+	"1000",
+	"100",
+	"100",
+	"",
+	"100",
+	"1024",
+	"64",
+	"0"			/**< the backend's own cache size */
 };
 
 /**
@@ -166,6 +196,24 @@ static inline int get_ini_int(char *section, char *name, bool required,
 	return iniparser_getint(conf.ini, buf, def);
 }
 
+/**
+ * analagous method to get_ini_string(), for boolean settings
+ *
+ * @param section the section of the ini file
+ * @param name the name of the key
+ * @param def default value when the key is missing
+ *
+ * @return the value
+ */
+static inline bool get_ini_bool(char *section, char *name, bool def)
+{
+	char buf[PATH_MAX];
+
+	assert(conf.ini);
+	snprintf(buf, sizeof(buf), "%s:%s", section, name);
+	return iniparser_getboolean(conf.ini, buf, def) == 1;
+}
+
 /**
  * @internal
  * Initialize conf
@@ -282,6 +330,66 @@ const char* buxton_socket(void)
 	return (const char*)conf.keys[CONFIG_BUXTON_SOCKET];
 }
 
+const char* buxton_priority_uids(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_PRIORITY_UIDS];
+}
+
+const char* buxton_priority_labels(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_PRIORITY_LABELS];
+}
+
+const char* buxton_read_rate(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_READ_RATE];
+}
+
+const char* buxton_write_rate(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_WRITE_RATE];
+}
+
+const char* buxton_notify_rate(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_NOTIFY_RATE];
+}
+
+const char* buxton_coalesce_keys(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_COALESCE_KEYS];
+}
+
+const char* buxton_coalesce_interval(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_COALESCE_INTERVAL];
+}
+
+const char* buxton_journal_size(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_JOURNAL_SIZE];
+}
+
+const char* buxton_max_open_databases(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_MAX_OPEN_DATABASES];
+}
+
+const char* buxton_database_cache_size(void)
+{
+	initialize();
+	return (const char*)conf.keys[CONFIG_DATABASE_CACHE_SIZE];
+}
+
 int buxton_key_get_layers(ConfigLayer **layers)
 {
 	ConfigLayer *_layers;
@@ -320,6 +428,8 @@ int buxton_key_get_layers(ConfigLayer **layers)
 			true, 0);
 		_layers[j].access = get_ini_string(section_name, "Access",
 			false, "read-write");
+		_layers[j].snapshot = get_ini_bool(section_name, "Snapshot",
+			false);
 		j++;
 	}
 	*layers = _layers;
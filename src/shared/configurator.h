@@ -20,6 +20,8 @@
 	#include "config.h"
 #endif
 
+#include <stdbool.h>
+
 typedef enum ConfigKey {
 	CONFIG_MIN = 0,
 	CONFIG_CONF_FILE,
@@ -27,6 +29,16 @@ typedef enum ConfigKey {
 	CONFIG_DB_PATH,
 	CONFIG_SMACK_LOAD_FILE,
 	CONFIG_BUXTON_SOCKET,
+	CONFIG_PRIORITY_UIDS,
+	CONFIG_PRIORITY_LABELS,
+	CONFIG_READ_RATE,
+	CONFIG_WRITE_RATE,
+	CONFIG_NOTIFY_RATE,
+	CONFIG_COALESCE_KEYS,
+	CONFIG_COALESCE_INTERVAL,
+	CONFIG_JOURNAL_SIZE,
+	CONFIG_MAX_OPEN_DATABASES,
+	CONFIG_DATABASE_CACHE_SIZE,
 	CONFIG_MAX
 } ConfigKey;
 
@@ -42,6 +54,7 @@ typedef struct ConfigLayer {
 	char *description;
 	char *access;
 	int priority;
+	bool snapshot;
 } ConfigLayer;
 
 /**
@@ -105,6 +118,117 @@ const char *buxton_smack_load_file(void)
 const char *buxton_socket(void)
 	__attribute__((warn_unused_result));
 
+/**
+ * @internal
+ * @brief Get the UIDs of clients buxtond serves first.
+ *
+ *
+ * @return a comma separated list of UIDs. Do not free this pointer.
+ * It belongs to configurator.
+ */
+const char *buxton_priority_uids(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the Smack labels of clients buxtond serves first.
+ *
+ *
+ * @return a comma separated list of labels. Do not free this pointer.
+ * It belongs to configurator.
+ */
+const char *buxton_priority_labels(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the rate limit of a client's reads.
+ *
+ *
+ * @return the number of reads per second, 0 for no limit. Do not free
+ * this pointer. It belongs to configurator.
+ */
+const char *buxton_read_rate(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the rate limit of a client's writes.
+ *
+ *
+ * @return the number of writes per second, 0 for no limit. Do not free
+ * this pointer. It belongs to configurator.
+ */
+const char *buxton_write_rate(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the rate limit of a client's notification registrations.
+ *
+ *
+ * @return the number of registrations per second, 0 for no limit. Do
+ * not free this pointer. It belongs to configurator.
+ */
+const char *buxton_notify_rate(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the keys whose notifications are coalesced.
+ *
+ *
+ * @return a comma separated list of groups and group:name keys. Do not
+ * free this pointer. It belongs to configurator.
+ */
+const char *buxton_coalesce_keys(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the least time between notifications of a coalesced key.
+ *
+ *
+ * @return the number of milliseconds. Do not free this pointer. It
+ * belongs to configurator.
+ */
+const char *buxton_coalesce_interval(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the number of changes buxtond keeps in its journal.
+ *
+ *
+ * @return the number of changes, 0 to keep no journal. Do not free
+ * this pointer. It belongs to configurator.
+ */
+const char *buxton_journal_size(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the number of databases a backend keeps open at once.
+ *
+ *
+ * @return the number of databases, 0 for no limit. Do not free this
+ * pointer. It belongs to configurator.
+ */
+const char *buxton_max_open_databases(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * @internal
+ * @brief Get the size of the cache a backend keeps for each open
+ * database.
+ *
+ *
+ * @return the number of cached buckets, 0 for the backend's default.
+ * Do not free this pointer. It belongs to configurator.
+ */
+const char *buxton_database_cache_size(void)
+	__attribute__((warn_unused_result));
+
 /**
  * @internal
  * @brief Get an array of ConfigLayers from the conf file
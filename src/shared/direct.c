@@ -38,9 +38,28 @@ bool buxton_direct_open(BuxtonControl *control)
 	return true;
 }
 
+/*
+ * Get a value from one layer, and its version if version isn't NULL.
+ * Backends without versions report 0.
+ */
+static int get_value_for_layer(BuxtonControl *control, _BuxtonKey *key,
+			       BuxtonData *data, BuxtonString *data_label,
+			       BuxtonString *client_label, uint64_t *version);
+
 int32_t buxton_direct_get_value(BuxtonControl *control, _BuxtonKey *key,
 			     BuxtonData *data, BuxtonString *data_label,
 			     BuxtonString *client_label)
+{
+	return buxton_direct_get_versioned_value(control, key, data,
+						 data_label, client_label,
+						 NULL);
+}
+
+int32_t buxton_direct_get_versioned_value(BuxtonControl *control,
+					  _BuxtonKey *key, BuxtonData *data,
+					  BuxtonString *data_label,
+					  BuxtonString *client_label,
+					  uint64_t *version)
 {
 	/* Handle direct manipulation */
 	BuxtonLayer *l;
@@ -56,9 +75,9 @@ int32_t buxton_direct_get_value(BuxtonControl *control, _BuxtonKey *key,
 	assert(key);
 
 	if (key->layer.value) {
-		ret = (int32_t)buxton_direct_get_value_for_layer(control, key, data,
-						      data_label,
-						      client_label);
+		ret = (int32_t)get_value_for_layer(control, key, data,
+						   data_label, client_label,
+						   version);
 		return ret;
 	}
 
@@ -98,11 +117,9 @@ int32_t buxton_direct_get_value(BuxtonControl *control, _BuxtonKey *key,
 	if (layer.value) {
 		key->layer.value = layer.value;
 		key->layer.length = layer.length;
-		ret = (int32_t)buxton_direct_get_value_for_layer(control,
-						      key,
-						      data,
-						      data_label,
-						      client_label);
+		ret = (int32_t)get_value_for_layer(control, key, data,
+						   data_label, client_label,
+						   version);
 		key->layer.value = NULL;
 		key->layer.length = 0;
 
@@ -116,6 +133,14 @@ int buxton_direct_get_value_for_layer(BuxtonControl *control,
 				       BuxtonData *data,
 				       BuxtonString *data_label,
 				       BuxtonString *client_label)
+{
+	return get_value_for_layer(control, key, data, data_label,
+				   client_label, NULL);
+}
+
+static int get_value_for_layer(BuxtonControl *control, _BuxtonKey *key,
+			       BuxtonData *data, BuxtonString *data_label,
+			       BuxtonString *client_label, uint64_t *version)
 {
 	/* Handle direct manipulation */
 	BuxtonBackend *backend = NULL;
@@ -172,7 +197,16 @@ int buxton_direct_get_value_for_layer(BuxtonControl *control,
 		}
 	}
 
-	ret = backend->get_value(layer, key, data, data_label);
+	if (!version) {
+		ret = backend->get_value(layer, key, data, data_label);
+	} else if (backend_has_version(backend, 1) &&
+		   backend->get_versioned_value) {
+		ret = backend->get_versioned_value(layer, key, data,
+						   data_label, version);
+	} else {
+		ret = backend->get_value(layer, key, data, data_label);
+		*version = 0;
+	}
 	if (!ret) {
 		/* Access checks are not needed for direct clients, where client_label is NULL */
 		if (data_label->value && client_label && client_label->value &&
@@ -195,27 +229,125 @@ fail:
 	return ret;
 }
 
-bool buxton_direct_set_value(BuxtonControl *control,
-			     _BuxtonKey *key,
-			     BuxtonData *data,
-			     BuxtonString *label)
+/*
+ * Add delta to an integer value, where a key without a value counts as
+ * 0. Fails if the sum doesn't fit the key's type.
+ */
+static bool add_delta(BuxtonDataType type, BuxtonData *current,
+		      int64_t delta, BuxtonData *sum)
+{
+	int64_t i;
+	uint64_t u;
+
+	memzero(sum, sizeof(BuxtonData));
+	sum->type = type;
+
+	switch (type) {
+	case INT32:
+		i = current ? current->store.d_int32 : 0;
+		if (delta > (int64_t)INT32_MAX - i || delta < (int64_t)INT32_MIN - i) {
+			return false;
+		}
+		sum->store.d_int32 = (int32_t)(i + delta);
+		break;
+	case UINT32:
+		i = current ? current->store.d_uint32 : 0;
+		if (delta > (int64_t)UINT32_MAX - i || delta < -i) {
+			return false;
+		}
+		sum->store.d_uint32 = (uint32_t)(i + delta);
+		break;
+	case INT64:
+		i = current ? current->store.d_int64 : 0;
+		if ((delta > 0 && i > INT64_MAX - delta) ||
+		    (delta < 0 && i < INT64_MIN - delta)) {
+			return false;
+		}
+		sum->store.d_int64 = i + delta;
+		break;
+	case UINT64:
+		u = current ? current->store.d_uint64 : 0;
+		if (delta >= 0) {
+			if ((uint64_t)delta > UINT64_MAX - u) {
+				return false;
+			}
+			sum->store.d_uint64 = u + (uint64_t)delta;
+		} else {
+			/* -delta overflows for INT64_MIN, so negate delta + 1 */
+			if ((uint64_t)-(delta + 1) + 1 > u) {
+				return false;
+			}
+			sum->store.d_uint64 = u - ((uint64_t)-(delta + 1) + 1);
+		}
+		break;
+	default:
+		buxton_debug("Can't add to a value of type %s\n",
+			     buxton_type_as_string(type));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Check an update against the key's current value and version, where
+ * current is NULL if the key has no value
+ */
+static int32_t check_update(BuxtonUpdate *update, BuxtonData *current,
+			    uint64_t version)
+{
+	switch (update->type) {
+	case BUXTON_UPDATE_IF_VALUE:
+		assert(update->expected);
+		if (!current || !buxton_data_equal(current, update->expected)) {
+			return BUXTON_STATUS_MISMATCH;
+		}
+		break;
+	case BUXTON_UPDATE_IF_VERSION:
+		/* Unversioned values report 0, which never matches */
+		if (current ? (version == 0 || version != update->version) :
+		    update->version != 0) {
+			return BUXTON_STATUS_MISMATCH;
+		}
+		break;
+	case BUXTON_UPDATE_ADD:
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Set a value, first checking or changing it as update says when update
+ * isn't NULL. The value is fetched once, for both the access checks and
+ * the update.
+ */
+static int32_t update_value(BuxtonControl *control, _BuxtonKey *key,
+			    BuxtonUpdate *update, BuxtonData *data,
+			    BuxtonString *label, BuxtonData *result,
+			    uint64_t *version)
 {
 	BuxtonBackend *backend;
 	BuxtonLayer *layer;
 	BuxtonConfig *config;
 	BuxtonString default_label = buxton_string_pack("_");
 	BuxtonString *l;
+	BuxtonData sum;
 	_cleanup_buxton_data_ BuxtonData *d = NULL;
 	_cleanup_buxton_data_ BuxtonData *g = NULL;
 	_cleanup_buxton_key_ _BuxtonKey *group = NULL;
 	_cleanup_buxton_string_ BuxtonString *data_label = NULL;
 	_cleanup_buxton_string_ BuxtonString *group_label = NULL;
-	bool r = false;
+	uint64_t current_version = 0;
+	bool found;
+	int32_t r = -1;
 	int ret;
 
 	assert(control);
 	assert(key);
-	assert(data);
+	assert(data || (update && update->type == BUXTON_UPDATE_ADD));
 
 	buxton_debug("set_value start\n");
 
@@ -259,11 +391,13 @@ bool buxton_direct_set_value(BuxtonControl *control,
 			goto fail;
 		}
 
-		ret = buxton_direct_get_value_for_layer(control, key, d, data_label, NULL);
+		ret = get_value_for_layer(control, key, d, data_label, NULL,
+					  &current_version);
 		if (ret == -ENOENT || ret == EINVAL) {
 			goto fail;
 		}
-		if (!ret) {
+		found = !ret;
+		if (found) {
 			if (!buxton_check_smack_access(label, data_label, ACCESS_WRITE)) {
 				goto fail;
 			}
@@ -272,10 +406,13 @@ bool buxton_direct_set_value(BuxtonControl *control,
 			l = label;
 		}
 	} else {
-		ret = buxton_direct_get_value_for_layer(control, key, d, data_label, NULL);
+		ret = get_value_for_layer(control, key, d, data_label, NULL,
+					  &current_version);
 		if (ret == -ENOENT || ret == EINVAL) {
 			goto fail;
-		} else if (!ret) {
+		}
+		found = !ret;
+		if (found) {
 			l = data_label;
 		} else {
 			l = &default_label;
@@ -292,6 +429,30 @@ bool buxton_direct_set_value(BuxtonControl *control,
 		goto fail;
 	}
 
+	if (update) {
+		r = check_update(update, found ? d : NULL, current_version);
+		if (r == BUXTON_STATUS_MISMATCH) {
+			/* Only clients allowed to read the value are told of it */
+			if (found && (!label || buxton_check_smack_access(label, l, ACCESS_READ))) {
+				if (!buxton_data_copy(d, result)) {
+					abort();
+				}
+				*version = current_version;
+			}
+			goto fail;
+		}
+		if (r) {
+			goto fail;
+		}
+		r = -1;
+		if (update->type == BUXTON_UPDATE_ADD) {
+			if (!add_delta(key->type, found ? d : NULL, update->delta, &sum)) {
+				goto fail;
+			}
+			data = &sum;
+		}
+	}
+
 	backend = backend_for_layer(config, layer);
 	assert(backend);
 
@@ -299,8 +460,30 @@ bool buxton_direct_set_value(BuxtonControl *control,
 	ret = backend->set_value(layer, key, data, l);
 	if (ret) {
 		buxton_debug("set value failed: %s\n", strerror(ret));
-	} else {
-		r = true;
+		goto fail;
+	}
+	r = 0;
+
+	if (update) {
+		_cleanup_buxton_data_ BuxtonData *stored = NULL;
+		_cleanup_buxton_string_ BuxtonString *stored_label = NULL;
+
+		stored = malloc0(sizeof(BuxtonData));
+		if (!stored) {
+			abort();
+		}
+		stored_label = malloc0(sizeof(BuxtonString));
+		if (!stored_label) {
+			abort();
+		}
+
+		/* The backend picks the new version, so read it back */
+		if (get_value_for_layer(control, key, stored, stored_label, NULL, version)) {
+			*version = 0;
+		}
+		if (!buxton_data_copy(data, result)) {
+			abort();
+		}
 	}
 
 fail:
@@ -308,6 +491,34 @@ fail:
 	return r;
 }
 
+bool buxton_direct_set_value(BuxtonControl *control,
+			     _BuxtonKey *key,
+			     BuxtonData *data,
+			     BuxtonString *label)
+{
+	assert(data);
+
+	return update_value(control, key, NULL, data, label, NULL, NULL) == 0;
+}
+
+int32_t buxton_direct_update_value(BuxtonControl *control,
+				   _BuxtonKey *key,
+				   BuxtonUpdate *update,
+				   BuxtonData *data,
+				   BuxtonString *label,
+				   BuxtonData *result,
+				   uint64_t *version)
+{
+	assert(update);
+	assert(result);
+	assert(version);
+
+	*version = 0;
+
+	return update_value(control, key, update, data, label, result, version);
+}
+
+
 bool buxton_direct_set_label(BuxtonControl *control,
 			     _BuxtonKey *key,
 			     BuxtonString *label)
@@ -489,7 +700,7 @@ bool buxton_direct_remove_group(BuxtonControl *control,
 	}
 
 	if (layer->readonly) {
-		buxton_debug("Read-ony layer!\n");
+		buxton_debug("Read-only layer!\n");
 		goto fail;
 	}
 
@@ -520,7 +731,12 @@ bool buxton_direct_remove_group(BuxtonControl *control,
 
 	layer->uid = control->client.uid;
 
-	ret = backend->unset_value(layer, key, NULL, NULL);
+	/* Modules without group removal only drop the group record */
+	if (backend_has_version(backend, 1) && backend->remove_group) {
+		ret = backend->remove_group(layer, key, NULL, NULL);
+	} else {
+		ret = backend->unset_value(layer, key, NULL, NULL);
+	}
 	if (ret) {
 		buxton_debug("remove group failed: %s\n", strerror(ret));
 	} else {
@@ -531,6 +747,104 @@ fail:
 	return r;
 }
 
+bool buxton_direct_sweep_orphans(BuxtonControl *control,
+				 BuxtonString *layer_name,
+				 uint32_t *removed)
+{
+	BuxtonBackend *backend;
+	BuxtonLayer *layer;
+	BuxtonConfig *config;
+
+	assert(control);
+	assert(layer_name);
+	assert(removed);
+
+	config = &control->config;
+	if ((layer = hashmap_get(config->layers, layer_name->value)) == NULL) {
+		return false;
+	}
+
+	if (layer->readonly) {
+		buxton_debug("Read-only layer!\n");
+		return false;
+	}
+
+	backend = backend_for_layer(config, layer);
+	assert(backend);
+
+	if (!backend_has_version(backend, 1) || !backend->sweep_orphans) {
+		buxton_debug("Layer '%s' does not support sweeping\n",
+			     layer_name->value);
+		return false;
+	}
+
+	layer->uid = control->client.uid;
+	return backend->sweep_orphans(layer, removed);
+}
+
+/*
+ * Collect the key names of a layer, a batch of records at a time. The
+ * list is only handed out once the walk has finished without an error.
+ */
+static bool collect_keys(BuxtonBackend *backend, BuxtonCursor *cursor,
+			 BuxtonArray **list)
+{
+	BuxtonRecordView views[BUXTON_CURSOR_BATCH];
+	BuxtonArray *k_list;
+	BuxtonData *current;
+	size_t count;
+	bool ret = false;
+
+	k_list = buxton_array_new();
+	if (!k_list) {
+		abort();
+	}
+
+	while (true) {
+		if (!backend->cursor_next(cursor, views, BUXTON_CURSOR_BATCH,
+					  &count)) {
+			goto end;
+		}
+		if (!count) {
+			break;
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (!views[i].name.value) {
+				continue;
+			}
+			current = malloc0(sizeof(BuxtonData));
+			if (!current) {
+				abort();
+			}
+			current->type = STRING;
+			current->store.d_string.value = strdup(views[i].name.value);
+			if (!current->store.d_string.value) {
+				abort();
+			}
+			current->store.d_string.length = views[i].name.length;
+			if (!buxton_array_add(k_list, current)) {
+				abort();
+			}
+		}
+	}
+
+	/* Pass ownership of the array to the caller */
+	*list = k_list;
+	ret = true;
+
+end:
+	backend->cursor_close(cursor);
+	if (!ret) {
+		for (uint16_t i = 0; i < k_list->len; i++) {
+			current = buxton_array_get(k_list, i);
+			free(current->store.d_string.value);
+			free(current);
+		}
+		buxton_array_free(&k_list, NULL);
+	}
+	return ret;
+}
+
 bool buxton_direct_list_keys(BuxtonControl *control,
 			     BuxtonString *layer_name,
 			     BuxtonArray **list)
@@ -542,6 +856,7 @@ bool buxton_direct_list_keys(BuxtonControl *control,
 	BuxtonBackend *backend = NULL;
 	BuxtonLayer *layer;
 	BuxtonConfig *config;
+	BuxtonCursor *cursor;
 
 	config = &control->config;
 	if ((layer = hashmap_get(config->layers, layer_name->value)) == NULL) {
@@ -551,6 +866,13 @@ bool buxton_direct_list_keys(BuxtonControl *control,
 	assert(backend);
 
 	layer->uid = control->client.uid;
+	cursor = backend_cursor_open(backend, layer, NULL, 0);
+	if (cursor) {
+		return collect_keys(backend, cursor, list);
+	}
+	if (!backend->list_keys) {
+		return false;
+	}
 	return backend->list_keys(layer, list);
 }
 
@@ -642,6 +964,228 @@ fail:
 	return r;
 }
 
+/* Whether two keys of one layer name the same value */
+static bool same_key(_BuxtonKey *a, _BuxtonKey *b)
+{
+	return a->group.length == b->group.length &&
+		a->name.length == b->name.length &&
+		memcmp(a->group.value, b->group.value, a->group.length) == 0 &&
+		memcmp(a->name.value, b->name.value, a->name.length) == 0;
+}
+
+/*
+ * Check the client may make change index, and find the label its value
+ * is stored with. groups and values hold what the layer has for the
+ * group and key of each change. A key changed earlier in the same
+ * commit is judged by that change rather than by what the layer holds.
+ */
+static bool check_change(BuxtonChange *changes, BuxtonBatchItem *groups,
+			 BuxtonBatchItem *values, BuxtonString *labels,
+			 size_t index, BuxtonString *label)
+{
+	BuxtonChange *c = &changes[index];
+	BuxtonString default_label = buxton_string_pack("_");
+	BuxtonString *l = NULL;
+	bool found = false;
+	bool earlier = false;
+
+	/* Groups must be created first, so bail if this key's group doesn't exist */
+	if (groups[index].status) {
+		buxton_debug("Group %s for name %s missing for commit\n",
+			     c->key->group.value, c->key->name.value);
+		return false;
+	}
+
+	/* Access checks are not needed for direct clients, where label is NULL */
+	if (label && !buxton_check_smack_access(label, groups[index].label,
+						ACCESS_WRITE)) {
+		return false;
+	}
+
+	for (size_t i = index; i > 0; i--) {
+		if (same_key(changes[i - 1].key, c->key)) {
+			earlier = true;
+			if (changes[i - 1].data) {
+				found = true;
+				l = &labels[i - 1];
+			}
+			break;
+		}
+	}
+
+	if (!earlier) {
+		if (values[index].status == 0) {
+			if (label && !buxton_check_smack_access(label,
+								values[index].label,
+								ACCESS_WRITE)) {
+				return false;
+			}
+			found = true;
+			l = values[index].label;
+		} else if (values[index].status != ENOENT) {
+			return false;
+		}
+	}
+
+	if (!found) {
+		if (!c->data) {
+			buxton_debug("Key %s not found, so unset fails\n",
+				     c->key->name.value);
+			return false;
+		}
+		l = label ? label : &default_label;
+	}
+
+	if (!buxton_string_copy(l, &labels[index])) {
+		abort();
+	}
+
+	return true;
+}
+
+/*
+ * Apply changes in order for backends without commits, passing each run
+ * of sets or unsets to the backend at once
+ */
+static int apply_changes(BuxtonBackend *backend, BuxtonLayer *layer,
+			 BuxtonChange *changes, size_t count)
+{
+	_cleanup_free_ BuxtonBatchItem *items = NULL;
+	size_t start = 0, end;
+	int ret = 0;
+
+	items = new0(BuxtonBatchItem, count);
+	if (!items) {
+		abort();
+	}
+	for (size_t i = 0; i < count; i++) {
+		items[i].key = changes[i].key;
+		items[i].data = changes[i].data;
+		items[i].label = changes[i].label;
+	}
+
+	while (start < count && !ret) {
+		end = start + 1;
+		while (end < count && !changes[end].data == !changes[start].data) {
+			end++;
+		}
+		if (changes[start].data) {
+			ret = backend_set_many(backend, layer, items + start,
+					       end - start);
+		} else {
+			ret = backend_unset_many(backend, layer, items + start,
+						 end - start);
+		}
+		start = end;
+	}
+
+	return ret;
+}
+
+bool buxton_direct_commit(BuxtonControl *control,
+			  BuxtonString *layer_name,
+			  BuxtonChange *changes,
+			  size_t count,
+			  BuxtonString *label)
+{
+	BuxtonBackend *backend;
+	BuxtonLayer *layer;
+	BuxtonConfig *config;
+	BuxtonString *labels = NULL;
+	_cleanup_free_ BuxtonBatchItem *items = NULL;
+	_cleanup_free_ _BuxtonKey *groups = NULL;
+	_cleanup_free_ BuxtonData *current = NULL;
+	_cleanup_free_ BuxtonString *current_labels = NULL;
+	bool r = false;
+	int ret = 0;
+
+	assert(control);
+	assert(layer_name);
+	assert(changes || count == 0);
+
+	config = &control->config;
+	layer = hashmap_get(config->layers, layer_name->value);
+	if (!layer) {
+		return false;
+	}
+	if (layer->readonly) {
+		buxton_debug("Read-only layer!\n");
+		return false;
+	}
+	if (count == 0) {
+		return true;
+	}
+
+	labels = new0(BuxtonString, count);
+	items = new0(BuxtonBatchItem, count * 2);
+	groups = new0(_BuxtonKey, count);
+	current = new0(BuxtonData, count * 2);
+	current_labels = new0(BuxtonString, count * 2);
+	if (!labels || !items || !groups || !current || !current_labels) {
+		abort();
+	}
+
+	/* The group of each change goes first, then the key itself */
+	for (size_t i = 0; i < count; i++) {
+		_BuxtonKey *key = changes[i].key;
+
+		if (!key->name.value || !key->layer.value ||
+		    strcmp(key->layer.value, layer_name->value) != 0) {
+			goto end;
+		}
+		groups[i] = *key;
+		groups[i].name = (BuxtonString){ NULL, 0 };
+		groups[i].type = STRING;
+		items[i].key = &groups[i];
+		items[count + i].key = key;
+	}
+	for (size_t i = 0; i < count * 2; i++) {
+		items[i].data = &current[i];
+		items[i].label = &current_labels[i];
+	}
+
+	backend = backend_for_layer(config, layer);
+	assert(backend);
+
+	layer->uid = control->client.uid;
+
+	/* Check every change before the layer is touched */
+	(void)backend_get_many(backend, layer, items, count * 2);
+	for (size_t i = 0; i < count; i++) {
+		if (!check_change(changes, items, items + count, labels, i,
+				  label)) {
+			goto end;
+		}
+		changes[i].label = &labels[i];
+	}
+
+	if (backend_has_version(backend, 1) && backend->commit) {
+		ret = backend->commit(layer, changes, count);
+	} else {
+		ret = apply_changes(backend, layer, changes, count);
+	}
+	if (ret) {
+		buxton_debug("Commit failed: %s\n", strerror(ret));
+		goto end;
+	}
+	r = true;
+
+end:
+	for (size_t i = 0; i < count; i++) {
+		changes[i].label = NULL;
+		free(labels[i].value);
+	}
+	free(labels);
+	for (size_t i = 0; i < count * 2; i++) {
+		if (items[i].status == 0 && current[i].type == STRING) {
+			free(current[i].store.d_string.value);
+		}
+		free(current_labels[i].value);
+	}
+
+	return r;
+}
+
 bool buxton_direct_init_db(BuxtonControl *control, BuxtonString *layer_name)
 {
 	BuxtonBackend *backend;
@@ -676,6 +1220,18 @@ end:
 	return ret;
 }
 
+void buxton_direct_sync(BuxtonControl *control)
+{
+	Iterator iterator;
+	BuxtonBackend *backend;
+
+	assert(control);
+
+	HASHMAP_FOREACH(backend, control->config.backends, iterator) {
+		backend_sync(backend);
+	}
+}
+
 void buxton_direct_close(BuxtonControl *control)
 {
 	Iterator iterator;
@@ -43,6 +43,12 @@ bool buxton_direct_open(BuxtonControl *control)
 bool buxton_direct_init_db(BuxtonControl *control, BuxtonString *layer_name)
 	__attribute__((warn_unused_result));
 
+/**
+ * Write out what the backends only hold in memory, leaving them open
+ * @param control Valid BuxtonControl instance
+ */
+void buxton_direct_sync(BuxtonControl *control);
+
 /**
  * Close direct Buxton management connection
  * @param control Valid BuxtonControl instance
@@ -85,6 +91,18 @@ bool buxton_direct_remove_group(BuxtonControl *control,
 				BuxtonString *client_label)
 	__attribute__((warn_unused_result));
 
+/**
+ * Remove keys whose group no longer exists from a layer
+ * @param control An initialized control structure
+ * @param layer_name BuxtonString of the layer name to sweep
+ * @param removed Pointer to store the number of keys removed
+ * @return A boolean value, indicating success of the operation
+ */
+bool buxton_direct_sweep_orphans(BuxtonControl *control,
+				 BuxtonString *layer_name,
+				 uint32_t *removed)
+	__attribute__((warn_unused_result));
+
 /**
  * Set a value within Buxton
  * @param control An initialized control structure
@@ -99,6 +117,50 @@ bool buxton_direct_set_value(BuxtonControl *control,
 			     BuxtonString *label)
 	__attribute__((warn_unused_result));
 
+/**
+ * How buxton_direct_update_value changes a value
+ */
+typedef enum BuxtonUpdateType {
+	BUXTON_UPDATE_IF_VALUE, /**<Set the value if it equals an expected value */
+	BUXTON_UPDATE_IF_VERSION, /**<Set the value if it has an expected version */
+	BUXTON_UPDATE_ADD /**<Add to an integer value */
+} BuxtonUpdateType;
+
+/**
+ * A change made by reading, checking and storing a value in one step
+ */
+typedef struct BuxtonUpdate {
+	BuxtonUpdateType type; /**<How the value is changed */
+	BuxtonData *expected; /**<Value expected by BUXTON_UPDATE_IF_VALUE */
+	uint64_t version; /**<Version expected by BUXTON_UPDATE_IF_VERSION,
+			     where 0 means the key must not have a value yet */
+	int64_t delta; /**<Amount added by BUXTON_UPDATE_ADD */
+} BuxtonUpdate;
+
+/**
+ * Set a value within Buxton depending on the value it already holds,
+ * fetching and storing it only once
+ * @param control An initialized control structure
+ * @param key The key struct
+ * @param update How the value is checked or changed
+ * @param data The data to set, unused by BUXTON_UPDATE_ADD
+ * @param label The Smack label for the client
+ * @param result An empty BuxtonData, where the value stored is put. On a
+ * mismatch it gets the current value, unless the key has none or the
+ * client may not read it.
+ * @param version Pointer to store the version of result
+ * @return 0 on success, BUXTON_STATUS_MISMATCH if the key didn't hold
+ * the expected value or version, or -1 on failure
+ */
+int32_t buxton_direct_update_value(BuxtonControl *control,
+				   _BuxtonKey *key,
+				   BuxtonUpdate *update,
+				   BuxtonData *data,
+				   BuxtonString *label,
+				   BuxtonData *result,
+				   uint64_t *version)
+	__attribute__((warn_unused_result));
+
 /**
  * Retrieve a value from Buxton
  * @param control An initialized control structure
@@ -115,6 +177,24 @@ int32_t buxton_direct_get_value(BuxtonControl *control,
 			     BuxtonString *client_label)
 	__attribute__((warn_unused_result));
 
+/**
+ * Retrieve a value and its version from Buxton
+ * @param control An initialized control structure
+ * @param key The key to retrieve
+ * @param data An empty BuxtonData, where data is stored
+ * @param data_label The Smack label of the data
+ * @param client_label The Smack label of the client
+ * @param version Pointer to store the value's version in, or NULL
+ * @return A int32_t value, indicating success of the operation
+ */
+int32_t buxton_direct_get_versioned_value(BuxtonControl *control,
+					  _BuxtonKey *key,
+					  BuxtonData *data,
+					  BuxtonString *data_label,
+					  BuxtonString *client_label,
+					  uint64_t *version)
+	__attribute__((warn_unused_result));
+
 /**
  * Retrieve a value from Buxton by layer
  * @param control An initialized control structure
@@ -155,6 +235,24 @@ bool buxton_direct_unset_value(BuxtonControl *control,
 			       BuxtonString *label)
 	__attribute__((warn_unused_result));
 
+/**
+ * Set and unset several values in one layer as a single commit, where
+ * either every change is kept or none of them is
+ * @param control An initialized control structure
+ * @param layer_name The layer every key belongs to
+ * @param changes The changes to make, in order. A change with no data
+ * unsets its key. Their labels are filled in while committing.
+ * @param count Number of changes
+ * @param label The Smack label of the client
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_direct_commit(BuxtonControl *control,
+			  BuxtonString *layer_name,
+			  BuxtonChange *changes,
+			  size_t count,
+			  BuxtonString *label)
+	__attribute__((warn_unused_result));
+
 /*
  * Editor modelines  -	http://www.wireshark.org/tools/modelines.html
  *
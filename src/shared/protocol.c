@@ -18,6 +18,7 @@
 #include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "buxtonclient.h"
@@ -143,6 +144,7 @@ void run_callback(BuxtonCallback callback, void *data, size_t count,
 	response.type = type;
 	response.data = array;
 	response.key = key;
+	response.keys = NULL;
 	callback(&response, data);
 
 out:
@@ -248,11 +250,145 @@ void unlock_mutex(void)
 	pthread_mutex_unlock(&callback_guard);
 }
 
+/*
+ * Pass a run of changes from a grouped notification to their callback,
+ * with callback_guard unlocked like for single changes
+ */
+static void run_grouped_callback(struct notify_value *nv, BuxtonArray *keys,
+				 BuxtonArray *values)
+{
+	_BuxtonResponse response;
+
+	response.type = BUXTON_CONTROL_CHANGED;
+	response.data = values;
+	response.key = buxton_array_get(keys, 0);
+	response.keys = keys;
+
+	(void)pthread_mutex_unlock(&callback_guard);
+	nv->cb(&response, nv->data);
+	(void)pthread_mutex_lock(&callback_guard);
+}
+
+/*
+ * Split a grouped notification, a list of msgid and value pairs, into
+ * one callback for each run of changes registered with the same callback
+ * and data
+ */
+static void handle_grouped_response(BuxtonData *list, size_t count)
+{
+	struct notify_value run = { 0 };
+	struct notify_value *nv;
+	BuxtonArray *keys = NULL;
+	BuxtonArray *values = NULL;
+
+	keys = buxton_array_new();
+	values = buxton_array_new();
+	if (!keys || !values) {
+		goto out;
+	}
+
+	for (size_t i = 0; i + 1 < count; i += 2) {
+		if (list[i].type != UINT32) {
+			break;
+		}
+#if UINTPTR_MAX == 0xffffffffffffffff
+		nv = hashmap_get(notify_callbacks,
+				 (void *)((uint64_t)list[i].store.d_uint32));
+#else
+		nv = hashmap_get(notify_callbacks,
+				 (void *)list[i].store.d_uint32);
+#endif
+		if (!nv || !nv->cb) {
+			continue;
+		}
+
+		if (keys->len && (nv->cb != run.cb || nv->data != run.data)) {
+			run_grouped_callback(&run, keys, values);
+			buxton_array_free(&keys, NULL);
+			buxton_array_free(&values, NULL);
+			keys = buxton_array_new();
+			values = buxton_array_new();
+			if (!keys || !values) {
+				goto out;
+			}
+		}
+		/* The callback may unregister, so keep what the run needs */
+		run.cb = nv->cb;
+		run.data = nv->data;
+		if (!buxton_array_add(keys, nv->key) ||
+		    !buxton_array_add(values, &list[i + 1])) {
+			goto out;
+		}
+	}
+
+	if (keys->len) {
+		run_grouped_callback(&run, keys, values);
+	}
+
+out:
+	buxton_array_free(&keys, NULL);
+	buxton_array_free(&values, NULL);
+}
+
+/*
+ * Pass a journal entry to the subscription's callback, with the key it
+ * names, or none when it signals lost changes
+ */
+static void handle_journal_response(uint32_t msgid, BuxtonData *list,
+				    size_t count)
+{
+	struct notify_value *nv;
+	_BuxtonKey key = { { 0 }, { 0 }, { 0 }, 0 };
+	_BuxtonKey *k = NULL;
+
+#if UINTPTR_MAX == 0xffffffffffffffff
+	nv = hashmap_get(notify_callbacks, (void *)((uint64_t)msgid));
+#else
+	nv = hashmap_get(notify_callbacks, (void *)msgid);
+#endif
+	if (!nv || nv->type != BUXTON_CONTROL_SUBSCRIBE) {
+		return;
+	}
+	if (count < 2 || list[0].type != UINT64 || list[1].type != UINT32) {
+		return;
+	}
+
+	if (count >= 6) {
+		if (list[2].type != STRING || list[3].type != STRING ||
+		    list[4].type != STRING) {
+			return;
+		}
+		key.layer = list[2].store.d_string;
+		key.group = list[3].store.d_string;
+		/* Group changes come with an empty name */
+		if (list[4].store.d_string.length > 1) {
+			key.name = list[4].store.d_string;
+		}
+		key.type = count > 6 ? list[6].type : STRING;
+		k = &key;
+	}
+
+	(void)pthread_mutex_unlock(&callback_guard);
+	run_callback((BuxtonCallback)(nv->cb), nv->data, count, list,
+		     BUXTON_CONTROL_JOURNAL, k);
+	(void)pthread_mutex_lock(&callback_guard);
+}
+
 void handle_callback_response(BuxtonControlMessage msg, uint32_t msgid,
 			      BuxtonData *list, size_t count)
 {
 	struct notify_value *nv;
 
+	if (msg == BUXTON_CONTROL_CHANGED_MANY) {
+		handle_grouped_response(list, count);
+		return;
+	}
+
+	if (msg == BUXTON_CONTROL_JOURNAL) {
+		handle_journal_response(msgid, list, count);
+		return;
+	}
+
 	/* use notification callbacks for notification messages */
 	if (msg == BUXTON_CONTROL_CHANGED) {
 #if UINTPTR_MAX == 0xffffffffffffffff
@@ -308,6 +444,41 @@ void handle_callback_response(BuxtonControlMessage msg, uint32_t msgid,
 
 			return;
 		}
+	} else if (nv->type == BUXTON_CONTROL_SUBSCRIBE) {
+		/* Entries come under the subscription's msgid */
+		if (list[0].type == INT32 &&
+		    (list[0].store.d_int32 == 0 ||
+		     list[0].store.d_int32 == BUXTON_STATUS_RESYNC)) {
+#if UINTPTR_MAX == 0xffffffffffffffff
+			if (hashmap_put(notify_callbacks, (void *)((uint64_t)msgid), nv)
+#else
+			if (hashmap_put(notify_callbacks, (void *)msgid, nv)
+#endif
+			    >= 0) {
+				(void)pthread_mutex_unlock(&callback_guard);
+				run_callback((BuxtonCallback)(nv->cb), nv->data,
+					     count, list, nv->type, nv->key);
+				(void)pthread_mutex_lock(&callback_guard);
+				return;
+			}
+		}
+	} else if (nv->type == BUXTON_CONTROL_UNSUBSCRIBE) {
+		if (list[0].type == INT32 && list[0].store.d_int32 == 0 &&
+		    count > 1 && list[1].type == UINT32) {
+			struct notify_value *subscription;
+
+#if UINTPTR_MAX == 0xffffffffffffffff
+			subscription = hashmap_remove(notify_callbacks,
+						      (void *)((uint64_t)list[1].store.d_uint32));
+#else
+			subscription = hashmap_remove(notify_callbacks,
+						      (void *)list[1].store.d_uint32);
+#endif
+			if (subscription) {
+				key_free(subscription->key);
+				free(subscription);
+			}
+		}
 	}
 
 	/* callback should be run on notfiy or unnotify failure */
@@ -319,79 +490,109 @@ void handle_callback_response(BuxtonControlMessage msg, uint32_t msgid,
 	free(nv);
 }
 
-ssize_t buxton_wire_handle_response(_BuxtonClient *client)
+/*
+ * Make room at the end of the buffer for the rest of the partial response
+ * at its start
+ */
+static bool reserve_response_buffer(_BuxtonClient *client)
 {
-	ssize_t l;
-	_cleanup_free_ uint8_t *response = NULL;
-	BuxtonData *r_list = NULL;
-	BuxtonControlMessage r_msg = BUXTON_CONTROL_MIN;
-	ssize_t count = 0;
-	size_t offset = 0;
-	size_t size = BUXTON_MESSAGE_HEADER_LENGTH;
+	size_t need = BUXTON_MESSAGE_HEADER_LENGTH;
+	size_t available = client->offset - client->start;
+	uint8_t *buffer;
+
+	if (!client->buffer) {
+		client->buffer = malloc(BUXTON_RESPONSE_BUFFER_SIZE);
+		if (!client->buffer) {
+			return false;
+		}
+		client->size = BUXTON_RESPONSE_BUFFER_SIZE;
+		client->start = 0;
+		client->offset = 0;
+		return true;
+	}
+
+	if (available >= BUXTON_MESSAGE_HEADER_LENGTH) {
+		need = buxton_get_message_size(client->buffer + client->start,
+					       available);
+	}
+
+	/* Only move data once the handled head is worth reclaiming */
+	if (client->start && (client->size - client->offset < need - available ||
+			      client->start >= client->size / 2)) {
+		memmove(client->buffer, client->buffer + client->start,
+			available);
+		client->start = 0;
+		client->offset = available;
+	}
+	if (need > client->size) {
+		buffer = realloc(client->buffer, need);
+		if (!buffer) {
+			return false;
+		}
+		client->buffer = buffer;
+		client->size = need;
+	}
+
+	return true;
+}
+
+/*
+ * Run the callbacks of every complete response in the buffer, taking
+ * callback_guard once for all of them. Returns the number handled, or -1
+ * if the buffer holds an invalid response.
+ */
+static ssize_t dispatch_responses(_BuxtonClient *client)
+{
+	BuxtonData *r_list;
+	BuxtonControlMessage r_msg;
+	ssize_t count;
+	size_t available, size;
 	uint32_t r_msgid;
-	int s;
 	ssize_t handled = 0;
+	int s;
 
 	s = pthread_mutex_lock(&callback_guard);
 	if (s) {
 		return 0;
 	}
 	reap_callbacks();
-	(void)pthread_mutex_unlock(&callback_guard);
-
-	response = malloc0(BUXTON_MESSAGE_HEADER_LENGTH);
-	if (!response) {
-		return 0;
-	}
 
-	do {
-		l = read(client->fd, response + offset, size - offset);
-		if (l <= 0) {
-			return handled;
+	while (true) {
+		available = client->offset - client->start;
+		if (available < BUXTON_MESSAGE_HEADER_LENGTH) {
+			break;
 		}
-		offset += (size_t)l;
-		if (offset < BUXTON_MESSAGE_HEADER_LENGTH) {
-			continue;
+		size = buxton_get_message_size(client->buffer + client->start,
+					       available);
+		if (size == 0 || size > BUXTON_MESSAGE_MAX_LENGTH) {
+			handled = -1;
+			break;
 		}
-		if (size == BUXTON_MESSAGE_HEADER_LENGTH) {
-			size = buxton_get_message_size(response, offset);
-			if (size == 0 || size > BUXTON_MESSAGE_MAX_LENGTH) {
-				return -1;
-			}
-		}
-		if (size != BUXTON_MESSAGE_HEADER_LENGTH) {
-			response = realloc(response, size);
-			if (!response) {
-				return -1;
-			}
-		}
-		if (size != offset) {
-			continue;
+		if (size > available) {
+			break;
 		}
 
-		count = buxton_deserialize_message(response, &r_msg, size, &r_msgid, &r_list);
+		r_list = NULL;
+		r_msg = BUXTON_CONTROL_MIN;
+		count = buxton_deserialize_message(client->buffer + client->start,
+						   &r_msg, size, &r_msgid,
+						   &r_list);
+		client->start += size;
 		if (count < 0) {
-			goto next;
+			continue;
 		}
 
 		if (!(r_msg == BUXTON_CONTROL_STATUS && r_list && r_list[0].type == INT32)
-		    && !(r_msg == BUXTON_CONTROL_CHANGED)) {
-			handled++;
+		    && !(r_msg == BUXTON_CONTROL_CHANGED)
+		    && !(r_msg == BUXTON_CONTROL_CHANGED_MANY)
+		    && !(r_msg == BUXTON_CONTROL_JOURNAL)) {
 			buxton_log("Critical error: Invalid response\n");
-			goto next;
+		} else {
+			handle_callback_response(r_msg, r_msgid, r_list,
+						 (size_t)count);
 		}
-
-		s = pthread_mutex_lock(&callback_guard);
-		if (s) {
-			goto next;
-		}
-
-		handle_callback_response(r_msg, r_msgid, r_list, (size_t)count);
-
-		(void)pthread_mutex_unlock(&callback_guard);
 		handled++;
 
-	next:
 		if (r_list) {
 			for (int i = 0; i < count; i++) {
 				if (r_list[i].type == STRING) {
@@ -400,11 +601,58 @@ ssize_t buxton_wire_handle_response(_BuxtonClient *client)
 			}
 			free(r_list);
 		}
+	}
+
+	(void)pthread_mutex_unlock(&callback_guard);
+
+	if (client->start == client->offset) {
+		client->start = 0;
+		client->offset = 0;
+	}
+
+	return handled;
+}
+
+ssize_t buxton_wire_handle_response(_BuxtonClient *client)
+{
+	ssize_t l;
+	ssize_t r;
+	size_t space;
+	ssize_t handled = 0;
+	bool reaped = false;
+	int s;
+
+	/* Drain the socket in buffer sized reads */
+	do {
+		if (!reserve_response_buffer(client)) {
+			return -1;
+		}
+		space = client->size - client->offset;
+		l = read(client->fd, client->buffer + client->offset, space);
+		if (l <= 0) {
+			break;
+		}
+		client->offset += (size_t)l;
 
-		/* reset for next possible message */
-		size = BUXTON_MESSAGE_HEADER_LENGTH;
-		offset = 0;
-	} while (true);
+		r = dispatch_responses(client);
+		if (r < 0) {
+			return -1;
+		}
+		handled += r;
+		reaped = true;
+	} while ((size_t)l == space);
+
+	/* Timed out callbacks are reaped on every call */
+	if (!reaped) {
+		s = pthread_mutex_lock(&callback_guard);
+		if (s) {
+			return 0;
+		}
+		reap_callbacks();
+		(void)pthread_mutex_unlock(&callback_guard);
+	}
+
+	return handled;
 }
 
 int buxton_wire_get_response(_BuxtonClient *client)
@@ -429,52 +677,61 @@ int buxton_wire_get_response(_BuxtonClient *client)
 	return (int)processed;
 }
 
-bool buxton_wire_set_value(_BuxtonClient *client, _BuxtonKey *key, void *value,
-			   BuxtonCallback callback, void *data)
+/*
+ * Wrap a client's value of the given type in a BuxtonData, without
+ * copying strings
+ */
+static void pack_value(BuxtonDataType type, void *value, BuxtonData *d)
 {
-	_cleanup_free_ uint8_t *send = NULL;
-	bool ret = false;
-	size_t send_len = 0;
-	BuxtonArray *list = NULL;
-	BuxtonData d_layer;
-	BuxtonData d_group;
-	BuxtonData d_name;
-	BuxtonData d_value;
-	uint32_t msgid = get_msgid();
-
-	buxton_string_to_data(&key->layer, &d_layer);
-	buxton_string_to_data(&key->group, &d_group);
-	buxton_string_to_data(&key->name, &d_name);
-	d_value.type = key->type;
-	switch (key->type) {
+	d->type = type;
+	switch (type) {
 	case STRING:
-		d_value.store.d_string.value = (char *)value;
-		d_value.store.d_string.length = (uint32_t)strlen((char *)value) + 1;
+		d->store.d_string.value = (char *)value;
+		d->store.d_string.length = (uint32_t)strlen((char *)value) + 1;
 		break;
 	case INT32:
-		d_value.store.d_int32 = *(int32_t *)value;
+		d->store.d_int32 = *(int32_t *)value;
 		break;
 	case INT64:
-		d_value.store.d_int64 = *(int64_t *)value;
+		d->store.d_int64 = *(int64_t *)value;
 		break;
 	case UINT32:
-		d_value.store.d_uint32 = *(uint32_t *)value;
+		d->store.d_uint32 = *(uint32_t *)value;
 		break;
 	case UINT64:
-		d_value.store.d_uint64 = *(uint64_t *)value;
+		d->store.d_uint64 = *(uint64_t *)value;
 		break;
 	case FLOAT:
-		d_value.store.d_float = *(float *)value;
+		d->store.d_float = *(float *)value;
 		break;
 	case DOUBLE:
-		memcpy(&d_value.store.d_double, value, sizeof(double));
+		memcpy(&d->store.d_double, value, sizeof(double));
 		break;
 	case BOOLEAN:
-		d_value.store.d_boolean = *(bool *)value;
+		d->store.d_boolean = *(bool *)value;
 		break;
 	default:
 		break;
 	}
+}
+
+bool buxton_wire_set_value(_BuxtonClient *client, _BuxtonKey *key, void *value,
+			   BuxtonCallback callback, void *data)
+{
+	_cleanup_free_ uint8_t *send = NULL;
+	bool ret = false;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	BuxtonData d_layer;
+	BuxtonData d_group;
+	BuxtonData d_name;
+	BuxtonData d_value;
+	uint32_t msgid = get_msgid();
+
+	buxton_string_to_data(&key->layer, &d_layer);
+	buxton_string_to_data(&key->group, &d_group);
+	buxton_string_to_data(&key->name, &d_name);
+	pack_value(key->type, value, &d_value);
 
 	list = buxton_array_new();
 	if (!buxton_array_add(list, &d_layer)) {
@@ -513,6 +770,127 @@ end:
 	return ret;
 }
 
+bool buxton_wire_compare_and_set(_BuxtonClient *client, _BuxtonKey *key,
+				 void *value, uint32_t compare, void *expected,
+				 BuxtonCallback callback, void *data)
+{
+	_cleanup_free_ uint8_t *send = NULL;
+	bool ret = false;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	BuxtonData d_layer;
+	BuxtonData d_group;
+	BuxtonData d_name;
+	BuxtonData d_value;
+	BuxtonData d_compare;
+	BuxtonData d_expected;
+	uint32_t msgid = get_msgid();
+
+	assert(client);
+	assert(key);
+	assert(value);
+	assert(expected);
+
+	buxton_string_to_data(&key->layer, &d_layer);
+	buxton_string_to_data(&key->group, &d_group);
+	buxton_string_to_data(&key->name, &d_name);
+	pack_value(key->type, value, &d_value);
+	d_compare.type = UINT32;
+	d_compare.store.d_uint32 = compare;
+	if (compare == BUXTON_COMPARE_VERSION) {
+		pack_value(UINT64, expected, &d_expected);
+	} else {
+		pack_value(key->type, expected, &d_expected);
+	}
+
+	list = buxton_array_new();
+	if (!list) {
+		abort();
+	}
+	if (!buxton_array_add(list, &d_layer) ||
+	    !buxton_array_add(list, &d_group) ||
+	    !buxton_array_add(list, &d_name) ||
+	    !buxton_array_add(list, &d_value) ||
+	    !buxton_array_add(list, &d_compare) ||
+	    !buxton_array_add(list, &d_expected)) {
+		buxton_log("Failed to build compare_and_set array\n");
+		goto end;
+	}
+
+	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_COMPARE_AND_SET,
+					    msgid, list);
+	if (send_len == 0) {
+		goto end;
+	}
+
+	if (!send_message(client, send, send_len, callback, data, msgid,
+			  BUXTON_CONTROL_COMPARE_AND_SET, key)) {
+		goto end;
+	}
+
+	ret = true;
+
+end:
+	buxton_array_free(&list, NULL);
+	return ret;
+}
+
+bool buxton_wire_add_value(_BuxtonClient *client, _BuxtonKey *key,
+			   int64_t delta, BuxtonCallback callback, void *data)
+{
+	_cleanup_free_ uint8_t *send = NULL;
+	bool ret = false;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	BuxtonData d_layer;
+	BuxtonData d_group;
+	BuxtonData d_name;
+	BuxtonData d_type;
+	BuxtonData d_delta;
+	uint32_t msgid = get_msgid();
+
+	assert(client);
+	assert(key);
+
+	buxton_string_to_data(&key->layer, &d_layer);
+	buxton_string_to_data(&key->group, &d_group);
+	buxton_string_to_data(&key->name, &d_name);
+	d_type.type = UINT32;
+	d_type.store.d_uint32 = key->type;
+	d_delta.type = INT64;
+	d_delta.store.d_int64 = delta;
+
+	list = buxton_array_new();
+	if (!list) {
+		abort();
+	}
+	if (!buxton_array_add(list, &d_layer) ||
+	    !buxton_array_add(list, &d_group) ||
+	    !buxton_array_add(list, &d_name) ||
+	    !buxton_array_add(list, &d_type) ||
+	    !buxton_array_add(list, &d_delta)) {
+		buxton_log("Failed to build add_value array\n");
+		goto end;
+	}
+
+	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_ADD, msgid,
+					    list);
+	if (send_len == 0) {
+		goto end;
+	}
+
+	if (!send_message(client, send, send_len, callback, data, msgid,
+			  BUXTON_CONTROL_ADD, key)) {
+		goto end;
+	}
+
+	ret = true;
+
+end:
+	buxton_array_free(&list, NULL);
+	return ret;
+}
+
 bool buxton_wire_set_label(_BuxtonClient *client,
 			   _BuxtonKey *key, BuxtonString *value,
 			   BuxtonCallback callback, void *data)
@@ -664,7 +1042,12 @@ end:
 	return ret;
 }
 
-bool buxton_wire_get_value(_BuxtonClient *client, _BuxtonKey *key,
+/*
+ * Send a GET, or a GET_IF_CHANGED carrying the version the client
+ * already holds
+ */
+static bool wire_get_value(_BuxtonClient *client, _BuxtonKey *key,
+			   BuxtonControlMessage msg, uint64_t version,
 			   BuxtonCallback callback, void *data)
 {
 	bool ret = false;
@@ -675,12 +1058,15 @@ bool buxton_wire_get_value(_BuxtonClient *client, _BuxtonKey *key,
 	BuxtonData d_group;
 	BuxtonData d_name;
 	BuxtonData d_type;
+	BuxtonData d_version;
 	uint32_t msgid = get_msgid();
 
 	buxton_string_to_data(&key->group, &d_group);
 	buxton_string_to_data(&key->name, &d_name);
 	d_type.type = UINT32;
 	d_type.store.d_int32 = key->type;
+	d_version.type = UINT64;
+	d_version.store.d_uint64 = version;
 
 	list = buxton_array_new();
 	if (key->layer.value) {
@@ -702,15 +1088,20 @@ bool buxton_wire_get_value(_BuxtonClient *client, _BuxtonKey *key,
 		buxton_log("Failed to add type to set_value array\n");
 		goto end;
 	}
+	if (msg == BUXTON_CONTROL_GET_IF_CHANGED &&
+	    !buxton_array_add(list, &d_version)) {
+		buxton_log("Failed to add version to get_value array\n");
+		goto end;
+	}
 
-	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_GET, msgid, list);
+	send_len = buxton_serialize_message(&send, msg, msgid, list);
 
 	if (send_len == 0) {
 		goto end;
 	}
 
 	if (!send_message(client, send, send_len, callback, data, msgid,
-			  BUXTON_CONTROL_GET, key)) {
+			  msg, key)) {
 		goto end;
 	}
 
@@ -721,6 +1112,21 @@ end:
 	return ret;
 }
 
+bool buxton_wire_get_value(_BuxtonClient *client, _BuxtonKey *key,
+			   BuxtonCallback callback, void *data)
+{
+	return wire_get_value(client, key, BUXTON_CONTROL_GET, 0, callback,
+			      data);
+}
+
+bool buxton_wire_get_value_if_changed(_BuxtonClient *client,
+				      _BuxtonKey *key, uint64_t version,
+				      BuxtonCallback callback, void *data)
+{
+	return wire_get_value(client, key, BUXTON_CONTROL_GET_IF_CHANGED,
+			      version, callback, data);
+}
+
 bool buxton_wire_unset_value(_BuxtonClient *client,
 			     _BuxtonKey *key,
 			     BuxtonCallback callback,
@@ -828,7 +1234,7 @@ end:
 bool buxton_wire_register_notification(_BuxtonClient *client,
 				       _BuxtonKey *key,
 				       BuxtonCallback callback,
-				       void *data)
+				       void *data, uint32_t flags)
 {
 	assert(client);
 	assert(key);
@@ -839,6 +1245,7 @@ bool buxton_wire_register_notification(_BuxtonClient *client,
 	BuxtonData d_group;
 	BuxtonData d_name;
 	BuxtonData d_type;
+	BuxtonData d_flags;
 	bool ret = false;
 	uint32_t msgid = get_msgid();
 
@@ -846,6 +1253,8 @@ bool buxton_wire_register_notification(_BuxtonClient *client,
 	buxton_string_to_data(&key->name, &d_name);
 	d_type.type = UINT32;
 	d_type.store.d_int32 = key->type;
+	d_flags.type = UINT32;
+	d_flags.store.d_uint32 = flags;
 
 	list = buxton_array_new();
 	if (!buxton_array_add(list, &d_group)) {
@@ -860,6 +1269,11 @@ bool buxton_wire_register_notification(_BuxtonClient *client,
 		buxton_log("Failed to add type to set_value array\n");
 		goto end;
 	}
+	/* Daemons without grouped notifications only take three */
+	if (flags && !buxton_array_add(list, &d_flags)) {
+		buxton_log("Failed to add flags to set_value array\n");
+		goto end;
+	}
 
 	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_NOTIFY, msgid,
 					    list);
@@ -935,6 +1349,166 @@ end:
 	return ret;
 }
 
+bool buxton_wire_subscribe_journal(_BuxtonClient *client, uint64_t epoch,
+				   uint64_t from, BuxtonCallback callback,
+				   void *data)
+{
+	assert(client);
+
+	_cleanup_free_ uint8_t *send = NULL;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	BuxtonData d_from, d_epoch;
+	bool ret = false;
+	uint32_t msgid = get_msgid();
+
+	d_from.type = UINT64;
+	d_from.store.d_uint64 = from;
+	d_epoch.type = UINT64;
+	d_epoch.store.d_uint64 = epoch;
+
+	list = buxton_array_new();
+	if (!buxton_array_add(list, &d_from)) {
+		buxton_log("Failed to add sequence to subscribe array\n");
+		goto end;
+	}
+	if (!buxton_array_add(list, &d_epoch)) {
+		buxton_log("Failed to add epoch to subscribe array\n");
+		goto end;
+	}
+
+	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_SUBSCRIBE,
+					    msgid, list);
+
+	if (send_len == 0) {
+		goto end;
+	}
+
+	if (!send_message(client, send, send_len, callback, data, msgid,
+			  BUXTON_CONTROL_SUBSCRIBE, NULL)) {
+		goto end;
+	}
+
+	ret = true;
+
+end:
+	buxton_array_free(&list, NULL);
+	return ret;
+}
+
+bool buxton_wire_unsubscribe_journal(_BuxtonClient *client,
+				     BuxtonCallback callback, void *data)
+{
+	assert(client);
+
+	_cleanup_free_ uint8_t *send = NULL;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	bool ret = false;
+	uint32_t msgid = get_msgid();
+
+	list = buxton_array_new();
+	if (!list) {
+		goto end;
+	}
+
+	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_UNSUBSCRIBE,
+					    msgid, list);
+
+	if (send_len == 0) {
+		goto end;
+	}
+
+	if (!send_message(client, send, send_len, callback, data, msgid,
+			  BUXTON_CONTROL_UNSUBSCRIBE, NULL)) {
+		goto end;
+	}
+
+	ret = true;
+
+end:
+	buxton_array_free(&list, NULL);
+	return ret;
+}
+
+bool buxton_wire_begin_transaction(_BuxtonClient *client,
+				   BuxtonString *layer,
+				   BuxtonCallback callback, void *data)
+{
+	_cleanup_free_ uint8_t *send = NULL;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	BuxtonData d_layer;
+	bool ret = false;
+	uint32_t msgid = get_msgid();
+
+	assert(client);
+	assert(layer);
+
+	buxton_string_to_data(layer, &d_layer);
+
+	list = buxton_array_new();
+	if (!list) {
+		abort();
+	}
+	if (!buxton_array_add(list, &d_layer)) {
+		buxton_log("Failed to build begin_transaction array\n");
+		goto end;
+	}
+
+	send_len = buxton_serialize_message(&send, BUXTON_CONTROL_BEGIN,
+					    msgid, list);
+	if (send_len == 0) {
+		goto end;
+	}
+
+	if (!send_message(client, send, send_len, callback, data, msgid,
+			  BUXTON_CONTROL_BEGIN, NULL)) {
+		goto end;
+	}
+
+	ret = true;
+
+end:
+	buxton_array_free(&list, NULL);
+	return ret;
+}
+
+bool buxton_wire_end_transaction(_BuxtonClient *client,
+				 BuxtonControlMessage msg,
+				 BuxtonCallback callback, void *data)
+{
+	_cleanup_free_ uint8_t *send = NULL;
+	size_t send_len = 0;
+	BuxtonArray *list = NULL;
+	bool ret = false;
+	uint32_t msgid = get_msgid();
+
+	assert(client);
+	assert(msg == BUXTON_CONTROL_COMMIT || msg == BUXTON_CONTROL_ROLLBACK);
+
+	list = buxton_array_new();
+	if (!list) {
+		abort();
+	}
+
+	send_len = buxton_serialize_message(&send, msg, msgid, list);
+	if (send_len == 0) {
+		goto end;
+	}
+
+	if (!send_message(client, send, send_len, callback, data, msgid,
+			  msg, NULL)) {
+		goto end;
+	}
+
+	ret = true;
+
+end:
+	buxton_array_free(&list, NULL);
+	return ret;
+}
+
 void include_protocol(void)
 {
 	;
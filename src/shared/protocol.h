@@ -27,6 +27,28 @@
 #include "serialize.h"
 #include "hashmap.h"
 
+/**
+ * Initial size of a client's response buffer, which grows to fit the
+ * largest response received
+ */
+#define BUXTON_RESPONSE_BUFFER_SIZE 4096
+
+/**
+ * NOTIFY flag of a client that takes the changes of several keys in one
+ * BUXTON_CONTROL_CHANGED_MANY message
+ */
+#define BUXTON_NOTIFY_GROUPED (1 << 0)
+
+/**
+ * COMPARE_AND_SET checks the key's current value against the expected one
+ */
+#define BUXTON_COMPARE_VALUE 0
+
+/**
+ * COMPARE_AND_SET checks the key's current version against the expected one
+ */
+#define BUXTON_COMPARE_VERSION 1
+
 /**
  * Initialize callback hashamps
  * @return a boolean value, indicating success of the operation
@@ -87,6 +109,8 @@ void handle_callback_response(BuxtonControlMessage msg, uint32_t msgid,
  * Parse responses from buxtond and run callbacks on received messages
  * @param client A BuxtonClient
  * @return number of received messages processed
+ * @note Responses are read into the client's buffer, and a partial one
+ * is kept there until the rest arrives
  */
 
 ssize_t buxton_wire_handle_response(_BuxtonClient *client)
@@ -113,6 +137,37 @@ bool buxton_wire_set_value(_BuxtonClient *client, _BuxtonKey *key, void *value,
 			   BuxtonCallback callback, void *data)
 	__attribute__((warn_unused_result));
 
+/**
+ * Send a COMPARE_AND_SET message over the wire protocol, which sets the
+ * value only if the key still holds the expected value or version
+ * @param client Client connection
+ * @param key _BuxtonKey pointer
+ * @param value A pointer to a new value
+ * @param compare BUXTON_COMPARE_VALUE or BUXTON_COMPARE_VERSION
+ * @param expected A pointer to the expected value, or to a uint64_t
+ * version for BUXTON_COMPARE_VERSION
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_compare_and_set(_BuxtonClient *client, _BuxtonKey *key,
+				 void *value, uint32_t compare, void *expected,
+				 BuxtonCallback callback, void *data)
+	__attribute__((warn_unused_result));
+
+/**
+ * Send an ADD message over the wire protocol, which adds to an integer value
+ * @param client Client connection
+ * @param key _BuxtonKey pointer
+ * @param delta Amount to add, which may be negative
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_add_value(_BuxtonClient *client, _BuxtonKey *key,
+			   int64_t delta, BuxtonCallback callback, void *data)
+	__attribute__((warn_unused_result));
+
 /**
  * Send a SET_LABEL message over the wire protocol, return the response
  *
@@ -172,6 +227,21 @@ bool buxton_wire_get_value(_BuxtonClient *client, _BuxtonKey *key,
 			   BuxtonCallback callback, void *data)
 	__attribute__((warn_unused_result));
 
+/**
+ * Send a GET_IF_CHANGED message over the wire protocol, which returns
+ * the value only if its version differs from the one given
+ * @param client Client connection
+ * @param key _BuxtonKey pointer
+ * @param version Version of the value the client already holds
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_get_value_if_changed(_BuxtonClient *client,
+				      _BuxtonKey *key, uint64_t version,
+				      BuxtonCallback callback, void *data)
+	__attribute__((warn_unused_result));
+
 
 /**
  * Send an UNSET message over the wire protocol, return the response
@@ -192,12 +262,13 @@ bool buxton_wire_unset_value(_BuxtonClient *client,
  * @param key _BuxtonKey pointer
  * @param callback A callback function to handle daemon reply
  * @param data User data to be used with callback function
+ * @param flags BUXTON_NOTIFY_GROUPED or 0
  * @return a boolean value, indicating success of the operation
  */
 bool buxton_wire_register_notification(_BuxtonClient *client,
 				       _BuxtonKey *key,
 				       BuxtonCallback callback,
-				       void *data)
+				       void *data, uint32_t flags)
 	__attribute__((warn_unused_result));
 
 /**
@@ -214,6 +285,32 @@ bool buxton_wire_list_keys(_BuxtonClient *client,
 			   void *data)
 	__attribute__((warn_unused_result));
 
+/**
+ * Send a SUBSCRIBE message over the protocol, to follow the journal
+ * @param client Client connection
+ * @param epoch Epoch from is numbered in, 0 for new changes
+ * @param from Sequence number of the first change wanted, 0 for new ones
+ * @param callback A callback function to handle daemon reply and entries
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_subscribe_journal(_BuxtonClient *client, uint64_t epoch,
+				   uint64_t from, BuxtonCallback callback,
+				   void *data)
+	__attribute__((warn_unused_result));
+
+/**
+ * Send an UNSUBSCRIBE message over the protocol, to stop following the
+ * journal
+ * @param client Client connection
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_unsubscribe_journal(_BuxtonClient *client,
+				     BuxtonCallback callback, void *data)
+	__attribute__((warn_unused_result));
+
 /**
  * Send an UNNOTIFY message over the protocol, no longer recieve events
  * @param client Client connection
@@ -228,6 +325,34 @@ bool buxton_wire_unregister_notification(_BuxtonClient *client,
 					 void *data)
 	__attribute__((warn_unused_result));
 
+/**
+ * Send a BEGIN message over the protocol, to stage later sets and
+ * unsets within one layer until they are committed
+ * @param client Client connection
+ * @param layer Layer the transaction changes
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_begin_transaction(_BuxtonClient *client,
+				   BuxtonString *layer,
+				   BuxtonCallback callback, void *data)
+	__attribute__((warn_unused_result));
+
+/**
+ * Send a COMMIT or ROLLBACK message over the protocol, to end the open
+ * transaction
+ * @param client Client connection
+ * @param msg BUXTON_CONTROL_COMMIT or BUXTON_CONTROL_ROLLBACK
+ * @param callback A callback function to handle daemon reply
+ * @param data User data to be used with callback function
+ * @return a boolean value, indicating success of the operation
+ */
+bool buxton_wire_end_transaction(_BuxtonClient *client,
+				 BuxtonControlMessage msg,
+				 BuxtonCallback callback, void *data)
+	__attribute__((warn_unused_result));
+
 void include_protocol(void);
 
 /**
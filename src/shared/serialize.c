@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "buxton.h"
 #include "log.h"
@@ -186,6 +187,369 @@ void buxton_deserialize(uint8_t *source, BuxtonData *target,
 	target->type = type;
 }
 
+/* Size of the value of a fixed size type in a record */
+static size_t record_value_size(BuxtonDataType type)
+{
+	switch (type) {
+	case INT32:
+		return sizeof(int32_t);
+	case UINT32:
+		return sizeof(uint32_t);
+	case INT64:
+		return sizeof(int64_t);
+	case UINT64:
+		return sizeof(uint64_t);
+	case FLOAT:
+		return sizeof(float);
+	case DOUBLE:
+		return sizeof(double);
+	case BOOLEAN:
+		return sizeof(bool);
+	default:
+		return 0;
+	}
+}
+
+static void label_table_add(BuxtonLabelTable *table, uint8_t *value,
+			    uint32_t length)
+{
+	BuxtonString *labels;
+	char *copy;
+
+	labels = realloc(table->labels,
+			 sizeof(BuxtonString) * ((size_t)table->count + 1));
+	if (!labels) {
+		abort();
+	}
+	table->labels = labels;
+
+	/* Terminate the copy so it can key the hashmap */
+	copy = malloc((size_t)length + 1);
+	if (!copy) {
+		abort();
+	}
+	memcpy(copy, value, length);
+	copy[length] = '\0';
+	table->labels[table->count].value = copy;
+	table->labels[table->count].length = length;
+
+	if (!table->ids) {
+		table->ids = hashmap_new(string_hash_func, string_compare_func);
+		if (!table->ids) {
+			abort();
+		}
+	}
+	/* Keep the first of any labels that only differ past a nil */
+	if (!hashmap_get(table->ids, copy)) {
+		if (hashmap_put(table->ids, copy,
+				UINT_TO_PTR(table->count + 1u)) < 0) {
+			abort();
+		}
+	}
+	table->count++;
+}
+
+bool buxton_label_table_load(BuxtonLabelTable *table, uint8_t *source,
+			     size_t size)
+{
+	size_t offset = sizeof(uint16_t) * 2;
+	uint16_t version, count, length;
+
+	assert(table);
+	assert(source);
+	assert(table->count == 0);
+
+	if (size < offset) {
+		return false;
+	}
+	memcpy(&version, source, sizeof(uint16_t));
+	memcpy(&count, source + sizeof(uint16_t), sizeof(uint16_t));
+	if (version != BUXTON_LABEL_TABLE_VERSION) {
+		buxton_log("Unknown label table version %u\n", version);
+		return false;
+	}
+
+	for (uint16_t i = 0; i < count; i++) {
+		if (size - offset < sizeof(uint16_t)) {
+			goto fail;
+		}
+		memcpy(&length, source + offset, sizeof(uint16_t));
+		offset += sizeof(uint16_t);
+		if (size - offset < length) {
+			goto fail;
+		}
+		label_table_add(table, source + offset, length);
+		offset += length;
+	}
+
+	return true;
+
+fail:
+	buxton_label_table_free(table);
+	return false;
+}
+
+size_t buxton_label_table_serialize(BuxtonLabelTable *table,
+				    uint8_t **target)
+{
+	size_t size = sizeof(uint16_t) * 2;
+	size_t offset = 0;
+	uint16_t version = BUXTON_LABEL_TABLE_VERSION;
+	uint16_t length;
+	uint8_t *data;
+
+	assert(table);
+	assert(target);
+
+	for (uint16_t i = 0; i < table->count; i++) {
+		size += sizeof(uint16_t) + table->labels[i].length;
+	}
+
+	data = malloc(size);
+	if (!data) {
+		abort();
+	}
+
+	memcpy(data, &version, sizeof(uint16_t));
+	offset += sizeof(uint16_t);
+	memcpy(data + offset, &table->count, sizeof(uint16_t));
+	offset += sizeof(uint16_t);
+	for (uint16_t i = 0; i < table->count; i++) {
+		length = (uint16_t)table->labels[i].length;
+		memcpy(data + offset, &length, sizeof(uint16_t));
+		offset += sizeof(uint16_t);
+		memcpy(data + offset, table->labels[i].value, length);
+		offset += length;
+	}
+
+	*target = data;
+	return size;
+}
+
+bool buxton_label_table_intern(BuxtonLabelTable *table, BuxtonString *label,
+			       uint16_t *id, bool *added)
+{
+	void *found;
+
+	assert(table);
+	assert(label);
+	assert(id);
+	assert(added);
+
+	*added = false;
+
+	/* Only nil terminated labels can be looked up in the hashmap */
+	if (!label->value || label->length == 0 ||
+	    label->value[label->length - 1] != '\0' ||
+	    label->length > UINT16_MAX) {
+		return false;
+	}
+
+	if (table->ids) {
+		found = hashmap_get(table->ids, label->value);
+		if (found) {
+			*id = (uint16_t)(PTR_TO_UINT(found) - 1);
+			return table->labels[*id].length == label->length;
+		}
+	}
+
+	if (table->count == UINT16_MAX) {
+		return false;
+	}
+	*id = table->count;
+	label_table_add(table, (uint8_t *)label->value, label->length);
+	*added = true;
+
+	return true;
+}
+
+void buxton_label_table_truncate(BuxtonLabelTable *table, uint16_t count)
+{
+	assert(table);
+	assert(count <= table->count);
+
+	while (table->count > count) {
+		char *value = table->labels[table->count - 1].value;
+
+		/* A duplicate past a nil left the first one in the map */
+		if (hashmap_get(table->ids, value) == UINT_TO_PTR(table->count)) {
+			(void)hashmap_remove(table->ids, value);
+		}
+		free(value);
+		table->count--;
+	}
+}
+
+void buxton_label_table_free(BuxtonLabelTable *table)
+{
+	assert(table);
+
+	/* The ids map is keyed by the labels, so it goes first */
+	hashmap_free(table->ids);
+	for (uint16_t i = 0; i < table->count; i++) {
+		free(table->labels[i].value);
+	}
+	free(table->labels);
+	table->labels = NULL;
+	table->count = 0;
+	table->ids = NULL;
+}
+
+uint64_t buxton_record_next_version(void)
+{
+	static uint64_t last = 0;
+	struct timespec now;
+	uint64_t usec;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0) {
+		abort();
+	}
+	usec = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+
+	/* Never step back, even when the clock does */
+	last = usec > last ? usec : last + 1;
+
+	return last;
+}
+
+size_t buxton_serialize_record(BuxtonData *source, uint16_t label_id,
+			       uint64_t version, uint8_t **target)
+{
+	uint8_t *data;
+	uint32_t length;
+	size_t offset = 0;
+	uint8_t format = BUXTON_RECORD_VERSION;
+	uint8_t type;
+
+	assert(source);
+	assert(target);
+
+	if (source->type == STRING) {
+		length = source->store.d_string.length;
+	} else {
+		length = (uint32_t)record_value_size(source->type);
+		if (!length) {
+			abort();
+		}
+	}
+	type = (uint8_t)source->type;
+
+	data = malloc(BUXTON_RECORD_HEADER_LENGTH + length +
+		      BUXTON_RECORD_KEY_VERSION_LENGTH);
+	if (!data) {
+		abort();
+	}
+
+	memcpy(data, &format, sizeof(uint8_t));
+	offset += sizeof(uint8_t);
+	memcpy(data + offset, &type, sizeof(uint8_t));
+	offset += sizeof(uint8_t);
+	memcpy(data + offset, &label_id, sizeof(uint16_t));
+	offset += sizeof(uint16_t);
+	memcpy(data + offset, &length, sizeof(uint32_t));
+	offset += sizeof(uint32_t);
+
+	/* The store union keeps every fixed size value at its start */
+	if (source->type == STRING) {
+		memcpy(data + offset, source->store.d_string.value, length);
+	} else {
+		memcpy(data + offset, &source->store, length);
+	}
+	offset += length;
+	memcpy(data + offset, &version, BUXTON_RECORD_KEY_VERSION_LENGTH);
+
+	*target = data;
+	return BUXTON_RECORD_HEADER_LENGTH + length +
+		BUXTON_RECORD_KEY_VERSION_LENGTH;
+}
+
+bool buxton_deserialize_record(uint8_t *source, size_t size,
+			       BuxtonLabelTable *table, BuxtonData *target,
+			       BuxtonString *label, uint64_t *version)
+{
+	BuxtonString old_label;
+	size_t offset = sizeof(uint8_t);
+	uint8_t type;
+	uint16_t label_id;
+	uint32_t length;
+
+	assert(source);
+	assert(table);
+	assert(target);
+
+	if (size == 0) {
+		return false;
+	}
+
+	/* Records written before label tables carry their own label */
+	if (source[0] < BUXTON_TYPE_MAX) {
+		if (size < BXT_MINIMUM_SIZE) {
+			return false;
+		}
+		buxton_deserialize(source, target, &old_label);
+		free(old_label.value);
+		if (label) {
+			label->value = (char *)source + sizeof(BuxtonDataType) +
+				sizeof(uint32_t) * 2;
+			label->length = old_label.length;
+		}
+		if (version) {
+			*version = 0;
+		}
+		return true;
+	}
+	if (source[0] != BUXTON_RECORD_VERSION) {
+		buxton_log("Record version %u isn't supported\n", source[0]);
+		return false;
+	}
+
+	if (size < BUXTON_RECORD_HEADER_LENGTH +
+	    BUXTON_RECORD_KEY_VERSION_LENGTH) {
+		return false;
+	}
+	size -= BUXTON_RECORD_KEY_VERSION_LENGTH;
+	memcpy(&type, source + offset, sizeof(uint8_t));
+	offset += sizeof(uint8_t);
+	memcpy(&label_id, source + offset, sizeof(uint16_t));
+	offset += sizeof(uint16_t);
+	memcpy(&length, source + offset, sizeof(uint32_t));
+	offset += sizeof(uint32_t);
+
+	if (label_id >= table->count || length > size - offset) {
+		buxton_log("Invalid record for label %u\n", label_id);
+		return false;
+	}
+	if (type != STRING && length != record_value_size(type)) {
+		buxton_log("Invalid record of type %u\n", type);
+		return false;
+	}
+
+	memzero(target, sizeof(BuxtonData));
+	target->type = (BuxtonDataType)type;
+	if (type == STRING) {
+		/* User must free the string */
+		target->store.d_string.value = malloc(length);
+		if (length && !target->store.d_string.value) {
+			abort();
+		}
+		memcpy(target->store.d_string.value, source + offset, length);
+		target->store.d_string.length = length;
+	} else {
+		memcpy(&target->store, source + offset, length);
+	}
+
+	if (label) {
+		*label = table->labels[label_id];
+	}
+
+	if (version) {
+		memcpy(version, source + offset + length,
+		       BUXTON_RECORD_KEY_VERSION_LENGTH);
+	}
+
+	return true;
+}
+
 size_t buxton_serialize_message(uint8_t **dest, BuxtonControlMessage message,
 				uint32_t msgid, BuxtonArray *list)
 {
@@ -20,10 +20,13 @@
 	#include "config.h"
 #endif
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "buxton.h"
 #include "buxtonarray.h"
+#include "hashmap.h"
 
 /**
  * Magic for Buxton messages
@@ -79,6 +82,150 @@ size_t buxton_serialize(BuxtonData *source, BuxtonString *label,
 void buxton_deserialize(uint8_t *source, BuxtonData *target,
 			BuxtonString *label);
 
+/**
+ * First byte of a stored record that refers to its label by ID. Records
+ * starting with a BuxtonDataType use the original format, which carries
+ * the whole label.
+ */
+#define BUXTON_RECORD_VERSION 0xB3
+
+/**
+ * Length of a record header: version, type, label ID and value length
+ */
+#define BUXTON_RECORD_HEADER_LENGTH (sizeof(uint8_t) * 2	\
+	+ sizeof(uint16_t) + sizeof(uint32_t))
+
+/**
+ * Length of the key version stored after a record's value
+ */
+#define BUXTON_RECORD_KEY_VERSION_LENGTH sizeof(uint64_t)
+
+/**
+ * Version of the serialized label table
+ */
+#define BUXTON_LABEL_TABLE_VERSION 1
+
+/**
+ * Database key of a layer's label table. It has no nil separator, so it
+ * is neither a group\0name\0 key nor prefixed by any group.
+ */
+#define BUXTON_LABEL_TABLE_KEY "buxton-labels"
+
+/**
+ * Length of BUXTON_LABEL_TABLE_KEY, without the C string terminator
+ */
+#define BUXTON_LABEL_TABLE_KEY_LENGTH (sizeof(BUXTON_LABEL_TABLE_KEY) - 1)
+
+/**
+ * Labels used by the records of one layer. Each label is stored once,
+ * and records refer to it by its index.
+ */
+typedef struct BuxtonLabelTable {
+	BuxtonString *labels; /**<Labels, indexed by ID */
+	uint16_t count; /**<Number of labels */
+	Hashmap *ids; /**<Label value to ID + 1 */
+} BuxtonLabelTable;
+
+/**
+ * Check whether a database key is the label table rather than a key
+ * @param key The key data
+ * @param length Length of the key data
+ * @return true if key is BUXTON_LABEL_TABLE_KEY
+ */
+static inline bool buxton_is_label_table_key(const char *key, size_t length)
+{
+	return length == BUXTON_LABEL_TABLE_KEY_LENGTH &&
+		memcmp(key, BUXTON_LABEL_TABLE_KEY, length) == 0;
+}
+
+/**
+ * Load a label table written by buxton_label_table_serialize
+ * @param table An empty label table to fill
+ * @param source Serialized table
+ * @param size Length of source
+ * @return a boolean value, false if source is not a valid table
+ */
+bool buxton_label_table_load(BuxtonLabelTable *table, uint8_t *source,
+			     size_t size)
+	__attribute__((warn_unused_result));
+
+/**
+ * Serialize a label table for storage
+ * @param table The label table
+ * @param target Pointer to store serialized data in
+ * @return a size_t value, indicating the size of serialized data
+ */
+size_t buxton_label_table_serialize(BuxtonLabelTable *table,
+				    uint8_t **target)
+	__attribute__((warn_unused_result));
+
+/**
+ * Find the ID of a label, adding it to the table if needed
+ * @param table The label table
+ * @param label The label to look up
+ * @param id Pointer to store the label ID in
+ * @param added Set to true if the table changed and must be stored
+ * @return a boolean value, false if the label can't be given an ID
+ */
+bool buxton_label_table_intern(BuxtonLabelTable *table, BuxtonString *label,
+			       uint16_t *id, bool *added)
+	__attribute__((warn_unused_result));
+
+/**
+ * Drop the labels added to a table since it held count labels, for
+ * when storing the grown table fails
+ * @param table The label table
+ * @param count Number of labels to keep
+ */
+void buxton_label_table_truncate(BuxtonLabelTable *table, uint16_t count);
+
+/**
+ * Free the contents of a label table, leaving it empty
+ * @param table The label table
+ */
+void buxton_label_table_free(BuxtonLabelTable *table);
+
+/**
+ * Get a version for a newly stored value
+ *
+ * Versions start from the wall clock in microseconds and grow by at
+ * least one per call, so a key keeps moving forward across restarts.
+ * 0 is never returned; it marks a value stored without a version.
+ * @return a new key version
+ */
+uint64_t buxton_record_next_version(void)
+	__attribute__((warn_unused_result));
+
+/**
+ * Serialize data with a label ID for backend storage
+ * @param source Data to be serialized
+ * @param label_id ID of the label in the layer's label table
+ * @param version Version of the value
+ * @param target Pointer to store serialized data in
+ * @return a size_t value, indicating the size of serialized data
+ */
+size_t buxton_serialize_record(BuxtonData *source, uint16_t label_id,
+			       uint64_t version, uint8_t **target)
+	__attribute__((warn_unused_result));
+
+/**
+ * Deserialize a stored record in either format
+ * @param source Serialized data pointer
+ * @param size Length of source
+ * @param table Label table of the layer the record belongs to
+ * @param target A pointer where the deserialized data will be stored
+ * @param label A pointer where the label will be stored, or NULL if the
+ * label isn't needed. It is borrowed from table, or from source for
+ * records from before label tables, and must not be freed.
+ * @param version A pointer where the value's version will be stored, or
+ * NULL if the version isn't needed
+ * @return a boolean value, false if the record is invalid
+ */
+bool buxton_deserialize_record(uint8_t *source, size_t size,
+			       BuxtonLabelTable *table, BuxtonData *target,
+			       BuxtonString *label, uint64_t *version)
+	__attribute__((warn_unused_result));
+
 /**
  * Serialize an internal buxton message for wire communication
  * @param dest Pointer to store serialized message in
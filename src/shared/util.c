@@ -144,6 +144,68 @@ fail:
 	return false;
 }
 
+bool buxton_data_equal(BuxtonData *a, BuxtonData *b)
+{
+	int c = 1;
+
+	assert(a);
+	assert(b);
+
+	if (a->type != b->type) {
+		return false;
+	}
+
+	switch (b->type) {
+	case STRING:
+		if (a->store.d_string.length != b->store.d_string.length) {
+			return false;
+		}
+		c = memcmp((const void *)(a->store.d_string.value),
+			   (const void *)(b->store.d_string.value),
+			   b->store.d_string.length);
+		break;
+	case INT32:
+		c = memcmp((const void *)&(a->store.d_int32),
+			   (const void *)&(b->store.d_int32),
+			   sizeof(int32_t));
+		break;
+	case UINT32:
+		c = memcmp((const void *)&(a->store.d_uint32),
+			   (const void *)&(b->store.d_uint32),
+			   sizeof(uint32_t));
+		break;
+	case INT64:
+		c = memcmp((const void *)&(a->store.d_int64),
+			   (const void *)&(b->store.d_int64),
+			   sizeof(int64_t));
+		break;
+	case UINT64:
+		c = memcmp((const void *)&(a->store.d_uint64),
+			   (const void *)&(b->store.d_uint64),
+			   sizeof(uint64_t));
+		break;
+	case FLOAT:
+		c = memcmp((const void *)&(a->store.d_float),
+			   (const void *)&(b->store.d_float),
+			   sizeof(float));
+		break;
+	case DOUBLE:
+		c = memcmp((const void *)&(a->store.d_double),
+			   (const void *)&(b->store.d_double),
+			   sizeof(double));
+		break;
+	case BOOLEAN:
+		c = memcmp((const void *)&(a->store.d_boolean),
+			   (const void *)&(b->store.d_boolean),
+			   sizeof(bool));
+		break;
+	default:
+		return false;
+	}
+
+	return c == 0;
+}
+
 bool buxton_string_copy(BuxtonString *original, BuxtonString *copy)
 {
 	if (!original || !copy) {
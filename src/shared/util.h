@@ -148,6 +148,15 @@ char* get_layer_path(BuxtonLayer *layer)
  */
 bool buxton_data_copy(BuxtonData *original, BuxtonData *copy);
 
+/**
+ * Compare two BuxtonData for equal type and value
+ * @param a The first data
+ * @param b The second data
+ * @return true if both hold the same type and value, false otherwise
+ */
+bool buxton_data_equal(BuxtonData *a, BuxtonData *b)
+	__attribute__((warn_unused_result));
+
 /**
  * Perform a deep copy of one BuxtonString to another
  * @param original The BuxtonString being copied
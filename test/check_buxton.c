@@ -16,6 +16,8 @@
 #include <check.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -245,6 +247,1346 @@ START_TEST(buxton_memory_backend_check)
 }
 END_TEST
 
+START_TEST(buxton_direct_remove_group_keys_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	_BuxtonKey group;
+	_BuxtonKey key;
+	char *layers[] = { "test-gdbm", "temp", "test-ordered" };
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	for (int i = 0; i < 3; i++) {
+		group.layer = buxton_string_pack(layers[i]);
+		group.group = buxton_string_pack("bxt_rm_group");
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+
+		key.layer = group.layer;
+		key.group = group.group;
+		key.name = buxton_string_pack("bxt_rm_key");
+		key.type = STRING;
+
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Creating group failed.");
+		fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+			"Setting group label failed.");
+		data.type = STRING;
+		data.store.d_string = buxton_string_pack("bxt_rm_value");
+		fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+			"Setting value failed.");
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove group");
+		fail_if(!buxton_direct_get_value_for_layer(&c, &key, &result,
+							   &dlabel, NULL),
+			"Key survived removal of its group");
+
+		/* recreating the group must not resurrect the old key */
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Recreating group failed.");
+		fail_if(!buxton_direct_get_value_for_layer(&c, &key, &result,
+							   &dlabel, NULL),
+			"Old key visible in recreated group");
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove recreated group");
+	}
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_direct_versioned_value_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	_BuxtonKey group;
+	_BuxtonKey key;
+	uint64_t version, version2;
+	char *layers[] = { "test-gdbm", "temp", "test-ordered" };
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	for (int i = 0; i < 3; i++) {
+		group.layer = buxton_string_pack(layers[i]);
+		group.group = buxton_string_pack("bxt_version_group");
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+
+		key.layer = group.layer;
+		key.group = group.group;
+		key.name = buxton_string_pack("bxt_version_key");
+		key.type = STRING;
+
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Creating group failed.");
+		fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+			"Setting group label failed.");
+		data.type = STRING;
+		data.store.d_string = buxton_string_pack("bxt_version_value");
+		fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+			"Setting value failed.");
+		fail_if(buxton_direct_get_versioned_value(&c, &key, &result,
+							  &dlabel, NULL,
+							  &version),
+			"Getting versioned value failed.");
+		fail_if(version == 0, "Value has no version");
+		free(result.store.d_string.value);
+		free(dlabel.value);
+
+		/* A new label alone leaves the value's version alone */
+		fail_if(!buxton_direct_set_label(&c, &key, &glabel),
+			"Setting key label failed.");
+		fail_if(buxton_direct_get_versioned_value(&c, &key, &result,
+							  &dlabel, NULL,
+							  &version2),
+			"Getting relabeled value failed.");
+		fail_if(version2 != version, "Label changed the version");
+		free(result.store.d_string.value);
+		free(dlabel.value);
+
+		fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+			"Setting value again failed.");
+		fail_if(buxton_direct_get_versioned_value(&c, &key, &result,
+							  &dlabel, NULL,
+							  &version2),
+			"Getting updated value failed.");
+		fail_if(version2 <= version, "Setting didn't change the version");
+		free(result.store.d_string.value);
+		free(dlabel.value);
+
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove group");
+	}
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_direct_update_value_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonUpdate update;
+	_BuxtonKey group;
+	_BuxtonKey key;
+	uint64_t version, version2;
+	char *layers[] = { "test-gdbm", "temp", "test-ordered" };
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	for (int i = 0; i < 3; i++) {
+		group.layer = buxton_string_pack(layers[i]);
+		group.group = buxton_string_pack("bxt_update_group");
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+
+		key.layer = group.layer;
+		key.group = group.group;
+		key.name = buxton_string_pack("bxt_update_key");
+		key.type = INT64;
+
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Creating group failed.");
+		fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+			"Setting group label failed.");
+
+		/* Version 0 only matches a key without a value */
+		memzero(&update, sizeof(BuxtonUpdate));
+		update.type = BUXTON_UPDATE_IF_VERSION;
+		data.type = INT64;
+		data.store.d_int64 = 7;
+		memzero(&result, sizeof(BuxtonData));
+		fail_if(buxton_direct_update_value(&c, &key, &update, &data,
+						   NULL, &result, &version),
+			"Creating value if absent failed.");
+		fail_if(result.store.d_int64 != 7 || version == 0,
+			"Created value is wrong.");
+		memzero(&result, sizeof(BuxtonData));
+		fail_if(buxton_direct_update_value(&c, &key, &update, &data,
+						   NULL, &result, &version2) !=
+			BUXTON_STATUS_MISMATCH,
+			"Created value that was present.");
+		fail_if(version2 != version, "Mismatch has wrong version.");
+
+		update.type = BUXTON_UPDATE_ADD;
+		update.delta = INT64_MIN;
+		memzero(&result, sizeof(BuxtonData));
+		fail_if(buxton_direct_update_value(&c, &key, &update, NULL,
+						   NULL, &result, &version2),
+			"Adding to value failed.");
+		fail_if(result.store.d_int64 != INT64_MIN + 7,
+			"Sum is wrong.");
+		fail_if(version2 <= version, "Adding didn't change the version");
+		update.delta = -8;
+		fail_if(buxton_direct_update_value(&c, &key, &update, NULL,
+						   NULL, &result, &version2) != -1,
+			"Added past the type's range.");
+
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove group");
+	}
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_direct_commit_check)
+{
+	BuxtonControl c;
+	BuxtonData one, two, result;
+	BuxtonString rlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name;
+	BuxtonChange changes[3];
+	_BuxtonKey group;
+	_BuxtonKey key1, key2, missing;
+	char *layers[] = { "test-gdbm", "temp", "test-ordered" };
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	one.type = INT32;
+	one.store.d_int32 = 1;
+	two.type = INT32;
+	two.store.d_int32 = 2;
+
+	for (int i = 0; i < 3; i++) {
+		layer_name = buxton_string_pack(layers[i]);
+		group.layer = layer_name;
+		group.group = buxton_string_pack("bxt_commit_group");
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+
+		key1 = group;
+		key1.name = buxton_string_pack("bxt_commit_key1");
+		key1.type = INT32;
+		key2 = key1;
+		key2.name = buxton_string_pack("bxt_commit_key2");
+		missing = key1;
+		missing.name = buxton_string_pack("bxt_commit_missing");
+
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Creating group failed.");
+		fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+			"Setting group label failed.");
+
+		/* Later changes see earlier ones in the same commit */
+		memzero(changes, sizeof(changes));
+		changes[0].key = &key1;
+		changes[0].data = &one;
+		changes[1].key = &key2;
+		changes[1].data = &two;
+		changes[2].key = &key1;
+		fail_if(!buxton_direct_commit(&c, &layer_name, changes, 3, NULL),
+			"Commit failed.");
+		fail_if(buxton_direct_get_value_for_layer(&c, &key1, &result,
+							  &rlabel, NULL) == 0,
+			"Unset in commit was not applied.");
+		fail_if(buxton_direct_get_value_for_layer(&c, &key2, &result,
+							  &rlabel, NULL),
+			"Set in commit was not applied.");
+		fail_if(result.store.d_int32 != 2, "Committed value is wrong.");
+		fail_if(!streq(rlabel.value, "_"), "Committed label is wrong.");
+		free(rlabel.value);
+
+		/* A change that can't be made leaves the others out too */
+		memzero(changes, sizeof(changes));
+		changes[0].key = &key1;
+		changes[0].data = &one;
+		changes[1].key = &missing;
+		fail_if(buxton_direct_commit(&c, &layer_name, changes, 2, NULL),
+			"Commit with an invalid change succeeded.");
+		fail_if(buxton_direct_get_value_for_layer(&c, &key1, &result,
+							  &rlabel, NULL) == 0,
+			"Failed commit was partly applied.");
+
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove group");
+	}
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+/* Write a gdbm commit log setting key to data, numbered number if not 0 */
+static void write_commit_log(const char *path, _BuxtonKey *key,
+			     BuxtonData *data, uint64_t number)
+{
+	BuxtonString label = buxton_string_pack("_");
+	uint8_t *value = NULL;
+	uint32_t key_len = key->group.length + key->name.length;
+	uint32_t value_len, number_len = sizeof(uint64_t);
+	uint32_t commit_len = sizeof("buxton-commit") - 1;
+	uint8_t op = 1;
+	FILE *f;
+
+	value_len = (uint32_t)buxton_serialize(data, &label, &value);
+	f = fopen(path, "w");
+	fail_if(!f, "Failed to write commit log");
+	fwrite(&op, 1, 1, f);
+	fwrite(&key_len, sizeof(uint32_t), 1, f);
+	fwrite(&value_len, sizeof(uint32_t), 1, f);
+	fwrite(key->group.value, 1, key->group.length, f);
+	fwrite(key->name.value, 1, key->name.length, f);
+	fwrite(value, 1, value_len, f);
+	if (number) {
+		fwrite(&op, 1, 1, f);
+		fwrite(&commit_len, sizeof(uint32_t), 1, f);
+		fwrite(&number_len, sizeof(uint32_t), 1, f);
+		fwrite("buxton-commit", 1, commit_len, f);
+		fwrite(&number, sizeof(uint64_t), 1, f);
+	}
+	fclose(f);
+	free(value);
+}
+
+START_TEST(buxton_gdbm_commit_log_check)
+{
+	BuxtonControl c;
+	BuxtonData old, new, result;
+	BuxtonString rlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name = buxton_string_pack("test-gdbm");
+	BuxtonChange change;
+	_BuxtonKey group;
+	_BuxtonKey key;
+	char log[PATH_MAX];
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_log_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+	key = group;
+	key.name = buxton_string_pack("bxt_log_key");
+	key.type = INT32;
+	old.type = INT32;
+	old.store.d_int32 = 1;
+	new.type = INT32;
+	new.store.d_int32 = 2;
+	sprintf(log, "%s/test-gdbm.db.commit", buxton_db_path());
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	memzero(&change, sizeof(BuxtonChange));
+	change.key = &key;
+	change.data = &old;
+	fail_if(!buxton_direct_commit(&c, &layer_name, &change, 1, NULL),
+		"Commit failed.");
+	fail_if(!buxton_direct_set_value(&c, &key, &new, NULL),
+		"Setting value failed.");
+	buxton_direct_close(&c);
+
+	/* A log left from a commit the database holds isn't applied again */
+	write_commit_log(log, &key, &old, 1);
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &rlabel,
+						  NULL),
+		"Failed to get value.");
+	fail_if(result.store.d_int32 != 2,
+		"An applied commit log rolled a value back.");
+	free(rlabel.value);
+	fail_if(access(log, F_OK) == 0, "Applied commit log was kept.");
+	buxton_direct_close(&c);
+
+	/* A log that can't be applied keeps the layer closed */
+	write_commit_log(log, &key, &old, 0);
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &rlabel,
+						  NULL) == 0,
+		"Opened a layer with an invalid commit log.");
+	fail_if(buxton_direct_set_value(&c, &key, &old, NULL),
+		"Set a value with an invalid commit log.");
+	buxton_direct_close(&c);
+
+	fail_if(unlink(log) == -1, "Failed to remove commit log");
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_direct_sweep_orphans_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name = buxton_string_pack("test-gdbm");
+	BuxtonBackend *backend;
+	BuxtonLayer *layer;
+	_BuxtonKey group;
+	_BuxtonKey key;
+	uint32_t removed = 0;
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_orphan_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_orphan_key");
+	key.type = STRING;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("bxt_orphan_value");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting value failed.");
+
+	/* drop only the group record, as older daemons did */
+	layer = hashmap_get(c.config.layers, layer_name.value);
+	fail_if(!layer, "Failed to find test layer");
+	backend = backend_for_layer(&c.config, layer);
+	fail_if(!backend, "Failed to get backend for test layer");
+	fail_if(backend->unset_value(layer, &group, NULL, NULL),
+		"Failed to unset group record");
+
+	fail_if(!buxton_direct_sweep_orphans(&c, &layer_name, &removed),
+		"Failed to sweep orphaned keys");
+	fail_if(removed != 1, "Swept an unexpected number of keys");
+
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Recreating group failed.");
+	fail_if(!buxton_direct_get_value_for_layer(&c, &key, &result,
+						   &dlabel, NULL),
+		"Orphaned key survived sweep");
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_backend_abi_check)
+{
+	/* Modules built before the version field fill these slots only */
+	fail_if(offsetof(BuxtonBackend, destroy) != 1 * sizeof(void *),
+		"destroy moved");
+	fail_if(offsetof(BuxtonBackend, set_value) != 2 * sizeof(void *),
+		"set_value moved");
+	fail_if(offsetof(BuxtonBackend, get_value) != 3 * sizeof(void *),
+		"get_value moved");
+	fail_if(offsetof(BuxtonBackend, list_keys) != 4 * sizeof(void *),
+		"list_keys moved");
+	fail_if(offsetof(BuxtonBackend, unset_value) != 5 * sizeof(void *),
+		"unset_value moved");
+	fail_if(offsetof(BuxtonBackend, create_db) != 6 * sizeof(void *),
+		"create_db moved");
+	fail_if(offsetof(BuxtonBackend, version) != 7 * sizeof(void *),
+		"version isn't right after create_db");
+}
+END_TEST
+
+START_TEST(buxton_backend_batch_check)
+{
+	BuxtonControl c;
+	BuxtonData values[3], results[3];
+	BuxtonString labels[3], rlabels[3];
+	BuxtonBatchItem items[3];
+	BuxtonBackend *backend;
+	BuxtonLayer *layer;
+	_BuxtonKey group;
+	_BuxtonKey keys[3];
+	char *layers[] = { "test-gdbm", "temp", "test-ordered" };
+	char *names[] = { "bxt_batch_key1", "bxt_batch_key2", "bxt_batch_key3" };
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	/* test-ordered has no batch functions, so it tests the fallback */
+	for (int i = 0; i < 3; i++) {
+		group.layer = buxton_string_pack(layers[i]);
+		group.group = buxton_string_pack("bxt_batch_group");
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Creating group failed.");
+
+		layer = hashmap_get(c.config.layers, layers[i]);
+		fail_if(!layer, "Failed to find test layer");
+		backend = backend_for_layer(&c.config, layer);
+		fail_if(!backend, "Failed to get backend for test layer");
+		fail_if(backend->version != BUXTON_BACKEND_VERSION,
+			"Backend has the wrong version");
+
+		memzero(items, sizeof(items));
+		for (int k = 0; k < 3; k++) {
+			keys[k] = group;
+			keys[k].name = buxton_string_pack(names[k]);
+			keys[k].type = UINT32;
+			values[k].type = UINT32;
+			values[k].store.d_uint32 = (uint32_t)k;
+			labels[k] = buxton_string_pack("_");
+			items[k].key = &keys[k];
+			items[k].data = &values[k];
+			items[k].label = &labels[k];
+		}
+		fail_if(backend_set_many(backend, layer, items, 2),
+			"Setting values failed.");
+
+		/* Each key gets its own result */
+		memzero(results, sizeof(results));
+		memzero(rlabels, sizeof(rlabels));
+		for (int k = 0; k < 3; k++) {
+			items[k].data = &results[k];
+			items[k].label = &rlabels[k];
+		}
+		fail_if(backend_get_many(backend, layer, items, 3) != ENOENT,
+			"Got a value that wasn't set.");
+		for (int k = 0; k < 2; k++) {
+			fail_if(items[k].status, "Getting value failed.");
+			fail_if(results[k].store.d_uint32 != (uint32_t)k,
+				"Got the wrong value.");
+			fail_if(!streq(rlabels[k].value, "_"),
+				"Got the wrong label.");
+			fail_if(items[k].version == 0, "Value has no version.");
+			free(rlabels[k].value);
+		}
+		fail_if(items[2].status != ENOENT, "Missing key didn't fail.");
+
+		fail_if(backend_unset_many(backend, layer, items, 3) != ENOENT,
+			"Unset a value that wasn't set.");
+		fail_if(items[0].status || items[1].status,
+			"Unsetting values failed.");
+		fail_if(backend_get_many(backend, layer, items, 2) != ENOENT,
+			"Unset values are still there.");
+
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove group");
+	}
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_backend_cursor_check)
+{
+	BuxtonControl c;
+	BuxtonData value, big;
+	BuxtonString label = buxton_string_pack("_");
+	BuxtonRecordView views[BUXTON_CURSOR_BATCH];
+	BuxtonBatchItem items[100];
+	static char big_value[65536];
+	BuxtonBackend *backend;
+	BuxtonLayer *layer;
+	BuxtonCursor *cursor;
+	BuxtonArray *list = NULL;
+	BuxtonData *item;
+	_BuxtonKey group;
+	_BuxtonKey keys[100];
+	char names[100][16];
+	char *layers[] = { "test-gdbm", "temp", "test-ordered" };
+	bool seen[100];
+	size_t count, groups, total;
+	unsigned int k;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+
+	for (int i = 0; i < 3; i++) {
+		group.layer = buxton_string_pack(layers[i]);
+		group.group = buxton_string_pack("bxt_cursor_group");
+		group.name = (BuxtonString){ NULL, 0 };
+		group.type = STRING;
+		fail_if(!buxton_direct_create_group(&c, &group, NULL),
+			"Creating group failed.");
+
+		layer = hashmap_get(c.config.layers, layers[i]);
+		fail_if(!layer, "Failed to find test layer");
+		backend = backend_for_layer(&c.config, layer);
+		fail_if(!backend, "Failed to get backend for test layer");
+
+		/* More keys than fit in one batch */
+		memzero(items, sizeof(items));
+		value.type = UINT32;
+		for (k = 0; k < 100; k++) {
+			snprintf(names[k], sizeof(names[k]), "bxt_cursor_%u", k);
+			keys[k] = group;
+			keys[k].name = buxton_string_pack(names[k]);
+			keys[k].type = UINT32;
+			items[k].key = &keys[k];
+			items[k].data = &value;
+			items[k].label = &label;
+			value.store.d_uint32 = k;
+			fail_if(backend_set_many(backend, layer, &items[k], 1),
+				"Setting value failed.");
+		}
+
+		cursor = backend_cursor_open(backend, layer, &group.group,
+					     BUXTON_CURSOR_VALUES);
+		fail_if(!cursor, "Opening cursor failed.");
+		memzero(seen, sizeof(seen));
+		groups = 0;
+		while (backend->cursor_next(cursor, views, BUXTON_CURSOR_BATCH,
+					    &count) && count) {
+			for (size_t v = 0; v < count; v++) {
+				fail_if(!streq(views[v].group.value,
+					       "bxt_cursor_group"),
+					"Cursor left its group.");
+				fail_if(!streq(views[v].label.value, "_"),
+					"Cursor got the wrong label.");
+				if (!views[v].name.value) {
+					groups++;
+					continue;
+				}
+				fail_if(sscanf(views[v].name.value,
+					       "bxt_cursor_%u", &k) != 1 || k >= 100,
+					"Cursor got an unknown key.");
+				fail_if(seen[k], "Cursor got a key twice.");
+				seen[k] = true;
+				fail_if(views[v].data.type != UINT32 ||
+					views[v].data.store.d_uint32 != k,
+					"Cursor got the wrong value.");
+				fail_if(views[v].version == 0,
+					"Cursor value has no version.");
+			}
+		}
+		backend->cursor_close(cursor);
+		fail_if(groups != 1, "Cursor didn't get the group record once.");
+		for (k = 0; k < 100; k++) {
+			fail_if(!seen[k], "Cursor missed a key.");
+		}
+
+		/* The whole layer holds at least the group */
+		cursor = backend_cursor_open(backend, layer, NULL, 0);
+		fail_if(!cursor, "Opening cursor failed.");
+		total = 0;
+		while (backend->cursor_next(cursor, views, 10, &count) && count) {
+			fail_if(count > 10, "Cursor overfilled its batch.");
+			total += count;
+		}
+		backend->cursor_close(cursor);
+		fail_if(total < 101, "Cursor missed records of the layer.");
+
+		fail_if(!buxton_direct_list_keys(&c, &group.layer, &list),
+			"Listing keys failed.");
+		total = 0;
+		for (uint16_t j = 0; j < list->len; j++) {
+			item = buxton_array_get(list, j);
+			if (strncmp(item->store.d_string.value, "bxt_cursor_",
+				    strlen("bxt_cursor_")) == 0) {
+				total++;
+			}
+			free(item->store.d_string.value);
+			free(item);
+		}
+		buxton_array_free(&list, NULL);
+		fail_if(total != 100, "Listing got the wrong keys.");
+
+		/* A batch stays readable while the layer changes under it */
+		cursor = backend_cursor_open(backend, layer, &group.group,
+					     BUXTON_CURSOR_VALUES);
+		fail_if(!cursor, "Opening cursor failed.");
+		fail_if(!backend->cursor_next(cursor, views, BUXTON_CURSOR_BATCH,
+					      &count) || count == 0,
+			"Cursor got no records.");
+		fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+			"Failed to remove group");
+		memset(big_value, 'x', sizeof(big_value) - 1);
+		big.type = STRING;
+		big.store.d_string.value = big_value;
+		big.store.d_string.length = sizeof(big_value);
+		items[0].data = &big;
+		fail_if(backend_set_many(backend, layer, &items[0], 1),
+			"Setting a large value failed.");
+		for (size_t v = 0; v < count; v++) {
+			fail_if(!streq(views[v].group.value, "bxt_cursor_group"),
+				"Cursor batch changed with the layer.");
+			fail_if(views[v].name.value &&
+				(sscanf(views[v].name.value, "bxt_cursor_%u",
+					&k) != 1 || k >= 100 ||
+				 views[v].data.store.d_uint32 != k),
+				"Cursor key changed with the layer.");
+		}
+		backend->cursor_close(cursor);
+		fail_if(backend_unset_many(backend, layer, &items[0], 1),
+			"Unsetting the large value failed.");
+	}
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_gdbm_open_limit_check)
+{
+	BuxtonControl c;
+	BuxtonData value, result;
+	BuxtonString label = buxton_string_pack("_");
+	BuxtonString rlabel;
+	BuxtonRecordView views[BUXTON_CURSOR_BATCH];
+	BuxtonBatchItem item;
+	BuxtonBackend *backend;
+	BuxtonLayer *layer;
+	BuxtonCursor *cursor;
+	_BuxtonKey key;
+	size_t count;
+	void *handle;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	layer = hashmap_get(c.config.layers, "test-gdbm-user");
+	fail_if(!layer, "Failed to find test layer");
+	backend = backend_for_layer(&c.config, layer);
+	fail_if(!backend, "Failed to get backend for test layer");
+
+	key.layer = buxton_string_pack("test-gdbm-user");
+	key.group = buxton_string_pack("bxt_limit_group");
+	key.name = buxton_string_pack("bxt_limit_key");
+	key.type = UINT32;
+	value.type = UINT32;
+	memzero(&item, sizeof(item));
+	item.key = &key;
+	item.data = &value;
+	item.label = &label;
+
+	/* The test config keeps 4 databases open, far fewer than users */
+	for (uid_t uid = 5000; uid < 5010; uid++) {
+		layer->uid = uid;
+		value.store.d_uint32 = (uint32_t)uid;
+		fail_if(backend_set_many(backend, layer, &item, 1),
+			"Setting value failed.");
+		handle = layer->handle;
+		fail_if(!handle, "Layer didn't cache its database.");
+		fail_if(backend_set_many(backend, layer, &item, 1),
+			"Setting value again failed.");
+		fail_if(layer->handle != handle,
+			"Layer didn't reuse its database.");
+	}
+
+	/* A walk keeps its database open while others come and go */
+	layer->uid = 5000;
+	cursor = backend_cursor_open(backend, layer, NULL, BUXTON_CURSOR_VALUES);
+	fail_if(!cursor, "Opening cursor failed.");
+
+	item.data = &result;
+	item.label = &rlabel;
+	for (uid_t uid = 5009; uid >= 5000; uid--) {
+		layer->uid = uid;
+		memzero(&result, sizeof(result));
+		fail_if(backend_get_many(backend, layer, &item, 1),
+			"Value was lost when its database closed.");
+		fail_if(result.store.d_uint32 != (uint32_t)uid,
+			"Got another user's value.");
+		free(rlabel.value);
+	}
+
+	fail_if(!backend->cursor_next(cursor, views, BUXTON_CURSOR_BATCH,
+				      &count) || count != 1,
+		"Cursor lost its database.");
+	fail_if(views[0].data.store.d_uint32 != 5000,
+		"Cursor got the wrong value.");
+	backend->cursor_close(cursor);
+
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_memory_backend_values_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	_BuxtonKey group;
+	_BuxtonKey key;
+
+	group.layer = buxton_string_pack("temp");
+	group.group = buxton_string_pack("bxt_mem_values_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_mem_values_key");
+	key.type = STRING;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+
+	/* short strings are stored inline, longer ones are not */
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("short");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting short value failed.");
+	data.store.d_string = buxton_string_pack("a value too long to be inline");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting long value failed.");
+	fail_if(!buxton_direct_set_label(&c, &key, &glabel),
+		"Setting key label failed.");
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel, NULL),
+		"Retrieving long value failed.");
+	fail_if(!streq(result.store.d_string.value,
+		       "a value too long to be inline"),
+		"Memory backend returned a different long value.");
+	fail_if(result.store.d_string.length != data.store.d_string.length,
+		"Memory backend returned a different length.");
+	fail_if(!streq(dlabel.value, "*"), "Key label was not kept.");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+
+	/* keys of another group with a shared prefix stay distinct */
+	key.group = buxton_string_pack("bxt_mem_values_grou");
+	fail_if(!buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel, NULL),
+		"Found key through a different group.");
+
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_memory_snapshot_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	_BuxtonKey group;
+	_BuxtonKey key;
+
+	group.layer = buxton_string_pack("test-memory-snapshot");
+	group.group = buxton_string_pack("bxt_snapshot_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_snapshot_key");
+	key.type = STRING;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("a value that outlives the module");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting value failed.");
+	buxton_direct_close(&c);
+
+	/* closing the layer wrote the snapshot, opening again reads it */
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel, NULL),
+		"Value was not restored from the snapshot.");
+	fail_if(!streq(result.store.d_string.value,
+		       "a value that outlives the module"),
+		"Snapshot returned a different value.");
+	fail_if(!streq(dlabel.value, "_"), "Snapshot lost the key label.");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+
+	/* removals have to persist as well */
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel, NULL),
+		"Removed value came back from the snapshot.");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_memory_corrupt_snapshot_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	_BuxtonKey group;
+	_BuxtonKey key;
+	char snapshot[PATH_MAX];
+	uint8_t buf[8192];
+	uint32_t slots, entry_size, arena_used, labels_size, label;
+	size_t arena, labels;
+	uint16_t len = UINT16_MAX;
+	ssize_t size;
+	int fd;
+
+	group.layer = buxton_string_pack("test-memory-snapshot");
+	group.group = buxton_string_pack("bxt_corrupt_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_corrupt_key");
+	key.type = STRING;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("bxt_corrupt_value");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting value failed.");
+	buxton_direct_close(&c);
+
+	sprintf(snapshot, "%s/test-memory-snapshot.db", buxton_db_path());
+	fd = open(snapshot, O_RDWR);
+	fail_if(fd == -1, "Failed to open memory snapshot");
+	size = read(fd, buf, sizeof(buf));
+	fail_if(size <= 32 || size == sizeof(buf),
+		"Unexpected memory snapshot size");
+
+	/* Make the first interned label run past the end of the arena */
+	memcpy(&slots, buf + 8, sizeof(uint32_t));
+	memcpy(&arena_used, buf + 16, sizeof(uint32_t));
+	memcpy(&labels_size, buf + 20, sizeof(uint32_t));
+	memcpy(&entry_size, buf + 28, sizeof(uint32_t));
+	arena = 32 + (size_t)slots * entry_size;
+	labels = arena + arena_used;
+	fail_if(labels + labels_size * sizeof(uint32_t) != (size_t)size,
+		"Bad memory snapshot layout");
+	label = 0;
+	for (uint32_t i = 0; i < labels_size && !label; i++) {
+		memcpy(&label, buf + labels + i * sizeof(uint32_t),
+		       sizeof(uint32_t));
+	}
+	fail_if(!label, "Memory snapshot has no labels");
+	fail_if(pwrite(fd, &len, sizeof(uint16_t), (off_t)(arena + label)) !=
+		sizeof(uint16_t), "Failed to corrupt the memory snapshot");
+	close(fd);
+
+	/* The snapshot is ignored rather than read past its arena */
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel,
+						   NULL),
+		"Value was loaded from a corrupt snapshot.");
+	buxton_direct_close(&c);
+	unlink(snapshot);
+}
+END_TEST
+
+START_TEST(buxton_ordered_backend_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name = buxton_string_pack("test-ordered");
+	BuxtonArray *list = NULL;
+	BuxtonData *item;
+	_BuxtonKey group;
+	_BuxtonKey key;
+	bool found = false;
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_ordered_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_ordered_key");
+	key.type = STRING;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_init_db(&c, &layer_name),
+		"Failed to run init_db for ordered layer");
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("bxt_ordered_value");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting value in ordered backend failed.");
+	buxton_direct_close(&c);
+
+	/* values must survive reopening the layer */
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel, NULL),
+		"Retrieving value from ordered backend failed.");
+	fail_if(!streq(result.store.d_string.value, "bxt_ordered_value"),
+		"Ordered backend returned a different value to that set.");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+
+	fail_if(!buxton_direct_list_keys(&c, &layer_name, &list),
+		"Listing keys in ordered backend failed.");
+	for (uint16_t i = 0; i < list->len; i++) {
+		item = buxton_array_get(list, i);
+		if (streq(item->store.d_string.value, "bxt_ordered_key")) {
+			found = true;
+		}
+		free(item->store.d_string.value);
+		free(item);
+	}
+	buxton_array_free(&list, NULL);
+	fail_if(!found, "Ordered backend did not list key");
+
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_ordered_label_table_check)
+{
+	BuxtonControl c;
+	BuxtonData result;
+	BuxtonString dlabel;
+	BuxtonString layer_name = buxton_string_pack("test-ordered");
+	_BuxtonKey group;
+	_BuxtonKey other;
+	char journal[PATH_MAX];
+	uint8_t entry[1 + 2 * sizeof(uint32_t) + BUXTON_LABEL_TABLE_KEY_LENGTH +
+		      sizeof(uint32_t)];
+	uint32_t key_len = BUXTON_LABEL_TABLE_KEY_LENGTH;
+	uint32_t value_len = sizeof(uint32_t);
+	uint32_t table = UINT32_MAX;
+	struct stat st;
+	size_t offset = 0;
+	int fd;
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_label_table_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	other = group;
+	other.group = buxton_string_pack("bxt_label_table_other");
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	buxton_direct_close(&c);
+
+	/* Journal a label table of an unknown version over the real one */
+	sprintf(journal, "%s/test-ordered.db-journal", buxton_db_path());
+	fail_if(stat(journal, &st) == -1, "Ordered layer has no journal");
+	entry[offset++] = 1;
+	memcpy(entry + offset, &key_len, sizeof(uint32_t));
+	offset += sizeof(uint32_t);
+	memcpy(entry + offset, &value_len, sizeof(uint32_t));
+	offset += sizeof(uint32_t);
+	memcpy(entry + offset, BUXTON_LABEL_TABLE_KEY, key_len);
+	offset += key_len;
+	memcpy(entry + offset, &table, sizeof(uint32_t));
+	fd = open(journal, O_WRONLY | O_APPEND);
+	fail_if(fd == -1, "Failed to open ordered journal");
+	fail_if(write(fd, entry, sizeof(entry)) != (ssize_t)sizeof(entry),
+		"Failed to corrupt the label table");
+	close(fd);
+
+	/* The layer is refused rather than given labels over the table */
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_create_group(&c, &other, NULL),
+		"Created a group over an invalid label table.");
+	fail_if(!buxton_direct_get_value_for_layer(&c, &group, &result,
+						   &dlabel, NULL),
+		"Read a group despite an invalid label table.");
+	buxton_direct_close(&c);
+
+	fail_if(truncate(journal, st.st_size) == -1,
+		"Failed to restore the ordered journal");
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_ordered_order_check)
+{
+	BuxtonControl c;
+	BuxtonData data;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name = buxton_string_pack("test-ordered");
+	BuxtonArray *list = NULL;
+	BuxtonData *item;
+	_BuxtonKey group;
+	_BuxtonKey key;
+	char name[16];
+	char last[16] = "";
+	int found = 0;
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_order_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.type = INT32;
+	data.type = INT32;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	/* Set out of order, then unset every third key */
+	for (int i = 0; i < 64; i++) {
+		sprintf(name, "bxt_order_%02d", (i * 37) % 64);
+		key.name = buxton_string_pack(name);
+		data.store.d_int32 = i;
+		fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+			"Setting value in ordered backend failed.");
+	}
+	for (int i = 0; i < 64; i += 3) {
+		sprintf(name, "bxt_order_%02d", i);
+		key.name = buxton_string_pack(name);
+		fail_if(!buxton_direct_unset_value(&c, &key, NULL),
+			"Unsetting value in ordered backend failed.");
+	}
+	buxton_direct_close(&c);
+
+	/* The keys come back sorted once the snapshot is read again */
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_list_keys(&c, &layer_name, &list),
+		"Listing keys in ordered backend failed.");
+	for (uint16_t i = 0; i < list->len; i++) {
+		item = buxton_array_get(list, i);
+		if (strncmp(item->store.d_string.value, "bxt_order_", 10) == 0) {
+			fail_if(strcmp(last, item->store.d_string.value) >= 0,
+				"Ordered backend listed %s after %s",
+				item->store.d_string.value, last);
+			fail_if(atoi(item->store.d_string.value + 10) % 3 == 0,
+				"Ordered backend listed unset key %s",
+				item->store.d_string.value);
+			strcpy(last, item->store.d_string.value);
+			found++;
+		}
+		free(item->store.d_string.value);
+		free(item);
+	}
+	buxton_array_free(&list, NULL);
+	fail_if(found != 42, "Ordered backend listed %d keys, not 42", found);
+
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_ordered_torn_journal_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name = buxton_string_pack("test-ordered");
+	_BuxtonKey group;
+	_BuxtonKey key;
+	char journal[PATH_MAX];
+	uint8_t buf[4096];
+	struct stat st;
+	ssize_t size;
+	int fd;
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_torn_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_torn_key");
+	key.type = STRING;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("bxt_torn_value");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting value in ordered backend failed.");
+
+	/* Keep the journal, which closing folds into the snapshot */
+	sprintf(journal, "%s/test-ordered.db-journal", buxton_db_path());
+	fd = open(journal, O_RDONLY);
+	fail_if(fd == -1, "Failed to open ordered journal");
+	size = read(fd, buf, sizeof(buf) - 5);
+	close(fd);
+	fail_if(size <= 5, "Ordered journal is too short");
+	buxton_direct_close(&c);
+
+	/* Put it back with the start of another entry torn off after it */
+	memcpy(buf + size, buf, 5);
+	fd = open(journal, O_WRONLY | O_TRUNC);
+	fail_if(fd == -1, "Failed to open ordered journal");
+	fail_if(write(fd, buf, (size_t)size + 5) != size + 5,
+		"Failed to tear the ordered journal");
+	close(fd);
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel,
+						  NULL),
+		"Retrieving value after a torn journal failed.");
+	fail_if(!streq(result.store.d_string.value, "bxt_torn_value"),
+		"Torn journal gave a different value to that set.");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+	fail_if(stat(journal, &st) == -1, "Ordered layer has no journal");
+	fail_if(st.st_size != size, "Torn journal entry was not dropped");
+
+	/* Entries written now follow the last whole one */
+	data.store.d_string = buxton_string_pack("bxt_torn_after");
+	fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+		"Setting value after a torn journal failed.");
+	buxton_direct_close(&c);
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel,
+						  NULL),
+		"Retrieving value after a torn journal failed.");
+	fail_if(!streq(result.store.d_string.value, "bxt_torn_after"),
+		"Value set after a torn journal was lost.");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
+START_TEST(buxton_ordered_compact_check)
+{
+	BuxtonControl c;
+	BuxtonData data, result;
+	BuxtonString dlabel;
+	BuxtonString glabel = buxton_string_pack("*");
+	BuxtonString layer_name = buxton_string_pack("test-ordered");
+	_BuxtonKey group;
+	_BuxtonKey key;
+	char journal[PATH_MAX];
+	struct stat st;
+	off_t least;
+
+	group.layer = layer_name;
+	group.group = buxton_string_pack("bxt_compact_group");
+	group.name = (BuxtonString){ NULL, 0 };
+	group.type = STRING;
+
+	key.layer = group.layer;
+	key.group = group.group;
+	key.name = buxton_string_pack("bxt_compact_key");
+	key.type = INT32;
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(!buxton_direct_create_group(&c, &group, NULL),
+		"Creating group failed.");
+	fail_if(!buxton_direct_set_label(&c, &group, &glabel),
+		"Setting group label failed.");
+	data.type = INT32;
+	for (int32_t i = 0; i < 1100; i++) {
+		data.store.d_int32 = i;
+		fail_if(!buxton_direct_set_value(&c, &key, &data, NULL),
+			"Setting value in ordered backend failed.");
+	}
+
+	/* Setting values only appends, however long the journal gets */
+	sprintf(journal, "%s/test-ordered.db-journal", buxton_db_path());
+	least = (off_t)(1100 * (1 + 2 * sizeof(uint32_t) + key.group.length +
+				key.name.length));
+	fail_if(stat(journal, &st) == -1, "Ordered layer has no journal");
+	fail_if(st.st_size < least, "Ordered journal compacted while setting");
+
+	/* Syncing folds it into the snapshot */
+	buxton_direct_sync(&c);
+	fail_if(stat(journal, &st) == -1, "Ordered layer has no journal");
+	fail_if(st.st_size != 0, "Ordered journal wasn't compacted by a sync");
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel,
+						  NULL),
+		"Retrieving value after compacting failed.");
+	fail_if(result.store.d_int32 != 1099,
+		"Compacting changed the value");
+	free(dlabel.value);
+	buxton_direct_close(&c);
+
+	fail_if(buxton_direct_open(&c) == false,
+		"Direct open failed without daemon.");
+	c.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&c, &key, &result, &dlabel,
+						  NULL),
+		"Retrieving value from the compacted layer failed.");
+	fail_if(result.store.d_int32 != 1099,
+		"Compacted layer has a different value");
+	free(dlabel.value);
+	fail_if(!buxton_direct_remove_group(&c, &group, NULL),
+		"Failed to remove group");
+	buxton_direct_close(&c);
+}
+END_TEST
+
 START_TEST(buxton_key_check)
 {
 	char *group = "group";
@@ -669,10 +2011,209 @@ START_TEST(handle_callback_response_check)
 }
 END_TEST
 
-START_TEST(buxton_wire_handle_response_check)
+static void grouped_response_cb_test(_BuxtonResponse *response, void *data)
+{
+	size_t *changes = (size_t *)data;
+	_BuxtonKey *key;
+	int32_t *value;
+	size_t count;
+
+	count = buxton_response_changes(response);
+	fail_if(count == 0, "Got no changes");
+	key = buxton_response_changed_key(response, count - 1);
+	value = buxton_response_changed_value(response, count - 1);
+	fail_if(!key || !value, "Failed to get last change");
+	fail_if(*value != (int32_t)(*changes + count),
+		"Got change %d with the wrong value", *value);
+	fail_if(!streq(key->name.value, *value == 2 ? "name2" : "name3"),
+		"Got value %d with the wrong key", *value);
+	fail_if(buxton_response_changed_key(response, count),
+		"Got key past the last change");
+	buxton_key_free(key);
+	free(value);
+	*changes += count;
+}
+START_TEST(handle_grouped_response_check)
+{
+	_BuxtonClient client;
+	BuxtonArray *out_list = NULL;
+	uint8_t *dest = NULL;
+	int server;
+	size_t size;
+	size_t changes1 = 0, changes2 = 2;
+	BuxtonData data;
+	_BuxtonKey key;
+	BuxtonData good[] = {
+		{INT32, {.d_int32 = 0}}
+	};
+	BuxtonData grouped[] = {
+		{UINT32, {.d_uint32 = 1}},
+		{INT32, {.d_int32 = 1}},
+		{UINT32, {.d_uint32 = 2}},
+		{INT32, {.d_int32 = 2}},
+		{UINT32, {.d_uint32 = 9}},
+		{INT32, {.d_int32 = 9}},
+		{UINT32, {.d_uint32 = 3}},
+		{INT32, {.d_int32 = 3}}
+	};
+
+	setup_socket_pair(&(client.fd), &server);
+	fail_if(fcntl(client.fd, F_SETFL, O_NONBLOCK),
+		"Failed to set socket to non blocking");
+	fail_if(fcntl(server, F_SETFL, O_NONBLOCK),
+		"Failed to set socket to non blocking");
+	fail_if(!setup_callbacks(),
+		"Failed to initialeze response callbacks");
+
+	out_list = buxton_array_new();
+	data.type = INT32;
+	data.store.d_int32 = 0;
+	fail_if(!buxton_array_add(out_list, &data),
+		"Failed to add data to array");
+	size = buxton_serialize_message(&dest, BUXTON_CONTROL_STATUS, 1,
+					out_list);
+	buxton_array_free(&out_list, NULL);
+	fail_if(size == 0, "Failed to serialize message");
+
+	/* Two keys share a callback and data, the third has its own */
+	memzero(&key, sizeof(_BuxtonKey));
+	key.group = buxton_string_pack("group");
+	key.type = INT32;
+	key.name = buxton_string_pack("name1");
+	fail_if(!send_message(&client, dest, size, grouped_response_cb_test,
+			      &changes1, 1, BUXTON_CONTROL_NOTIFY, &key),
+		"Failed to send message 1");
+	key.name = buxton_string_pack("name2");
+	fail_if(!send_message(&client, dest, size, grouped_response_cb_test,
+			      &changes1, 2, BUXTON_CONTROL_NOTIFY, &key),
+		"Failed to send message 2");
+	key.name = buxton_string_pack("name3");
+	fail_if(!send_message(&client, dest, size, grouped_response_cb_test,
+			      &changes2, 3, BUXTON_CONTROL_NOTIFY, &key),
+		"Failed to send message 3");
+	lock_mutex();
+	for (uint32_t msgid = 1; msgid <= 3; msgid++) {
+		handle_callback_response(BUXTON_CONTROL_STATUS, msgid, good, 1);
+	}
+
+	/* Unknown msgids are skipped */
+	handle_callback_response(BUXTON_CONTROL_CHANGED_MANY, 0, grouped, 8);
+	unlock_mutex();
+	fail_if(changes1 != 2, "Grouped changes not passed in one call");
+	fail_if(changes2 != 3, "Change with its own callback not passed");
+
+	cleanup_callbacks();
+	free(dest);
+	close(client.fd);
+	close(server);
+}
+END_TEST
+
+static void journal_response_cb_test(_BuxtonResponse *response, void *data)
+{
+	uint64_t *next = (uint64_t *)data;
+	_BuxtonKey *key;
+	char *value;
+
+	switch (buxton_response_type(response)) {
+	case BUXTON_CONTROL_SUBSCRIBE:
+		fail_if(buxton_response_status(response) != 0,
+			"Journal subscription failed");
+		fail_if(buxton_response_epoch(response) != 42,
+			"Bad journal epoch");
+		*next = buxton_response_sequence(response);
+		break;
+	case BUXTON_CONTROL_JOURNAL:
+		fail_if(buxton_response_sequence(response) != *next,
+			"Journal entry out of order");
+		if (buxton_response_status(response) == BUXTON_STATUS_RESYNC) {
+			fail_if(buxton_response_journal_op(response) !=
+				BUXTON_CONTROL_MIN, "Bad resync signal");
+			fail_if(buxton_response_key(response),
+				"Resync signal has a key");
+			*next = 0;
+			break;
+		}
+		fail_if(buxton_response_journal_op(response) != BUXTON_CONTROL_SET,
+			"Bad journal op");
+		key = buxton_response_key(response);
+		value = buxton_response_value(response);
+		fail_if(!key || !streq(key->name.value, "name"),
+			"Bad journal key");
+		fail_if(!value || !streq(value, "value"), "Bad journal value");
+		buxton_key_free(key);
+		free(value);
+		(*next)++;
+		break;
+	default:
+		fail("Unexpected response to journal subscription");
+	}
+}
+START_TEST(handle_journal_response_check)
 {
 	_BuxtonClient client;
 	BuxtonArray *out_list = NULL;
+	uint8_t *dest = NULL;
+	int server;
+	size_t size;
+	uint64_t next = 0;
+	BuxtonData subscribed[] = {
+		{INT32, {.d_int32 = 0}},
+		{UINT64, {.d_uint64 = 5}},
+		{UINT64, {.d_uint64 = 42}}
+	};
+	BuxtonData entry[] = {
+		{UINT64, {.d_uint64 = 5}},
+		{UINT32, {.d_uint32 = BUXTON_CONTROL_SET}},
+		{STRING, {.d_string = {"base", 5}}},
+		{STRING, {.d_string = {"group", 6}}},
+		{STRING, {.d_string = {"name", 5}}},
+		{UINT32, {.d_uint32 = 0}},
+		{STRING, {.d_string = {"value", 6}}}
+	};
+	BuxtonData resync[] = {
+		{UINT64, {.d_uint64 = 6}},
+		{UINT32, {.d_uint32 = BUXTON_CONTROL_MIN}}
+	};
+
+	setup_socket_pair(&(client.fd), &server);
+	fail_if(fcntl(client.fd, F_SETFL, O_NONBLOCK),
+		"Failed to set socket to non blocking");
+	fail_if(!setup_callbacks(),
+		"Failed to initialeze response callbacks");
+
+	out_list = buxton_array_new();
+	fail_if(!buxton_array_add(out_list, &subscribed[1]),
+		"Failed to add data to array");
+	size = buxton_serialize_message(&dest, BUXTON_CONTROL_SUBSCRIBE, 1,
+					out_list);
+	buxton_array_free(&out_list, NULL);
+	fail_if(size == 0, "Failed to serialize message");
+	fail_if(!send_message(&client, dest, size, journal_response_cb_test,
+			      &next, 1, BUXTON_CONTROL_SUBSCRIBE, NULL),
+		"Failed to send journal subscription");
+
+	lock_mutex();
+	/* The callback stays registered for the entries that follow */
+	handle_callback_response(BUXTON_CONTROL_STATUS, 1, subscribed, 3);
+	fail_if(next != 5, "Journal subscription not passed to callback");
+	handle_callback_response(BUXTON_CONTROL_JOURNAL, 1, entry, 7);
+	fail_if(next != 6, "Journal entry not passed to callback");
+	handle_callback_response(BUXTON_CONTROL_JOURNAL, 1, resync, 2);
+	fail_if(next != 0, "Resync signal not passed to callback");
+	unlock_mutex();
+
+	cleanup_callbacks();
+	free(dest);
+	close(client.fd);
+	close(server);
+}
+END_TEST
+
+START_TEST(buxton_wire_handle_response_check)
+{
+	_BuxtonClient client = {0};
+	BuxtonArray *out_list = NULL;
 	int server;
 	uint8_t *dest = NULL;
 	size_t size;
@@ -712,6 +2253,7 @@ START_TEST(buxton_wire_handle_response_check)
 
 	cleanup_callbacks();
 	free(dest);
+	free(client.buffer);
 	close(client.fd);
 	close(server);
 }
@@ -719,7 +2261,7 @@ END_TEST
 
 START_TEST(buxton_wire_get_response_check)
 {
-	_BuxtonClient client;
+	_BuxtonClient client = {0};
 	BuxtonArray *out_list = NULL;
 	int server;
 	uint8_t *dest = NULL;
@@ -760,6 +2302,69 @@ START_TEST(buxton_wire_get_response_check)
 
 	cleanup_callbacks();
 	free(dest);
+	free(client.buffer);
+	close(client.fd);
+	close(server);
+}
+END_TEST
+
+START_TEST(buxton_wire_handle_response_buffer_check)
+{
+	_BuxtonClient client = {0};
+	BuxtonArray *out_list = NULL;
+	int server;
+	uint8_t *dest[3];
+	size_t size[3];
+	BuxtonData data;
+	bool test_data[3] = { true, true, true };
+
+	setup_socket_pair(&(client.fd), &server);
+	fail_if(fcntl(client.fd, F_SETFL, O_NONBLOCK),
+		"Failed to set socket to non blocking");
+	fail_if(fcntl(server, F_SETFL, O_NONBLOCK),
+		"Failed to set socket to non blocking");
+
+	fail_if(!setup_callbacks(),
+		"Failed to initialeze callbacks");
+	out_list = buxton_array_new();
+	data.type = INT32;
+	data.store.d_int32 = 0;
+	fail_if(!buxton_array_add(out_list, &data),
+		"Failed to add data to array");
+	for (uint32_t i = 0; i < 3; i++) {
+		size[i] = buxton_serialize_message(&dest[i], BUXTON_CONTROL_STATUS,
+						   i, out_list);
+		fail_if(size[i] == 0, "Failed to serialize message");
+		fail_if(!send_message(&client, dest[i], size[i],
+				      handle_response_cb_test, &test_data[i],
+				      i, BUXTON_CONTROL_STATUS, NULL),
+			"Failed to send message");
+	}
+	buxton_array_free(&out_list, NULL);
+
+	/* server sends one and a half responses, then the rest */
+	fail_if(!_write(server, dest[0], size[0]),
+		"Failed to send first response");
+	fail_if(!_write(server, dest[1], size[1] / 2),
+		"Failed to send half a response");
+	fail_if(buxton_wire_handle_response(&client) != 1,
+		"Failed to handle only the complete response");
+	fail_if(test_data[0], "Failed to run first callback");
+	fail_if(!test_data[1], "Ran callback for a partial response");
+
+	fail_if(!_write(server, dest[1] + size[1] / 2, size[1] - size[1] / 2),
+		"Failed to send rest of a response");
+	fail_if(!_write(server, dest[2], size[2]),
+		"Failed to send last response");
+	fail_if(buxton_wire_handle_response(&client) != 2,
+		"Failed to handle the buffered responses");
+	fail_if(test_data[1] || test_data[2], "Failed to run callbacks");
+
+	cleanup_callbacks();
+	for (int i = 0; i < 3; i++) {
+		free(dest[i]);
+	}
+	free(client.buffer);
 	close(client.fd);
 	close(server);
 }
@@ -1180,6 +2785,24 @@ buxton_suite(void)
 	tcase_add_test(tc, buxton_direct_get_value_for_layer_check);
 	tcase_add_test(tc, buxton_direct_get_value_check);
 	tcase_add_test(tc, buxton_memory_backend_check);
+	tcase_add_test(tc, buxton_memory_backend_values_check);
+	tcase_add_test(tc, buxton_memory_snapshot_check);
+	tcase_add_test(tc, buxton_memory_corrupt_snapshot_check);
+	tcase_add_test(tc, buxton_ordered_backend_check);
+	tcase_add_test(tc, buxton_ordered_label_table_check);
+	tcase_add_test(tc, buxton_ordered_order_check);
+	tcase_add_test(tc, buxton_ordered_torn_journal_check);
+	tcase_add_test(tc, buxton_ordered_compact_check);
+	tcase_add_test(tc, buxton_direct_remove_group_keys_check);
+	tcase_add_test(tc, buxton_direct_versioned_value_check);
+	tcase_add_test(tc, buxton_direct_update_value_check);
+	tcase_add_test(tc, buxton_direct_commit_check);
+	tcase_add_test(tc, buxton_gdbm_commit_log_check);
+	tcase_add_test(tc, buxton_direct_sweep_orphans_check);
+	tcase_add_test(tc, buxton_backend_abi_check);
+	tcase_add_test(tc, buxton_backend_batch_check);
+	tcase_add_test(tc, buxton_backend_cursor_check);
+	tcase_add_test(tc, buxton_gdbm_open_limit_check);
 	tcase_add_test(tc, buxton_key_check);
 	tcase_add_test(tc, buxton_set_label_check);
 	tcase_add_test(tc, buxton_group_label_check);
@@ -1189,9 +2812,12 @@ buxton_suite(void)
 	tc = tcase_create("buxton_protocol_functions");
 	tcase_add_test(tc, run_callback_check);
 	tcase_add_test(tc, handle_callback_response_check);
+	tcase_add_test(tc, handle_grouped_response_check);
+	tcase_add_test(tc, handle_journal_response_check);
 	tcase_add_test(tc, send_message_check);
 	tcase_add_test(tc, buxton_wire_handle_response_check);
 	tcase_add_test(tc, buxton_wire_get_response_check);
+	tcase_add_test(tc, buxton_wire_handle_response_buffer_check);
 	tcase_add_test(tc, buxton_wire_set_value_check);
 	tcase_add_test(tc, buxton_wire_set_label_check);
 	tcase_add_test(tc, buxton_wire_get_value_check);
@@ -86,6 +86,12 @@ START_TEST(configurator_default_buxton_socket)
 }
 END_TEST
 
+START_TEST(configurator_default_priority_uids)
+{
+	default_test(buxton_priority_uids(), "0", "buxton_priority_uids()");
+}
+END_TEST
+
 
 START_TEST(configurator_env_conf_file)
 {
@@ -122,6 +128,13 @@ START_TEST(configurator_env_buxton_socket)
 }
 END_TEST
 
+START_TEST(configurator_env_priority_labels)
+{
+	putenv("BUXTON_PRIORITY_LABELS=System,User");
+	default_test(buxton_priority_labels(), "System,User", "buxton_priority_labels()");
+}
+END_TEST
+
 
 START_TEST(configurator_cmd_conf_file)
 {
@@ -281,6 +294,7 @@ configurator_suite(void)
 	tcase_add_test(tc, configurator_default_db_path);
 	tcase_add_test(tc, configurator_default_smack_load_file);
 	tcase_add_test(tc, configurator_default_buxton_socket);
+	tcase_add_test(tc, configurator_default_priority_uids);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("env clobbers defaults");
@@ -289,6 +303,7 @@ configurator_suite(void)
 	tcase_add_test(tc, configurator_env_db_path);
 	tcase_add_test(tc, configurator_env_smack_load_file);
 	tcase_add_test(tc, configurator_env_buxton_socket);
+	tcase_add_test(tc, configurator_env_priority_labels);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("command line clobbers all");
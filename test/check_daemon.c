@@ -16,6 +16,7 @@
 #include <check.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
@@ -29,6 +30,7 @@
 #include <unistd.h>
 
 #include "buxton.h"
+#include "buxtonclient.h"
 #include "buxtonresponse.h"
 #include "configurator.h"
 #include "check_utils.h"
@@ -37,6 +39,7 @@
 #include "hashmap.h"
 #include "log.h"
 #include "smack.h"
+#include "uring.h"
 #include "util.h"
 #include "buxtonlist.h"
 
@@ -447,6 +450,192 @@ START_TEST(buxton_get_value_check)
 }
 END_TEST
 
+static void client_handoff_notify(BuxtonResponse response, void *data)
+{
+	int *changed = (int *)data;
+
+	if (buxton_response_type(response) == BUXTON_CONTROL_CHANGED) {
+		(*changed)++;
+	}
+}
+START_TEST(buxtond_handoff_check)
+{
+	BuxtonClient c = NULL;
+	BuxtonKey group = buxton_key_create("handoff", NULL, "test-gdbm", STRING);
+	fail_if(!group, "Failed to create key for group");
+	BuxtonKey key = buxton_key_create("handoff", "name", "test-gdbm", STRING);
+	fail_if(!key, "Failed to create key");
+	struct pollfd pfd;
+	int changed = 0;
+
+	fail_if(buxton_open(&c) == -1,
+		"Open failed with daemon.");
+	fail_if(buxton_create_group(c, group, NULL, NULL, true),
+		"Creating group in buxton failed.");
+	fail_if(buxton_set_label(c, group, "*", NULL, NULL, true),
+		"Setting group in buxton failed.");
+	fail_if(buxton_set_value(c, key, "before", NULL, NULL, true),
+		"Setting value in buxton failed.");
+	fail_if(buxton_register_notification(c, key, client_handoff_notify,
+					     &changed, true),
+		"Registering notification failed.");
+
+	/* The new daemon keeps the connection and the notification */
+	fail_if(kill(daemon_pid, SIGUSR2), "Failed to signal daemon");
+	usleep(128*1000);
+	fail_if(buxton_set_value(c, key, "after", NULL, NULL, true),
+		"Setting value after handoff failed.");
+	pfd.fd = ((_BuxtonClient *)c)->fd;
+	pfd.events = POLLIN;
+	while (!changed && poll(&pfd, 1, 1000) > 0) {
+		fail_if(buxton_client_handle_response(c) < 0,
+			"Failed to handle notification");
+	}
+	fail_if(!changed, "No notification after handoff");
+
+	buxton_key_free(group);
+	buxton_key_free(key);
+	buxton_close(c);
+}
+END_TEST
+
+static void client_handoff_status(BuxtonResponse response, void *data)
+{
+	int32_t *status = (int32_t *)data;
+
+	*status = buxton_response_status(response);
+}
+static void client_handoff_value(BuxtonResponse response, void *data)
+{
+	char **value = (char **)data;
+
+	fail_if(buxton_response_status(response) != 0,
+		"Get value failed");
+	*value = buxton_response_value(response);
+}
+START_TEST(buxtond_handoff_transaction_check)
+{
+	BuxtonClient c = NULL;
+	BuxtonKey group = buxton_key_create("handoff", NULL, "test-gdbm", STRING);
+	fail_if(!group, "Failed to create key for group");
+	BuxtonKey key = buxton_key_create("handoff", "staged", "test-gdbm", STRING);
+	fail_if(!key, "Failed to create key");
+	char *value = NULL;
+	int32_t status = -1;
+
+	fail_if(buxton_open(&c) == -1,
+		"Open failed with daemon.");
+	fail_if(buxton_create_group(c, group, NULL, NULL, true),
+		"Creating group in buxton failed.");
+	fail_if(buxton_set_label(c, group, "*", NULL, NULL, true),
+		"Setting group in buxton failed.");
+	fail_if(buxton_begin_transaction(c, "test-gdbm", client_handoff_status,
+					 &status, true) || status != 0,
+		"Beginning transaction failed.");
+	status = -1;
+	fail_if(buxton_set_value(c, key, "staged", client_handoff_status,
+				 &status, true) || status != 0,
+		"Staging value failed.");
+
+	/* The new daemon keeps the open transaction */
+	fail_if(kill(daemon_pid, SIGUSR2), "Failed to signal daemon");
+	usleep(128*1000);
+	status = -1;
+	fail_if(buxton_commit_transaction(c, client_handoff_status,
+					  &status, true),
+		"Committing transaction failed.");
+	fail_if(status != 0, "Transaction lost in handoff");
+	fail_if(buxton_get_value(c, key, client_handoff_value, &value, true),
+		"Getting value failed.");
+	fail_if(!value || !streq(value, "staged"),
+		"Committed value not set");
+
+	free(value);
+	buxton_key_free(group);
+	buxton_key_free(key);
+	buxton_close(c);
+}
+END_TEST
+
+static void copy_file(const char *from, const char *to, mode_t mode)
+{
+	char buf[4096];
+	ssize_t count;
+	int in, out;
+
+	in = open(from, O_RDONLY);
+	fail_if(in < 0, "Failed to open %s: %m", from);
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	fail_if(out < 0, "Failed to create %s: %m", to);
+	while ((count = read(in, buf, sizeof(buf))) > 0) {
+		fail_if(write(out, buf, (size_t)count) != count,
+			"Failed to copy %s: %m", from);
+	}
+	fail_if(count < 0, "Failed to read %s: %m", from);
+	close(in);
+	close(out);
+}
+START_TEST(buxtond_handoff_exec_failure_check)
+{
+	BuxtonClient c = NULL;
+	BuxtonKey group = buxton_key_create("handoff", NULL, "test-memory", STRING);
+	fail_if(!group, "Failed to create key for group");
+	BuxtonKey key = buxton_key_create("handoff", "name", "test-memory", STRING);
+	fail_if(!key, "Failed to create key");
+	char path[PATH_MAX];
+	char copy[PATH_MAX];
+	char *value = NULL;
+	sigset_t sigset;
+	pid_t pid;
+
+	/* Run a copy of buxtond that can be made impossible to exec again */
+	snprintf(path, PATH_MAX, "%s/check_buxtond", get_current_dir_name());
+	snprintf(copy, PATH_MAX, "%s/check_buxtond-handoff", get_current_dir_name());
+	unlink(copy);
+	copy_file(path, copy, S_IRWXU);
+
+	daemon_pid = 0;
+	unlink(buxton_socket());
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigset, NULL);
+
+	pid = fork();
+	fail_if(pid < 0, "couldn't fork");
+	if (!pid) {
+		execl(copy, copy, (const char*)NULL);
+		fail("couldn't exec: %m");
+	}
+	daemon_pid = pid;
+	usleep(128*1000);
+
+	fail_if(buxton_open(&c) == -1,
+		"Open failed with daemon.");
+	fail_if(buxton_create_group(c, group, NULL, NULL, true),
+		"Creating group in buxton failed.");
+	fail_if(buxton_set_label(c, group, "*", NULL, NULL, true),
+		"Setting group in buxton failed.");
+	fail_if(buxton_set_value(c, key, "kept", NULL, NULL, true),
+		"Setting value in buxton failed.");
+
+	/* Neither the copy nor /proc/self/exe, its inode, can be exec'd */
+	fail_if(chmod(copy, 0), "Failed to make buxtond unexecutable");
+	fail_if(kill(daemon_pid, SIGUSR2), "Failed to signal daemon");
+	usleep(128*1000);
+
+	fail_if(buxton_get_value(c, key, client_handoff_value, &value, true),
+		"Getting value after failed handoff failed.");
+	fail_if(!value || !streq(value, "kept"),
+		"Memory layer lost its value when exec failed");
+
+	unlink(copy);
+	free(value);
+	buxton_key_free(group);
+	buxton_key_free(key);
+	buxton_close(c);
+}
+END_TEST
+
 START_TEST(parse_list_check)
 {
 	BuxtonData l3[2];
@@ -844,6 +1033,7 @@ START_TEST(remove_group_check)
 	BuxtonDaemon server;
 	BuxtonString clabel = buxton_string_pack("_");
 
+	memzero(&server, sizeof(BuxtonDaemon));
 	fail_if(!buxton_direct_open(&server.buxton),
 		"Failed to open buxton direct connection");
 
@@ -865,6 +1055,77 @@ START_TEST(remove_group_check)
 }
 END_TEST
 
+START_TEST(remove_group_notify_check)
+{
+	_BuxtonKey key = { {0}, {0}, {0}, 0};
+	int client, server;
+	BuxtonDaemon daemon;
+	BuxtonString slabel;
+	BuxtonData value;
+	client_list_item cl;
+	int32_t status;
+	BuxtonData *list;
+	BuxtonControlMessage msg;
+	ssize_t csize;
+	ssize_t s;
+	uint8_t buf[4096];
+	uint32_t msgid;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
+	setup_socket_pair(&client, &server);
+
+	cl.fd = server;
+	slabel = buxton_string_pack("_");
+	if (use_smack())
+		cl.smack_label = &slabel;
+	else
+		cl.smack_label = NULL;
+	cl.cred.uid = getuid();
+	daemon.notify_mapping = hashmap_new(string_hash_func,
+					    string_compare_func);
+	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
+	fail_if(!buxton_cache_smack_rules(),
+		"Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	key.layer = buxton_string_pack("base");
+	key.group = buxton_string_pack("rgroup");
+	key.type = STRING;
+	fail_if(!buxton_direct_create_group(&daemon.buxton, &key, NULL),
+		"Failed to create group");
+	fail_if(!buxton_direct_set_label(&daemon.buxton, &key, &slabel),
+		"Failed to set group label");
+
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("member value");
+	key.name = buxton_string_pack("member");
+	fail_if(!buxton_direct_set_value(&daemon.buxton, &key, &value, NULL),
+		"Failed to set member value");
+	register_notification(&daemon, &cl, &key, 4, 0, &status);
+	fail_if(status != 0, "Failed to register notification for member");
+
+	key.name.value = NULL;
+	key.name.length = 0;
+	remove_group(&daemon, &cl, &key, &status);
+	fail_if(status != 0, "Failed to remove group");
+
+	/* The member went with its group, so its watchers are told */
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 0 || msg != BUXTON_CONTROL_CHANGED || msgid != 4,
+		"Failed to notify of the removed member");
+
+	free(list);
+	close(client);
+	buxton_direct_close(&daemon.buxton);
+}
+END_TEST
+
 START_TEST(set_label_check)
 {
 	_BuxtonKey key = { {0}, {0}, {0}, 0};
@@ -940,6 +1201,7 @@ START_TEST(get_value_check)
 	BuxtonData *value;
 	client_list_item client;
 	int32_t status;
+	uint64_t version, version2;
 	BuxtonDaemon server;
 	BuxtonString clabel = buxton_string_pack("_");
 
@@ -959,7 +1221,7 @@ START_TEST(get_value_check)
 	key.name = buxton_string_pack("name");
 	key.type = STRING;
 
-	value = get_value(&server, &client, &key, &status);
+	value = get_value(&server, &client, &key, NULL, &status);
 	fail_if(!value, "Failed to get value");
 	fail_if(status != 0, "Failed to get value");
 	fail_if(value->type != STRING, "Failed to get correct type");
@@ -970,7 +1232,7 @@ START_TEST(get_value_check)
 	server.buxton.client.uid = 0;
 	key.layer.value = NULL;
 	key.layer.length = 0;
-	value = get_value(&server, &client, &key, &status);
+	value = get_value(&server, &client, &key, NULL, &status);
 	fail_if(!value, "Failed to get value 2");
 	fail_if(status != 0, "Failed to get value 2");
 	fail_if(value->type != STRING, "Failed to get correct type 2");
@@ -978,6 +1240,120 @@ START_TEST(get_value_check)
 	fail_if(server.buxton.client.uid != client.cred.uid, "Failed to change buxton uid 2");
 	free(value);
 
+	/* Setting a value, even to the same data, gives it a new version */
+	key.layer = buxton_string_pack("test-gdbm-user");
+	value = get_value(&server, &client, &key, &version, &status);
+	fail_if(!value || status != 0, "Failed to get value 3");
+	fail_if(version == 0, "Failed to get value version");
+	set_value(&server, &client, &key, value, &status);
+	fail_if(status != 0, "Failed to set value 3");
+	free(value->store.d_string.value);
+	free(value);
+	value = get_value(&server, &client, &key, &version2, &status);
+	fail_if(!value || status != 0, "Failed to get value 4");
+	fail_if(version2 <= version, "Failed to change value version");
+	free(value->store.d_string.value);
+	free(value);
+
+	buxton_direct_close(&server.buxton);
+}
+END_TEST
+
+START_TEST(update_value_check)
+{
+	_BuxtonKey key = { {0}, {0}, {0}, 0};
+	BuxtonData *value;
+	BuxtonData data, expected;
+	BuxtonUpdate update;
+	client_list_item client;
+	int32_t status;
+	uint64_t version, version2;
+	BuxtonDaemon server;
+	BuxtonString clabel = buxton_string_pack("_");
+
+	fail_if(!buxton_direct_open(&server.buxton),
+		"Failed to open buxton direct connection");
+
+	fail_if(!buxton_cache_smack_rules(),
+		"Failed to cache smack rules");
+	client.cred.uid = getuid();
+	if (use_smack())
+		client.smack_label = &clabel;
+	else
+		client.smack_label = NULL;
+	server.buxton.client.uid = 0;
+	key.layer = buxton_string_pack("test-gdbm-user");
+	key.group = buxton_string_pack("daemon-check");
+	key.name = buxton_string_pack("counter");
+	key.type = INT32;
+
+	data.type = INT32;
+	data.store.d_int32 = 10;
+	set_value(&server, &client, &key, &data, &status);
+	fail_if(status != 0, "Failed to set counter");
+
+	memzero(&update, sizeof(BuxtonUpdate));
+	update.type = BUXTON_UPDATE_ADD;
+	update.delta = 5;
+	value = update_value(&server, &client, &key, &update, NULL, &version,
+			     &status);
+	fail_if(status != 0 || !value, "Failed to add to counter");
+	fail_if(value->type != INT32 || value->store.d_int32 != 15,
+		"Failed to get correct sum");
+	fail_if(version == 0, "Failed to get sum version");
+	free(value);
+
+	/* Sums must fit the key's type */
+	update.delta = INT32_MAX;
+	value = update_value(&server, &client, &key, &update, NULL, &version2,
+			     &status);
+	fail_if(status != -1 || value, "Added past the type's range");
+
+	/* The value is only set while it holds the expected one */
+	update.type = BUXTON_UPDATE_IF_VALUE;
+	update.expected = &expected;
+	expected.type = INT32;
+	expected.store.d_int32 = 15;
+	data.store.d_int32 = 20;
+	value = update_value(&server, &client, &key, &update, &data, &version2,
+			     &status);
+	fail_if(status != 0 || !value, "Failed to compare and set");
+	fail_if(value->store.d_int32 != 20, "Failed to set compared value");
+	fail_if(version2 <= version, "Failed to change compared version");
+	free(value);
+
+	data.store.d_int32 = 25;
+	value = update_value(&server, &client, &key, &update, &data, &version,
+			     &status);
+	fail_if(status != BUXTON_STATUS_MISMATCH || !value,
+		"Set a value that didn't match");
+	fail_if(value->store.d_int32 != 20, "Failed to get current value");
+	fail_if(version != version2, "Failed to get current version");
+	free(value);
+
+	/* Or while it still has the expected version */
+	update.type = BUXTON_UPDATE_IF_VERSION;
+	update.version = version2;
+	value = update_value(&server, &client, &key, &update, &data, &version,
+			     &status);
+	fail_if(status != 0 || !value, "Failed to set if version");
+	fail_if(value->store.d_int32 != 25, "Failed to set versioned value");
+	free(value);
+	value = update_value(&server, &client, &key, &update, &data, &version,
+			     &status);
+	fail_if(status != BUXTON_STATUS_MISMATCH,
+		"Set a value with a stale version");
+	free(value);
+
+	/* Only integers can be added to */
+	key.name = buxton_string_pack("name");
+	key.type = STRING;
+	update.type = BUXTON_UPDATE_ADD;
+	update.delta = 1;
+	value = update_value(&server, &client, &key, &update, NULL, &version,
+			     &status);
+	fail_if(status != -1 || value, "Added to a string");
+
 	buxton_direct_close(&server.buxton);
 }
 END_TEST
@@ -991,6 +1367,8 @@ START_TEST(register_notification_check)
 	BuxtonDaemon server;
 	uint32_t msgid;
 
+	memzero(&client, sizeof(client_list_item));
+	memzero(&no_client, sizeof(client_list_item));
 	fail_if(!buxton_cache_smack_rules(),
 		"Failed to cache smack rules");
 	if (use_smack())
@@ -1002,15 +1380,13 @@ START_TEST(register_notification_check)
 		"Failed to open buxton direct connection");
 	server.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!server.notify_mapping, "Failed to allocate hashmap");
-	server.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!server.client_key_mapping, "Failed to allocate hashmap");
 
 	key.group = buxton_string_pack("group");
 	key.name = buxton_string_pack("name");
 	key.type = STRING;
-	register_notification(&server, &client, &key, 1, &status);
+	register_notification(&server, &client, &key, 1, 0, &status);
 	fail_if(status != 0, "Failed to register notification");
-	register_notification(&server, &client, &key, 1, &status);
+	register_notification(&server, &client, &key, 1, 0, &status);
 	fail_if(status != 0, "Failed to register notification");
 	//FIXME: Figure out what to do with duplicates
 	key.group = buxton_string_pack("no-key");
@@ -1028,11 +1404,10 @@ START_TEST(register_notification_check)
 		"Unable to unregister from notifications");
 	fail_if(msgid != 1, "Failed to get correct notify message id");
 	key.group = buxton_string_pack("key2");
-	register_notification(&server, &client, &key, 0, &status);
+	register_notification(&server, &client, &key, 0, 0, &status);
 	fail_if(status == 0, "Registered notification with key not in db");
 
 	hashmap_free(server.notify_mapping);
-	hashmap_free(server.client_key_mapping);
 	buxton_direct_close(&server.buxton);
 }
 END_TEST
@@ -1048,6 +1423,9 @@ START_TEST(buxtond_handle_message_error_check)
 	BuxtonArray *list = NULL;
 	uint16_t control;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	fail_if(fcntl(client, F_SETFL, O_NONBLOCK),
 		"Failed to set socket to non blocking");
@@ -1115,6 +1493,9 @@ START_TEST(buxtond_handle_message_create_group_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	fail_if(fcntl(client, F_SETFL, O_NONBLOCK),
 		"Failed to set socket to non blocking");
@@ -1134,8 +1515,6 @@ START_TEST(buxtond_handle_message_create_group_check)
 		"Failed to open buxton direct connection");
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
 	out_list1 = buxton_array_new();
 	fail_if(!out_list1, "Failed to allocate list");
@@ -1155,6 +1534,7 @@ START_TEST(buxtond_handle_message_create_group_check)
 	free(cl.data);
 	fail_if(!r, "Failed to handle create group message");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1184,6 +1564,7 @@ START_TEST(buxtond_handle_message_create_group_check)
 	free(cl.data);
 	fail_if(!r, "Failed to handle create group message");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1200,7 +1581,6 @@ START_TEST(buxtond_handle_message_create_group_check)
 	cleanup_callbacks();
 	close(client);
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	buxton_direct_close(&daemon.buxton);
 	buxton_array_free(&out_list1, NULL);
 	buxton_array_free(&out_list2, NULL);
@@ -1224,6 +1604,9 @@ START_TEST(buxtond_handle_message_remove_group_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	fail_if(fcntl(client, F_SETFL, O_NONBLOCK),
 		"Failed to set socket to non blocking");
@@ -1245,8 +1628,6 @@ START_TEST(buxtond_handle_message_remove_group_check)
 		"Failed to open buxton direct connection");
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
 	data1.type = STRING;
 	data1.store.d_string = buxton_string_pack("base");
@@ -1264,6 +1645,7 @@ START_TEST(buxtond_handle_message_remove_group_check)
 	free(cl.data);
 	fail_if(!r, "Failed to handle remove group message");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1280,7 +1662,6 @@ START_TEST(buxtond_handle_message_remove_group_check)
 	cleanup_callbacks();
 	close(client);
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	buxton_direct_close(&daemon.buxton);
 	buxton_array_free(&out_list, NULL);
 }
@@ -1303,6 +1684,9 @@ START_TEST(buxtond_handle_message_set_label_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	fail_if(fcntl(client, F_SETFL, O_NONBLOCK),
 		"Failed to set socket to non blocking");
@@ -1324,8 +1708,6 @@ START_TEST(buxtond_handle_message_set_label_check)
 		"Failed to open buxton direct connection");
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
 	data1.type = STRING;
 	data1.store.d_string = buxton_string_pack("base");
@@ -1347,6 +1729,7 @@ START_TEST(buxtond_handle_message_set_label_check)
 	free(cl.data);
 	fail_if(!r, "Failed to handle set label message");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1363,7 +1746,6 @@ START_TEST(buxtond_handle_message_set_label_check)
 	cleanup_callbacks();
 	close(client);
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	buxton_direct_close(&daemon.buxton);
 	buxton_array_free(&out_list, NULL);
 }
@@ -1386,6 +1768,9 @@ START_TEST(buxtond_handle_message_set_value_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	fail_if(fcntl(client, F_SETFL, O_NONBLOCK),
 		"Failed to set socket to non blocking");
@@ -1407,8 +1792,6 @@ START_TEST(buxtond_handle_message_set_value_check)
 		"Failed to open buxton direct connection");
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
 	data1.type = STRING;
 	data1.store.d_string = buxton_string_pack("base");
@@ -1440,6 +1823,7 @@ START_TEST(buxtond_handle_message_set_value_check)
 	free(cl.data);
 	fail_if(!r, "Failed to handle set message");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1456,54 +1840,72 @@ START_TEST(buxtond_handle_message_set_value_check)
 	cleanup_callbacks();
 	close(client);
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	buxton_direct_close(&daemon.buxton);
 	buxton_array_free(&out_list, NULL);
 }
 END_TEST
 
-START_TEST(buxtond_handle_message_get_check)
+START_TEST(buxtond_handle_message_stalled_notify_check)
 {
-	int client, server;
+	_BuxtonKey key = { {0}, {0}, {0}, 0};
 	BuxtonDaemon daemon;
 	BuxtonString slabel;
 	size_t size;
 	BuxtonData data1, data2, data3, data4;
-	client_list_item cl;
+	client_list_item cl, watcher;
+	int32_t status;
 	bool r;
 	BuxtonData *list;
 	BuxtonArray *out_list;
-	BuxtonArray *out_list2;
 	BuxtonControlMessage msg;
 	ssize_t csize;
+	int client, server;
 	ssize_t s;
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+	memzero(&watcher, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
+
 	out_list = buxton_array_new();
 	fail_if(!out_list, "Failed to allocate list");
-
-	cl.fd = server;
 	slabel = buxton_string_pack("_");
 	if (use_smack())
 		cl.smack_label = &slabel;
 	else
 		cl.smack_label = NULL;
-	cl.cred.uid = getuid();
+	cl.cred.uid = 1002;
+	watcher.fd = server;
+	watcher.smack_label = cl.smack_label;
+	watcher.cred.uid = 1002;
 	daemon.buxton.client.uid = 1001;
 	fail_if(!buxton_cache_smack_rules(), "Failed to cache Smack rules");
 	fail_if(!buxton_direct_open(&daemon.buxton),
 		"Failed to open buxton direct connection");
+	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
+	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
+
+	key.layer = buxton_string_pack("base");
+	key.group = buxton_string_pack("daemon-check");
+	key.name = buxton_string_pack("name");
+	key.type = STRING;
+	data4.type = STRING;
+	data4.store.d_string = buxton_string_pack("watched value");
+	r = buxton_direct_set_value(&daemon.buxton, &key, &data4, NULL);
+	fail_if(!r, "Failed to set value for notify");
+	register_notification(&daemon, &watcher, &key, 3, 0, &status);
+	fail_if(status != 0, "Failed to register notification");
 
 	data1.type = STRING;
-	data1.store.d_string = buxton_string_pack("test-gdbm-user");
+	data1.store.d_string = buxton_string_pack("base");
 	data2.type = STRING;
 	data2.store.d_string = buxton_string_pack("daemon-check");
 	data3.type = STRING;
 	data3.store.d_string = buxton_string_pack("name");
-	data4.type = UINT32;
-	data4.store.d_uint32 = STRING;
+	data4.store.d_string = buxton_string_pack("stalled value");
 	r = buxton_array_add(out_list, &data1);
 	fail_if(!r, "Failed to add element to array");
 	r = buxton_array_add(out_list, &data2);
@@ -1512,49 +1914,135 @@ START_TEST(buxtond_handle_message_get_check)
 	fail_if(!r, "Failed to add element to array");
 	r = buxton_array_add(out_list, &data4);
 	fail_if(!r, "Failed to add element to array");
-	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_GET, 0,
+
+	/* The setting client's responses back up, but the value is stored */
+	cl.out_offset = BUXTON_CLIENT_OUTPUT_LIMIT;
+	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_SET, 0,
 					out_list);
 	fail_if(size == 0, "Failed to serialize message");
 	r = buxtond_handle_message(&daemon, &cl, size);
 	free(cl.data);
-	fail_if(!r, "Failed to get message 1");
+	fail_if(r, "Queued a response past the output limit");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
-	fail_if(csize != 2, "Failed to get valid message from buffer");
-	fail_if(msg != BUXTON_CONTROL_STATUS,
-		"Failed to get correct control type");
-	fail_if(msgid != 0, "Failed to get correct message id");
-	fail_if(list[0].type != INT32, "Failed to get correct response type");
-	fail_if(list[0].store.d_int32 != 0,
-		"Failed to get value");
-	fail_if(list[1].type != STRING, "Failed to get correct value type");
-	fail_if(!streq(list[1].store.d_string.value, "user-layer-value"),
-		"Failed to get correct value");
+	fail_if(csize != 1 || msg != BUXTON_CONTROL_CHANGED || msgid != 3,
+		"Failed to notify the watcher of the change");
+	fail_if(!streq(list[0].store.d_string.value, "stalled value"),
+		"Failed to notify the watcher of the new value");
 
-	free(list[1].store.d_string.value);
+	free(list[0].store.d_string.value);
 	free(list);
+	close(client);
+	buxton_direct_close(&daemon.buxton);
+	buxton_array_free(&out_list, NULL);
+}
+END_TEST
 
-	out_list2 = buxton_array_new();
-	fail_if(!out_list2, "Failed to allocate list 2");
-	r = buxton_array_add(out_list2, &data2);
-	fail_if(!r, "Failed to add element to array 2");
-	r = buxton_array_add(out_list2, &data3);
-	fail_if(!r, "Failed to add element to array 2");
-	r = buxton_array_add(out_list2, &data4);
-	fail_if(!r, "Failed to add element to array 2");
-	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_GET, 0,
-					out_list2);
-	fail_if(size == 0, "Failed to serialize message 2");
-	r = buxtond_handle_message(&daemon, &cl, size);
-	free(cl.data);
-	fail_if(!r, "Failed to get message 2");
-
-	s = read(client, buf, 4096);
+START_TEST(buxtond_handle_message_get_check)
+{
+	int client, server;
+	BuxtonDaemon daemon;
+	BuxtonString slabel;
+	size_t size;
+	BuxtonData data1, data2, data3, data4, data5;
+	client_list_item cl;
+	bool r;
+	BuxtonData *list;
+	BuxtonArray *out_list;
+	BuxtonArray *out_list2;
+	BuxtonControlMessage msg;
+	ssize_t csize;
+	ssize_t s;
+	uint8_t buf[4096];
+	uint32_t msgid;
+	uint64_t version;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
+	setup_socket_pair(&client, &server);
+	out_list = buxton_array_new();
+	fail_if(!out_list, "Failed to allocate list");
+
+	cl.fd = server;
+	slabel = buxton_string_pack("_");
+	if (use_smack())
+		cl.smack_label = &slabel;
+	else
+		cl.smack_label = NULL;
+	cl.cred.uid = getuid();
+	daemon.buxton.client.uid = 1001;
+	fail_if(!buxton_cache_smack_rules(), "Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	data1.type = STRING;
+	data1.store.d_string = buxton_string_pack("test-gdbm-user");
+	data2.type = STRING;
+	data2.store.d_string = buxton_string_pack("daemon-check");
+	data3.type = STRING;
+	data3.store.d_string = buxton_string_pack("name");
+	data4.type = UINT32;
+	data4.store.d_uint32 = STRING;
+	r = buxton_array_add(out_list, &data1);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data2);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data3);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data4);
+	fail_if(!r, "Failed to add element to array");
+	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_GET, 0,
+					out_list);
+	fail_if(size == 0, "Failed to serialize message");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(!r, "Failed to get message 1");
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 3, "Failed to get valid message from buffer");
+	fail_if(msg != BUXTON_CONTROL_STATUS,
+		"Failed to get correct control type");
+	fail_if(msgid != 0, "Failed to get correct message id");
+	fail_if(list[0].type != INT32, "Failed to get correct response type");
+	fail_if(list[0].store.d_int32 != 0,
+		"Failed to get value");
+	fail_if(list[1].type != STRING, "Failed to get correct value type");
+	fail_if(!streq(list[1].store.d_string.value, "user-layer-value"),
+		"Failed to get correct value");
+	fail_if(list[2].type != UINT64 || list[2].store.d_uint64 == 0,
+		"Failed to get value version");
+	version = list[2].store.d_uint64;
+
+	free(list[1].store.d_string.value);
+	free(list);
+
+	out_list2 = buxton_array_new();
+	fail_if(!out_list2, "Failed to allocate list 2");
+	r = buxton_array_add(out_list2, &data2);
+	fail_if(!r, "Failed to add element to array 2");
+	r = buxton_array_add(out_list2, &data3);
+	fail_if(!r, "Failed to add element to array 2");
+	r = buxton_array_add(out_list2, &data4);
+	fail_if(!r, "Failed to add element to array 2");
+	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_GET, 0,
+					out_list2);
+	fail_if(size == 0, "Failed to serialize message 2");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(!r, "Failed to get message 2");
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed 2");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
-	fail_if(csize != 2, "Failed to get correct response to get 2");
+	fail_if(csize != 3, "Failed to get correct response to get 2");
 	fail_if(msg != BUXTON_CONTROL_STATUS,
 		"Failed to get correct control type 2");
 	fail_if(msgid != 0, "Failed to get correct message id 2");
@@ -1565,6 +2053,51 @@ START_TEST(buxtond_handle_message_get_check)
 	fail_if(streq(list[1].store.d_string.value, "bxt_test_value2"),
 		"Failed to get correct value 2");
 
+	free(list[1].store.d_string.value);
+	free(list);
+
+	/* The value is only sent again once its version moves on */
+	data5.type = UINT64;
+	data5.store.d_uint64 = version;
+	r = buxton_array_add(out_list, &data5);
+	fail_if(!r, "Failed to add element to array 3");
+	size = buxton_serialize_message(&cl.data,
+					BUXTON_CONTROL_GET_IF_CHANGED, 0,
+					out_list);
+	fail_if(size == 0, "Failed to serialize message 3");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(!r, "Failed to get message 3");
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed 3");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1, "Failed to get correct response to get 3");
+	fail_if(list[0].store.d_int32 != BUXTON_STATUS_UNCHANGED,
+		"Failed to get unchanged status");
+	free(list);
+
+	data5.store.d_uint64 = version - 1;
+	size = buxton_serialize_message(&cl.data,
+					BUXTON_CONTROL_GET_IF_CHANGED, 0,
+					out_list);
+	fail_if(size == 0, "Failed to serialize message 4");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(!r, "Failed to get message 4");
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed 4");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 3, "Failed to get correct response to get 4");
+	fail_if(list[0].store.d_int32 != 0, "Failed to get value 4");
+	fail_if(!streq(list[1].store.d_string.value, "user-layer-value"),
+		"Failed to get correct value 4");
+	fail_if(list[2].store.d_uint64 != version,
+		"Failed to get correct version 4");
+
 	free(list[1].store.d_string.value);
 	free(list);
 	close(client);
@@ -1574,6 +2107,291 @@ START_TEST(buxtond_handle_message_get_check)
 }
 END_TEST
 
+START_TEST(buxtond_handle_message_add_check)
+{
+	int client, server;
+	BuxtonDaemon daemon;
+	BuxtonString slabel;
+	size_t size;
+	BuxtonData data1, data2, data3, data4, data5;
+	client_list_item cl;
+	bool r;
+	BuxtonData *list;
+	BuxtonArray *out_list;
+	BuxtonControlMessage msg;
+	ssize_t csize;
+	ssize_t s;
+	uint8_t buf[4096];
+	uint32_t msgid;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
+	setup_socket_pair(&client, &server);
+	out_list = buxton_array_new();
+	fail_if(!out_list, "Failed to allocate list");
+
+	cl.fd = server;
+	slabel = buxton_string_pack("_");
+	if (use_smack())
+		cl.smack_label = &slabel;
+	else
+		cl.smack_label = NULL;
+	cl.cred.uid = getuid();
+	daemon.buxton.client.uid = 1001;
+	fail_if(!buxton_cache_smack_rules(), "Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	data1.type = STRING;
+	data1.store.d_string = buxton_string_pack("test-gdbm-user");
+	data2.type = STRING;
+	data2.store.d_string = buxton_string_pack("daemon-check");
+	data3.type = STRING;
+	data3.store.d_string = buxton_string_pack("hits");
+	data4.type = UINT32;
+	data4.store.d_uint32 = UINT64;
+	data5.type = INT64;
+	data5.store.d_int64 = 3;
+	r = buxton_array_add(out_list, &data1);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data2);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data3);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data4);
+	fail_if(!r, "Failed to add element to array");
+	r = buxton_array_add(out_list, &data5);
+	fail_if(!r, "Failed to add element to array");
+
+	/* A key without a value counts as 0 */
+	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_ADD, 0,
+					out_list);
+	fail_if(size == 0, "Failed to serialize message");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(!r, "Failed to add message 1");
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 3, "Failed to get valid message from buffer");
+	fail_if(msg != BUXTON_CONTROL_STATUS,
+		"Failed to get correct control type");
+	fail_if(list[0].store.d_int32 != 0, "Failed to add value");
+	fail_if(list[1].type != UINT64 || list[1].store.d_uint64 != 3,
+		"Failed to get correct sum");
+	fail_if(list[2].type != UINT64 || list[2].store.d_uint64 == 0,
+		"Failed to get sum version");
+	free(list);
+
+	/* Going below 0 fails and sends no value */
+	data5.store.d_int64 = -4;
+	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_ADD, 0,
+					out_list);
+	fail_if(size == 0, "Failed to serialize message 2");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(!r, "Failed to add message 2");
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed 2");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1, "Failed to get correct response to add 2");
+	fail_if(list[0].store.d_int32 != -1, "Added past the type's range");
+	free(list);
+
+	/* Adds need an INT64 amount */
+	data5.type = INT32;
+	data5.store.d_int32 = 1;
+	size = buxton_serialize_message(&cl.data, BUXTON_CONTROL_ADD, 0,
+					out_list);
+	fail_if(size == 0, "Failed to serialize message 3");
+	r = buxtond_handle_message(&daemon, &cl, size);
+	free(cl.data);
+	fail_if(r, "Parsed add with a bad amount");
+
+	close(client);
+	buxton_direct_close(&daemon.buxton);
+	buxton_array_free(&out_list, NULL);
+}
+END_TEST
+
+/*
+ * Have the daemon handle a message from cl, returning the status of
+ * its response
+ */
+static int32_t handle_for_status(BuxtonDaemon *daemon, client_list_item *cl,
+				 int client, BuxtonControlMessage type,
+				 BuxtonArray *params)
+{
+	BuxtonControlMessage msg;
+	BuxtonData *list;
+	uint8_t buf[4096];
+	uint32_t msgid;
+	ssize_t csize;
+	ssize_t s;
+	size_t size;
+	int32_t status;
+
+	size = buxton_serialize_message(&cl->data, type, 0, params);
+	fail_if(size == 0, "Failed to serialize message");
+	fail_if(!buxtond_handle_message(daemon, cl, size),
+		"Failed to handle message %d", type);
+	free(cl->data);
+
+	flush_clients(daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize < 1, "Failed to get valid message from buffer");
+	fail_if(msg != BUXTON_CONTROL_STATUS,
+		"Failed to get correct control type");
+	status = list[0].store.d_int32;
+	for (ssize_t i = 0; i < csize; i++) {
+		if (list[i].type == STRING) {
+			free(list[i].store.d_string.value);
+		}
+	}
+	free(list);
+
+	return status;
+}
+
+START_TEST(buxtond_handle_message_transaction_check)
+{
+	int client, server;
+	BuxtonDaemon daemon;
+	BuxtonString slabel;
+	BuxtonString dlabel;
+	BuxtonData layer, group, name, value, type, result;
+	client_list_item cl;
+	BuxtonArray *begin, *set, *unset, *empty;
+	_BuxtonKey key;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
+	setup_socket_pair(&client, &server);
+	begin = buxton_array_new();
+	set = buxton_array_new();
+	unset = buxton_array_new();
+	empty = buxton_array_new();
+	fail_if(!begin || !set || !unset || !empty, "Failed to allocate list");
+
+	cl.fd = server;
+	slabel = buxton_string_pack("_");
+	if (use_smack())
+		cl.smack_label = &slabel;
+	else
+		cl.smack_label = NULL;
+	cl.cred.uid = getuid();
+	daemon.buxton.client.uid = 1001;
+	fail_if(!buxton_cache_smack_rules(), "Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	layer.type = STRING;
+	layer.store.d_string = buxton_string_pack("test-gdbm-user");
+	group.type = STRING;
+	group.store.d_string = buxton_string_pack("daemon-check");
+	name.type = STRING;
+	name.store.d_string = buxton_string_pack("transaction");
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("staged");
+	type.type = UINT32;
+	type.store.d_uint32 = STRING;
+	fail_if(!buxton_array_add(begin, &layer), "Failed to add element");
+	fail_if(!buxton_array_add(set, &layer) ||
+		!buxton_array_add(set, &group) ||
+		!buxton_array_add(set, &name) ||
+		!buxton_array_add(set, &value), "Failed to add element");
+	fail_if(!buxton_array_add(unset, &layer) ||
+		!buxton_array_add(unset, &group) ||
+		!buxton_array_add(unset, &name) ||
+		!buxton_array_add(unset, &type), "Failed to add element");
+
+	key.layer = layer.store.d_string;
+	key.group = group.store.d_string;
+	key.name = name.store.d_string;
+	key.type = STRING;
+
+	/* Ending a transaction that wasn't begun fails */
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_COMMIT,
+				  empty) != -1, "Committed without a transaction");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_ROLLBACK,
+				  empty) != -1, "Rolled back without a transaction");
+
+	/* A set is only staged until the commit */
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_BEGIN,
+				  begin) != 0, "Failed to begin transaction");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_BEGIN,
+				  begin) != -1, "Began a nested transaction");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_SET,
+				  set) != 0, "Failed to stage set");
+	fail_if(!cl.transaction || cl.transaction->count != 1,
+		"Set wasn't staged");
+	daemon.buxton.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&daemon.buxton, &key, &result,
+						  &dlabel, NULL) == 0,
+		"Staged set was applied before the commit");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_COMMIT,
+				  empty) != 0, "Failed to commit transaction");
+	fail_if(cl.transaction, "Commit left the transaction open");
+	daemon.buxton.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&daemon.buxton, &key, &result,
+						  &dlabel, NULL),
+		"Committed set wasn't applied");
+	fail_if(!streq(result.store.d_string.value, "staged"),
+		"Committed value is wrong");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+
+	/* A rolled back unset leaves the value */
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_BEGIN,
+				  begin) != 0, "Failed to begin transaction 2");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_UNSET,
+				  unset) != 0, "Failed to stage unset");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_ROLLBACK,
+				  empty) != 0, "Failed to roll back transaction");
+	daemon.buxton.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&daemon.buxton, &key, &result,
+						  &dlabel, NULL),
+		"Rolled back unset was applied");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+
+	/* A commit that fails applies nothing, and ends the transaction */
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_BEGIN,
+				  begin) != 0, "Failed to begin transaction 3");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_UNSET,
+				  unset) != 0, "Failed to stage unset 2");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_UNSET,
+				  unset) != 0, "Failed to stage unset 3");
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_COMMIT,
+				  empty) != -1, "Committed unset of an unset key");
+	fail_if(cl.transaction, "Failed commit left the transaction open");
+	daemon.buxton.client.uid = getuid();
+	fail_if(buxton_direct_get_value_for_layer(&daemon.buxton, &key, &result,
+						  &dlabel, NULL),
+		"Failed commit was partly applied");
+	free(result.store.d_string.value);
+	free(dlabel.value);
+
+	fail_if(handle_for_status(&daemon, &cl, client, BUXTON_CONTROL_UNSET,
+				  unset) != 0, "Failed to unset value");
+
+	close(client);
+	buxton_direct_close(&daemon.buxton);
+	buxton_array_free(&begin, NULL);
+	buxton_array_free(&set, NULL);
+	buxton_array_free(&unset, NULL);
+	buxton_array_free(&empty, NULL);
+}
+END_TEST
+
 START_TEST(buxtond_handle_message_notify_check)
 {
 	int client, server;
@@ -1591,6 +2409,9 @@ START_TEST(buxtond_handle_message_notify_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	out_list = buxton_array_new();
 	fail_if(!out_list, "Failed to allocate list");
@@ -1605,8 +2426,6 @@ START_TEST(buxtond_handle_message_notify_check)
 	daemon.buxton.client.uid = 1001;
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 	fail_if(!buxton_cache_smack_rules(), "Failed to cache Smack rules");
 	fail_if(!buxton_direct_open(&daemon.buxton),
 		"Failed to open buxton direct connection");
@@ -1630,6 +2449,7 @@ START_TEST(buxtond_handle_message_notify_check)
 	free(cl.data);
 	fail_if(!r, "Failed to register for notification");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1651,6 +2471,7 @@ START_TEST(buxtond_handle_message_notify_check)
 	free(cl.data);
 	fail_if(!r, "Failed to unregister from notification");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed 2");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1670,7 +2491,6 @@ START_TEST(buxtond_handle_message_notify_check)
 	free(list);
 	close(client);
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	buxton_direct_close(&daemon.buxton);
 	buxton_array_free(&out_list, NULL);
 }
@@ -1693,6 +2513,9 @@ START_TEST(buxtond_handle_message_unset_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 	out_list = buxton_array_new();
 	fail_if(!out_list, "Failed to allocate list");
@@ -1710,8 +2533,6 @@ START_TEST(buxtond_handle_message_unset_check)
 		"Failed to open buxton direct connection");
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
 	data1.type = STRING;
 	data1.store.d_string = buxton_string_pack("base");
@@ -1736,6 +2557,7 @@ START_TEST(buxtond_handle_message_unset_check)
 	free(cl.data);
 	fail_if(!r, "Failed to unset message");
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1751,7 +2573,6 @@ START_TEST(buxtond_handle_message_unset_check)
 	free(list);
 	close(client);
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	buxton_direct_close(&daemon.buxton);
 	buxton_array_free(&out_list, NULL);
 }
@@ -1774,6 +2595,9 @@ START_TEST(buxtond_notify_clients_check)
 	uint8_t buf[4096];
 	uint32_t msgid;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+
 	setup_socket_pair(&client, &server);
 
 	cl.fd = server;
@@ -1786,8 +2610,6 @@ START_TEST(buxtond_notify_clients_check)
 	daemon.notify_mapping = hashmap_new(string_hash_func,
 					    string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 	fail_if(!buxton_cache_smack_rules(),
 		"Failed to cache Smack rules");
 	fail_if(!buxton_direct_open(&daemon.buxton),
@@ -1807,7 +2629,7 @@ START_TEST(buxtond_notify_clients_check)
 	r = buxton_direct_set_value(&daemon.buxton, &key,
 				    &value1, NULL);
 	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
 	fail_if(status != 0,
 		"Failed to register notification for notify");
 	buxtond_notify_clients(&daemon, &cl, &key, &value1);
@@ -1816,6 +2638,7 @@ START_TEST(buxtond_notify_clients_check)
 	value2.store.d_string = buxton_string_pack("new value");
 	buxtond_notify_clients(&daemon, &cl, &key, &value2);
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1850,11 +2673,12 @@ START_TEST(buxtond_notify_clients_check)
 	r = buxton_direct_set_value(&daemon.buxton, &key,
 				    &value1, NULL);
 	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
 	fail_if(status != 0,
 		"Failed to register notification for notify");
 	buxtond_notify_clients(&daemon, &cl, &key, &value2);
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1880,11 +2704,12 @@ START_TEST(buxtond_notify_clients_check)
 	r = buxton_direct_set_value(&daemon.buxton, &key,
 				    &value1, NULL);
 	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
 	fail_if(status != 0,
 		"Failed to register notification for notify");
 	buxtond_notify_clients(&daemon, &cl, &key, &value2);
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1910,11 +2735,12 @@ START_TEST(buxtond_notify_clients_check)
 	r = buxton_direct_set_value(&daemon.buxton, &key,
 				    &value1, NULL);
 	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
 	fail_if(status != 0,
 		"Failed to register notification for notify");
 	buxtond_notify_clients(&daemon, &cl, &key, &value2);
 
+	flush_clients(&daemon);
 	s = read(client, buf, 4096);
 	fail_if(s < 0, "Read from client failed");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
@@ -1940,117 +2766,631 @@ START_TEST(buxtond_notify_clients_check)
 	r = buxton_direct_set_value(&daemon.buxton, &key,
 				    &value1, NULL);
 	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
+	fail_if(status != 0,
+		"Failed to register notification for notify");
+	buxtond_notify_clients(&daemon, &cl, &key, &value2);
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1,
+		"Failed to get correct response to notify uint64");
+	fail_if(msg != BUXTON_CONTROL_CHANGED,
+		"Failed to get correct control type");
+	fail_if(msgid != 0, "Failed to get correct message id");
+	fail_if(list[0].type != UINT64,
+		"Failed to get correct notification value type uint64");
+	fail_if(list[0].store.d_uint64 != 3,
+		"Failed to get correct notification value data uint64");
+
+	free(list);
+
+	value1.type = FLOAT;
+	value1.store.d_float = 3.1F;
+	value2.type = FLOAT;
+	value2.store.d_float = 3.14F;
+	key.group = buxton_string_pack("group");
+	key.name = buxton_string_pack("namef");
+	key.type = FLOAT;
+	r = buxton_direct_set_value(&daemon.buxton, &key,
+				    &value1, NULL);
+	fail_if(!r, "Failed to set value for notify");
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
 	fail_if(status != 0,
 		"Failed to register notification for notify");
 	buxtond_notify_clients(&daemon, &cl, &key, &value2);
 
-	s = read(client, buf, 4096);
-	fail_if(s < 0, "Read from client failed");
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1,
+		"Failed to get correct response to notify float");
+	fail_if(msg != BUXTON_CONTROL_CHANGED,
+		"Failed to get correct control type");
+	fail_if(msgid != 0, "Failed to get correct message id");
+	fail_if(list[0].type != FLOAT,
+		"Failed to get correct notification value type float");
+	fail_if(list[0].store.d_float != 3.14F,
+		"Failed to get correct notification value data float");
+
+	free(list);
+
+	value1.type = DOUBLE;
+	value1.store.d_double = 3.141F;
+	value2.type = DOUBLE;
+	value2.store.d_double = 3.1415F;
+	key.group = buxton_string_pack("group");
+	key.name = buxton_string_pack("named");
+	key.type = DOUBLE;
+	r = buxton_direct_set_value(&daemon.buxton, &key,
+				    &value1, NULL);
+	fail_if(!r, "Failed to set value for notify");
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
+	fail_if(status != 0,
+		"Failed to register notification for notify");
+	buxtond_notify_clients(&daemon, &cl, &key, &value2);
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1,
+		"Failed to get correct response to notify double");
+	fail_if(msg != BUXTON_CONTROL_CHANGED,
+		"Failed to get correct control type");
+	fail_if(msgid != 0, "Failed to get correct message id");
+	fail_if(list[0].type != DOUBLE,
+		"Failed to get correct notification value type double");
+	fail_if(list[0].store.d_double != 3.1415F,
+		"Failed to get correct notification value data double");
+
+	free(list);
+
+	value1.type = BOOLEAN;
+	value1.store.d_boolean = false;
+	value2.type = BOOLEAN;
+	value2.store.d_int32 = true;
+	key.group = buxton_string_pack("group");
+	key.name = buxton_string_pack("nameb");
+	key.type = BOOLEAN;
+	r = buxton_direct_set_value(&daemon.buxton, &key,
+				    &value1, NULL);
+	fail_if(!r, "Failed to set value for notify");
+	register_notification(&daemon, &cl, &key, 0, 0, &status);
+	fail_if(status != 0,
+		"Failed to register notification for notify");
+	buxtond_notify_clients(&daemon, &cl, &key, &value2);
+
+	flush_clients(&daemon);
+	s = read(client, buf, 4096);
+	fail_if(s < 0, "Read from client failed");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1,
+		"Failed to get correct response to notify bool");
+	fail_if(msg != BUXTON_CONTROL_CHANGED,
+		"Failed to get correct control type");
+	fail_if(msgid != 0, "Failed to get correct message id");
+	fail_if(list[0].type != BOOLEAN,
+		"Failed to get correct notification value type bool");
+	fail_if(list[0].store.d_boolean != true,
+		"Failed to get correct notification value data bool");
+
+	free(list);
+	close(client);
+	buxton_direct_close(&daemon.buxton);
+}
+END_TEST
+
+START_TEST(notify_shared_value_check)
+{
+	int client1, client2;
+	BuxtonDaemon daemon;
+	_BuxtonKey key;
+	BuxtonString slabel;
+	BuxtonData value;
+	BuxtonWatchedKey *watched;
+	client_list_item cl1, cl2;
+	int32_t status;
+	uint32_t msgid;
+	uint8_t buf[4096];
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl1, sizeof(client_list_item));
+	memzero(&cl2, sizeof(client_list_item));
+	daemon.epollfd = -1;
+
+	setup_socket_pair(&client1, &cl1.fd);
+	setup_socket_pair(&client2, &cl2.fd);
+	fcntl(client1, F_SETFL, O_NONBLOCK);
+	fcntl(client2, F_SETFL, O_NONBLOCK);
+	slabel = buxton_string_pack("_");
+	cl1.smack_label = cl2.smack_label = use_smack() ? &slabel : NULL;
+	cl1.cred.uid = cl2.cred.uid = 1002;
+	daemon.notify_mapping = hashmap_new(string_hash_func,
+					    string_compare_func);
+	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
+	fail_if(!buxton_cache_smack_rules(),
+		"Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("shared value");
+	key.group = buxton_string_pack("daemon-check");
+	key.name = buxton_string_pack("name");
+	key.layer = buxton_string_pack("base");
+	key.type = STRING;
+	fail_if(!buxton_direct_set_value(&daemon.buxton, &key, &value, NULL),
+		"Failed to set value for notify");
+	register_notification(&daemon, &cl1, &key, 1, 0, &status);
+	fail_if(status != 0, "Failed to register first notification");
+	register_notification(&daemon, &cl2, &key, 2, 0, &status);
+	fail_if(status != 0, "Failed to register second notification");
+
+	/* Both clients share the one entry and its last value */
+	fail_if(hashmap_size(daemon.notify_mapping) != 1,
+		"Watched key not shared");
+	watched = hashmap_get(daemon.notify_mapping, "daemon-checkname");
+	fail_if(!watched || !watched->notifications ||
+		!watched->notifications->watcher_next,
+		"Notifications not on the key");
+	fail_if(!cl1.subscriptions || !cl2.subscriptions,
+		"Notifications not on the clients");
+	fail_if(!watched->last || !streq(watched->last->store.d_string.value,
+					 "shared value"),
+		"Last value not kept");
+
+	/* An unchanged value tells nobody */
+	buxtond_notify_clients(&daemon, &cl1, &key, &value);
+	fail_if(daemon.pending, "Notified of an unchanged value");
+
+	value.store.d_string = buxton_string_pack("changed value");
+	buxtond_notify_clients(&daemon, &cl1, &key, &value);
+	flush_clients(&daemon);
+	fail_if(read(client1, buf, sizeof(buf)) <= 0, "First client not notified");
+	fail_if(read(client2, buf, sizeof(buf)) <= 0, "Second client not notified");
+	fail_if(!streq(watched->last->store.d_string.value, "changed value"),
+		"Last value not updated");
+
+	/* The entry goes with the last registration */
+	msgid = unregister_notification(&daemon, &cl1, &key, &status);
+	fail_if(status != 0 || msgid != 1,
+		"Failed to unregister first notification");
+	fail_if(hashmap_size(daemon.notify_mapping) != 1,
+		"Watched key freed early");
+	msgid = unregister_notification(&daemon, &cl2, &key, &status);
+	fail_if(status != 0 || msgid != 2,
+		"Failed to unregister second notification");
+	fail_if(hashmap_size(daemon.notify_mapping) != 0,
+		"Unwatched key not freed");
+
+	hashmap_free(daemon.notify_mapping);
+	buxton_direct_close(&daemon.buxton);
+	close(client1);
+	close(client2);
+	close(cl1.fd);
+	close(cl2.fd);
+}
+END_TEST
+
+START_TEST(notify_coalesce_check)
+{
+	int client;
+	BuxtonDaemon daemon;
+	_BuxtonKey key;
+	BuxtonString slabel;
+	BuxtonData value;
+	BuxtonData *list = NULL;
+	BuxtonControlMessage msg;
+	BuxtonWatchedKey *watched;
+	client_list_item cl;
+	int32_t status;
+	uint32_t msgid;
+	ssize_t csize;
+	ssize_t s;
+	uint8_t buf[4096];
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+	daemon.epollfd = -1;
+
+	setup_socket_pair(&client, &cl.fd);
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	slabel = buxton_string_pack("_");
+	cl.smack_label = use_smack() ? &slabel : NULL;
+	cl.cred.uid = 1002;
+	daemon.notify_mapping = hashmap_new(string_hash_func,
+					    string_compare_func);
+	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
+	fail_if(!buxton_cache_smack_rules(),
+		"Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("first");
+	key.group = buxton_string_pack("daemon-check");
+	key.name = buxton_string_pack("coalesce");
+	key.layer = buxton_string_pack("base");
+	key.type = STRING;
+	fail_if(!buxton_direct_set_value(&daemon.buxton, &key, &value, NULL),
+		"Failed to set value for notify");
+	register_notification(&daemon, &cl, &key, 1, 0, &status);
+	fail_if(status != 0, "Failed to register notification");
+	watched = hashmap_get(daemon.notify_mapping, "daemon-checkcoalesce");
+	fail_if(!watched || watched->interval != 50,
+		"Key not coalesced as configured");
+	fail_if(notification_timeout(&daemon) != -1,
+		"Timer set without deferred notifications");
+
+	/* The first change goes out at once */
+	value.store.d_string = buxton_string_pack("second");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	flush_clients(&daemon);
+	fail_if(read(client, buf, sizeof(buf)) <= 0, "Client not notified");
+
+	/* Later ones wait for the interval to end */
+	value.store.d_string = buxton_string_pack("third");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	value.store.d_string = buxton_string_pack("fourth");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	fail_if(daemon.pending, "Notified within the interval");
+	fail_if(!watched->deferred || daemon.timers_pending != 1,
+		"Notification not deferred");
+	s = notification_timeout(&daemon);
+	fail_if(s < 0 || s > BUXTON_TIMER_TICK, "Bad timeout for deferred notification");
+	send_deferred_notifications(&daemon, false);
+	fail_if(daemon.pending, "Deferred notification sent early");
+
+	usleep(60 * 1000);
+	send_deferred_notifications(&daemon, false);
+	fail_if(watched->deferred || daemon.timers_pending != 0,
+		"Deferred notification left on the timer wheel");
+	flush_clients(&daemon);
+	s = read(client, buf, sizeof(buf));
+	fail_if(s <= 0, "Deferred notification not sent");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1 || msg != BUXTON_CONTROL_CHANGED || msgid != 1,
+		"Bad deferred notification");
+	fail_if(!streq(list[0].store.d_string.value, "fourth"),
+		"Deferred notification without the last value");
+	free(list[0].store.d_string.value);
+	free(list);
+	fail_if(read(client, buf, sizeof(buf)) > 0,
+		"More than one deferred notification");
+
+	/* A key back at the value last sent has nothing to notify */
+	value.store.d_string = buxton_string_pack("fifth");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	value.store.d_string = buxton_string_pack("fourth");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	fail_if(daemon.timers_pending != 1, "Notification not deferred");
+	usleep(60 * 1000);
+	send_deferred_notifications(&daemon, false);
+	fail_if(watched->deferred || daemon.timers_pending != 0,
+		"Unchanged key left on the timer wheel");
+	flush_clients(&daemon);
+	fail_if(read(client, buf, sizeof(buf)) > 0,
+		"Notified of a key back at its last value");
+
+	/* Unwatching drops a deferred notification */
+	value.store.d_string = buxton_string_pack("fifth");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	flush_clients(&daemon);
+	fail_if(read(client, buf, sizeof(buf)) <= 0, "Client not notified");
+	value.store.d_string = buxton_string_pack("sixth");
+	buxtond_notify_clients(&daemon, &cl, &key, &value);
+	fail_if(daemon.timers_pending != 1, "Notification not deferred");
+	msgid = unregister_notification(&daemon, &cl, &key, &status);
+	fail_if(status != 0 || msgid != 1, "Failed to unregister notification");
+	fail_if(daemon.timers_pending != 0 || notification_timeout(&daemon) != -1,
+		"Unwatched key left on the timer wheel");
+
+	hashmap_free(daemon.notify_mapping);
+	buxton_direct_close(&daemon.buxton);
+	close(client);
+	close(cl.fd);
+}
+END_TEST
+
+START_TEST(notify_grouped_check)
+{
+	int client;
+	BuxtonDaemon daemon;
+	_BuxtonKey key1, key2;
+	BuxtonString slabel;
+	BuxtonData value;
+	BuxtonData *list = NULL;
+	BuxtonControlMessage msg;
+	client_list_item cl;
+	int32_t status;
+	uint32_t msgid;
+	ssize_t csize;
+	ssize_t s;
+	uint8_t buf[4096];
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+	daemon.epollfd = -1;
+
+	setup_socket_pair(&client, &cl.fd);
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	slabel = buxton_string_pack("_");
+	cl.smack_label = use_smack() ? &slabel : NULL;
+	cl.cred.uid = 1002;
+	daemon.notify_mapping = hashmap_new(string_hash_func,
+					    string_compare_func);
+	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
+	fail_if(!buxton_cache_smack_rules(),
+		"Failed to cache Smack rules");
+	fail_if(!buxton_direct_open(&daemon.buxton),
+		"Failed to open buxton direct connection");
+
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("first");
+	key1.group = buxton_string_pack("daemon-check");
+	key1.name = buxton_string_pack("grouped1");
+	key1.layer = buxton_string_pack("base");
+	key1.type = STRING;
+	key2 = key1;
+	key2.name = buxton_string_pack("grouped2");
+	fail_if(!buxton_direct_set_value(&daemon.buxton, &key1, &value, NULL),
+		"Failed to set value for notify");
+	fail_if(!buxton_direct_set_value(&daemon.buxton, &key2, &value, NULL),
+		"Failed to set value for notify");
+	register_notification(&daemon, &cl, &key1, 1, BUXTON_NOTIFY_GROUPED,
+			      &status);
+	fail_if(status != 0, "Failed to register first notification");
+	register_notification(&daemon, &cl, &key2, 2, BUXTON_NOTIFY_GROUPED,
+			      &status);
+	fail_if(status != 0, "Failed to register second notification");
+
+	/* Changes to both keys go out in one message */
+	value.store.d_string = buxton_string_pack("second");
+	buxtond_notify_clients(&daemon, &cl, &key1, &value);
+	value.store.d_string = buxton_string_pack("third");
+	buxtond_notify_clients(&daemon, &cl, &key2, &value);
+	flush_clients(&daemon);
+	s = read(client, buf, sizeof(buf));
+	fail_if(s <= 0, "Client not notified");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
-	fail_if(csize != 1,
-		"Failed to get correct response to notify uint64");
-	fail_if(msg != BUXTON_CONTROL_CHANGED,
-		"Failed to get correct control type");
-	fail_if(msgid != 0, "Failed to get correct message id");
-	fail_if(list[0].type != UINT64,
-		"Failed to get correct notification value type uint64");
-	fail_if(list[0].store.d_uint64 != 3,
-		"Failed to get correct notification value data uint64");
-
+	fail_if(csize != 4 || msg != BUXTON_CONTROL_CHANGED_MANY,
+		"Changes not grouped");
+	fail_if(buxton_get_message_size(buf, (size_t)s) != (size_t)s,
+		"More than one message for grouped changes");
+	fail_if(list[0].type != UINT32 || list[0].store.d_uint32 != 1 ||
+		!streq(list[1].store.d_string.value, "second"),
+		"Bad first grouped change");
+	fail_if(list[2].type != UINT32 || list[2].store.d_uint32 != 2 ||
+		!streq(list[3].store.d_string.value, "third"),
+		"Bad second grouped change");
+	free(list[1].store.d_string.value);
+	free(list[3].store.d_string.value);
 	free(list);
 
-	value1.type = FLOAT;
-	value1.store.d_float = 3.1F;
-	value2.type = FLOAT;
-	value2.store.d_float = 3.14F;
-	key.group = buxton_string_pack("group");
-	key.name = buxton_string_pack("namef");
-	key.type = FLOAT;
-	r = buxton_direct_set_value(&daemon.buxton, &key,
-				    &value1, NULL);
-	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
-	fail_if(status != 0,
-		"Failed to register notification for notify");
-	buxtond_notify_clients(&daemon, &cl, &key, &value2);
-
-	s = read(client, buf, 4096);
-	fail_if(s < 0, "Read from client failed");
+	/* A single change goes out as before */
+	value.store.d_string = buxton_string_pack("fourth");
+	buxtond_notify_clients(&daemon, &cl, &key1, &value);
+	flush_clients(&daemon);
+	s = read(client, buf, sizeof(buf));
+	fail_if(s <= 0, "Client not notified of single change");
 	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
-	fail_if(csize != 1,
-		"Failed to get correct response to notify float");
-	fail_if(msg != BUXTON_CONTROL_CHANGED,
-		"Failed to get correct control type");
-	fail_if(msgid != 0, "Failed to get correct message id");
-	fail_if(list[0].type != FLOAT,
-		"Failed to get correct notification value type float");
-	fail_if(list[0].store.d_float != 3.14F,
-		"Failed to get correct notification value data float");
+	fail_if(csize != 1 || msg != BUXTON_CONTROL_CHANGED || msgid != 1 ||
+		!streq(list[0].store.d_string.value, "fourth"),
+		"Bad single grouped change");
+	free(list[0].store.d_string.value);
+	free(list);
 
+	/* Unsets aren't grouped, and keep their place */
+	buxtond_notify_clients(&daemon, &cl, &key2, &value);
+	buxtond_notify_clients(&daemon, &cl, &key1, NULL);
+	flush_clients(&daemon);
+	s = read(client, buf, sizeof(buf));
+	fail_if(s <= 0, "Client not notified of unset");
+	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
+	fail_if(csize != 1 || msg != BUXTON_CONTROL_CHANGED || msgid != 2,
+		"Change before unset out of order");
+	free(list[0].store.d_string.value);
+	free(list);
+	csize = buxton_deserialize_message(buf + buxton_get_message_size(buf, (size_t)s),
+					   &msg, (size_t)s - buxton_get_message_size(buf, (size_t)s),
+					   &msgid, &list);
+	fail_if(csize != 0 || msg != BUXTON_CONTROL_CHANGED || msgid != 1,
+		"Bad unset notification");
 	free(list);
 
-	value1.type = DOUBLE;
-	value1.store.d_double = 3.141F;
-	value2.type = DOUBLE;
-	value2.store.d_double = 3.1415F;
-	key.group = buxton_string_pack("group");
-	key.name = buxton_string_pack("named");
-	key.type = DOUBLE;
-	r = buxton_direct_set_value(&daemon.buxton, &key,
-				    &value1, NULL);
-	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
-	fail_if(status != 0,
-		"Failed to register notification for notify");
-	buxtond_notify_clients(&daemon, &cl, &key, &value2);
+	msgid = unregister_notification(&daemon, &cl, &key1, &status);
+	fail_if(status != 0 || msgid != 1, "Failed to unregister notification");
+	msgid = unregister_notification(&daemon, &cl, &key2, &status);
+	fail_if(status != 0 || msgid != 2, "Failed to unregister notification");
 
-	s = read(client, buf, 4096);
-	fail_if(s < 0, "Read from client failed");
-	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
-	fail_if(csize != 1,
-		"Failed to get correct response to notify double");
-	fail_if(msg != BUXTON_CONTROL_CHANGED,
-		"Failed to get correct control type");
-	fail_if(msgid != 0, "Failed to get correct message id");
-	fail_if(list[0].type != DOUBLE,
-		"Failed to get correct notification value type double");
-	fail_if(list[0].store.d_double != 3.1415F,
-		"Failed to get correct notification value data double");
+	hashmap_free(daemon.notify_mapping);
+	buxton_direct_close(&daemon.buxton);
+	close(client);
+	close(cl.fd);
+}
+END_TEST
 
-	free(list);
+/*
+ * Read the journal entries queued for a client, keeping the sequence
+ * number and op of each
+ */
+static size_t read_journal(int fd, uint64_t *seqs, uint32_t *ops, size_t max)
+{
+	BuxtonData *list = NULL;
+	BuxtonControlMessage msg;
+	uint8_t buf[4096];
+	uint32_t msgid;
+	ssize_t count;
+	ssize_t s;
+	size_t offset = 0;
+	size_t size;
+	size_t n = 0;
 
-	value1.type = BOOLEAN;
-	value1.store.d_boolean = false;
-	value2.type = BOOLEAN;
-	value2.store.d_int32 = true;
-	key.group = buxton_string_pack("group");
-	key.name = buxton_string_pack("nameb");
-	key.type = BOOLEAN;
-	r = buxton_direct_set_value(&daemon.buxton, &key,
-				    &value1, NULL);
-	fail_if(!r, "Failed to set value for notify");
-	register_notification(&daemon, &cl, &key, 0, &status);
-	fail_if(status != 0,
-		"Failed to register notification for notify");
-	buxtond_notify_clients(&daemon, &cl, &key, &value2);
+	s = read(fd, buf, sizeof(buf));
+	if (s <= 0) {
+		return 0;
+	}
 
-	s = read(client, buf, 4096);
-	fail_if(s < 0, "Read from client failed");
-	csize = buxton_deserialize_message(buf, &msg, (size_t)s, &msgid, &list);
-	fail_if(csize != 1,
-		"Failed to get correct response to notify bool");
-	fail_if(msg != BUXTON_CONTROL_CHANGED,
-		"Failed to get correct control type");
-	fail_if(msgid != 0, "Failed to get correct message id");
-	fail_if(list[0].type != BOOLEAN,
-		"Failed to get correct notification value type bool");
-	fail_if(list[0].store.d_boolean != true,
-		"Failed to get correct notification value data bool");
+	while (offset < (size_t)s && n < max) {
+		size = buxton_get_message_size(buf + offset, (size_t)s - offset);
+		if (size == 0 || size > (size_t)s - offset) {
+			break;
+		}
+		count = buxton_deserialize_message(buf + offset, &msg, size,
+						   &msgid, &list);
+		fail_if(count < 2 || msg != BUXTON_CONTROL_JOURNAL ||
+			msgid != 7, "Bad journal entry");
+		seqs[n] = list[0].store.d_uint64;
+		ops[n] = list[1].store.d_uint32;
+		n++;
+		for (int i = 0; i < count; i++) {
+			if (list[i].type == STRING) {
+				free(list[i].store.d_string.value);
+			}
+		}
+		free(list);
+		offset += size;
+	}
 
-	free(list);
+	return n;
+}
+
+START_TEST(journal_check)
+{
+	int client, oclient;
+	BuxtonDaemon daemon;
+	_BuxtonKey key;
+	BuxtonData value;
+	BuxtonString glabel = buxton_string_pack("_");
+	BuxtonString klabel = buxton_string_pack("_");
+	BuxtonString olabel = buxton_string_pack("user");
+	client_list_item cl, other;
+	int32_t status;
+	uint64_t seqs[16];
+	uint32_t ops[16];
+	uint64_t seq, epoch;
+	uint32_t msgid;
+	size_t n;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&cl, sizeof(client_list_item));
+	memzero(&other, sizeof(client_list_item));
+	daemon.epollfd = -1;
+
+	setup_socket_pair(&client, &cl.fd);
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	setup_socket_pair(&oclient, &other.fd);
+	fcntl(oclient, F_SETFL, O_NONBLOCK);
+	other.smack_label = &olabel;
+	fail_if(!buxton_cache_smack_rules(),
+		"Failed to cache Smack rules");
+
+	key.layer = buxton_string_pack("base");
+	key.group = buxton_string_pack("daemon-check");
+	key.name = buxton_string_pack("journal");
+	key.type = STRING;
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("journaled");
+
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key, &value,
+			       &glabel, &klabel);
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key, &value,
+			       &glabel, &klabel);
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_UNSET, &key, NULL,
+			       &glabel, &klabel);
+
+	/* Sequence numbers from another run of the daemon can't resume */
+	epoch = daemon.journal.epoch;
+	fail_if(epoch == 0, "No journal epoch");
+	seq = subscribe_journal(&daemon, &cl, epoch + 1, 1, 7, &status);
+	fail_if(status != BUXTON_STATUS_RESYNC || seq != 4,
+		"No resync for another epoch");
+	msgid = unsubscribe_journal(&daemon, &cl, &status);
+	fail_if(msgid != 7, "Failed to drop subscription from another epoch");
+
+	/* Replay from the start */
+	seq = subscribe_journal(&daemon, &cl, epoch, 1, 7, &status);
+	fail_if(status != 0 || seq != 1, "Failed to subscribe from start");
+	seq = subscribe_journal(&daemon, &cl, epoch, 1, 8, &status);
+	fail_if(status != -1, "Subscribed to the journal twice");
+	flush_clients(&daemon);
+	n = read_journal(client, seqs, ops, 16);
+	fail_if(n != 3 || seqs[0] != 1 || seqs[2] != 3, "Bad journal replay");
+	fail_if(ops[0] != BUXTON_CONTROL_SET || ops[2] != BUXTON_CONTROL_UNSET,
+		"Bad journal replay ops");
+
+	/* Then changes as they're made */
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key, &value,
+			       &glabel, &klabel);
+	flush_clients(&daemon);
+	n = read_journal(client, seqs, ops, 16);
+	fail_if(n != 1 || seqs[0] != 4, "Bad live journal entry");
+
+	fail_if(unsubscribe_journal(&daemon, &cl, &status) != 7 || status != 0,
+		"Failed to unsubscribe from the journal");
+	msgid = unsubscribe_journal(&daemon, &cl, &status);
+	fail_if(msgid != 0 || status != -1,
+		"Unsubscribed from the journal twice");
+
+	/* The test config keeps 8 entries, so 5 to 14 leave 7 to 14 */
+	for (int i = 0; i < 10; i++) {
+		buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key,
+				       &value, &glabel, &klabel);
+	}
+	seq = subscribe_journal(&daemon, &cl, epoch, 3, 7, &status);
+	fail_if(status != BUXTON_STATUS_RESYNC || seq != 15,
+		"No resync for entries no longer kept");
+	msgid = unsubscribe_journal(&daemon, &cl, &status);
+	fail_if(msgid != 7, "Failed to drop resynced subscription");
+	seq = subscribe_journal(&daemon, &cl, epoch, 7, 7, &status);
+	fail_if(status != 0 || seq != 7, "Failed to subscribe from oldest");
+	flush_clients(&daemon);
+	n = read_journal(client, seqs, ops, 16);
+	fail_if(n != 8 || seqs[0] != 7 || seqs[7] != 14,
+		"Bad journal replay after wrapping");
+
+	/* A subscriber that falls too far behind is told to resync */
+	for (int i = 0; i < 9; i++) {
+		buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key,
+				       &value, &glabel, &klabel);
+	}
+	flush_clients(&daemon);
+	n = read_journal(client, seqs, ops, 16);
+	fail_if(n != 1 || ops[0] != BUXTON_CONTROL_MIN || seqs[0] != 24,
+		"No resync for a subscriber left behind");
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key, &value,
+			       &glabel, &klabel);
+	flush_clients(&daemon);
+	n = read_journal(client, seqs, ops, 16);
+	fail_if(n != 1 || seqs[0] != 24, "Bad journal entry after resync");
+
+	msgid = unsubscribe_journal(&daemon, &cl, &status);
+	fail_if(msgid != 7, "Failed to unsubscribe from the journal 2");
+
+	/* Clients with a label aren't sent keys whose labels are unknown */
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key, &value,
+			       NULL, NULL);
+	buxtond_journal_change(&daemon, &cl, BUXTON_CONTROL_SET, &key, &value,
+			       &glabel, &klabel);
+	seq = subscribe_journal(&daemon, &other, epoch, 25, 7, &status);
+	fail_if(status != 0 || seq != 25, "Failed to subscribe with a label");
+	flush_clients(&daemon);
+	n = read_journal(oclient, seqs, ops, 16);
+	fail_if(n != 1 || seqs[0] != 26, "Sent a change without labels");
+
+	msgid = unsubscribe_journal(&daemon, &other, &status);
+	fail_if(msgid != 7, "Failed to unsubscribe with a label");
+	buxtond_journal_free(&daemon);
+	free(cl.out);
+	free(other.out);
 	close(client);
-	buxton_direct_close(&daemon.buxton);
+	close(cl.fd);
+	close(oclient);
+	close(other.fd);
 }
 END_TEST
 
@@ -2059,16 +3399,44 @@ START_TEST(identify_client_check)
 	int sender;
 	client_list_item client;
 	bool r;
-	int32_t msg = 5;
 
+	memzero(&client, sizeof(client_list_item));
 	setup_socket_pair(&client.fd, &sender);
 	r = identify_client(&client);
-	fail_if(r, "Identified client without message");
-
-	write(sender, &msg, sizeof(int32_t));
-	r = identify_client(&client);
 	fail_if(!r, "Identify client failed");
+	fail_if(client.cred.pid != getpid(), "Wrong pid for client");
+	fail_if(client.cred.uid != getuid(), "Wrong uid for client");
+
+	close(client.fd);
+	close(sender);
+}
+END_TEST
+
+START_TEST(setup_client_check)
+{
+	BuxtonDaemon daemon;
+	client_list_item client;
+	int sender;
 
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&client, sizeof(client_list_item));
+	daemon.labels = hashmap_new(string_hash_func, string_compare_func);
+	fail_if(!daemon.labels, "Failed to allocate hashmap");
+	daemon.rate_limits = hashmap_new(string_hash_func, string_compare_func);
+	fail_if(!daemon.rate_limits, "Failed to allocate hashmap");
+
+	/* Nothing has been sent, the client is known from the connection */
+	setup_socket_pair(&client.fd, &sender);
+	fail_if(!setup_client(&daemon, &client), "Failed to set up client");
+	fail_if(client.cred.pid != getpid(), "Client not identified");
+	fail_if(client.class != client_class(&client), "Client not classified");
+	fail_if((client.class == BUXTON_CLIENT_SYSTEM) != (client.rate == NULL),
+		"Client rate limits not attached");
+
+	detach_rate_limit(&daemon, &client);
+	release_smack_label(&daemon, &client);
+	hashmap_free(daemon.labels);
+	hashmap_free(daemon.rate_limits);
 	close(client.fd);
 	close(sender);
 }
@@ -2087,16 +3455,25 @@ START_TEST(add_pollfd_check)
 	daemon.nfds = 0;
 	daemon.pollfds = NULL;
 	daemon.accepting = NULL;
+	daemon.polled_alloc = 0;
+	daemon.polled = NULL;
+	daemon.retired = NULL;
+	daemon.epollfd = -1;
+	daemon.uring = NULL;
 	events = 1;
 	a = true;
-	add_pollfd(&daemon, fd, events, a);
+	add_pollfd(&daemon, fd, events, a, NULL);
 	fail_if(daemon.nfds != 1, "Failed to increase nfds");
 	fail_if(daemon.pollfds[0].fd != fd, "Failed to set pollfd");
 	fail_if(daemon.pollfds[0].events != events, "Failed to set events");
 	fail_if(daemon.pollfds[0].revents != 0, "Failed to set revents");
 	fail_if(daemon.accepting[0] != a, "Failed to set accepting status");
+	fail_if(daemon.polled[0]->fd != fd || daemon.polled[0]->index != 0,
+		"Failed to set poll entry");
+	free(daemon.polled[0]);
 	free(daemon.pollfds);
 	free(daemon.accepting);
+	free(daemon.polled);
 }
 END_TEST
 
@@ -2113,9 +3490,14 @@ START_TEST(del_pollfd_check)
 	daemon.nfds = 0;
 	daemon.pollfds = NULL;
 	daemon.accepting = NULL;
+	daemon.polled_alloc = 0;
+	daemon.polled = NULL;
+	daemon.retired = NULL;
+	daemon.epollfd = -1;
+	daemon.uring = NULL;
 	events = 1;
 	a = true;
-	add_pollfd(&daemon, fd, events, a);
+	add_pollfd(&daemon, fd, events, a, NULL);
 	fail_if(daemon.nfds != 1, "Failed to add pollfd");
 	del_pollfd(&daemon, 0);
 	fail_if(daemon.nfds != 0, "Failed to decrease nfds 1");
@@ -2123,7 +3505,7 @@ START_TEST(del_pollfd_check)
 	fd = 4;
 	events = 2;
 	a = false;
-	add_pollfd(&daemon, fd, events, a);
+	add_pollfd(&daemon, fd, events, a, NULL);
 	fail_if(daemon.nfds != 1, "Failed to increase nfds after del");
 	fail_if(daemon.pollfds[0].fd != fd, "Failed to set pollfd after del");
 	fail_if(daemon.pollfds[0].events != events,
@@ -2135,7 +3517,7 @@ START_TEST(del_pollfd_check)
 	fd = 5;
 	events = 3;
 	a = true;
-	add_pollfd(&daemon, fd, events, a);
+	add_pollfd(&daemon, fd, events, a, NULL);
 	del_pollfd(&daemon, 0);
 	fail_if(daemon.nfds != 1, "Failed to delete fd 2");
 	fail_if(daemon.pollfds[0].fd != fd, "Failed to set pollfd after del2");
@@ -2145,19 +3527,128 @@ START_TEST(del_pollfd_check)
 		"Failed to set revents after del2");
 	fail_if(daemon.accepting[0] != a,
 		"Failed to set accepting status after del2");
+	fail_if(daemon.polled[0]->fd != fd || daemon.polled[0]->index != 0,
+		"Failed to move poll entry");
+	fail_if(!daemon.retired || daemon.retired->fd != -1,
+		"Failed to retire removed poll entry");
+	release_pollfds(&daemon);
+	fail_if(daemon.retired, "Failed to release poll entries");
+	free(daemon.polled[0]);
+	free(daemon.pollfds);
+	free(daemon.accepting);
+	free(daemon.polled);
+}
+END_TEST
+
+START_TEST(epoll_pollfd_check)
+{
+	BuxtonDaemon daemon;
+	struct epoll_event ev;
+	int client, server;
+	nfds_t i;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	daemon.epollfd = epoll_create1(EPOLL_CLOEXEC);
+	fail_if(daemon.epollfd < 0, "Failed to create epoll set");
+	setup_socket_pair(&client, &server);
+
+	add_pollfd(&daemon, server, POLLIN, false, NULL);
+	fail_if(epoll_wait(daemon.epollfd, &ev, 1, 0) != 0, "Event without data");
+	write(client, "x", 1);
+	fail_if(epoll_wait(daemon.epollfd, &ev, 1, 0) != 1, "No event for data");
+	fail_if(ev.data.ptr != daemon.polled[0], "Event for the wrong fd");
+	fail_if(!(ev.events & EPOLLIN), "Event isn't for input");
+
+	fail_if(!find_pollfd(&daemon, server, &i), "Failed to find pollfd");
+	update_pollfd(&daemon, i, POLLIN | POLLOUT);
+	fail_if(daemon.pollfds[i].events != (POLLIN | POLLOUT), "Failed to update events");
+	fail_if(epoll_wait(daemon.epollfd, &ev, 1, 0) != 1, "No event after update");
+	fail_if(!(ev.events & EPOLLOUT), "Event isn't for output");
+
+	del_pollfd(&daemon, i);
+	fail_if(find_pollfd(&daemon, server, &i), "Found removed pollfd");
+	fail_if(epoll_wait(daemon.epollfd, &ev, 1, 0) != 0, "Event for removed fd");
+
+	free(daemon.pollfds);
+	free(daemon.accepting);
+	close(daemon.epollfd);
+	close(client);
+	close(server);
+}
+END_TEST
+
+#ifdef HAVE_IO_URING
+START_TEST(uring_pollfd_check)
+{
+	BuxtonDaemon daemon;
+	struct epoll_event ev;
+	int client, server;
+	nfds_t i;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	daemon.epollfd = -1;
+	fail_if(!buxtond_uring_setup(&daemon), "Failed to set up io_uring");
+	setup_socket_pair(&client, &server);
+
+	add_pollfd(&daemon, server, POLLIN, false, NULL);
+	fail_if(buxtond_uring_wait(&daemon, &ev, 1, 0) != 0, "Event without data");
+	write(client, "x", 1);
+	fail_if(buxtond_uring_wait(&daemon, &ev, 1, 1000) != 1,
+		"No event for data");
+	fail_if(ev.data.ptr != daemon.polled[0], "Event for the wrong fd");
+	fail_if(!(ev.events & EPOLLIN), "Event isn't for input");
+
+	fail_if(!find_pollfd(&daemon, server, &i), "Failed to find pollfd");
+	del_pollfd(&daemon, i);
+	write(client, "x", 1);
+	fail_if(buxtond_uring_wait(&daemon, &ev, 1, 100) != 0,
+		"Event for removed fd");
+
+	buxtond_uring_free(&daemon);
+	fail_if(daemon.uring, "Failed to free io_uring");
+	free(daemon.pollfds);
+	free(daemon.accepting);
+	close(client);
+	close(server);
 }
 END_TEST
+#endif
 
 START_TEST(handle_smack_label_check)
 {
-	client_list_item client;
-	int server;
+	BuxtonDaemon daemon;
+	client_list_item client, other;
+	int server, other_server;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&client, sizeof(client_list_item));
+	memzero(&other, sizeof(client_list_item));
+	daemon.labels = hashmap_new(string_hash_func, string_compare_func);
+	fail_if(!daemon.labels, "Failed to allocate hashmap");
 
 	setup_socket_pair(&client.fd, &server);
-	handle_smack_label(&client);
+	setup_socket_pair(&other.fd, &other_server);
+	handle_smack_label(&daemon, &client);
+	handle_smack_label(&daemon, &other);
+	fail_if(client.smack_label != other.smack_label,
+		"Clients with the same label don't share it");
+	if (client.smack_label) {
+		fail_if(hashmap_size(daemon.labels) != 1, "Label not kept once");
+	}
 
+	release_smack_label(&daemon, &client);
+	fail_if(client.smack_label, "Label still set after release");
+	if (other.smack_label) {
+		fail_if(hashmap_size(daemon.labels) != 1, "Shared label freed early");
+	}
+	release_smack_label(&daemon, &other);
+	fail_if(hashmap_size(daemon.labels) != 0, "Unused label not freed");
+
+	hashmap_free(daemon.labels);
 	close(client.fd);
 	close(server);
+	close(other.fd);
+	close(other_server);
 }
 END_TEST
 
@@ -2166,12 +3657,9 @@ START_TEST(terminate_client_check)
 	client_list_item *client;
 	BuxtonDaemon daemon;
 	int dummy;
-	BuxtonList *n_list = NULL;
-	BuxtonList *key_list = NULL;
+	BuxtonWatchedKey *watched = NULL;
 	char *key_name = strdup("groupkey");
-	char *key_name_copy = strdup("groupkey");
 	int ret = -1;
-	uint64_t *fd = NULL;
 	BuxtonNotification *nitem = NULL;
 
 	client = malloc0(sizeof(client_list_item));
@@ -2185,45 +3673,419 @@ START_TEST(terminate_client_check)
 	daemon.nfds = 0;
 	daemon.pollfds = NULL;
 	daemon.accepting = NULL;
-	add_pollfd(&daemon, client->fd, 2, false);
+	daemon.polled_alloc = 0;
+	daemon.polled = NULL;
+	daemon.retired = NULL;
+	daemon.epollfd = -1;
+	daemon.uring = NULL;
+	daemon.labels = NULL;
+	add_pollfd(&daemon, client->fd, 2, false, client);
 	fail_if(daemon.nfds != 1, "Failed to add pollfd");
 	client->smack_label->value = strdup("dummy");
 	client->smack_label->length = 6;
 	fail_if(!client->smack_label->value, "label strdup failed");
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
 	nitem = malloc0(sizeof(BuxtonNotification));
 	fail_if(!nitem,"Failed to allocate notification item\n");
 	nitem->client = client;
-	nitem->old_data = NULL;
 	nitem->msgid = 0;
-
-	ret = buxton_list_append(&n_list, nitem);
-	fail_if(!ret, "Failed to append to list\n");
-	ret = buxton_list_append(&key_list, key_name_copy);
-	fail_if(!ret, "Failed to append to list\n");
-
-	fd = malloc0(sizeof(uint64_t));
-	fail_if(!fd, "Failed to allocate fd\n");
-	*fd = (uint64_t)client->fd;
-
-	ret = hashmap_put(daemon.notify_mapping, key_name, n_list);
-	fail_if(ret < 0,"Failed to put in hashmap\n");
-	ret = hashmap_put(daemon.client_key_mapping, fd, key_list);
+	watched = malloc0(sizeof(BuxtonWatchedKey));
+	fail_if(!watched, "Failed to allocate watched key\n");
+	watched->name = key_name;
+	nitem->watched = watched;
+	LIST_PREPEND(BuxtonNotification, watcher, watched->notifications, nitem);
+	LIST_PREPEND(BuxtonNotification, subscription, client->subscriptions, nitem);
+
+	ret = hashmap_put(daemon.notify_mapping, key_name, watched);
 	fail_if(ret < 0,"Failed to put in hashmap\n");
 
 	terminate_client(&daemon, client, 0);
 	fail_if(daemon.client_list, "Failed to set client list item to NULL");
+	fail_if(hashmap_size(daemon.notify_mapping) != 0,
+		"Failed to remove the client's notifications");
 
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 	close(dummy);
 }
 END_TEST
 
+START_TEST(client_has_message_check)
+{
+	client_list_item *client;
+	uint8_t *message = NULL;
+	BuxtonArray *list = NULL;
+	BuxtonData data;
+	size_t size;
+
+	list = buxton_array_new();
+	fail_if(!list, "Failed to allocate list");
+	data.type = STRING;
+	data.store.d_string = buxton_string_pack("client-has-message");
+	fail_if(!buxton_array_add(list, &data), "Failed to add data to array");
+	size = buxton_serialize_message(&message, BUXTON_CONTROL_GET, 0, list);
+	fail_if(size == 0, "Failed to serialize message");
+
+	client = malloc0(sizeof(client_list_item));
+	fail_if(!client, "client malloc failed");
+	fail_if(client_has_message(client), "Message without a buffer");
+
+	client->size = size * 2;
+	client->buffer = malloc0(client->size);
+	fail_if(!client->buffer, "buffer malloc failed");
+
+	/* A partial message is kept until the rest arrives */
+	memcpy(client->buffer, message, size);
+	client->offset = size - 1;
+	fail_if(client_has_message(client), "Partial message reported");
+	client->offset = size;
+	fail_if(!client_has_message(client), "Complete message not reported");
+
+	/* Messages are found wherever they start in the buffer */
+	memcpy(client->buffer + size, message, size);
+	client->start = size;
+	client->offset = size + BUXTON_MESSAGE_HEADER_LENGTH;
+	fail_if(client_has_message(client), "Partial second message reported");
+	client->offset = size * 2;
+	fail_if(!client_has_message(client), "Second message not reported");
+
+	free(client->buffer);
+	free(client);
+	free(message);
+	buxton_array_free(&list, NULL);
+}
+END_TEST
+
+START_TEST(client_class_check)
+{
+	client_list_item client;
+	BuxtonString label;
+
+	memzero(&client, sizeof(client_list_item));
+	client.cred.uid = 0;
+	fail_if(client_class(&client) != BUXTON_CLIENT_SYSTEM,
+		"Priority uid not in the system class");
+
+	client.cred.uid = 5000;
+	fail_if(client_class(&client) != BUXTON_CLIENT_DEFAULT,
+		"Unlisted uid not in the default class");
+
+	label = buxton_string_pack("System");
+	client.smack_label = &label;
+	fail_if(client_class(&client) != BUXTON_CLIENT_SYSTEM,
+		"Priority label not in the system class");
+
+	label = buxton_string_pack("Sys");
+	fail_if(client_class(&client) != BUXTON_CLIENT_DEFAULT,
+		"Label prefix matched a priority label");
+}
+END_TEST
+
+START_TEST(queue_client_check)
+{
+	BuxtonDaemon daemon;
+	client_list_item a, b, c;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&a, sizeof(client_list_item));
+	memzero(&b, sizeof(client_list_item));
+	memzero(&c, sizeof(client_list_item));
+	a.class = BUXTON_CLIENT_DEFAULT;
+	b.class = BUXTON_CLIENT_SYSTEM;
+	c.class = BUXTON_CLIENT_DEFAULT;
+
+	fail_if(clients_ready(&daemon), "Empty queues have clients");
+	queue_client(&daemon, &a);
+	queue_client(&daemon, &b);
+	queue_client(&daemon, &c);
+	queue_client(&daemon, &a);
+	fail_if(!clients_ready(&daemon), "Queued clients not ready");
+	fail_if(daemon.ready[BUXTON_CLIENT_SYSTEM] != &b, "System client not queued");
+	fail_if(b.ready_next, "Default client on the system queue");
+	fail_if(daemon.ready[BUXTON_CLIENT_DEFAULT] != &a, "Queue out of order");
+	fail_if(a.ready_next != &c, "Client queued twice");
+	fail_if(daemon.ready_tail[BUXTON_CLIENT_DEFAULT] != &c, "Wrong queue tail");
+
+	/* Served clients go to the back of the queue */
+	dequeue_client(&daemon, &a);
+	queue_client(&daemon, &a);
+	fail_if(daemon.ready[BUXTON_CLIENT_DEFAULT] != &c, "Queue out of order after requeue");
+	fail_if(daemon.ready_tail[BUXTON_CLIENT_DEFAULT] != &a, "Requeued client not last");
+
+	dequeue_client(&daemon, &a);
+	fail_if(daemon.ready_tail[BUXTON_CLIENT_DEFAULT] != &c, "Tail not moved back");
+	dequeue_client(&daemon, &a);
+	dequeue_client(&daemon, &b);
+	dequeue_client(&daemon, &c);
+	fail_if(clients_ready(&daemon), "Dequeued clients still ready");
+	fail_if(daemon.ready_tail[BUXTON_CLIENT_DEFAULT], "Tail left on empty queue");
+	fail_if(a.queued || b.queued || c.queued, "Dequeued client marked queued");
+}
+END_TEST
+
+START_TEST(rate_limit_check)
+{
+	BuxtonDaemon daemon;
+	client_list_item client, other, system;
+	BuxtonString label;
+	uint32_t rate;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	daemon.rate_limits = hashmap_new(string_hash_func, string_compare_func);
+	fail_if(!daemon.rate_limits, "Failed to allocate hashmap");
+	memzero(&client, sizeof(client_list_item));
+	memzero(&other, sizeof(client_list_item));
+	memzero(&system, sizeof(client_list_item));
+	label = buxton_string_pack("App");
+	client.cred.uid = 5000;
+	client.smack_label = &label;
+	client.class = BUXTON_CLIENT_DEFAULT;
+	other = client;
+	system.class = BUXTON_CLIENT_SYSTEM;
+
+	attach_rate_limit(&daemon, &client);
+	attach_rate_limit(&daemon, &other);
+	attach_rate_limit(&daemon, &system);
+	fail_if(!client.rate, "Client not rate limited");
+	fail_if(other.rate != client.rate, "Connections of one app don't share limits");
+	fail_if(client.rate->clients != 2, "Wrong count of clients for limits");
+	fail_if(system.rate, "System client rate limited");
+
+	/* A full bucket allows one second of requests, across connections */
+	rate = client.rate->rate[BUXTON_RATE_WRITE];
+	fail_if(rate == 0, "Writes not limited by default");
+	for (uint32_t i = 0; i < rate; i++) {
+		fail_if(!take_rate_token(&daemon, i % 2 ? &client : &other,
+					 BUXTON_RATE_WRITE),
+			"Write %u within the limit throttled", i);
+	}
+	fail_if(take_rate_token(&daemon, &client, BUXTON_RATE_WRITE),
+		"Write over the limit allowed");
+	fail_if(daemon.stats.throttled[BUXTON_RATE_WRITE] != 1,
+		"Throttled write not counted");
+	fail_if(!take_rate_token(&daemon, &client, BUXTON_RATE_READ),
+		"Read throttled by writes");
+	fail_if(!take_rate_token(&daemon, &system, BUXTON_RATE_WRITE),
+		"System client throttled");
+
+	/* The bucket refills with time */
+	client.rate->refilled -= 1000000;
+	fail_if(!take_rate_token(&daemon, &client, BUXTON_RATE_WRITE),
+		"Write throttled after refill");
+
+	detach_rate_limit(&daemon, &client);
+	fail_if(client.rate, "Client still rate limited");
+	fail_if(hashmap_size(daemon.rate_limits) != 1, "Shared limits freed early");
+	detach_rate_limit(&daemon, &other);
+	fail_if(hashmap_size(daemon.rate_limits) != 0, "Unused limits not freed");
+
+	hashmap_free(daemon.rate_limits);
+}
+END_TEST
+
+START_TEST(flush_clients_check)
+{
+	BuxtonDaemon daemon;
+	client_list_item cl;
+	int client;
+	uint8_t first[] = "first";
+	uint8_t second[] = "second";
+	uint8_t buf[64];
+	uint8_t *big;
+	ssize_t s;
+
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	daemon.epollfd = -1;
+	memzero(&cl, sizeof(client_list_item));
+	setup_socket_pair(&client, &cl.fd);
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	add_pollfd(&daemon, cl.fd, POLLIN, false, &cl);
+
+	/* Output waits for the flush, then goes out together */
+	fail_if(!queue_output(&daemon, &cl, first, sizeof(first)),
+		"Failed to queue first message");
+	fail_if(!queue_output(&daemon, &cl, second, sizeof(second)),
+		"Failed to queue second message");
+	fail_if(daemon.pending != &cl, "Client not pending a flush");
+	fail_if(read(client, buf, sizeof(buf)) != -1, "Wrote before the flush");
+
+	flush_clients(&daemon);
+	fail_if(daemon.pending, "Client still pending after flush");
+	s = read(client, buf, sizeof(buf));
+	fail_if(s != sizeof(first) + sizeof(second), "Didn't get all output");
+	fail_if(memcmp(buf, first, sizeof(first)) ||
+		memcmp(buf + sizeof(first), second, sizeof(second)),
+		"Output out of order");
+	fail_if(cl.out_offset != 0, "Flushed output left in buffer");
+
+	/* Clients that don't read get cut off */
+	big = malloc0(BUXTON_CLIENT_OUTPUT_LIMIT);
+	fail_if(!big, "Failed to allocate message");
+	fail_if(!queue_output(&daemon, &cl, big, BUXTON_CLIENT_OUTPUT_LIMIT),
+		"Failed to queue message at the limit");
+	fail_if(queue_output(&daemon, &cl, first, sizeof(first)),
+		"Queued output over the limit");
+
+	/* What the socket doesn't take waits for POLLOUT */
+	flush_clients(&daemon);
+	fail_if(cl.out_offset == cl.out_start, "Socket took all output");
+	fail_if(!(daemon.pollfds[0].events & POLLOUT), "Not polling to write");
+	while (read(client, buf, sizeof(buf)) > 0);
+	fail_if(!flush_client(&daemon, &cl, 0), "Failed to flush the rest");
+
+	free(big);
+	free(cl.out);
+	free(daemon.pollfds);
+	free(daemon.accepting);
+	close(client);
+	close(cl.fd);
+}
+END_TEST
+
+START_TEST(buxtond_save_state_check)
+{
+	BuxtonDaemon daemon, taken;
+	client_list_item *cl;
+	BuxtonNotification *nitem;
+	BuxtonWatchedKey *watched;
+	char *key_name = strdup("groupname");
+	uint8_t in[] = "in";
+	uint8_t out[] = "out";
+	BuxtonString layer = buxton_string_pack("base");
+	_BuxtonKey key;
+	BuxtonData value;
+	int32_t status;
+	uint32_t flags;
+	int listener, client;
+	FILE *state;
+
+	fail_if(!key_name, "Failed to allocate key name");
+	memzero(&daemon, sizeof(BuxtonDaemon));
+	memzero(&taken, sizeof(BuxtonDaemon));
+	daemon.epollfd = taken.epollfd = -1;
+	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
+	taken.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
+	daemon.labels = hashmap_new(string_hash_func, string_compare_func);
+	taken.labels = hashmap_new(string_hash_func, string_compare_func);
+	daemon.rate_limits = hashmap_new(string_hash_func, string_compare_func);
+	taken.rate_limits = hashmap_new(string_hash_func, string_compare_func);
+	fail_if(!daemon.notify_mapping || !taken.notify_mapping ||
+		!daemon.labels || !taken.labels ||
+		!daemon.rate_limits || !taken.rate_limits,
+		"Failed to allocate hashmap");
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	fail_if(listener < 0, "Failed to create listener");
+	add_pollfd(&daemon, listener, POLLIN | POLLPRI, true, NULL);
+
+	cl = malloc0(sizeof(client_list_item));
+	fail_if(!cl, "client malloc failed");
+	setup_socket_pair(&client, &cl->fd);
+	fail_if(!setup_client(&daemon, cl), "Failed to set up client");
+	LIST_PREPEND(client_list_item, item, daemon.client_list, cl);
+	add_pollfd(&daemon, cl->fd, POLLIN | POLLPRI, false, cl);
+	cl->buffer = malloc(BUXTON_CLIENT_BUFFER_SIZE);
+	fail_if(!cl->buffer, "buffer malloc failed");
+	cl->size = BUXTON_CLIENT_BUFFER_SIZE;
+	memcpy(cl->buffer, in, sizeof(in));
+	cl->offset = sizeof(in);
+	fail_if(!queue_output(&daemon, cl, out, sizeof(out)),
+		"Failed to queue output");
+
+	/* An open transaction, with one value set and one unset */
+	cl->transaction = malloc0(sizeof(BuxtonTransaction));
+	fail_if(!cl->transaction, "Failed to allocate transaction");
+	fail_if(!buxton_string_copy(&layer, &cl->transaction->layer),
+		"Failed to copy layer");
+	key.group = buxton_string_pack("group");
+	key.name = buxton_string_pack("name");
+	key.layer = layer;
+	key.type = STRING;
+	value.type = STRING;
+	value.store.d_string = buxton_string_pack("staged");
+	stage_change(&daemon, cl, &key, &value, &status);
+	fail_if(status != 0, "Failed to stage value");
+	key.name = buxton_string_pack("other");
+	stage_change(&daemon, cl, &key, NULL, &status);
+	fail_if(status != 0, "Failed to stage unset");
+
+	nitem = malloc0(sizeof(BuxtonNotification));
+	fail_if(!nitem, "Failed to allocate notification item");
+	nitem->client = cl;
+	nitem->msgid = 7;
+	watched = malloc0(sizeof(BuxtonWatchedKey));
+	fail_if(!watched, "Failed to allocate watched key");
+	watched->last = malloc0(sizeof(BuxtonData));
+	fail_if(!watched->last, "Failed to allocate data");
+	watched->last->type = STRING;
+	watched->last->store.d_string = buxton_string_pack("old");
+	watched->name = key_name;
+	nitem->watched = watched;
+	LIST_PREPEND(BuxtonNotification, watcher, watched->notifications, nitem);
+	LIST_PREPEND(BuxtonNotification, subscription, cl->subscriptions, nitem);
+	fail_if(hashmap_put(daemon.notify_mapping, key_name, watched) < 0,
+		"Failed to put in hashmap");
+
+	state = tmpfile();
+	fail_if(!state, "Failed to create state file");
+	fail_if(!buxtond_save_state(&daemon, state, BUXTON_HANDOFF_MANUAL_START),
+		"Failed to save state");
+	rewind(state);
+	fail_if(!buxtond_restore_state(&taken, state, &flags),
+		"Failed to restore state");
+	fclose(state);
+
+	fail_if(flags != BUXTON_HANDOFF_MANUAL_START, "Lost the handoff flags");
+	fail_if(taken.nfds != 2, "Wrong number of fds taken over");
+	fail_if(taken.pollfds[0].fd != listener || !taken.accepting[0],
+		"Listener not taken over");
+	fail_if(!taken.client_list || taken.client_list->item_next,
+		"Wrong clients taken over");
+	cl = taken.client_list;
+	fail_if(cl->fd != daemon.client_list->fd, "Client fd changed");
+	fail_if(cl->cred.pid != getpid(), "Client not identified");
+	fail_if(cl->offset - cl->start != sizeof(in) ||
+		memcmp(cl->buffer + cl->start, in, sizeof(in)),
+		"Lost the client's input");
+	fail_if(cl->out_offset - cl->out_start != sizeof(out) ||
+		memcmp(cl->out + cl->out_start, out, sizeof(out)),
+		"Lost the client's output");
+	fail_if(taken.pending != cl, "Output not pending a flush");
+	fail_if(!cl->transaction || cl->transaction->count != 2 ||
+		!streq(cl->transaction->layer.value, "base"),
+		"Lost the client's transaction");
+	fail_if(!streq(cl->transaction->changes[0].key->group.value, "group") ||
+		!streq(cl->transaction->changes[0].key->name.value, "name") ||
+		!streq(cl->transaction->changes[0].key->layer.value, "base") ||
+		cl->transaction->changes[0].key->type != STRING ||
+		!cl->transaction->changes[0].data ||
+		!streq(cl->transaction->changes[0].data->store.d_string.value,
+		       "staged"),
+		"Lost the staged value");
+	fail_if(!streq(cl->transaction->changes[1].key->name.value, "other") ||
+		cl->transaction->changes[1].data,
+		"Lost the staged unset");
+
+	watched = hashmap_get(taken.notify_mapping, "groupname");
+	fail_if(!watched || !watched->notifications ||
+		watched->notifications->watcher_next,
+		"Wrong notifications taken over");
+	nitem = watched->notifications;
+	fail_if(nitem->client != cl || nitem->msgid != 7,
+		"Notification not taken over");
+	fail_if(cl->subscriptions != nitem || nitem->subscription_next,
+		"Client's notifications not taken over");
+	fail_if(!watched->last || watched->last->type != STRING ||
+		!streq(watched->last->store.d_string.value, "old"),
+		"Lost the key's last value");
+
+	close(listener);
+	close(client);
+	close(cl->fd);
+}
+END_TEST
+
 START_TEST(handle_client_check)
 {
 	BuxtonDaemon daemon;
@@ -2255,6 +4117,7 @@ START_TEST(handle_client_check)
 	fail_if(!r, "Failed to add data to array");
 	ret = buxton_serialize_message(&message, BUXTON_CONTROL_GET, 0, list);
 	fail_if(ret == 0, "Failed to serialize string data");
+	memzero(&daemon, sizeof(BuxtonDaemon));
 	daemon.client_list = malloc0(sizeof(client_list_item));
 	fail_if(!daemon.client_list, "client malloc failed");
 	setup_socket_pair(&daemon.client_list->fd, &dummy);
@@ -2264,12 +4127,15 @@ START_TEST(handle_client_check)
 	daemon.nfds = 0;
 	daemon.pollfds = NULL;
 	daemon.accepting = NULL;
+	daemon.polled_alloc = 0;
+	daemon.polled = NULL;
+	daemon.retired = NULL;
+	daemon.epollfd = -1;
 	daemon.notify_mapping = hashmap_new(string_hash_func, string_compare_func);
 	fail_if(!daemon.notify_mapping, "Failed to allocate hashmap");
-	daemon.client_key_mapping = hashmap_new(uint64_hash_func, uint64_compare_func);
-	fail_if(!daemon.client_key_mapping, "Failed to allocate hashmap");
 
-	add_pollfd(&daemon, daemon.client_list->fd, 2, false);
+	add_pollfd(&daemon, daemon.client_list->fd, 2, false,
+		   daemon.client_list);
 	fail_if(daemon.nfds != 1, "Failed to add pollfd 1");
 	fail_if(handle_client(&daemon, daemon.client_list, 0), "More data available 1");
 	fail_if(daemon.client_list, "Failed to terminate client with no data");
@@ -2279,7 +4145,8 @@ START_TEST(handle_client_check)
 	fail_if(!daemon.client_list, "client malloc failed");
 	setup_socket_pair(&daemon.client_list->fd, &dummy);
 	fcntl(daemon.client_list->fd, F_SETFL, O_NONBLOCK);
-	add_pollfd(&daemon, daemon.client_list->fd, 2, false);
+	add_pollfd(&daemon, daemon.client_list->fd, 2, false,
+		   daemon.client_list);
 	fail_if(daemon.nfds != 1, "Failed to add pollfd 2");
 	write(dummy, buf, 1);
 	fail_if(handle_client(&daemon, daemon.client_list, 0), "More data available 2");
@@ -2297,7 +4164,8 @@ START_TEST(handle_client_check)
 	fail_if(!daemon.client_list, "client malloc failed");
 	setup_socket_pair(&daemon.client_list->fd, &dummy);
 	fcntl(daemon.client_list->fd, F_SETFL, O_NONBLOCK);
-	add_pollfd(&daemon, daemon.client_list->fd, 2, false);
+	add_pollfd(&daemon, daemon.client_list->fd, 2, false,
+		   daemon.client_list);
 	fail_if(daemon.nfds != 1, "Failed to add pollfd 3");
 	bsize = BUXTON_MESSAGE_MAX_LENGTH + 1;
 	memcpy(message + BUXTON_LENGTH_OFFSET, &bsize, sizeof(uint32_t));
@@ -2310,21 +4178,29 @@ START_TEST(handle_client_check)
 	fail_if(!daemon.client_list, "client malloc failed");
 	setup_socket_pair(&daemon.client_list->fd, &dummy);
 	fcntl(daemon.client_list->fd, F_SETFL, O_NONBLOCK);
-	add_pollfd(&daemon, daemon.client_list->fd, 2, false);
+	add_pollfd(&daemon, daemon.client_list->fd, 2, false,
+		   daemon.client_list);
 	fail_if(daemon.nfds != 1, "Failed to add pollfd 4");
 	bsize = (uint32_t)ret;
 	memcpy(message + BUXTON_LENGTH_OFFSET, &bsize, sizeof(uint32_t));
 	write(dummy, message, ret);
-	fail_if(handle_client(&daemon, daemon.client_list, 0), "More data available 5");
+	fail_if(!handle_client(&daemon, daemon.client_list, 0), "Message not queued");
 	fail_if(!daemon.client_list, "Terminated client with correct data length");
+	fail_if(daemon.ready[daemon.client_list->class] != daemon.client_list,
+		"Client not on its ready queue");
+	fail_if(daemon.client_list->data, "Handled message before serving clients");
 
-	for (int i = 0; i < 33; i++) {
+	/* More than fits in the buffer stays in the socket */
+	for (size_t i = 0; i <= BUXTON_CLIENT_BUFFER_SIZE / ret; i++) {
 		write(dummy, message, ret);
 	}
-	fail_if(!handle_client(&daemon, daemon.client_list, 0), "No more data available");
+	fail_if(!handle_client(&daemon, daemon.client_list, 0), "Client left the ready queue");
 	fail_if(!daemon.client_list, "Terminated client with correct data length");
+	fail_if(daemon.client_list->offset != daemon.client_list->size,
+		"Didn't fill the client's buffer");
 	terminate_client(&daemon, daemon.client_list, 0);
 	fail_if(daemon.client_list, "Failed to remove client 1");
+	fail_if(clients_ready(&daemon), "Terminated client still queued");
 	close(dummy);
 
 	//FIXME: add SIGPIPE handler
@@ -2332,7 +4208,7 @@ START_TEST(handle_client_check)
 	/* fail_if(!daemon.client_list, "client malloc failed"); */
 	/* setup_socket_pair(&daemon.client_list->fd, &dummy); */
 	/* fcntl(daemon.client_list->fd, F_SETFL, O_NONBLOCK); */
-	/* add_pollfd(&daemon, daemon.client_list->fd, 2, false); */
+	/* add_pollfd(&daemon, daemon.client_list->fd, 2, false, daemon.client_list); */
 	/* fail_if(daemon.nfds != 1, "Failed to add pollfd 5"); */
 	/* write(dummy, message, ret); */
 	/* close(dummy); */
@@ -2340,7 +4216,6 @@ START_TEST(handle_client_check)
 	/* fail_if(daemon.client_list, "Failed to terminate client"); */
 
 	hashmap_free(daemon.notify_mapping);
-	hashmap_free(daemon.client_key_mapping);
 }
 END_TEST
 
@@ -2741,31 +4616,58 @@ daemon_suite(void)
 	tcase_add_test(tc, buxton_set_label_check);
 	tcase_add_test(tc, buxton_get_value_for_layer_check);
 	tcase_add_test(tc, buxton_get_value_check);
+	tcase_add_test(tc, buxtond_handoff_check);
+	tcase_add_test(tc, buxtond_handoff_transaction_check);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("buxton daemon handoff failure");
+	tcase_add_checked_fixture(tc, NULL, teardown);
+	tcase_add_test(tc, buxtond_handoff_exec_failure_check);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("buxton_daemon_functions");
 	tcase_add_test(tc, parse_list_check);
 	tcase_add_test(tc, create_group_check);
 	tcase_add_test(tc, remove_group_check);
+	tcase_add_test(tc, remove_group_notify_check);
 	tcase_add_test(tc, set_label_check);
 
 	tcase_add_test(tc, set_value_check);
 	tcase_add_test(tc, get_value_check);
+	tcase_add_test(tc, update_value_check);
 	tcase_add_test(tc, register_notification_check);
 	tcase_add_test(tc, buxtond_handle_message_error_check);
 	tcase_add_test(tc, buxtond_handle_message_create_group_check);
 	tcase_add_test(tc, buxtond_handle_message_remove_group_check);
 	tcase_add_test(tc, buxtond_handle_message_set_label_check);
 	tcase_add_test(tc, buxtond_handle_message_set_value_check);
+	tcase_add_test(tc, buxtond_handle_message_stalled_notify_check);
 	tcase_add_test(tc, buxtond_handle_message_get_check);
+	tcase_add_test(tc, buxtond_handle_message_add_check);
+	tcase_add_test(tc, buxtond_handle_message_transaction_check);
 	tcase_add_test(tc, buxtond_handle_message_notify_check);
 	tcase_add_test(tc, buxtond_handle_message_unset_check);
 	tcase_add_test(tc, buxtond_notify_clients_check);
+	tcase_add_test(tc, notify_shared_value_check);
+	tcase_add_test(tc, notify_coalesce_check);
+	tcase_add_test(tc, notify_grouped_check);
+	tcase_add_test(tc, journal_check);
 	tcase_add_test(tc, identify_client_check);
+	tcase_add_test(tc, setup_client_check);
 	tcase_add_test(tc, add_pollfd_check);
 	tcase_add_test(tc, del_pollfd_check);
+	tcase_add_test(tc, epoll_pollfd_check);
+#ifdef HAVE_IO_URING
+	tcase_add_test(tc, uring_pollfd_check);
+#endif
 	tcase_add_test(tc, handle_smack_label_check);
 	tcase_add_test(tc, terminate_client_check);
+	tcase_add_test(tc, client_has_message_check);
+	tcase_add_test(tc, client_class_check);
+	tcase_add_test(tc, queue_client_check);
+	tcase_add_test(tc, rate_limit_check);
+	tcase_add_test(tc, flush_clients_check);
+	tcase_add_test(tc, buxtond_save_state_check);
 	tcase_add_test(tc, handle_client_check);
 	suite_add_tcase(s, tc);
 
@@ -505,6 +505,129 @@ START_TEST(buxton_db_serialize_check)
 }
 END_TEST
 
+START_TEST(buxton_db_record_serialize_check)
+{
+	BuxtonData dsource, dtarget;
+	BuxtonString lsource, ltarget;
+	BuxtonString lother = buxton_string_pack("other");
+	BuxtonLabelTable table = { NULL, 0, NULL };
+	BuxtonLabelTable loaded = { NULL, 0, NULL };
+	uint8_t *packed = NULL;
+	uint8_t *legacy = NULL;
+	size_t size, legacy_size;
+	uint16_t id, other;
+	uint64_t version;
+	bool added;
+
+	lsource = buxton_string_pack("label");
+	fail_if(!buxton_label_table_intern(&table, &lsource, &id, &added),
+		"Failed to intern label");
+	fail_if(!added || id != 0, "First label didn't get ID 0");
+	fail_if(!buxton_label_table_intern(&table, &lother, &other, &added),
+		"Failed to intern second label");
+	fail_if(!added || other != 1, "Second label didn't get ID 1");
+	fail_if(!buxton_label_table_intern(&table, &lsource, &id, &added),
+		"Failed to look up interned label");
+	fail_if(added || id != 0, "Interned label was added twice");
+
+	/* A label whose table couldn't be stored is taken back */
+	fail_if(!buxton_label_table_intern(&table, &(BuxtonString){ "dropped", 8 },
+					   &id, &added) || !added,
+		"Failed to intern third label");
+	buxton_label_table_truncate(&table, 2);
+	fail_if(table.count != 2, "Truncated table has wrong count");
+	fail_if(!buxton_label_table_intern(&table, &lother, &id, &added) ||
+		added || id != other, "Truncating lost a kept label");
+	fail_if(!buxton_label_table_intern(&table, &(BuxtonString){ "dropped", 8 },
+					   &id, &added) || !added || id != 2,
+		"Truncating kept a dropped label");
+	buxton_label_table_truncate(&table, 2);
+	fail_if(!buxton_label_table_intern(&table, &lsource, &id, &added),
+		"Failed to look up interned label");
+
+	dsource.type = STRING;
+	dsource.store.d_string = buxton_string_pack("test-string");
+	size = buxton_serialize_record(&dsource, id, 42, &packed);
+	legacy_size = buxton_serialize(&dsource, &lsource, &legacy);
+	fail_if(size >= legacy_size, "Record with a label ID isn't smaller");
+	fail_if(!buxton_deserialize_record(packed, size, &table, &dtarget,
+					   &ltarget, &version),
+		"Failed to deserialize string record");
+	fail_if(version != 42, "Record version differs");
+	fail_if(dtarget.type != STRING, "Record type differs for string");
+	fail_if(!streq(dtarget.store.d_string.value, "test-string"),
+		"Record string data differs");
+	fail_if(!streq(ltarget.value, "label") ||
+		ltarget.length != lsource.length,
+		"Record label differs");
+	fail_if(ltarget.value != table.labels[id].value,
+		"Record label isn't the table's");
+	free(dtarget.store.d_string.value);
+
+	/* Every record ends with its version */
+	fail_if(buxton_deserialize_record(packed, size -
+					  BUXTON_RECORD_KEY_VERSION_LENGTH,
+					  &table, &dtarget, NULL, &version),
+		"Deserialized record without a version");
+	packed[0] = BUXTON_RECORD_VERSION - 1;
+	fail_if(buxton_deserialize_record(packed, size, &table, &dtarget,
+					  NULL, &version),
+		"Deserialized record of an older version");
+	packed[0] = BUXTON_RECORD_VERSION;
+
+	/* Records from before label tables still load */
+	fail_if(!buxton_deserialize_record(legacy, legacy_size, &table,
+					   &dtarget, &ltarget, &version),
+		"Failed to deserialize legacy record");
+	fail_if(!streq(dtarget.store.d_string.value, "test-string") ||
+		!streq(ltarget.value, "label"),
+		"Legacy record differs");
+	fail_if(version != 0, "Legacy record has a version");
+	free(dtarget.store.d_string.value);
+	free(legacy);
+
+	/* A record naming a label the table lacks is rejected */
+	free(packed);
+	dsource.type = INT64;
+	dsource.store.d_int64 = INT64_MAX;
+	size = buxton_serialize_record(&dsource, 7, 1, &packed);
+	fail_if(buxton_deserialize_record(packed, size, &table, &dtarget, NULL,
+					  NULL),
+		"Accepted a record with an unknown label");
+	free(packed);
+
+	/* The table survives a round trip with its IDs intact */
+	size = buxton_label_table_serialize(&table, &packed);
+	fail_if(!buxton_label_table_load(&loaded, packed, size),
+		"Failed to load label table");
+	fail_if(loaded.count != 2, "Loaded label table has wrong count");
+	fail_if(!buxton_label_table_intern(&loaded, &lother, &id, &added),
+		"Failed to look up loaded label");
+	fail_if(added || id != other, "Loaded label has a different ID");
+	free(packed);
+
+	dsource.type = BOOLEAN;
+	dsource.store.d_boolean = true;
+	size = buxton_serialize_record(&dsource, id, 1, &packed);
+	fail_if(!buxton_deserialize_record(packed, size, &loaded, &dtarget,
+					   &ltarget, NULL),
+		"Failed to deserialize boolean record");
+	fail_if(dtarget.type != BOOLEAN || !dtarget.store.d_boolean,
+		"Record boolean data differs");
+	fail_if(!streq(ltarget.value, "other"), "Record label differs");
+	free(packed);
+
+	buxton_label_table_free(&table);
+	buxton_label_table_free(&loaded);
+
+	/* Versions only move forward */
+	version = buxton_record_next_version();
+	fail_if(version == 0, "Got version 0");
+	fail_if(buxton_record_next_version() <= version,
+		"Version didn't grow");
+}
+END_TEST
+
 START_TEST(buxton_message_serialize_check)
 {
 	BuxtonControlMessage csource;
@@ -856,6 +979,7 @@ shared_lib_suite(void)
 
 	tc = tcase_create("buxton_serialize_functions");
 	tcase_add_test(tc, buxton_db_serialize_check);
+	tcase_add_test(tc, buxton_db_record_serialize_check);
 	tcase_add_test(tc, buxton_message_serialize_check);
 	tcase_add_test(tc, buxton_get_message_size_check);
 	suite_add_tcase(s, tc);